@@ -0,0 +1,603 @@
+#include "userfs.h"
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmarks of userfs. Run without arguments to execute all of them, or pass
+ * names of the needed ones. Build with CMAKE_BUILD_TYPE=Release to get
+ * meaningful numbers.
+ */
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_report(const char *what, uint64_t ns, uint64_t ops)
+{
+	printf("%-32s %10.1f ns/op %12.0f op/s\n", what, (double)ns / ops,
+	       ops * 1e9 / ns);
+}
+
+static void
+bench_report_time(const char *what, uint64_t ns)
+{
+	printf("%-32s %10.1f ms\n", what, ns / 1e6);
+}
+
+static void
+bench_open_delete(void)
+{
+	const int count = 100000;
+	char name[32];
+	printf("# open/delete with %d files\n", count);
+
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1 || ufs_close(fd) != 0) {
+			printf("create failed\n");
+			return;
+		}
+	}
+	bench_report("create", bench_now_ns() - start, count);
+
+	start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, 0);
+		if (fd == -1 || ufs_close(fd) != 0) {
+			printf("open failed\n");
+			return;
+		}
+	}
+	bench_report("open existing", bench_now_ns() - start, count);
+
+	start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "missing%d", i);
+		if (ufs_open(name, 0) != -1) {
+			printf("open of a missing file succeeded\n");
+			return;
+		}
+	}
+	bench_report("open missing", bench_now_ns() - start, count);
+
+	start = bench_now_ns();
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (ufs_delete(name) != 0) {
+			printf("delete failed\n");
+			return;
+		}
+	}
+	bench_report("delete", bench_now_ns() - start, count);
+	ufs_destroy();
+}
+
+/** Fill the files with the data from the given host file. */
+static int
+bench_load_dump(int src, int file_count, size_t file_size, char *buf,
+		size_t buf_size)
+{
+	char name[32];
+	for (int i = 0; i < file_count; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1)
+			return -1;
+		for (size_t done = 0; done < file_size; done += buf_size) {
+			if ((src >= 0 && read(src, buf, buf_size) !=
+			     (ssize_t)buf_size) ||
+			    ufs_write(fd, buf, buf_size) != (ssize_t)buf_size)
+				return -1;
+		}
+		ufs_close(fd);
+	}
+	return 0;
+}
+
+static void
+bench_image_startup(void)
+{
+	const int file_count = 16;
+	const size_t file_size = 64 * 1024 * 1024;
+	const size_t buf_size = 1024 * 1024;
+	const char *dump_path = "ufs_bench.dump";
+	const char *image_path = "ufs_bench.img";
+	printf("# startup with %d files, %zu MiB total\n", file_count,
+	       file_count * file_size / buf_size);
+	char *buf = new char[buf_size];
+	for (size_t i = 0; i < buf_size; ++i)
+		buf[i] = 'a' + i % 26;
+	/*
+	 * Without an image the data has to be kept somewhere else and be
+	 * loaded into the heap on each start.
+	 */
+	FILE *dump = fopen(dump_path, "w");
+	for (size_t i = 0; dump != NULL && i < file_count * file_size /
+	     buf_size; ++i)
+		fwrite(buf, 1, buf_size, dump);
+	if (dump == NULL || fclose(dump) != 0) {
+		printf("couldn't create the dump\n");
+		goto out;
+	}
+	{
+		uint64_t start = bench_now_ns();
+		FILE *src = fopen(dump_path, "r");
+		if (src == NULL || bench_load_dump(fileno(src), file_count,
+						   file_size, buf,
+						   buf_size) != 0) {
+			if (src != NULL)
+				fclose(src);
+			printf("cold reload failed\n");
+			goto out;
+		}
+		fclose(src);
+		bench_report_time("cold reload into heap", bench_now_ns() -
+				  start);
+		ufs_destroy();
+	}
+	unlink(image_path);
+	if (ufs_mount(image_path, file_count * (file_size + buf_size)) != 0 ||
+	    bench_load_dump(-1, file_count, file_size, buf, buf_size) != 0) {
+		printf("couldn't create the image\n");
+		goto out;
+	}
+	ufs_destroy();
+	{
+		uint64_t start = bench_now_ns();
+		if (ufs_mount(image_path, 0) != 0) {
+			printf("couldn't mount the image\n");
+			goto out;
+		}
+		int fd = ufs_open("file0", 0);
+		if (fd == -1 || ufs_read(fd, buf, 1) != 1) {
+			printf("couldn't read the image\n");
+			goto out;
+		}
+		ufs_close(fd);
+		bench_report_time("mmap reopen", bench_now_ns() - start);
+	}
+out:
+	ufs_destroy();
+	unlink(dump_path);
+	unlink(image_path);
+	delete[] buf;
+}
+
+enum bench_rw_mode {
+	BENCH_RW_READ_OWN,
+	BENCH_RW_READ_SHARED,
+	BENCH_RW_WRITE_OWN,
+};
+
+struct bench_rw_ctx {
+	enum bench_rw_mode mode;
+	int id;
+	size_t file_size;
+	size_t bytes;
+	pthread_barrier_t *barrier;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	bool ok;
+};
+
+static void *
+bench_rw_worker(void *arg)
+{
+	struct bench_rw_ctx *ctx = (struct bench_rw_ctx *)arg;
+	char name[32];
+	char buf[4096];
+	memset(buf, 'a', sizeof(buf));
+	if (ctx->mode == BENCH_RW_READ_SHARED)
+		snprintf(name, sizeof(name), "shared");
+	else
+		snprintf(name, sizeof(name), "file%d", ctx->id);
+	ctx->ok = false;
+	pthread_barrier_wait(ctx->barrier);
+	ctx->start_ns = bench_now_ns();
+	for (size_t done = 0; done < ctx->bytes; done += ctx->file_size) {
+		int fd = ufs_open(name, 0);
+		if (fd == -1)
+			return NULL;
+		for (size_t pos = 0; pos < ctx->file_size; pos += sizeof(buf)) {
+			ssize_t rc = ctx->mode == BENCH_RW_WRITE_OWN ?
+				     ufs_write(fd, buf, sizeof(buf)) :
+				     ufs_read(fd, buf, sizeof(buf));
+			if (rc != sizeof(buf))
+				return NULL;
+		}
+		ufs_close(fd);
+	}
+	ctx->end_ns = bench_now_ns();
+	ctx->ok = true;
+	return NULL;
+}
+
+static void
+bench_rw_run(enum bench_rw_mode mode, const char *what, int thread_count)
+{
+	const size_t file_size = 1024 * 1024;
+	const size_t bytes = 16 * file_size;
+	char buf[4096];
+	char name[32];
+	memset(buf, 'a', sizeof(buf));
+	for (int i = 0; i <= thread_count; ++i) {
+		if (i == thread_count)
+			snprintf(name, sizeof(name), "shared");
+		else
+			snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		for (size_t pos = 0; pos < file_size; pos += sizeof(buf))
+			ufs_write(fd, buf, sizeof(buf));
+		ufs_close(fd);
+	}
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, thread_count + 1);
+	struct bench_rw_ctx *ctxs = new bench_rw_ctx[thread_count];
+	pthread_t *threads = new pthread_t[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		ctxs[i].mode = mode;
+		ctxs[i].id = i;
+		ctxs[i].file_size = file_size;
+		ctxs[i].bytes = bytes;
+		ctxs[i].barrier = &barrier;
+		pthread_create(&threads[i], NULL, bench_rw_worker, &ctxs[i]);
+	}
+	pthread_barrier_wait(&barrier);
+	bool ok = true;
+	uint64_t start = UINT64_MAX, end = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i], NULL);
+		ok = ok && ctxs[i].ok;
+		if (ctxs[i].start_ns < start)
+			start = ctxs[i].start_ns;
+		if (ctxs[i].end_ns > end)
+			end = ctxs[i].end_ns;
+	}
+	uint64_t ns = end - start;
+	if (ok) {
+		double mib = (double)bytes * thread_count / (1024 * 1024);
+		printf("%-24s %2d threads %10.1f MiB/s\n", what, thread_count,
+		       mib * 1e9 / ns);
+	} else {
+		printf("%s failed\n", what);
+	}
+	pthread_barrier_destroy(&barrier);
+	delete[] threads;
+	delete[] ctxs;
+	ufs_destroy();
+}
+
+static void
+bench_threads(void)
+{
+	printf("# 4 KiB reads and writes of 1 MiB files\n");
+	const struct {
+		enum bench_rw_mode mode;
+		const char *name;
+	} modes[] = {
+		{BENCH_RW_READ_OWN, "read own files"},
+		{BENCH_RW_READ_SHARED, "read one shared file"},
+		{BENCH_RW_WRITE_OWN, "write own files"},
+	};
+	for (const auto &m : modes) {
+		for (int count = 1; count <= 16; count *= 2)
+			bench_rw_run(m.mode, m.name, count);
+	}
+}
+
+static void
+bench_iov_append(void)
+{
+	const int record_count = 200000;
+	const int part_count = 16;
+	const size_t part_size = 32;
+	printf("# append %d records of %d parts by %zu bytes\n", record_count,
+	       part_count, part_size);
+	char parts[part_count][part_size];
+	struct iovec iov[part_count];
+	for (int i = 0; i < part_count; ++i) {
+		memset(parts[i], 'a' + i, part_size);
+		iov[i].iov_base = parts[i];
+		iov[i].iov_len = part_size;
+	}
+	for (int is_vectored = 0; is_vectored <= 1; ++is_vectored) {
+		int fd = ufs_open("log", UFS_CREATE);
+		if (fd == -1) {
+			printf("open failed\n");
+			return;
+		}
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < record_count; ++i) {
+			if (is_vectored) {
+				if (ufs_writev(fd, iov, part_count) !=
+				    (ssize_t)(part_count * part_size))
+					goto fail;
+				continue;
+			}
+			for (int j = 0; j < part_count; ++j) {
+				if (ufs_write(fd, parts[j], part_size) !=
+				    (ssize_t)part_size)
+					goto fail;
+			}
+		}
+		bench_report(is_vectored ? "1 writev per record" :
+			     "16 writes per record", bench_now_ns() - start,
+			     record_count);
+		ufs_close(fd);
+		ufs_delete("log");
+	}
+	ufs_destroy();
+	return;
+fail:
+	printf("append failed\n");
+	ufs_destroy();
+}
+
+/** Bytes taken from the heap at the moment. */
+static size_t
+bench_heap_used(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+static void
+bench_sparse(void)
+{
+	const size_t file_size = 100 * 1024 * 1024;
+	const int write_count = 16;
+	printf("# resize to %zu MiB and write %d scattered bytes\n",
+	       file_size / (1024 * 1024), write_count);
+	size_t heap_before = bench_heap_used();
+	int fd = ufs_open("file", UFS_CREATE);
+	uint64_t start = bench_now_ns();
+	if (fd == -1 || ufs_resize(fd, file_size) != 0) {
+		printf("resize failed\n");
+		ufs_destroy();
+		return;
+	}
+	bench_report_time("resize", bench_now_ns() - start);
+	for (int i = 0; i < write_count; ++i) {
+		if (ufs_pwrite(fd, "x", 1, file_size / write_count * i +
+			       i * 4099) != 1) {
+			printf("write failed\n");
+			ufs_destroy();
+			return;
+		}
+	}
+	printf("%-32s %10.1f KiB\n", "heap used",
+	       (bench_heap_used() - heap_before) / 1024.0);
+	start = bench_now_ns();
+	if (ufs_resize(fd, 0) != 0)
+		printf("shrink failed\n");
+	bench_report_time("shrink to 0", bench_now_ns() - start);
+	ufs_destroy();
+}
+
+/** Write a byte into 1% of the blocks of the file at random. */
+static int
+bench_clone_modify(int fd, size_t file_size)
+{
+	const size_t block_size = 512;
+	size_t count = file_size / block_size / 100;
+	srand(1);
+	for (size_t i = 0; i < count; ++i) {
+		size_t pos = (size_t)rand() % file_size;
+		if (ufs_pwrite(fd, "x", 1, pos) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+bench_clone(void)
+{
+	const size_t file_size = 100 * 1024 * 1024;
+	const size_t buf_size = 1024 * 1024;
+	printf("# copy a %zu MiB file and change 1%% of its blocks\n",
+	       file_size / (1024 * 1024));
+	char *buf = new char[buf_size];
+	memset(buf, 'a', buf_size);
+	int fd = ufs_open("src", UFS_CREATE);
+	for (size_t done = 0; fd != -1 && done < file_size; done += buf_size) {
+		if (ufs_write(fd, buf, buf_size) != (ssize_t)buf_size)
+			goto fail;
+	}
+	ufs_close(fd);
+	for (int is_clone = 0; is_clone <= 1; ++is_clone) {
+		size_t heap_before = bench_heap_used();
+		uint64_t start = bench_now_ns();
+		if (is_clone) {
+			if (ufs_clone("src", "dst") != 0)
+				goto fail;
+		} else {
+			int src = ufs_open("src", 0);
+			int dst = ufs_open("dst", UFS_CREATE);
+			if (src == -1 || dst == -1)
+				goto fail;
+			ssize_t rc;
+			while ((rc = ufs_read(src, buf, buf_size)) > 0) {
+				if (ufs_write(dst, buf, rc) != rc)
+					goto fail;
+			}
+			ufs_close(src);
+			ufs_close(dst);
+		}
+		uint64_t copy_ns = bench_now_ns() - start;
+		fd = ufs_open("dst", 0);
+		start = bench_now_ns();
+		if (fd == -1 || bench_clone_modify(fd, file_size) != 0)
+			goto fail;
+		uint64_t modify_ns = bench_now_ns() - start;
+		ufs_close(fd);
+		const char *what = is_clone ? "clone" : "byte copy";
+		printf("%-12s copy %8.1f ms, writes %8.1f ms, %8.1f MiB more "\
+		       "heap\n", what, copy_ns / 1e6, modify_ns / 1e6,
+		       (bench_heap_used() - heap_before) / (1024.0 * 1024));
+		ufs_delete("dst");
+	}
+	ufs_destroy();
+	delete[] buf;
+	return;
+fail:
+	printf("clone failed\n");
+	ufs_destroy();
+	delete[] buf;
+}
+
+enum bench_cache_mode {
+	BENCH_CACHE_SEQ_READ,
+	BENCH_CACHE_HOT_READ,
+	BENCH_CACHE_HOT_WRITE,
+};
+
+/**
+ * Position of the next access. 90% of the random accesses go to the hot
+ * first part of the file.
+ */
+static size_t
+bench_cache_pos(enum bench_cache_mode mode, size_t i, size_t op_size,
+		size_t file_size, size_t hot_size)
+{
+	if (mode == BENCH_CACHE_SEQ_READ)
+		return i * op_size % file_size;
+	size_t range = rand() % 10 == 0 ? file_size : hot_size;
+	return (size_t)rand() % (range / op_size) * op_size;
+}
+
+static void
+bench_cache_run(enum bench_cache_mode mode, const char *what, size_t op_size,
+		size_t op_count)
+{
+	const char *dir = "ufs_bench_dir";
+	const size_t file_size = 64 * 1024 * 1024;
+	const size_t hot_size = 8 * 1024 * 1024;
+	const size_t cache_size = 16 * 1024 * 1024;
+	char buf[4096];
+	memset(buf, 'a', sizeof(buf));
+	uint64_t ns[2];
+	struct ufs_cache_stat stat;
+	for (int is_ufs = 0; is_ufs <= 1; ++is_ufs) {
+		srand(1);
+		uint64_t start = bench_now_ns();
+		bool ok = true;
+		if (is_ufs) {
+			ok = ufs_mount_dir(dir, cache_size) == 0;
+			int fd = ufs_open("data", 0);
+			for (size_t i = 0; ok && i < op_count; ++i) {
+				size_t pos = bench_cache_pos(mode, i, op_size,
+							     file_size,
+							     hot_size);
+				ssize_t rc = mode == BENCH_CACHE_HOT_WRITE ?
+					     ufs_pwrite(fd, buf, op_size, pos) :
+					     mode == BENCH_CACHE_SEQ_READ ?
+					     ufs_read(fd, buf, op_size) :
+					     ufs_pread(fd, buf, op_size, pos);
+				ok = rc == (ssize_t)op_size;
+			}
+			ok = ok && ufs_sync() == 0;
+			ufs_cache_stat(&stat);
+			ufs_close(fd);
+			ufs_destroy();
+		} else {
+			int fd = open("ufs_bench_dir/data", O_RDWR);
+			for (size_t i = 0; fd >= 0 && ok && i < op_count; ++i) {
+				size_t pos = bench_cache_pos(mode, i, op_size,
+							     file_size,
+							     hot_size);
+				ssize_t rc = mode == BENCH_CACHE_HOT_WRITE ?
+					     pwrite(fd, buf, op_size, pos) :
+					     pread(fd, buf, op_size, pos);
+				ok = rc == (ssize_t)op_size;
+			}
+			ok = ok && fdatasync(fd) == 0;
+			if (fd >= 0)
+				close(fd);
+		}
+		if (!ok) {
+			printf("%s failed\n", what);
+			return;
+		}
+		ns[is_ufs] = bench_now_ns() - start;
+	}
+	double mib = (double)op_size * op_count / (1024 * 1024);
+	printf("%-24s direct %8.1f MiB/s, cache %8.1f MiB/s, hits %5.1f%%, "\
+	       "readahead %zu, write-back %zu blocks in %zu calls\n", what,
+	       mib * 1e9 / ns[0], mib * 1e9 / ns[1],
+	       100.0 * stat.hits / (stat.hits + stat.misses),
+	       (size_t)stat.readahead, (size_t)stat.writeback,
+	       (size_t)stat.writeback_calls);
+}
+
+static void
+bench_page_cache(void)
+{
+	const size_t file_size = 64 * 1024 * 1024;
+	printf("# %zu MiB host file, 16 MiB cache, 90%% of random accesses to "\
+	       "the first 8 MiB\n", file_size / (1024 * 1024));
+	mkdir("ufs_bench_dir", 0755);
+	int fd = open("ufs_bench_dir/data", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	char buf[4096];
+	memset(buf, 'a', sizeof(buf));
+	for (size_t done = 0; fd >= 0 && done < file_size; done += sizeof(buf)) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			break;
+	}
+	if (fd < 0 || close(fd) != 0) {
+		printf("couldn't create the host file\n");
+		return;
+	}
+	bench_cache_run(BENCH_CACHE_SEQ_READ, "sequential 4 KiB reads", 4096,
+			file_size / 4096);
+	bench_cache_run(BENCH_CACHE_HOT_READ, "random 4 KiB reads", 4096,
+			100000);
+	bench_cache_run(BENCH_CACHE_HOT_WRITE, "random 512 B writes", 512,
+			200000);
+	unlink("ufs_bench_dir/data");
+	rmdir("ufs_bench_dir");
+}
+
+struct bench {
+	const char *name;
+	void (*func)(void);
+};
+
+static const struct bench benches[] = {
+	{"open_delete", bench_open_delete},
+	{"image_startup", bench_image_startup},
+	{"threads", bench_threads},
+	{"iov_append", bench_iov_append},
+	{"sparse", bench_sparse},
+	{"clone", bench_clone},
+	{"page_cache", bench_page_cache},
+};
+
+int
+main(int argc, char **argv)
+{
+	for (const struct bench &b : benches) {
+		bool is_needed = argc < 2;
+		for (int i = 1; i < argc && !is_needed; ++i)
+			is_needed = strcmp(argv[i], b.name) == 0;
+		if (is_needed)
+			b.func();
+	}
+	return 0;
+}
@@ -1,8 +1,13 @@
 #include "userfs.h"
 #include "unit.h"
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -15,6 +20,7 @@ test_open(void)
 
 	fd = ufs_open("file", UFS_CREATE);
 	unit_check(fd != -1, "use 'create' now");
+	unit_check(fd > 0, "descriptor is positive");
 	unit_check(ufs_close(fd) == 0, "close immediately");
 
 	fd = ufs_open("file", 0);
@@ -70,6 +76,47 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_many_files(void)
+{
+	unit_test_start();
+
+	const int count = 10000;
+	char name[16];
+	unit_msg("create %d files", count);
+	for (int i = 0; i < count; ++i) {
+		int name_len = snprintf(name, sizeof(name), "file%d", i) + 1;
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, name_len) != name_len);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("delete every third of them");
+	for (int i = 0; i < count; i += 3) {
+		snprintf(name, sizeof(name), "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_msg("the rest is still found by name");
+	char buf[16];
+	for (int i = 0; i < count; ++i) {
+		int name_len = snprintf(name, sizeof(name), "file%d", i) + 1;
+		int fd = ufs_open(name, 0);
+		if (i % 3 == 0) {
+			unit_fail_if(fd != -1);
+			unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+			continue;
+		}
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_read(fd, buf, sizeof(buf)) != name_len);
+		unit_fail_if(memcmp(buf, name, name_len) != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_open("file1", 0) == -1, "all files are deleted");
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -292,6 +339,189 @@ test_delete(void)
 	unit_test_finish();
 }
 
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	ssize_t rc = ufs_pwrite(fd, "tail", 4, 1000);
+	unit_check(rc == 4, "pwrite past the end");
+	char buffer[2048];
+	rc = ufs_read(fd, buffer, sizeof(buffer));
+	unit_check(rc == 1004, "the gap is a part of the file");
+	bool is_zero = true;
+	for (int i = 0; i < 1000 && is_zero; ++i)
+		is_zero = buffer[i] == 0;
+	unit_check(is_zero, "the gap is filled with zeros");
+	unit_check(memcmp(buffer + 1000, "tail", 4) == 0, "data after the gap");
+
+	rc = ufs_pwrite(fd, "head", 4, 0);
+	unit_fail_if(rc != 4);
+	rc = ufs_pread(fd, buffer, 4, 1000);
+	unit_check(rc == 4 && memcmp(buffer, "tail", 4) == 0, "pread");
+	rc = ufs_pread(fd, buffer, sizeof(buffer), 2000);
+	unit_check(rc == 0, "pread past the end");
+	rc = ufs_read(fd, buffer, sizeof(buffer));
+	unit_check(rc == 0, "position isn't changed by pwrite and pread");
+	unit_fail_if(ufs_close(fd) != 0);
+	/*
+	 * Vectored I/O crossing the block borders inside and between the
+	 * buffers.
+	 */
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	char a[300], b[1], c[700];
+	memset(a, 'a', sizeof(a));
+	memset(b, 'b', sizeof(b));
+	memset(c, 'c', sizeof(c));
+	struct iovec iov[] = {{a, sizeof(a)}, {NULL, 0}, {b, sizeof(b)},
+			      {c, sizeof(c)}};
+	rc = ufs_writev(fd, iov, 4);
+	unit_check(rc == 1001, "writev");
+	rc = ufs_writev(fd, iov, 1);
+	unit_check(rc == 300, "writev continues from the new position");
+	rc = ufs_pread(fd, buffer, sizeof(buffer), 0);
+	unit_fail_if(rc != 1301);
+	unit_check(memcmp(buffer, a, 300) == 0 && buffer[300] == 'b' &&
+		   memcmp(buffer + 301, c, 700) == 0 &&
+		   memcmp(buffer + 1001, a, 300) == 0, "writev data");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	memset(c, 0, sizeof(c));
+	rc = ufs_readv(fd, iov, 4);
+	unit_check(rc == 1001, "readv");
+	unit_check(a[0] == 'a' && a[299] == 'a' && b[0] == 'b' &&
+		   c[0] == 'c' && c[699] == 'c', "readv data");
+	rc = ufs_readv(fd, iov, 4);
+	unit_check(rc == 300, "readv stops at the end of file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_clone("src", "dst") == -1, "clone of a missing file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	char buf[2048];
+	memset(buf, 'a', sizeof(buf));
+	int fd = ufs_open("src", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	int old = ufs_open("dst", UFS_CREATE);
+	unit_fail_if(old == -1);
+	unit_fail_if(ufs_write(old, "old", 3) != 3);
+	unit_check(ufs_clone("src", "dst") == 0, "clone over an existing file");
+	unit_fail_if(ufs_pread(old, buf, sizeof(buf), 0) != 3);
+	unit_check(memcmp(buf, "old", 3) == 0, "the replaced file is intact");
+	unit_fail_if(ufs_close(old) != 0);
+
+	unit_fail_if(ufs_pwrite(fd, "src", 3, 600) != 3);
+	int dst = ufs_open("dst", 0);
+	unit_fail_if(dst == -1);
+	unit_fail_if(ufs_pwrite(dst, "dst", 3, 1000) != 3);
+	unit_check(ufs_pread(dst, buf, sizeof(buf), 0) == sizeof(buf),
+		   "the clone has the size of the source");
+	unit_check(memcmp(buf + 600, "aaa", 3) == 0 &&
+		   memcmp(buf + 1000, "dst", 3) == 0,
+		   "the clone doesn't see the source writes");
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf));
+	unit_check(memcmp(buf + 600, "src", 3) == 0 &&
+		   memcmp(buf + 1000, "aaa", 3) == 0,
+		   "the source doesn't see the clone writes");
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	dst = ufs_open("dst", 0);
+	unit_fail_if(dst == -1);
+	unit_check(ufs_read(dst, buf, sizeof(buf)) == sizeof(buf) &&
+		   buf[0] == 'a', "the clone outlives the source");
+	unit_fail_if(ufs_close(dst) != 0);
+	/*
+	 * A snapshot with a file to be changed, a file to be deleted, and a
+	 * file to be created after it.
+	 */
+	fd = ufs_open("new", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("new") != 0);
+	struct ufs_snapshot *snap = ufs_snapshot_create();
+	unit_check(snap != NULL, "snapshot");
+	fd = ufs_open("dst", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "changed", 7) != 7);
+	unit_fail_if(ufs_delete("dst") != 0);
+	int fd2 = ufs_open("new", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_snapshot_restore(snap) == 0, "restore");
+	unit_check(ufs_open("new", 0) == -1, "the new file is gone");
+	fd2 = ufs_open("dst", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == sizeof(buf) &&
+		   buf[0] == 'a', "the deleted file is back with the old data");
+	unit_fail_if(ufs_write(fd2, "x", 1) != 1);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_pread(fd, buf, 7, 0) != 7);
+	unit_check(memcmp(buf, "changed", 7) == 0,
+		   "the descriptor of the old file still works");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_snapshot_restore(snap) == 0, "restore again");
+	fd = ufs_open("dst", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 1) == sizeof(buf) - 1,
+		   "the snapshot isn't changed by the writes after restore");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_snapshot_delete(snap);
+	unit_fail_if(ufs_delete("dst") != 0);
+#if NEED_RESIZE
+	/* A shrink zeroes the tail of the last block, only in its own copy. */
+	memset(buf, 'b', sizeof(buf));
+	fd = ufs_open("a", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_clone("a", "b") != 0);
+	unit_fail_if(ufs_resize(fd, 100) != 0);
+	dst = ufs_open("b", 0);
+	unit_fail_if(dst == -1);
+	unit_check(ufs_pread(dst, buf, sizeof(buf), 0) == sizeof(buf) &&
+		   buf[200] == 'b', "the clone keeps the data cut off the "
+		   "source");
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+	unit_fail_if(ufs_resize(fd, sizeof(buf)) != 0);
+	unit_fail_if(ufs_pwrite(fd, "b", 1, 200) != 1);
+	snap = ufs_snapshot_create();
+	unit_fail_if(snap == NULL);
+	unit_fail_if(ufs_resize(fd, 100) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_snapshot_restore(snap) != 0);
+	fd = ufs_open("a", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == sizeof(buf) &&
+		   buf[200] == 'b', "the snapshot keeps the data cut off the "
+		   "file");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_snapshot_delete(snap);
+	unit_fail_if(ufs_delete("a") != 0);
+#endif
+	unit_check(ufs_snapshot_create() != NULL, "the snapshot left for "\
+		   "ufs_destroy()");
+	ufs_destroy();
+
+	unit_test_finish();
+}
+
 static void
 test_max_file_size(void)
 {
@@ -469,6 +699,467 @@ test_resize(void)
 #endif
 }
 
+static void
+test_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	const size_t max_size = 1024 * 1024 * 100;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[1024];
+	memset(buffer, 'a', sizeof(buffer));
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+	unit_fail_if(ufs_resize(fd, 100) != 0);
+	unit_check(ufs_resize(fd, max_size) == 0, "grow to the max size");
+	unit_check(ufs_pwrite(fd, "end", 3, max_size - 3) == 3,
+		   "write at the end");
+	unit_check(ufs_pwrite(fd, "mid", 3, max_size / 2) == 3,
+		   "write in the middle");
+	unit_check(ufs_pread(fd, buffer, sizeof(buffer), 0) == sizeof(buffer),
+		   "read the old data");
+	bool is_ok = true;
+	for (int i = 0; i < 100 && is_ok; ++i)
+		is_ok = buffer[i] == 'a';
+	for (size_t i = 100; i < sizeof(buffer) && is_ok; ++i)
+		is_ok = buffer[i] == 0;
+	unit_check(is_ok, "the cut off data doesn't come back");
+	unit_fail_if(ufs_pread(fd, buffer, 7, max_size / 2 - 2) != 7);
+	unit_check(memcmp(buffer, "\0\0mid\0\0", 7) == 0,
+		   "the hole around the data reads as zeros");
+	unit_fail_if(ufs_pread(fd, buffer, sizeof(buffer), max_size - 3) != 3);
+	unit_check(memcmp(buffer, "end", 3) == 0, "the last bytes");
+
+	unit_check(ufs_resize(fd, max_size / 2 + 1) == 0, "shrink");
+	unit_check(ufs_resize(fd, max_size) == 0, "grow again");
+	unit_fail_if(ufs_pread(fd, buffer, 4, max_size / 2) != 4);
+	unit_check(memcmp(buffer, "m\0\0\0", 4) == 0,
+		   "the tail of the shrunk block is zeroed");
+	unit_fail_if(ufs_pread(fd, buffer, 3, max_size - 3) != 3);
+	unit_check(memcmp(buffer, "\0\0\0", 3) == 0,
+		   "the freed block is a hole again");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	/*
+	 * The holes are kept in the image. It is much smaller than the file.
+	 */
+	const char *path = "userfs_test.img";
+	unlink(path);
+	unit_fail_if(ufs_mount(path, 64 * 1024) != 0);
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_resize(fd, max_size) == 0, "grow in the image");
+	unit_check(ufs_pwrite(fd, "mid", 3, max_size / 2) == 3 &&
+		   ufs_pwrite(fd, "start", 5, 0) == 5, "write into the image");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pread(fd, buffer, 5, 0) != 5);
+	unit_check(memcmp(buffer, "start", 5) == 0, "the first block");
+	unit_fail_if(ufs_pread(fd, buffer, 5, max_size / 2 - 1) != 5);
+	unit_check(memcmp(buffer, "\0mid\0", 5) == 0, "the middle block");
+	unit_fail_if(ufs_pread(fd, buffer, 1, max_size - 1) != 1);
+	unit_check(buffer[0] == 0, "the holes");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+#endif
+}
+
+struct thread_ctx {
+	int id;
+	bool ok;
+};
+
+static void *
+test_threads_worker(void *arg)
+{
+	struct thread_ctx *ctx = (struct thread_ctx *)arg;
+	char name[32], buf[4096], buf2[4096];
+	snprintf(name, sizeof(name), "thread%d", ctx->id);
+	memset(buf, 'a' + ctx->id, sizeof(buf));
+	ctx->ok = true;
+	for (int i = 0; i < 200 && ctx->ok; ++i) {
+		int fd = ufs_open(name, UFS_CREATE);
+		int fd2 = ufs_open(name, 0);
+		ctx->ok = fd != -1 && fd2 != -1 &&
+			  ufs_write(fd, buf, sizeof(buf)) == sizeof(buf) &&
+			  ufs_read(fd2, buf2, sizeof(buf2)) == sizeof(buf2) &&
+			  memcmp(buf, buf2, sizeof(buf)) == 0 &&
+			  ufs_close(fd) == 0 && ufs_close(fd2) == 0 &&
+			  ufs_delete(name) == 0;
+	}
+	/* The shared file can get deleted, but not while it is opened. */
+	int fd = ufs_open("shared", 0);
+	if (fd == -1)
+		return NULL;
+	ssize_t rc;
+	size_t total = 0;
+	while ((rc = ufs_read(fd, buf2, sizeof(buf2))) > 0) {
+		for (ssize_t i = 0; i < rc; ++i)
+			ctx->ok = ctx->ok && buf2[i] == 'x';
+		total += rc;
+	}
+	ctx->ok = ctx->ok && rc == 0 && total == 1024 * 1024 &&
+		  ufs_close(fd) == 0;
+#if NEED_OPEN_FLAGS
+	fd = ufs_open("errno", UFS_READ_ONLY);
+	ctx->ok = ctx->ok && ufs_write(fd, "a", 1) == -1 &&
+		  ufs_errno() == UFS_ERR_NO_PERMISSION && ufs_close(fd) == 0;
+#endif
+	return NULL;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	const int count = 8;
+	char buf[1024];
+	memset(buf, 'x', sizeof(buf));
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (int i = 0; i < 1024; ++i)
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("errno", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_open("missing", 0) != -1);
+	struct thread_ctx ctxs[count];
+	pthread_t threads[count];
+	for (int i = 0; i < count; ++i) {
+		ctxs[i].id = i;
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_threads_worker, &ctxs[i]) != 0);
+	}
+	usleep(1000);
+	unit_fail_if(ufs_delete("shared") != 0);
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		pthread_join(threads[i], NULL);
+		ok = ok && ctxs[i].ok;
+	}
+	unit_check(ok, "threads worked with own and shared files");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is per-thread");
+	unit_fail_if(ufs_delete("errno") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "userfs_test.img";
+	unlink(path);
+	unit_check(ufs_mount(path, 64 * 1024) == 0, "mount a new image");
+	unit_check(ufs_mount(path, 64 * 1024) == -1, "can't mount twice");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+
+	char buf[2048];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, buf, sizeof(buf)) == sizeof(buf),
+		   "write into the image");
+	unit_fail_if(ufs_close(fd) != 0);
+	int ghost = ufs_open("ghost", UFS_CREATE);
+	unit_fail_if(ghost == -1);
+	unit_fail_if(ufs_write(ghost, buf, 100) != 100);
+	unit_fail_if(ufs_delete("ghost") != 0);
+	char name[UFS_IMAGE_NAME_MAX + 2];
+	memset(name, 'x', sizeof(name) - 1);
+	name[sizeof(name) - 1] = 0;
+	unit_check(ufs_open(name, UFS_CREATE) == -1, "too long name");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_check(ufs_sync() == 0, "sync");
+	ufs_destroy();
+
+	unit_check(ufs_mount(path, 0) == 0, "mount the existing image");
+	unit_check(ufs_open("ghost", 0) == -1, "deleted file is not restored");
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	char buf2[4096];
+	unit_check(ufs_read(fd, buf2, sizeof(buf2)) == sizeof(buf),
+		   "the file is restored");
+	unit_check(memcmp(buf, buf2, sizeof(buf)) == 0, "with its data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_clone("file", "copy") == 0, "clone in the image");
+	fd = ufs_open("copy", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, buf2, sizeof(buf2)) == sizeof(buf) &&
+		   memcmp(buf, buf2, sizeof(buf)) == 0, "the copy has the data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_check(ufs_snapshot_create() == NULL &&
+		   ufs_errno() == UFS_ERR_NOT_IMPLEMENTED,
+		   "no snapshots in the image");
+
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	size_t total = 0;
+	ssize_t rc;
+	while ((rc = ufs_write(fd, buf, sizeof(buf))) > 0)
+		total += rc;
+	unit_check(rc == -1 && ufs_errno() == UFS_ERR_NO_MEM, "image is full");
+	unit_check(total + sizeof(buf) >= 60 * 1024, "and all of it was used, "\
+		   "the deleted file is reclaimed");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	ufs_destroy();
+
+	/*
+	 * Corrupt the image. The superblock has the inode region offset at 40,
+	 * and the region starts at 4096 with the size of the first inode.
+	 */
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	int img_fd = open(path, O_RDWR);
+	unit_fail_if(img_fd < 0);
+	uint64_t old_value;
+	uint64_t bad_value = UINT64_MAX - 4095;
+	unit_fail_if(pread(img_fd, &old_value, 8, 40) != 8);
+	unit_fail_if(pwrite(img_fd, &bad_value, 8, 40) != 8);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "a region out of the image is detected");
+	unit_fail_if(pwrite(img_fd, &old_value, 8, 40) != 8);
+	bad_value = UINT64_MAX;
+	unit_fail_if(pread(img_fd, &old_value, 8, 4096) != 8);
+	unit_fail_if(pwrite(img_fd, &bad_value, 8, 4096) != 8);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "a too big file is detected");
+	unit_fail_if(pwrite(img_fd, &old_value, 8, 4096) != 8);
+	close(img_fd);
+	unit_check(ufs_mount(path, 0) == 0, "mount the fixed image");
+	unit_fail_if(ufs_delete("file") != 0);
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
+/** Overwrite a part of a file, saving the old content into @a old. */
+static void
+file_patch(int fd, off_t pos, const void *data, size_t size, void *old)
+{
+	unit_fail_if(pread(fd, old, size, pos) != (ssize_t)size);
+	unit_fail_if(pwrite(fd, data, size, pos) != (ssize_t)size);
+}
+
+static void
+test_image_corrupt(void)
+{
+	unit_test_start();
+
+	/*
+	 * 100 blocks, so the last bitmap word has bits past the last block.
+	 * The superblock has the free block counter at 32, the inode region
+	 * offset at 40, and the bitmap offset at 48. An inode has the first
+	 * block at 8 and the name at 20, its size is 128.
+	 */
+	const char *path = "userfs_test_corrupt.img";
+	unlink(path);
+	unit_fail_if(ufs_mount(path, 100 * 512) != 0);
+	const char *names[] = {"a", "b"};
+	for (const char *name : names) {
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, "data", 4) != 4);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	ufs_destroy();
+	int img_fd = open(path, O_RDWR);
+	unit_fail_if(img_fd < 0);
+	uint64_t inode_offset;
+	uint64_t bitmap_offset;
+	unit_fail_if(pread(img_fd, &inode_offset, 8, 40) != 8);
+	unit_fail_if(pread(img_fd, &bitmap_offset, 8, 48) != 8);
+	off_t inode_a = inode_offset;
+	off_t inode_b = inode_offset + 128;
+	char name_a[2];
+	unit_fail_if(pread(img_fd, name_a, 2, inode_a + 20) != 2 ||
+		     strcmp(name_a, "a") != 0);
+
+	uint64_t words[2];
+	uint64_t old_words[2];
+	unit_fail_if(pread(img_fd, words, 16, bitmap_offset) != 16);
+	words[1] &= ~(UINT64_MAX << 36);
+	file_patch(img_fd, bitmap_offset, words, 16, old_words);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "free bits past the last block are detected");
+	words[0] = UINT64_MAX;
+	words[1] = UINT64_MAX;
+	uint32_t free_blocks = 50;
+	uint32_t old_free_blocks;
+	unit_fail_if(pwrite(img_fd, words, 16, bitmap_offset) != 16);
+	file_patch(img_fd, 32, &free_blocks, 4, &old_free_blocks);
+	unit_fail_if(ufs_mount(path, 0) != 0);
+	int fd = ufs_open("c", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, "data", 4) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "the free blocks are "\
+		   "counted by the bitmap");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("c") != 0);
+	ufs_destroy();
+	unit_fail_if(pwrite(img_fd, old_words, 16, bitmap_offset) != 16);
+
+	uint32_t first_block;
+	uint32_t old_first_block;
+	unit_fail_if(pread(img_fd, &first_block, 4, inode_a + 8) != 4);
+	file_patch(img_fd, inode_b + 8, &first_block, 4, &old_first_block);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "a block in two files is detected");
+	unit_fail_if(pwrite(img_fd, &old_first_block, 4, inode_b + 8) != 4);
+
+	char old_name[2];
+	file_patch(img_fd, inode_b + 20, "a", 2, old_name);
+	unit_check(ufs_mount(path, 0) == -1 && ufs_errno() == UFS_ERR_IO,
+		   "duplicate names are detected");
+	unit_fail_if(pwrite(img_fd, old_name, 2, inode_b + 20) != 2);
+	close(img_fd);
+
+	unit_check(ufs_mount(path, 0) == 0, "mount the fixed image");
+	for (const char *name : names)
+		unit_fail_if(ufs_delete(name) != 0);
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static void
+test_dir(void)
+{
+	unit_test_start();
+
+	const char *path = "userfs_test_dir";
+	/* A tiny cache to make the files not fit into it. */
+	unit_check(ufs_mount_dir(path, 0) == 0, "mount a new directory");
+	unit_check(ufs_mount_dir(path, 0) == -1, "can't mount twice");
+	unit_check(ufs_open("a/b", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_IO, "no paths in the names");
+
+	const int size = 100 * 1024;
+	char *data = new char[size];
+	char *data2 = new char[size];
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (int pos = 0; pos < size; pos += 1024)
+		unit_fail_if(ufs_write(fd, data + pos, 1024) != 1024);
+	unit_check(ufs_pread(fd, data2, size, 0) == size &&
+		   memcmp(data, data2, size) == 0,
+		   "the file is bigger than the cache");
+	for (int pos = 7; pos < size; pos += 4099) {
+		data[pos] = 'X';
+		unit_fail_if(ufs_pwrite(fd, "X", 1, pos) != 1);
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	bool is_ok = true;
+	for (int pos = 0; pos < size && is_ok; pos += 512) {
+		is_ok = ufs_read(fd, data2, 512) == 512 &&
+			memcmp(data + pos, data2, 512) == 0;
+	}
+	unit_check(is_ok, "sequential read");
+	struct ufs_cache_stat stat;
+	ufs_cache_stat(&stat);
+	unit_check(stat.readahead > 0 && stat.writeback > stat.writeback_calls,
+		   "readahead and batched write-back");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_clone("file", "copy") == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_IMPLEMENTED, "no clones");
+
+	int ghost = ufs_open("ghost", UFS_CREATE);
+	unit_fail_if(ghost == -1);
+	unit_fail_if(ufs_write(ghost, data, 3000) != 3000);
+	unit_fail_if(ufs_delete("ghost") != 0);
+	unit_check(ufs_pread(ghost, data2, size, 0) == 3000 &&
+		   memcmp(data, data2, 3000) == 0, "deleted file is readable");
+	unit_fail_if(ufs_close(ghost) != 0);
+#if NEED_RESIZE
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, 1000) != 1000);
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_resize(fd, 600) != 0);
+	unit_fail_if(ufs_pread(fd, data2, size, 0) != 600);
+	is_ok = memcmp(data, data2, 10) == 0;
+	for (int i = 10; i < 600 && is_ok; ++i)
+		is_ok = data2[i] == 0;
+	unit_check(is_ok, "resize");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+#endif
+	unit_check(ufs_sync() == 0, "sync");
+	int host_fd = open("userfs_test_dir/file", O_RDONLY);
+	unit_check(host_fd >= 0 && read(host_fd, data2, size) == size &&
+		   read(host_fd, data2, 1) == 0 && memcmp(data, data2, size) == 0,
+		   "the host file has the data");
+	close(host_fd);
+	ufs_destroy();
+	unit_check(ufs_errno() == UFS_ERR_NO_ERR, "destroy writes all back");
+
+	unit_check(ufs_mount_dir(path, 64 * 1024) == 0,
+		   "mount the existing directory");
+	unit_check(ufs_open("ghost", 0) == -1, "deleted file is not restored");
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, data2, size) == size &&
+		   memcmp(data, data2, size) == 0, "the file is restored");
+	ufs_cache_stat(&stat);
+	uint64_t misses = stat.misses;
+	unit_check(ufs_pread(fd, data2, 0, 0) == 0 &&
+		   ufs_pread(fd, data2, 0, 7) == 0, "zero-length read");
+	ufs_cache_stat(&stat);
+	unit_check(stat.misses == misses, "it doesn't touch the cache");
+	unit_check(ufs_read(fd, data2, 512) == 0 &&
+		   ufs_pread(fd, data2, 512, size) == 0 &&
+		   ufs_pread(fd, data2, 512, size + 100) == 0, "read at the end");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	/* The file size limit makes the write-back fail. */
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, 8192) != 8192);
+	unit_fail_if(ufs_close(fd) != 0);
+	struct rlimit old_limit;
+	unit_fail_if(getrlimit(RLIMIT_FSIZE, &old_limit) != 0);
+	struct rlimit limit = old_limit;
+	limit.rlim_cur = 1024;
+	unit_fail_if(setrlimit(RLIMIT_FSIZE, &limit) != 0);
+	void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+	ufs_destroy();
+	unit_check(ufs_errno() == UFS_ERR_IO, "failed write-back on destroy "\
+		   "is reported");
+	signal(SIGXFSZ, old_handler);
+	unit_fail_if(setrlimit(RLIMIT_FSIZE, &old_limit) != 0);
+	unit_fail_if(unlink("userfs_test_dir/big") != 0);
+	unit_check(rmdir(path) == 0, "no files left in the directory");
+	delete[] data;
+	delete[] data2;
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -490,9 +1181,17 @@ main(int argc, char **argv)
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_many_files();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_positional_io();
+	test_sparse();
+	test_clone();
+	test_threads();
+	test_image();
+	test_image_corrupt();
+	test_dir();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
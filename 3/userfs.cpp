@@ -2,8 +2,17 @@
 
 #include "rlist.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 enum {
@@ -11,33 +20,66 @@ enum {
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
 };
 
-/** Global error code. Set from any function on any error. */
-static ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/**
+ * Error code of the last failed call. Set from any function on any error. It
+ * is per-thread, so threads don't overwrite each other's errors.
+ */
+static thread_local ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
 struct block {
 	/** Block memory. */
 	char memory[BLOCK_SIZE];
-	/** A link in the block list of the owner-file. */
-	rlist in_block_list = RLIST_LINK_INITIALIZER;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * A block on the heap. Clones and snapshots share the blocks, and a shared
+ * block is copied on the first write into it. The blocks of the image are
+ * never shared.
+ */
+struct heap_block {
+	/** Number of the files having the block. */
+	int refs;
+	block data;
 };
 
 struct file {
 	/**
-	 * Doubly-linked intrusive list of file blocks. Intrusiveness of the
-	 * list gives you the full control over the lifetime of the items in the
-	 * list without having to use double pointers with performance penalty.
+	 * Block index of the file. The block number i holds the bytes
+	 * [i * BLOCK_SIZE, (i + 1) * BLOCK_SIZE). The blocks are either on the
+	 * heap or in the mounted image. The file is sparse: a NULL entry and
+	 * everything past the end of the index up to the file size is a hole,
+	 * which reads as zeros and gets a block only on the first write. The
+	 * bytes of the blocks past the file size are always zeros.
+	 */
+	std::vector<block *> blocks;
+	/**
+	 * Protects the blocks, the size, and the positions of the descriptors.
+	 * Reads take it shared, so readers never block each other, and readers
+	 * of different files never touch the same lock.
+	 */
+	pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+	/**
+	 * References of the opened descriptors plus one of the file list while
+	 * the file is not deleted. The file is freed with the last reference,
+	 * so a deleted file lives until all its readers are done.
 	 */
-	rlist blocks = RLIST_HEAD_INITIALIZER(blocks);
-	/** How many file descriptors are opened on the file. */
 	int refs = 0;
+	/** Descriptors opened on the file. Protected by the lock. */
+	rlist descs = RLIST_HEAD_INITIALIZER(descs);
 	/** File name. */
 	std::string name;
 	/** A link in the global file list. */
 	rlist in_file_list = RLIST_LINK_INITIALIZER;
-
-	/* PUT HERE OTHER MEMBERS */
+	/** Hash of the name. Used by the name index. */
+	uint32_t name_hash = 0;
+	/** File size in bytes. */
+	size_t size = 0;
+	/** Inode number when the file lives in a mounted image. */
+	uint32_t inode = 0;
+	/** Host file descriptor when the files live in a host directory. */
+	int host_fd = -1;
+	/** Size of the host file. It is behind the size until write-back. */
+	size_t host_size = 0;
 };
 
 /**
@@ -47,19 +89,218 @@ struct file {
  */
 static rlist file_list = RLIST_HEAD_INITIALIZER(file_list);
 
+/** Protects file_list and file_index. */
+static pthread_rwlock_t file_list_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Open-addressing hash index of the files from file_list by their names.
+ * Linear probing, the capacity is always a power of 2 and the load factor is
+ * kept below 1/2. Deletion shifts the following entries of the probe sequence
+ * back, so there are no tombstones and lookups never degrade after many
+ * create-delete cycles.
+ */
+static std::vector<file *> file_index;
+/** Number of files in file_index. */
+static size_t file_index_count = 0;
+
 struct filedesc {
 	file *atfile;
+	/**
+	 * Position in the file. Changed only by the descriptor owner and by
+	 * resize, both under the file lock.
+	 */
+	size_t pos;
+	/** Bitwise combination of open_flags the file was opened with. */
+	int flags;
+	/** A link in the descriptor list of the file. */
+	rlist in_file_descs = RLIST_LINK_INITIALIZER;
+	/** Where the next read starts if the reading is sequential. */
+	size_t readahead_pos = 0;
+	/** Number of blocks to read ahead of the sequential reads. */
+	size_t readahead_window = 0;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+enum {
+	FD_SHARD_COUNT = 16,
+	FD_CHUNK_SIZE = 1024,
+	FD_CHUNKS_PER_SHARD = 1024,
 };
 
 /**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * A part of the descriptor table. The descriptor number fd lives in the shard
+ * (fd - 1) % FD_SHARD_COUNT in the slot (fd - 1) / FD_SHARD_COUNT, so 0 is
+ * never a descriptor, as ufs_open() promises. Each thread opens
+ * descriptors in its own shard, so concurrent opens and closes don't fight
+ * for one lock. The slots are stored in chunks which are never moved or
+ * freed until ufs_destroy(), so the lookup by a descriptor number takes no
+ * locks at all.
  */
-static std::vector<filedesc*> file_descriptors;
+struct fd_shard {
+	/** Protects the allocation of the slots. */
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	/** Chunks of the slots. A closed descriptor's slot is NULL. */
+	filedesc **chunks[FD_CHUNKS_PER_SHARD];
+	/** Number of slots ever used. */
+	uint32_t slot_count;
+	/** Slots of the closed descriptors to take by next ufs_open() calls. */
+	std::vector<uint32_t> free_slots;
+};
+
+static fd_shard fd_shards[FD_SHARD_COUNT];
+
+/** Shard of the descriptors opened by this thread. */
+static thread_local int fd_shard_id = -1;
+/** Next shard to give to a thread. */
+static int fd_shard_next = 0;
+
+enum {
+	IMAGE_VERSION = 2,
+	/** All the image regions start at a page boundary. */
+	IMAGE_ALIGN = 4096,
+	/** One inode is reserved for each this number of data blocks. */
+	IMAGE_BLOCKS_PER_INODE = 16,
+	IMAGE_MIN_INODES = 16,
+	/** Terminator of block chains. */
+	IMAGE_CHAIN_END = UINT32_MAX,
+};
+
+static const char image_magic[8] = "UFSIMG";
+
+enum image_inode_flags {
+	IMAGE_INODE_USED = 1,
+	/**
+	 * The file was deleted while still opened. Its blocks are reclaimed on
+	 * the last close, or on the next mount if the process dies before.
+	 */
+	IMAGE_INODE_ORPHAN = 2,
+};
+
+struct image_inode {
+	/** File size in bytes. */
+	uint64_t size;
+	/**
+	 * First block of the file's chain or IMAGE_CHAIN_END. The chain links
+	 * the allocated blocks in no particular order, the position of each
+	 * one in the file is in the block index of the image.
+	 */
+	uint32_t first_block;
+	/** Number of blocks in the chain. */
+	uint32_t block_count;
+	/** Bitwise combination of image_inode_flags. */
+	uint32_t flags;
+	/** 0-terminated file name. */
+	char name[UFS_IMAGE_NAME_MAX + 1];
+};
+
+static_assert(sizeof(image_inode) == 128, "inodes are packed");
+
+struct image_super {
+	char magic[sizeof(image_magic)];
+	uint32_t version;
+	uint32_t block_size;
+	/** Total size of the image file. */
+	uint64_t image_size;
+	uint32_t inode_count;
+	uint32_t block_count;
+	uint32_t free_blocks;
+	uint64_t inode_offset;
+	uint64_t bitmap_offset;
+	uint64_t chain_offset;
+	uint64_t block_index_offset;
+	uint64_t data_offset;
+};
+
+/** A filesystem image mapped into the memory. */
+struct image {
+	/** Image file descriptor. */
+	int fd;
+	/** The whole image mapping. */
+	char *map;
+	/** Size of the mapping. */
+	size_t size;
+	image_super *super;
+	image_inode *inodes;
+	/** Bit per data block, set when the block is used. */
+	uint64_t *bitmap;
+	/** Next block in the chain of each data block. */
+	uint32_t *chain;
+	/** Number of each data block inside its file. */
+	uint32_t *block_index;
+	/** Data region. */
+	block *blocks;
+	/** Where to start looking for a free block. */
+	uint32_t block_hint;
+	/** Where to start looking for a free inode. */
+	uint32_t inode_hint;
+	/**
+	 * Protects the bitmap, allocation of inodes, and the hints. The rest
+	 * belongs to the files and is protected by their locks.
+	 */
+	pthread_mutex_t mutex;
+};
+
+/** The mounted image. NULL when the files live on the heap. */
+static image *mounted_image = NULL;
+
+struct ufs_snapshot {
+	/**
+	 * Frozen copies of the files. They are not in the file list and
+	 * share the blocks with the live files.
+	 */
+	std::vector<file *> files;
+	/** A link in snapshot_list. */
+	rlist in_snapshot_list = RLIST_LINK_INITIALIZER;
+};
+
+/** All the snapshots. Protected by file_list_lock. */
+static rlist snapshot_list = RLIST_HEAD_INITIALIZER(snapshot_list);
+
+enum {
+	CACHE_MIN_PAGES = 16,
+	/** Max number of blocks read ahead of a sequential reader. */
+	CACHE_READAHEAD_MAX = 64,
+	/** Max number of dirty blocks written back by one host call. */
+	CACHE_WRITEBACK_MAX = 64,
+};
+
+/** A block of a host file in the page cache. */
+struct cache_page {
+	block data;
+	/**
+	 * File of the page. NULL when the page is free or is being filled and
+	 * can't be evicted.
+	 */
+	file *owner;
+	/** Block number in the owner file. */
+	size_t index;
+	/** Changed and not written back yet. Protected by the owner lock. */
+	bool is_dirty;
+	/** Accessed since the last pass of the clock hand. */
+	bool is_referenced;
+};
+
+/**
+ * Host directory with the files and the page cache in front of them. Only
+ * the cached blocks are in the block indexes of the files, a NULL entry is
+ * read from the host file. The pages are evicted by the CLOCK algorithm.
+ */
+struct backing {
+	/** Host directory descriptor. */
+	int dir_fd;
+	/** The pages. The array never changes its size. */
+	std::vector<cache_page> pages;
+	/** Numbers of the free pages. */
+	std::vector<uint32_t> free_pages;
+	/** The clock hand, the next page to check for eviction. */
+	size_t hand;
+	/** Protects the ownership of the pages, the free pages, and the hand. */
+	pthread_mutex_t mutex;
+	/** Statistics updated atomically. */
+	struct ufs_cache_stat stat;
+};
+
+/** The mounted host directory. NULL when it is not used. */
+static backing *mounted_backing = NULL;
 
 enum ufs_error_code
 ufs_errno()
@@ -67,56 +308,1398 @@ ufs_errno()
 	return ufs_error_code;
 }
 
+static size_t
+image_align(size_t size)
+{
+	return (size + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+static uint32_t
+image_block_no(const image *img, const block *b)
+{
+	return b - img->blocks;
+}
+
+static uint32_t
+image_block_alloc(image *img)
+{
+	pthread_mutex_lock(&img->mutex);
+	if (img->super->free_blocks == 0) {
+		pthread_mutex_unlock(&img->mutex);
+		return IMAGE_CHAIN_END;
+	}
+	uint32_t word_count = (img->super->block_count + 63) / 64;
+	uint32_t w = img->block_hint / 64;
+	while (img->bitmap[w] == UINT64_MAX)
+		w = w + 1 == word_count ? 0 : w + 1;
+	uint32_t n = w * 64 + __builtin_ctzll(~img->bitmap[w]);
+	img->bitmap[w] |= (uint64_t)1 << (n % 64);
+	--img->super->free_blocks;
+	img->block_hint = n;
+	pthread_mutex_unlock(&img->mutex);
+	return n;
+}
+
+static void
+image_block_free(image *img, uint32_t n)
+{
+	pthread_mutex_lock(&img->mutex);
+	img->bitmap[n / 64] &= ~((uint64_t)1 << (n % 64));
+	++img->super->free_blocks;
+	pthread_mutex_unlock(&img->mutex);
+}
+
+static bool
+image_block_is_used(const image *img, uint32_t n)
+{
+	return (img->bitmap[n / 64] & ((uint64_t)1 << (n % 64))) != 0;
+}
+
+/** Take a free inode and mark it used. UINT32_MAX when there are none. */
+static uint32_t
+image_inode_alloc(image *img)
+{
+	pthread_mutex_lock(&img->mutex);
+	uint32_t count = img->super->inode_count;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t n = (img->inode_hint + i) % count;
+		if (img->inodes[n].flags == 0) {
+			img->inodes[n].flags = IMAGE_INODE_USED;
+			img->inode_hint = n + 1;
+			pthread_mutex_unlock(&img->mutex);
+			return n;
+		}
+	}
+	pthread_mutex_unlock(&img->mutex);
+	return UINT32_MAX;
+}
+
+static void
+image_inode_free(image *img, uint32_t n)
+{
+	pthread_mutex_lock(&img->mutex);
+	memset(&img->inodes[n], 0, sizeof(image_inode));
+	pthread_mutex_unlock(&img->mutex);
+}
+
+/** FNV-1a with a final avalanche, so linear probing gets spread keys. */
+static uint32_t
+name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (; *name != 0; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static void
+file_index_insert_slot(file *f)
+{
+	size_t mask = file_index.size() - 1;
+	size_t i = f->name_hash & mask;
+	while (file_index[i] != NULL)
+		i = (i + 1) & mask;
+	file_index[i] = f;
+}
+
+static void
+file_index_insert(file *f)
+{
+	if ((file_index_count + 1) * 2 > file_index.size()) {
+		size_t new_cap = file_index.empty() ? 16 : file_index.size() * 2;
+		std::vector<file *> old(new_cap, NULL);
+		old.swap(file_index);
+		for (file *it : old) {
+			if (it != NULL)
+				file_index_insert_slot(it);
+		}
+	}
+	file_index_insert_slot(f);
+	++file_index_count;
+}
+
+static size_t
+file_index_find_slot(const char *name, uint32_t hash)
+{
+	if (file_index.empty())
+		return SIZE_MAX;
+	size_t mask = file_index.size() - 1;
+	for (size_t i = hash & mask; file_index[i] != NULL; i = (i + 1) & mask) {
+		file *f = file_index[i];
+		if (f->name_hash == hash && strcmp(f->name.c_str(), name) == 0)
+			return i;
+	}
+	return SIZE_MAX;
+}
+
+static void
+file_index_delete_slot(size_t i)
+{
+	size_t mask = file_index.size() - 1;
+	size_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		file *f = file_index[j];
+		if (f == NULL)
+			break;
+		/*
+		 * The entry can fill the hole only if its home slot is not
+		 * cyclically inside (i, j], otherwise it would become
+		 * unreachable from the home slot.
+		 */
+		size_t home = f->name_hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			file_index[i] = f;
+			i = j;
+		}
+	}
+	file_index[i] = NULL;
+	--file_index_count;
+}
+
+static file *
+file_find(const char *name, uint32_t hash)
+{
+	size_t slot = file_index_find_slot(name, hash);
+	return slot == SIZE_MAX ? NULL : file_index[slot];
+}
+
+static void
+file_set_size(file *f, size_t size)
+{
+	f->size = size;
+	if (mounted_image != NULL)
+		mounted_image->inodes[f->inode].size = size;
+}
+
+static heap_block *
+heap_block_of(block *b)
+{
+	return (heap_block *)((char *)b - offsetof(heap_block, data));
+}
+
+static block *
+heap_block_new(void)
+{
+	heap_block *hb = new heap_block();
+	hb->refs = 1;
+	return &hb->data;
+}
+
+static void
+heap_block_ref(block *b)
+{
+	__atomic_add_fetch(&heap_block_of(b)->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+heap_block_unref(block *b)
+{
+	heap_block *hb = heap_block_of(b);
+	if (__atomic_sub_fetch(&hb->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		delete hb;
+}
+
+/**
+ * Check if the heap block is used by other files too. Only the file can
+ * give its blocks to the others, so the answer doesn't become wrong while
+ * the file is locked exclusively.
+ */
+static bool
+heap_block_is_shared(block *b)
+{
+	return __atomic_load_n(&heap_block_of(b)->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+/** Total size of the buffers. SIZE_MAX on overflow. */
+static size_t
+iov_size(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len > SIZE_MAX - total)
+			return SIZE_MAX;
+		total += iov[i].iov_len;
+	}
+	return total;
+}
+
+static void
+cache_stat_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static cache_page *
+cache_page_of(block *b)
+{
+	return (cache_page *)((char *)b - offsetof(cache_page, data));
+}
+
+static bool
+file_block_is_dirty(const file *f, size_t i)
+{
+	return i < f->blocks.size() && f->blocks[i] != NULL &&
+	       cache_page_of(f->blocks[i])->is_dirty;
+}
+
+/**
+ * Write back the run of the dirty blocks around the block @a i with one host
+ * call. Must be called under the exclusive file lock.
+ */
+static int
+file_writeback_run(file *f, size_t i)
+{
+	size_t first = i;
+	size_t end = i + 1;
+	while (first > 0 && end - first < CACHE_WRITEBACK_MAX &&
+	       file_block_is_dirty(f, first - 1))
+		--first;
+	while (end - first < CACHE_WRITEBACK_MAX && file_block_is_dirty(f, end))
+		++end;
+	struct iovec iov[CACHE_WRITEBACK_MAX];
+	int count = end - first;
+	size_t total = 0;
+	for (int k = 0; k < count; ++k) {
+		iov[k].iov_base = f->blocks[first + k]->memory;
+		/* The last block is cut by the file size. */
+		size_t n = f->size - (first + k) * BLOCK_SIZE;
+		if (n > BLOCK_SIZE)
+			n = BLOCK_SIZE;
+		iov[k].iov_len = n;
+		total += n;
+	}
+	ssize_t rc = pwritev(f->host_fd, iov, count, first * BLOCK_SIZE);
+	if (rc != (ssize_t)total) {
+		if (rc >= 0)
+			errno = EIO;
+		return -1;
+	}
+	for (size_t k = first; k < end; ++k)
+		cache_page_of(f->blocks[k])->is_dirty = false;
+	if (first * BLOCK_SIZE + total > f->host_size)
+		f->host_size = first * BLOCK_SIZE + total;
+	cache_stat_add(&mounted_backing->stat.writeback, count);
+	cache_stat_add(&mounted_backing->stat.writeback_calls, 1);
+	return 0;
+}
+
+/** Write back all the dirty blocks of the file. Under the exclusive lock. */
+static int
+file_writeback(file *f)
+{
+	for (size_t i = 0; i < f->blocks.size(); ++i) {
+		if (file_block_is_dirty(f, i) && file_writeback_run(f, i) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Take a page from the cache, evicting another one if needed. The page is
+ * not visible to the eviction until attached to a file, so several pages can
+ * be filled at once. Must be called under the exclusive lock of @a f. The
+ * pages of the other files are evicted only if their lock is free, so it
+ * never waits for the other files. A dirty victim is claimed and written
+ * back with the cache unlocked, so the disk doesn't stall the others either.
+ *
+ * @retval NULL All the pages are busy.
+ */
+static cache_page *
+cache_page_take(file *f)
+{
+	backing *bk = mounted_backing;
+	pthread_mutex_lock(&bk->mutex);
+	cache_page *p = NULL;
+	if (!bk->free_pages.empty()) {
+		p = &bk->pages[bk->free_pages.back()];
+		bk->free_pages.pop_back();
+	}
+	/* The first round might only clear the reference bits. */
+	for (size_t step = 0; p == NULL && step < 2 * bk->pages.size();
+	     ++step) {
+		cache_page *it = &bk->pages[bk->hand];
+		bk->hand = (bk->hand + 1) % bk->pages.size();
+		file *owner = it->owner;
+		if (owner == NULL ||
+		    __atomic_exchange_n(&it->is_referenced, false,
+					__ATOMIC_RELAXED))
+			continue;
+		if (owner != f && pthread_rwlock_trywrlock(&owner->lock) != 0)
+			continue;
+		bool is_evicted = true;
+		if (it->is_dirty) {
+			/*
+			 * Without an owner nobody else evicts it, and the
+			 * owner's lock keeps its blocks as they are.
+			 */
+			it->owner = NULL;
+			pthread_mutex_unlock(&bk->mutex);
+			is_evicted = file_writeback_run(owner, it->index) == 0;
+			pthread_mutex_lock(&bk->mutex);
+			if (!is_evicted)
+				it->owner = owner;
+		}
+		if (is_evicted) {
+			owner->blocks[it->index] = NULL;
+			it->owner = NULL;
+			p = it;
+		}
+		if (owner != f)
+			pthread_rwlock_unlock(&owner->lock);
+	}
+	pthread_mutex_unlock(&bk->mutex);
+	return p;
+}
+
+/** Make the taken page the block @a i of the file. */
+static void
+cache_page_attach(file *f, size_t i, cache_page *p)
+{
+	if (i >= f->blocks.size())
+		f->blocks.resize(i + 1, NULL);
+	f->blocks[i] = &p->data;
+	p->index = i;
+	p->is_dirty = false;
+	__atomic_store_n(&p->is_referenced, true, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&mounted_backing->mutex);
+	p->owner = f;
+	pthread_mutex_unlock(&mounted_backing->mutex);
+}
+
+/** Give the pages back to the cache. Their data is dropped. */
+static void
+cache_pages_release(cache_page **pages, size_t count)
+{
+	backing *bk = mounted_backing;
+	pthread_mutex_lock(&bk->mutex);
+	for (size_t i = 0; i < count; ++i) {
+		pages[i]->owner = NULL;
+		bk->free_pages.push_back(pages[i] - bk->pages.data());
+	}
+	pthread_mutex_unlock(&bk->mutex);
+}
+
+/**
+ * Read the host file. The part past the end of the host file is zeros.
+ * @retval 0 Success.
+ * @retval -1 Read error.
+ */
+static int
+file_host_readv(file *f, size_t pos, struct iovec *iov, int iovcnt)
+{
+	size_t done = 0;
+	if (pos < f->host_size) {
+		ssize_t rc = preadv(f->host_fd, iov, iovcnt, pos);
+		if (rc < 0)
+			return -1;
+		done = rc;
+	}
+	for (int v = 0; v < iovcnt; ++v) {
+		size_t len = iov[v].iov_len;
+		if (done >= len) {
+			done -= len;
+			continue;
+		}
+		memset((char *)iov[v].iov_base + done, 0, len - done);
+		done = 0;
+	}
+	return 0;
+}
+
+/**
+ * Get the cached block @a i of the host file, loading it if needed. Must be
+ * called under the exclusive file lock.
+ *
+ * @param need_data False if the whole block is going to be overwritten and
+ *     there is no need to read it.
+ * @retval NULL No free page or a read error. The caller can still go to the
+ *     host file directly.
+ */
+static block *
+file_cache_block(file *f, size_t i, bool need_data)
+{
+	block *b = i < f->blocks.size() ? f->blocks[i] : NULL;
+	if (b != NULL) {
+		__atomic_store_n(&cache_page_of(b)->is_referenced, true,
+				 __ATOMIC_RELAXED);
+		return b;
+	}
+	cache_page *p = cache_page_take(f);
+	if (p == NULL)
+		return NULL;
+	struct iovec iov = {p->data.memory, BLOCK_SIZE};
+	if (need_data && file_host_readv(f, i * BLOCK_SIZE, &iov, 1) != 0) {
+		cache_pages_release(&p, 1);
+		return NULL;
+	}
+	cache_page_attach(f, i, p);
+	return &p->data;
+}
+
+/** Account an access to the block @a i in the cache statistics. */
+static void
+file_cache_count(file *f, size_t i)
+{
+	bool is_hit = i < f->blocks.size() && f->blocks[i] != NULL;
+	backing *bk = mounted_backing;
+	cache_stat_add(is_hit ? &bk->stat.hits : &bk->stat.misses, 1);
+}
+
+/**
+ * Load the not cached blocks of [@a first, @a end) in runs, with one host
+ * read per run. Stops when the cache has no free pages.
+ */
+static void
+file_cache_load(file *f, size_t first, size_t end, bool is_readahead)
+{
+	cache_page *pages[CACHE_READAHEAD_MAX];
+	struct iovec iov[CACHE_READAHEAD_MAX];
+	size_t i = first;
+	while (i < end) {
+		if (i < f->blocks.size() && f->blocks[i] != NULL) {
+			++i;
+			continue;
+		}
+		size_t count = 0;
+		while (i + count < end && count < CACHE_READAHEAD_MAX &&
+		       (i + count >= f->blocks.size() ||
+			f->blocks[i + count] == NULL)) {
+			cache_page *p = cache_page_take(f);
+			if (p == NULL)
+				break;
+			pages[count] = p;
+			iov[count].iov_base = p->data.memory;
+			iov[count].iov_len = BLOCK_SIZE;
+			++count;
+		}
+		if (count == 0)
+			return;
+		if (file_host_readv(f, i * BLOCK_SIZE, iov, count) != 0) {
+			cache_pages_release(pages, count);
+			return;
+		}
+		for (size_t k = 0; k < count; ++k)
+			cache_page_attach(f, i + k, pages[k]);
+		if (is_readahead)
+			cache_stat_add(&mounted_backing->stat.readahead, count);
+		i += count;
+	}
+}
+
+/**
+ * Read ahead of the descriptor if it reads the file sequentially. The window
+ * grows with each sequential read and drops on a random one. New blocks are
+ * loaded when the reader gets to the middle of the loaded window, so they
+ * come in big runs. Must be called under the exclusive file lock.
+ */
+static void
+filedesc_readahead(filedesc *d, size_t size)
+{
+	file *f = d->atfile;
+	if (size == 0 || d->pos >= f->size)
+		return;
+	bool is_sequential = d->pos == d->readahead_pos;
+	d->readahead_pos = d->pos + size;
+	if (!is_sequential) {
+		d->readahead_window = 0;
+		return;
+	}
+	size_t max_window = mounted_backing->pages.size() / 4;
+	if (max_window > CACHE_READAHEAD_MAX)
+		max_window = CACHE_READAHEAD_MAX;
+	if (d->readahead_window == 0)
+		d->readahead_window = 4;
+	else if (d->readahead_window * 2 <= max_window)
+		d->readahead_window *= 2;
+	size_t block_count = (f->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t first = d->pos / BLOCK_SIZE;
+	size_t last = (d->pos + size - 1) / BLOCK_SIZE;
+	if (last >= block_count)
+		last = block_count - 1;
+	size_t probe = last + d->readahead_window / 2;
+	if (probe >= block_count)
+		probe = block_count - 1;
+	if (probe < f->blocks.size() && f->blocks[probe] != NULL)
+		return;
+	size_t end = last + 1 + d->readahead_window;
+	if (end > block_count)
+		end = block_count;
+	file_cache_load(f, first, end, true);
+}
+
+/**
+ * Fill the hole number @a i with a new block of the image, its data is not
+ * initialized. NULL when the image is full.
+ */
+static block *
+image_file_add_block(file *f, size_t i)
+{
+	image *img = mounted_image;
+	uint32_t n = image_block_alloc(img);
+	if (n == IMAGE_CHAIN_END)
+		return NULL;
+	if (i >= f->blocks.size())
+		f->blocks.resize(i + 1, NULL);
+	image_inode *inode = &img->inodes[f->inode];
+	img->block_index[n] = i;
+	img->chain[n] = inode->first_block;
+	inode->first_block = n;
+	++inode->block_count;
+	block *b = &img->blocks[n];
+	f->blocks[i] = b;
+	return b;
+}
+
+/**
+ * Fill the hole number @a i with a new zeroed block. NULL when the image is
+ * full.
+ */
+static block *
+file_alloc_block(file *f, size_t i)
+{
+	if (mounted_image != NULL) {
+		block *b = image_file_add_block(f, i);
+		if (b != NULL)
+			memset(b->memory, 0, BLOCK_SIZE);
+		return b;
+	}
+	if (i >= f->blocks.size())
+		f->blocks.resize(i + 1, NULL);
+	block *b = heap_block_new();
+	f->blocks[i] = b;
+	return b;
+}
+
+/**
+ * Give the file its own copy of the heap block number @a i if it is shared
+ * with the clones or the snapshots, before changing it. Must be called under
+ * the exclusive file lock.
+ */
+static block *
+file_unshare_block(file *f, size_t i)
+{
+	block *b = f->blocks[i];
+	if (mounted_image != NULL || mounted_backing != NULL ||
+	    !heap_block_is_shared(b))
+		return b;
+	block *copy = heap_block_new();
+	memcpy(copy->memory, b->memory, BLOCK_SIZE);
+	heap_block_unref(b);
+	f->blocks[i] = copy;
+	return copy;
+}
+
+/** Free the blocks beyond the first @a count ones. */
+static void
+file_truncate_blocks(file *f, size_t count)
+{
+	if (count >= f->blocks.size())
+		return;
+	image *img = mounted_image;
+	for (size_t i = count; i < f->blocks.size(); ++i) {
+		block *b = f->blocks[i];
+		if (b == NULL)
+			continue;
+		if (mounted_backing != NULL) {
+			cache_page *p = cache_page_of(b);
+			cache_pages_release(&p, 1);
+		} else if (img == NULL) {
+			heap_block_unref(b);
+		} else {
+			image_block_free(img, image_block_no(img, b));
+		}
+	}
+	while (count > 0 && f->blocks[count - 1] == NULL)
+		--count;
+	f->blocks.resize(count);
+	if (f->blocks.capacity() > 2 * count)
+		std::vector<block *>(f->blocks).swap(f->blocks);
+	if (img == NULL)
+		return;
+	/* Link the survivors again, the freed ones might be anywhere. */
+	image_inode *inode = &img->inodes[f->inode];
+	inode->first_block = IMAGE_CHAIN_END;
+	inode->block_count = 0;
+	for (block *b : f->blocks) {
+		if (b == NULL)
+			continue;
+		uint32_t n = image_block_no(img, b);
+		img->chain[n] = inode->first_block;
+		inode->first_block = n;
+		++inode->block_count;
+	}
+}
+
+/**
+ * Free the file object. Its content is kept if it lives in the image or in a
+ * host file.
+ * @retval 0 Success.
+ * @retval -1 The write-back to the host file failed, the object is freed
+ *     anyway.
+ */
+static int
+file_free(file *f)
+{
+	int rc = 0;
+	if (f->host_fd >= 0) {
+		/* The cache might be evicting the pages right now. */
+		pthread_rwlock_wrlock(&f->lock);
+		rc = file_writeback(f);
+		file_truncate_blocks(f, 0);
+		pthread_rwlock_unlock(&f->lock);
+		if (close(f->host_fd) != 0)
+			rc = -1;
+	} else if (mounted_image == NULL) {
+		file_truncate_blocks(f, 0);
+	}
+	pthread_rwlock_destroy(&f->lock);
+	delete f;
+	return rc;
+}
+
+/** Delete the file together with its content. */
+static void
+file_delete(file *f)
+{
+	if (f->host_fd >= 0) {
+		pthread_rwlock_wrlock(&f->lock);
+		file_truncate_blocks(f, 0);
+		pthread_rwlock_unlock(&f->lock);
+		close(f->host_fd);
+	} else {
+		file_truncate_blocks(f, 0);
+	}
+	if (mounted_image != NULL)
+		image_inode_free(mounted_image, f->inode);
+	pthread_rwlock_destroy(&f->lock);
+	delete f;
+}
+
+static void
+file_ref(file *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void
+file_unref(file *f)
+{
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		file_delete(f);
+}
+
+/** Find a descriptor by its number, or set the error. */
+static filedesc *
+filedesc_get(int fd)
+{
+	if (fd <= 0)
+		goto error;
+	{
+		fd_shard *shard = &fd_shards[(fd - 1) % FD_SHARD_COUNT];
+		uint32_t slot = (fd - 1) / FD_SHARD_COUNT;
+		if (slot / FD_CHUNK_SIZE >= FD_CHUNKS_PER_SHARD)
+			goto error;
+		filedesc **chunk = __atomic_load_n(
+			&shard->chunks[slot / FD_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+		if (chunk == NULL)
+			goto error;
+		filedesc *d = __atomic_load_n(&chunk[slot % FD_CHUNK_SIZE],
+					      __ATOMIC_ACQUIRE);
+		if (d == NULL)
+			goto error;
+		return d;
+	}
+error:
+	ufs_error_code = UFS_ERR_NO_FILE;
+	return NULL;
+}
+
+/** Store the descriptor into a free slot of this thread's shard. */
+static int
+filedesc_put(filedesc *d)
+{
+	if (fd_shard_id < 0) {
+		fd_shard_id = __atomic_fetch_add(&fd_shard_next, 1,
+						 __ATOMIC_RELAXED) %
+			      FD_SHARD_COUNT;
+	}
+	fd_shard *shard = &fd_shards[fd_shard_id];
+	pthread_mutex_lock(&shard->mutex);
+	uint32_t slot;
+	if (!shard->free_slots.empty()) {
+		slot = shard->free_slots.back();
+		shard->free_slots.pop_back();
+	} else if (shard->slot_count < FD_CHUNK_SIZE * FD_CHUNKS_PER_SHARD) {
+		slot = shard->slot_count++;
+		if (slot % FD_CHUNK_SIZE == 0) {
+			filedesc **chunk = new filedesc *[FD_CHUNK_SIZE]();
+			__atomic_store_n(&shard->chunks[slot / FD_CHUNK_SIZE],
+					 chunk, __ATOMIC_RELEASE);
+		}
+	} else {
+		pthread_mutex_unlock(&shard->mutex);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	filedesc **chunk = shard->chunks[slot / FD_CHUNK_SIZE];
+	__atomic_store_n(&chunk[slot % FD_CHUNK_SIZE], d, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shard->mutex);
+	return slot * FD_SHARD_COUNT + fd_shard_id + 1;
+}
+
+static void
+filedesc_remove(int fd)
+{
+	fd_shard *shard = &fd_shards[(fd - 1) % FD_SHARD_COUNT];
+	uint32_t slot = (fd - 1) / FD_SHARD_COUNT;
+	pthread_mutex_lock(&shard->mutex);
+	filedesc **chunk = shard->chunks[slot / FD_CHUNK_SIZE];
+	__atomic_store_n(&chunk[slot % FD_CHUNK_SIZE], NULL, __ATOMIC_RELEASE);
+	shard->free_slots.push_back(slot);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
+#if NEED_OPEN_FLAGS
+
+static bool
+filedesc_can_read(const filedesc *d)
+{
+	return (d->flags & UFS_READ_WRITE) == 0 ||
+	       (d->flags & UFS_READ_ONLY) != 0;
+}
+
+static bool
+filedesc_can_write(const filedesc *d)
+{
+	return (d->flags & UFS_READ_WRITE) == 0 ||
+	       (d->flags & UFS_WRITE_ONLY) != 0;
+}
+
+#else
+
+static bool
+filedesc_can_read(const filedesc *)
+{
+	return true;
+}
+
+static bool
+filedesc_can_write(const filedesc *)
+{
+	return true;
+}
+
+#endif
+
+/**
+ * Create an empty file not visible by name yet. In the image it stays an
+ * orphan until linked, so a crash in between doesn't leave it behind.
+ */
+static file *
+file_new(const char *filename, uint32_t hash)
+{
+	image *img = mounted_image;
+	uint32_t inode = 0;
+	int host_fd = -1;
+	if (mounted_backing != NULL) {
+		if (strchr(filename, '/') != NULL || strcmp(filename, ".") == 0 ||
+		    strcmp(filename, "..") == 0) {
+			errno = EINVAL;
+			ufs_error_code = UFS_ERR_IO;
+			return NULL;
+		}
+		host_fd = openat(mounted_backing->dir_fd, filename,
+				 O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (host_fd < 0) {
+			ufs_error_code = UFS_ERR_IO;
+			return NULL;
+		}
+	} else if (img != NULL) {
+		if (strlen(filename) > UFS_IMAGE_NAME_MAX ||
+		    (inode = image_inode_alloc(img)) == UINT32_MAX) {
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return NULL;
+		}
+		image_inode *i = &img->inodes[inode];
+		i->size = 0;
+		i->first_block = IMAGE_CHAIN_END;
+		i->block_count = 0;
+		i->flags |= IMAGE_INODE_ORPHAN;
+		strcpy(i->name, filename);
+	}
+	file *f = new file();
+	f->name = filename;
+	f->name_hash = hash;
+	f->inode = inode;
+	f->host_fd = host_fd;
+	f->refs = 1;
+	return f;
+}
+
+/**
+ * Add the file to the file list and the name index. Must be called under the
+ * file list lock.
+ */
+static void
+file_link(file *f)
+{
+	if (mounted_image != NULL)
+		mounted_image->inodes[f->inode].flags &= ~IMAGE_INODE_ORPHAN;
+	rlist_add_tail_entry(&file_list, f, in_file_list);
+	file_index_insert(f);
+}
+
+/**
+ * Remove the file in the index slot from the file list and the index. The
+ * reference of the list is left to the caller to drop. Must be called under
+ * the file list lock.
+ */
+static file *
+file_unlink(size_t slot)
+{
+	file *f = file_index[slot];
+	file_index_delete_slot(slot);
+	rlist_del_entry(f, in_file_list);
+	if (mounted_image != NULL) {
+		/* Reclaimed on the next mount if not closed till then. */
+		image_inode *inode = &mounted_image->inodes[f->inode];
+		inode->flags |= IMAGE_INODE_ORPHAN;
+		inode->name[0] = 0;
+	}
+	if (mounted_backing != NULL) {
+		/* The host file lives while it is opened, like here. */
+		unlinkat(mounted_backing->dir_fd, f->name.c_str(), 0);
+	}
+	return f;
+}
+
+/**
+ * Create a file in the file list and the name index. Must be called under the
+ * file list lock.
+ */
+static file *
+file_create(const char *filename, uint32_t hash)
+{
+	file *f = file_new(filename, hash);
+	if (f != NULL)
+		file_link(f);
+	return f;
+}
+
+/**
+ * Give the blocks of @a src to the new empty file @a dst. On the heap they
+ * are shared, in the image new ones are taken, to be filled by
+ * file_copy_blocks(). The holes are kept in both cases. Must be called under
+ * the lock of @a src.
+ * @retval 0 Success.
+ * @retval -1 No space in the image.
+ */
+static int
+file_clone_blocks(file *dst, file *src)
+{
+	image *img = mounted_image;
+	if (img == NULL) {
+		dst->blocks = src->blocks;
+		for (block *b : dst->blocks) {
+			if (b != NULL)
+				heap_block_ref(b);
+		}
+	} else {
+		for (size_t i = 0; i < src->blocks.size(); ++i) {
+			if (src->blocks[i] != NULL &&
+			    image_file_add_block(dst, i) == NULL) {
+				file_truncate_blocks(dst, 0);
+				return -1;
+			}
+		}
+	}
+	file_set_size(dst, src->size);
+	return 0;
+}
+
+/**
+ * Fill the blocks given by file_clone_blocks() with the data of @a src. Only
+ * the image needs it, on the heap they are shared. Must be called under the
+ * lock of @a src, not changed since then.
+ */
+static void
+file_copy_blocks(file *dst, file *src)
+{
+	if (mounted_image == NULL)
+		return;
+	for (size_t i = 0; i < src->blocks.size(); ++i) {
+		if (src->blocks[i] != NULL) {
+			memcpy(dst->blocks[i]->memory, src->blocks[i]->memory,
+			       BLOCK_SIZE);
+		}
+	}
+}
+
+/** Give the content of @a src to @a dst, see file_clone_blocks(). */
+static int
+file_clone_content(file *dst, file *src)
+{
+	if (file_clone_blocks(dst, src) != 0)
+		return -1;
+	file_copy_blocks(dst, src);
+	return 0;
+}
+
 int
 ufs_open(const char *filename, int flags)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	(void)flags;
-	(void)file_list;
-	(void)file_descriptors;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	uint32_t hash = name_hash(filename);
+	pthread_rwlock_rdlock(&file_list_lock);
+	file *f = file_find(filename, hash);
+	if (f != NULL)
+		file_ref(f);
+	pthread_rwlock_unlock(&file_list_lock);
+	if (f == NULL) {
+		if ((flags & UFS_CREATE) == 0) {
+			ufs_error_code = UFS_ERR_NO_FILE;
+			return -1;
+		}
+		pthread_rwlock_wrlock(&file_list_lock);
+		/* Could be created by another thread while unlocked. */
+		f = file_find(filename, hash);
+		if (f == NULL)
+			f = file_create(filename, hash);
+		if (f != NULL)
+			file_ref(f);
+		pthread_rwlock_unlock(&file_list_lock);
+		if (f == NULL)
+			return -1;
+	}
+	filedesc *d = new filedesc();
+	d->atfile = f;
+	d->pos = 0;
+	d->flags = flags;
+	pthread_rwlock_wrlock(&f->lock);
+	rlist_add_tail_entry(&f->descs, d, in_file_descs);
+	pthread_rwlock_unlock(&f->lock);
+	int fd = filedesc_put(d);
+	if (fd < 0) {
+		pthread_rwlock_wrlock(&f->lock);
+		rlist_del_entry(d, in_file_descs);
+		pthread_rwlock_unlock(&f->lock);
+		delete d;
+		file_unref(f);
+	}
+	return fd;
+}
+
+/**
+ * Write the buffers into the file starting from @a pos. The blocks and the
+ * buffers are walked together in one pass. Must be called under the exclusive
+ * file lock.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error, the code is set.
+ */
+static ssize_t
+file_writev(file *f, size_t pos, const struct iovec *iov, int iovcnt)
+{
+	size_t size = iov_size(iov, iovcnt);
+	if (pos > MAX_FILE_SIZE || size > MAX_FILE_SIZE - pos) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	if (size == 0)
+		return 0;
+	enum ufs_error_code err = UFS_ERR_NO_MEM;
+	size_t done = 0;
+	size_t iov_offset = 0;
+	for (int v = 0; v < iovcnt;) {
+		if (iov_offset == iov[v].iov_len) {
+			++v;
+			iov_offset = 0;
+			continue;
+		}
+		size_t i = pos / BLOCK_SIZE;
+		size_t offset = pos % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - offset;
+		if (n > iov[v].iov_len - iov_offset)
+			n = iov[v].iov_len - iov_offset;
+		const char *src = (const char *)iov[v].iov_base + iov_offset;
+		block *b = i < f->blocks.size() ? f->blocks[i] : NULL;
+		if (mounted_backing != NULL) {
+			file_cache_count(f, i);
+			b = file_cache_block(f, i, n != BLOCK_SIZE);
+			if (b != NULL) {
+				cache_page_of(b)->is_dirty = true;
+			} else if (pwrite(f->host_fd, src, n, pos) ==
+				   (ssize_t)n) {
+				/* No page for the block, it went directly. */
+				if (pos + n > f->host_size)
+					f->host_size = pos + n;
+			} else {
+				err = UFS_ERR_IO;
+				break;
+			}
+		} else if (b == NULL) {
+			if ((b = file_alloc_block(f, i)) == NULL)
+				break;
+		} else {
+			b = file_unshare_block(f, i);
+		}
+		if (b != NULL)
+			memcpy(b->memory + offset, src, n);
+		iov_offset += n;
+		done += n;
+		pos += n;
+		/* The write-back of the next evictions needs the new size. */
+		if (pos > f->size)
+			file_set_size(f, pos);
+	}
+	if (done == 0) {
+		ufs_error_code = err;
+		return -1;
+	}
+	return done;
+}
+
+/**
+ * Read the file from @a pos into the buffers. Must be called under the file
+ * lock taken by file_rdlock().
+ *
+ * @retval >= 0 How many bytes were read.
+ * @retval -1 Error, the code is set.
+ */
+static ssize_t
+file_readv(file *f, size_t pos, const struct iovec *iov, int iovcnt)
+{
+	if (pos >= f->size)
+		return 0;
+	size_t size = f->size - pos;
+	if (mounted_backing != NULL) {
+		/* Load all the missing blocks with as few host reads as can. */
+		size_t want = iov_size(iov, iovcnt);
+		size_t end = want < size ? pos + want : f->size;
+		if (end == pos)
+			return 0;
+		size_t first = pos / BLOCK_SIZE;
+		size_t last = (end - 1) / BLOCK_SIZE;
+		for (size_t i = first; i <= last; ++i)
+			file_cache_count(f, i);
+		file_cache_load(f, first, last + 1, false);
+	}
+	size_t done = 0;
+	size_t iov_offset = 0;
+	for (int v = 0; v < iovcnt && done < size;) {
+		if (iov_offset == iov[v].iov_len) {
+			++v;
+			iov_offset = 0;
+			continue;
+		}
+		size_t offset = pos % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - offset;
+		if (n > iov[v].iov_len - iov_offset)
+			n = iov[v].iov_len - iov_offset;
+		if (n > size - done)
+			n = size - done;
+		size_t i = pos / BLOCK_SIZE;
+		char *dst = (char *)iov[v].iov_base + iov_offset;
+		block *b = i < f->blocks.size() ? f->blocks[i] : NULL;
+		if (mounted_backing != NULL) {
+			b = file_cache_block(f, i, true);
+			struct iovec direct = {dst, n};
+			/* No page for the block, read it directly. */
+			if (b == NULL &&
+			    file_host_readv(f, pos, &direct, 1) != 0) {
+				if (done != 0)
+					break;
+				ufs_error_code = UFS_ERR_IO;
+				return -1;
+			}
+		}
+		if (b != NULL)
+			memcpy(dst, b->memory + offset, n);
+		else if (mounted_backing == NULL)
+			memset(dst, 0, n);
+		iov_offset += n;
+		done += n;
+		pos += n;
+	}
+	return done;
+}
+
+/**
+ * Lock the file for reading. The page cache fills the block index on reads,
+ * so with a host directory the reads are exclusive.
+ */
+static void
+file_rdlock(file *f)
+{
+	if (mounted_backing != NULL)
+		pthread_rwlock_wrlock(&f->lock);
+	else
+		pthread_rwlock_rdlock(&f->lock);
+}
+
+/** Get a descriptor allowed to write, or set the error. */
+static filedesc *
+filedesc_get_writable(int fd)
+{
+	filedesc *d = filedesc_get(fd);
+	if (d != NULL && !filedesc_can_write(d)) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return d;
+}
+
+/** Get a descriptor allowed to read, or set the error. */
+static filedesc *
+filedesc_get_readable(int fd)
+{
+	filedesc *d = filedesc_get(fd);
+	if (d != NULL && !filedesc_can_read(d)) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return d;
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	filedesc *d = filedesc_get_writable(fd);
+	if (d == NULL)
+		return -1;
+	file *f = d->atfile;
+	pthread_rwlock_wrlock(&f->lock);
+	ssize_t rc = file_writev(f, d->pos, iov, iovcnt);
+	if (rc > 0)
+		d->pos += rc;
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
 }
 
 ssize_t
 ufs_write(int fd, const char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct iovec iov = {(void *)buf, size};
+	return ufs_writev(fd, &iov, 1);
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	filedesc *d = filedesc_get_writable(fd);
+	if (d == NULL)
+		return -1;
+	file *f = d->atfile;
+	struct iovec iov = {(void *)buf, size};
+	pthread_rwlock_wrlock(&f->lock);
+	ssize_t rc = file_writev(f, offset, &iov, 1);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	filedesc *d = filedesc_get_readable(fd);
+	if (d == NULL)
+		return -1;
+	file *f = d->atfile;
+	file_rdlock(f);
+	if (mounted_backing != NULL)
+		filedesc_readahead(d, iov_size(iov, iovcnt));
+	ssize_t rc = file_readv(f, d->pos, iov, iovcnt);
+	if (rc > 0)
+		d->pos += rc;
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
 }
 
 ssize_t
 ufs_read(int fd, char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct iovec iov = {buf, size};
+	return ufs_readv(fd, &iov, 1);
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	filedesc *d = filedesc_get_readable(fd);
+	if (d == NULL)
+		return -1;
+	file *f = d->atfile;
+	struct iovec iov = {buf, size};
+	file_rdlock(f);
+	ssize_t rc = file_readv(f, offset, &iov, 1);
+	pthread_rwlock_unlock(&f->lock);
+	return rc;
 }
 
 int
 ufs_close(int fd)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	filedesc *d = filedesc_get(fd);
+	if (d == NULL)
+		return -1;
+	filedesc_remove(fd);
+	file *f = d->atfile;
+	pthread_rwlock_wrlock(&f->lock);
+	rlist_del_entry(d, in_file_descs);
+	pthread_rwlock_unlock(&f->lock);
+	delete d;
+	file_unref(f);
+	return 0;
 }
 
 int
 ufs_delete(const char *filename)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	pthread_rwlock_wrlock(&file_list_lock);
+	size_t slot = file_index_find_slot(filename, name_hash(filename));
+	if (slot == SIZE_MAX) {
+		pthread_rwlock_unlock(&file_list_lock);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	file *f = file_unlink(slot);
+	pthread_rwlock_unlock(&file_list_lock);
+	file_unref(f);
+	return 0;
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+	if (mounted_backing != NULL) {
+		ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
+		return -1;
+	}
+	uint32_t dst_hash = name_hash(dst);
+	pthread_rwlock_wrlock(&file_list_lock);
+	file *f = file_find(src, name_hash(src));
+	if (f == NULL) {
+		pthread_rwlock_unlock(&file_list_lock);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	if (strcmp(src, dst) == 0) {
+		pthread_rwlock_unlock(&file_list_lock);
+		return 0;
+	}
+	file *copy = file_new(dst, dst_hash);
+	if (copy == NULL) {
+		pthread_rwlock_unlock(&file_list_lock);
+		return -1;
+	}
+	/* The source could be deleted while copied. */
+	file_ref(f);
+	pthread_rwlock_rdlock(&f->lock);
+	int rc = file_clone_blocks(copy, f);
+	/*
+	 * The other files are not blocked by the copy of the data, only the
+	 * writers of the source are. The copy is not visible until linked.
+	 */
+	pthread_rwlock_unlock(&file_list_lock);
+	if (rc == 0)
+		file_copy_blocks(copy, f);
+	pthread_rwlock_unlock(&f->lock);
+	file_unref(f);
+	if (rc != 0) {
+		file_delete(copy);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	/* The old file is replaced like ufs_delete() would do. */
+	pthread_rwlock_wrlock(&file_list_lock);
+	file *old = NULL;
+	size_t slot = file_index_find_slot(dst, dst_hash);
+	if (slot != SIZE_MAX)
+		old = file_unlink(slot);
+	file_link(copy);
+	pthread_rwlock_unlock(&file_list_lock);
+	if (old != NULL)
+		file_unref(old);
+	return 0;
+}
+
+struct ufs_snapshot *
+ufs_snapshot_create(void)
+{
+	if (mounted_image != NULL || mounted_backing != NULL) {
+		ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
+		return NULL;
+	}
+	ufs_snapshot *snap = new ufs_snapshot();
+	pthread_rwlock_wrlock(&file_list_lock);
+	/*
+	 * All the files are locked at once to catch one moment of the whole
+	 * filesystem. The writers never wait for a second file lock, so it
+	 * can't deadlock.
+	 */
+	file *f;
+	rlist_foreach_entry(f, &file_list, in_file_list)
+		pthread_rwlock_rdlock(&f->lock);
+	rlist_foreach_entry(f, &file_list, in_file_list) {
+		file *copy = file_new(f->name.c_str(), f->name_hash);
+		file_clone_content(copy, f);
+		snap->files.push_back(copy);
+	}
+	rlist_foreach_entry(f, &file_list, in_file_list)
+		pthread_rwlock_unlock(&f->lock);
+	rlist_add_tail_entry(&snapshot_list, snap, in_snapshot_list);
+	pthread_rwlock_unlock(&file_list_lock);
+	return snap;
+}
+
+int
+ufs_snapshot_restore(struct ufs_snapshot *snap)
+{
+	if (mounted_image != NULL || mounted_backing != NULL) {
+		ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
+		return -1;
+	}
+	std::vector<file *> old;
+	pthread_rwlock_wrlock(&file_list_lock);
+	for (size_t slot = 0; slot < file_index.size();) {
+		/* Unlink shifts the next entries into the slot. */
+		if (file_index[slot] != NULL)
+			old.push_back(file_unlink(slot));
+		else
+			++slot;
+	}
+	for (file *f : snap->files) {
+		file *copy = file_new(f->name.c_str(), f->name_hash);
+		file_clone_content(copy, f);
+		file_link(copy);
+	}
+	pthread_rwlock_unlock(&file_list_lock);
+	for (file *f : old)
+		file_unref(f);
+	return 0;
+}
+
+static void
+snapshot_free(ufs_snapshot *snap)
+{
+	rlist_del_entry(snap, in_snapshot_list);
+	for (file *f : snap->files)
+		file_delete(f);
+	delete snap;
+}
+
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap)
+{
+	pthread_rwlock_wrlock(&file_list_lock);
+	snapshot_free(snap);
+	pthread_rwlock_unlock(&file_list_lock);
 }
 
 #if NEED_RESIZE
@@ -124,25 +1707,541 @@ ufs_delete(const char *filename)
 int
 ufs_resize(int fd, size_t new_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)new_size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	filedesc *d = filedesc_get_writable(fd);
+	if (d == NULL)
+		return -1;
+	if (new_size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	file *f = d->atfile;
+	pthread_rwlock_wrlock(&f->lock);
+	if (f->host_fd >= 0) {
+		if (ftruncate(f->host_fd, new_size) != 0) {
+			pthread_rwlock_unlock(&f->lock);
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+		f->host_size = new_size;
+	}
+	if (new_size >= f->size) {
+		/* The new part is a hole. */
+		file_set_size(f, new_size);
+		pthread_rwlock_unlock(&f->lock);
+		return 0;
+	}
+	size_t block_count = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	file_truncate_blocks(f, block_count);
+	/* Keep the cut off tail zeroed for the future growth. */
+	size_t offset = new_size % BLOCK_SIZE;
+	if (offset != 0 && block_count <= f->blocks.size() &&
+	    f->blocks[block_count - 1] != NULL) {
+		/* The clones and the snapshots keep their tail. */
+		block *b = file_unshare_block(f, block_count - 1);
+		memset(b->memory + offset, 0, BLOCK_SIZE - offset);
+	}
+	file_set_size(f, new_size);
+	filedesc *it;
+	rlist_foreach_entry(it, &f->descs, in_file_descs) {
+		if (it->pos > new_size)
+			it->pos = new_size;
+	}
+	pthread_rwlock_unlock(&f->lock);
+	return 0;
 }
 
 #endif
 
-void
-ufs_destroy(void)
+static void
+image_unmap(image *img)
+{
+	munmap(img->map, img->size);
+	close(img->fd);
+	pthread_mutex_destroy(&img->mutex);
+	delete img;
+}
+
+/** Set up the region pointers of a mapped image. */
+static void
+image_attach(image *img)
+{
+	img->super = (image_super *)img->map;
+	img->inodes = (image_inode *)(img->map + img->super->inode_offset);
+	img->bitmap = (uint64_t *)(img->map + img->super->bitmap_offset);
+	img->chain = (uint32_t *)(img->map + img->super->chain_offset);
+	img->block_index = (uint32_t *)(img->map +
+					img->super->block_index_offset);
+	img->blocks = (block *)(img->map + img->super->data_offset);
+	img->block_hint = 0;
+	img->inode_hint = 0;
+	pthread_mutex_init(&img->mutex, NULL);
+}
+
+static image *
+image_format(int fd, size_t size)
 {
+	size_t block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (block_count == 0 || block_count >= IMAGE_CHAIN_END) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t inode_count = block_count / IMAGE_BLOCKS_PER_INODE;
+	if (inode_count < IMAGE_MIN_INODES)
+		inode_count = IMAGE_MIN_INODES;
+	size_t word_count = (block_count + 63) / 64;
+
+	image_super super;
+	memset(&super, 0, sizeof(super));
+	memcpy(super.magic, image_magic, sizeof(image_magic));
+	super.version = IMAGE_VERSION;
+	super.block_size = BLOCK_SIZE;
+	super.inode_count = inode_count;
+	super.block_count = block_count;
+	super.free_blocks = block_count;
+	super.inode_offset = image_align(sizeof(super));
+	super.bitmap_offset = image_align(super.inode_offset +
+					  inode_count * sizeof(image_inode));
+	super.chain_offset = image_align(super.bitmap_offset +
+					 word_count * sizeof(uint64_t));
+	super.block_index_offset = image_align(super.chain_offset +
+					       block_count * sizeof(uint32_t));
+	super.data_offset = image_align(super.block_index_offset +
+					block_count * sizeof(uint32_t));
+	super.image_size = super.data_offset + block_count * BLOCK_SIZE;
 	/*
-	 * The file_descriptors array is likely to leak even if
-	 * you resize it to zero or call clear(). This is because
-	 * the vector keeps memory reserved in case more elements
-	 * would be added.
-	 *
-	 * The recommended way of freeing the memory is to swap()
-	 * the vector with a temporary empty vector.
+	 * Allocate the space right away. Otherwise a full disk would be
+	 * reported as SIGBUS on a write into the mapping.
 	 */
+	int rc = posix_fallocate(fd, 0, super.image_size);
+	if (rc != 0) {
+		errno = rc;
+		return NULL;
+	}
+	void *map = mmap(NULL, super.image_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	image *img = new image();
+	img->fd = fd;
+	img->map = (char *)map;
+	img->size = super.image_size;
+	/* The file is fresh and already zeroed. */
+	memcpy(img->map, &super, sizeof(super));
+	image_attach(img);
+	/* The bits past the last block are never allocated. */
+	if (block_count % 64 != 0)
+		img->bitmap[word_count - 1] = UINT64_MAX << (block_count % 64);
+	return img;
+}
+
+/**
+ * Check that a region of @a count items of @a item_size bytes is aligned,
+ * starts after @a end, the end of the previous region, and fits into the
+ * image. Then @a end is moved past the region.
+ */
+static bool
+image_region_is_valid(uint64_t offset, uint64_t count, uint64_t item_size,
+		      uint64_t image_size, uint64_t *end)
+{
+	if (offset % IMAGE_ALIGN != 0 || offset < *end || offset > image_size ||
+	    count > (image_size - offset) / item_size)
+		return false;
+	*end = offset + count * item_size;
+	return true;
+}
+
+/** Check the superblock, so the regions can be accessed without checks. */
+static bool
+image_super_is_valid(const image_super *super, size_t file_size)
+{
+	if (memcmp(super->magic, image_magic, sizeof(image_magic)) != 0 ||
+	    super->version != IMAGE_VERSION || super->block_size != BLOCK_SIZE ||
+	    super->image_size != file_size || super->block_count == 0 ||
+	    super->block_count >= IMAGE_CHAIN_END)
+		return false;
+	uint64_t size = super->image_size;
+	uint64_t word_count = ((uint64_t)super->block_count + 63) / 64;
+	uint64_t end = sizeof(*super);
+	return image_region_is_valid(super->inode_offset, super->inode_count,
+				     sizeof(image_inode), size, &end) &&
+	       image_region_is_valid(super->bitmap_offset, word_count,
+				     sizeof(uint64_t), size, &end) &&
+	       image_region_is_valid(super->chain_offset, super->block_count,
+				     sizeof(uint32_t), size, &end) &&
+	       image_region_is_valid(super->block_index_offset,
+				     super->block_count, sizeof(uint32_t),
+				     size, &end) &&
+	       image_region_is_valid(super->data_offset, super->block_count,
+				     BLOCK_SIZE, size, &end) &&
+	       end == size;
+}
+
+static image *
+image_open(int fd, size_t file_size)
+{
+	image_super super;
+	if (file_size < sizeof(super) ||
+	    pread(fd, &super, sizeof(super), 0) != sizeof(super) ||
+	    !image_super_is_valid(&super, file_size))
+		goto error_invalid;
+	{
+		void *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			return NULL;
+		image *img = new image();
+		img->fd = fd;
+		img->map = (char *)map;
+		img->size = file_size;
+		image_attach(img);
+		return img;
+	}
+error_invalid:
+	errno = EINVAL;
+	return NULL;
+}
+
+/**
+ * Count the free blocks by the bitmap. A crash between the updates of the
+ * bitmap and the counter leaves them apart, and the allocation trusts the
+ * counter.
+ * @retval 0 Success.
+ * @retval -1 The bits past the last block are not set.
+ */
+static int
+image_count_free_blocks(image *img)
+{
+	uint32_t block_count = img->super->block_count;
+	uint32_t word_count = (block_count + 63) / 64;
+	uint32_t used = 0;
+	for (uint32_t w = 0; w < word_count; ++w)
+		used += __builtin_popcountll(img->bitmap[w]);
+	if (block_count % 64 != 0) {
+		uint64_t tail = UINT64_MAX << (block_count % 64);
+		if ((img->bitmap[word_count - 1] & tail) != tail)
+			return -1;
+		used -= 64 - block_count % 64;
+	}
+	img->super->free_blocks = block_count - used;
+	return 0;
+}
+
+/**
+ * Build the files of the image in memory. Only the metadata is touched, the
+ * data blocks are not read.
+ */
+static int
+image_load(image *img)
+{
+	uint32_t block_count = img->super->block_count;
+	if (image_count_free_blocks(img) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* The blocks met in the chains, a block is in one chain only. */
+	std::vector<bool> is_seen(block_count, false);
+	for (uint32_t i = 0; i < img->super->inode_count; ++i) {
+		image_inode *inode = &img->inodes[i];
+		if ((inode->flags & IMAGE_INODE_USED) == 0)
+			continue;
+		if (inode->size > MAX_FILE_SIZE ||
+		    inode->block_count > block_count) {
+			errno = EINVAL;
+			return -1;
+		}
+		/* The blocks past the size would break the zero tail. */
+		size_t max_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		file *f = new file();
+		f->inode = i;
+		uint32_t n = inode->first_block;
+		for (uint32_t k = 0; k < inode->block_count; ++k) {
+			uint32_t i = n < block_count ? img->block_index[n] : 0;
+			/*
+			 * The block is allocated, is not in the file twice,
+			 * and is not in another chain.
+			 */
+			if (n >= block_count || i >= max_blocks ||
+			    !image_block_is_used(img, n) || is_seen[n] ||
+			    (i < f->blocks.size() && f->blocks[i] != NULL)) {
+				file_free(f);
+				errno = EINVAL;
+				return -1;
+			}
+			is_seen[n] = true;
+			if (i >= f->blocks.size())
+				f->blocks.resize(i + 1, NULL);
+			f->blocks[i] = &img->blocks[n];
+			n = img->chain[n];
+		}
+		if ((inode->flags & IMAGE_INODE_ORPHAN) != 0) {
+			file_delete(f);
+			continue;
+		}
+		inode->name[UFS_IMAGE_NAME_MAX] = 0;
+		f->name = inode->name;
+		f->name_hash = name_hash(inode->name);
+		if (file_find(inode->name, f->name_hash) != NULL) {
+			file_free(f);
+			errno = EINVAL;
+			return -1;
+		}
+		f->size = inode->size;
+		f->refs = 1;
+		rlist_add_tail_entry(&file_list, f, in_file_list);
+		file_index_insert(f);
+	}
+	return 0;
+}
+
+/**
+ * Close all the descriptors and free the in-memory files. The files stay in
+ * the image if it is mounted. The deleted ones are reclaimed.
+ * @retval 0 Success.
+ * @retval -1 The write-back of a host file failed, errno is set. All is
+ *     freed anyway.
+ */
+static int
+files_free(void)
+{
+	int rc = 0;
+	for (fd_shard &shard : fd_shards) {
+		for (uint32_t slot = 0; slot < shard.slot_count; ++slot) {
+			filedesc **chunk = shard.chunks[slot / FD_CHUNK_SIZE];
+			filedesc *d = chunk[slot % FD_CHUNK_SIZE];
+			if (d == NULL)
+				continue;
+			file *f = d->atfile;
+			rlist_del_entry(d, in_file_descs);
+			delete d;
+			file_unref(f);
+		}
+		for (filedesc **&chunk : shard.chunks) {
+			delete[] chunk;
+			chunk = NULL;
+		}
+		shard.slot_count = 0;
+		/*
+		 * The vector is likely to leak even if you resize it
+		 * to zero or call clear(). This is because the vector
+		 * keeps memory reserved in case more elements would be
+		 * added. Swap with an empty one to really free it.
+		 */
+		std::vector<uint32_t>().swap(shard.free_slots);
+	}
+	file *f, *tmp;
+	rlist_foreach_entry_safe(f, &file_list, in_file_list, tmp) {
+		if (file_free(f) != 0)
+			rc = -1;
+	}
+	rlist_create(&file_list);
+	std::vector<file *>().swap(file_index);
+	file_index_count = 0;
+	return rc;
+}
+
+/** Check if the filesystem has anything to lose on a mount. */
+static bool
+filesystem_is_busy(void)
+{
+	bool has_descriptors = false;
+	for (const fd_shard &shard : fd_shards) {
+		has_descriptors = has_descriptors ||
+				  shard.slot_count != shard.free_slots.size();
+	}
+	return mounted_image != NULL || mounted_backing != NULL ||
+	       !rlist_empty(&file_list) || !rlist_empty(&snapshot_list) ||
+	       has_descriptors;
+}
+
+int
+ufs_mount(const char *path, size_t size)
+{
+	if (filesystem_is_busy()) {
+		errno = EBUSY;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct stat st;
+	image *img = NULL;
+	if (fstat(fd, &st) == 0) {
+		if (st.st_size == 0)
+			img = image_format(fd, size);
+		else
+			img = image_open(fd, st.st_size);
+	}
+	if (img == NULL) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	mounted_image = img;
+	if (image_load(img) != 0) {
+		int err = errno;
+		files_free();
+		mounted_image = NULL;
+		image_unmap(img);
+		errno = err;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+backing_delete(backing *bk)
+{
+	close(bk->dir_fd);
+	pthread_mutex_destroy(&bk->mutex);
+	delete bk;
+}
+
+/** Build the files of the host directory. The data is not read. */
+static int
+backing_load(backing *bk)
+{
+	DIR *dir = fdopendir(dup(bk->dir_fd));
+	if (dir == NULL)
+		return -1;
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		struct stat st;
+		if (fstatat(bk->dir_fd, ent->d_name, &st, 0) != 0 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		int fd = openat(bk->dir_fd, ent->d_name, O_RDWR);
+		if (fd < 0) {
+			int err = errno;
+			closedir(dir);
+			errno = err;
+			return -1;
+		}
+		file *f = new file();
+		f->name = ent->d_name;
+		f->name_hash = name_hash(ent->d_name);
+		f->host_fd = fd;
+		f->size = st.st_size;
+		f->host_size = st.st_size;
+		f->refs = 1;
+		file_link(f);
+	}
+	closedir(dir);
+	return 0;
+}
+
+int
+ufs_mount_dir(const char *path, size_t cache_size)
+{
+	if (filesystem_is_busy()) {
+		errno = EBUSY;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	size_t page_count = cache_size / BLOCK_SIZE;
+	if (page_count < CACHE_MIN_PAGES)
+		page_count = CACHE_MIN_PAGES;
+	backing *bk = new backing();
+	bk->dir_fd = dir_fd;
+	bk->pages.resize(page_count);
+	bk->free_pages.reserve(page_count);
+	for (size_t i = page_count; i > 0; --i)
+		bk->free_pages.push_back(i - 1);
+	bk->hand = 0;
+	pthread_mutex_init(&bk->mutex, NULL);
+	mounted_backing = bk;
+	if (backing_load(bk) != 0) {
+		int err = errno;
+		files_free();
+		mounted_backing = NULL;
+		backing_delete(bk);
+		errno = err;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+void
+ufs_cache_stat(struct ufs_cache_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	backing *bk = mounted_backing;
+	if (bk == NULL)
+		return;
+	const struct ufs_cache_stat *src = &bk->stat;
+	stat->hits = __atomic_load_n(&src->hits, __ATOMIC_RELAXED);
+	stat->misses = __atomic_load_n(&src->misses, __ATOMIC_RELAXED);
+	stat->readahead = __atomic_load_n(&src->readahead, __ATOMIC_RELAXED);
+	stat->writeback = __atomic_load_n(&src->writeback, __ATOMIC_RELAXED);
+	stat->writeback_calls = __atomic_load_n(&src->writeback_calls,
+						__ATOMIC_RELAXED);
+}
+
+/** Write back the dirty blocks of all the files and flush the host files. */
+static int
+backing_sync(void)
+{
+	int rc = 0;
+	pthread_rwlock_rdlock(&file_list_lock);
+	file *f;
+	rlist_foreach_entry(f, &file_list, in_file_list) {
+		pthread_rwlock_wrlock(&f->lock);
+		if (file_writeback(f) != 0 || fdatasync(f->host_fd) != 0)
+			rc = -1;
+		pthread_rwlock_unlock(&f->lock);
+	}
+	pthread_rwlock_unlock(&file_list_lock);
+	return rc;
+}
+
+int
+ufs_sync(void)
+{
+	if (mounted_backing != NULL) {
+		if (backing_sync() != 0) {
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+		return 0;
+	}
+	image *img = mounted_image;
+	if (img == NULL)
+		return 0;
+	if (msync(img->map, img->size, MS_SYNC) != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+void
+ufs_destroy(void)
+{
+	ufs_snapshot *snap, *tmp;
+	rlist_foreach_entry_safe(snap, &snapshot_list, in_snapshot_list, tmp)
+		snapshot_free(snap);
+	ufs_error_code = files_free() == 0 ? UFS_ERR_NO_ERR : UFS_ERR_IO;
+	if (mounted_image != NULL) {
+		image_unmap(mounted_image);
+		mounted_image = NULL;
+	}
+	if (mounted_backing != NULL) {
+		backing_delete(mounted_backing);
+		mounted_backing = NULL;
+	}
 }
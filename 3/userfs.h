@@ -1,12 +1,20 @@
 #pragma once
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
  * has an unique file name, and there are no directories, so the
  * FS is a monolithic flat contiguous folder.
+ *
+ * The functions can be called from multiple threads at once. Readers of the
+ * same file don't block each other, and operations on different files don't
+ * contend. A descriptor must not be used by multiple threads at the same time
+ * though, because it has a position. ufs_mount() and ufs_destroy() need all
+ * the other threads to stay out of the filesystem while they work.
  */
 
 /**
@@ -23,8 +31,8 @@
  * It is important to define these macros here, in the header,
  * because it is used by tests.
  */
-#define NEED_OPEN_FLAGS 0
-#define NEED_RESIZE 0
+#define NEED_OPEN_FLAGS 1
+#define NEED_RESIZE 1
 
 /**
  * Flags for ufs_open call.
@@ -64,9 +72,11 @@ enum ufs_error_code {
 #if NEED_OPEN_FLAGS
 	UFS_ERR_NO_PERMISSION,
 #endif
+	/** A system call failed or an image is corrupted. See errno. */
+	UFS_ERR_IO,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the current thread. */
 ufs_error_code
 ufs_errno();
 
@@ -111,6 +121,54 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the given offset. The descriptor position is not
+ * used nor changed, so multiple threads can use one descriptor this way. If
+ * the offset is beyond the file end, the gap is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Position in the file to write to.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor position is not
+ * used nor changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Like ufs_write(), but the data is gathered from @a iovcnt buffers. They are
+ * written in one pass under one lock, so the data of concurrent writers
+ * doesn't get interleaved.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Like ufs_read(), but the data is scattered into @a iovcnt buffers. Each one
+ * is filled up before the next one is used.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -136,6 +194,56 @@ ufs_close(int fd);
 int
 ufs_delete(const char *filename);
 
+/**
+ * Make @a dst a copy of the file @a src. The copy shares the blocks with the
+ * source and a block is copied only when one of the files writes into it, so
+ * cloning is cheap even for big files. In a mounted image the blocks are
+ * copied right away. If @a dst exists, it is replaced like after
+ * ufs_delete().
+ *
+ * @param src Name of the file to copy.
+ * @param dst Name of the copy.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file @a src.
+ *     - UFS_ERR_NO_MEM - no space for the copy in the mounted image.
+ *     - UFS_ERR_NOT_IMPLEMENTED - a directory is mounted.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/** A frozen state of all the files. */
+struct ufs_snapshot;
+
+/**
+ * Take a snapshot of all the files. It catches one moment of the whole
+ * filesystem and shares the blocks with the files like ufs_clone() does. The
+ * opened descriptors are not a part of the snapshot. Not supported in a
+ * mounted image or directory.
+ *
+ * @retval Not NULL Snapshot to pass to ufs_snapshot_restore().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NOT_IMPLEMENTED - an image or a directory is mounted.
+ */
+struct ufs_snapshot *
+ufs_snapshot_create(void);
+
+/**
+ * Replace all the files with the ones from the snapshot. The current files
+ * are deleted like by ufs_delete(), so their opened descriptors keep working
+ * with the old content. The snapshot stays valid and can be restored again.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NOT_IMPLEMENTED - an image or a directory is mounted.
+ */
+int
+ufs_snapshot_restore(struct ufs_snapshot *snap);
+
+/** Free the snapshot. ufs_destroy() frees all the snapshots too. */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snap);
+
 #if NEED_RESIZE
 
 /**
@@ -161,10 +269,96 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Mount a filesystem image. After that all the files live in the file
+ * @a path mapped into the memory instead of the heap, and they survive
+ * ufs_destroy() and process restarts. Reads and writes go directly to the
+ * mapping, so mounting an existing image doesn't load the file data.
+ *
+ * The image consists of a superblock, an inode table, a block bitmap, a table
+ * of block chains (the next block of each block like in FAT), the position of
+ * each block in its file, and the data region. File names in an image can't
+ * be longer than UFS_IMAGE_NAME_MAX.
+ *
+ * @param path Path to the image file. If it doesn't exist or is empty, a new
+ *     image is created.
+ * @param size Data capacity of a new image in bytes. Ignored when the image
+ *     already exists.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image can't be opened, created, or is invalid. The
+ *       errno is set. EBUSY means the filesystem already has files,
+ *       snapshots, an image, or a directory mounted.
+ */
+int
+ufs_mount(const char *path, size_t size);
+
+enum {
+	/** Max file name length in a mounted image. */
+	UFS_IMAGE_NAME_MAX = 107,
+};
+
+/**
+ * Mount a host directory. After that each file is a host file in the
+ * directory @a path with the same name, and the files already there become
+ * visible. The file data goes through a page cache of @a cache_size bytes.
+ * The cache reads ahead of sequential readers and writes the changed blocks
+ * back in batches when they are evicted, on ufs_sync(), and on ufs_destroy().
+ * File names can't contain '/'.
+ *
+ * ufs_clone() and the snapshots are not supported with a host directory.
+ *
+ * @param path Path to the directory. It is created if it doesn't exist.
+ * @param cache_size Size of the page cache in bytes.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the directory can't be opened or read. The errno is
+ *       set. EBUSY means the filesystem already has files, snapshots, an
+ *       image, or a directory mounted.
+ */
+int
+ufs_mount_dir(const char *path, size_t cache_size);
+
+/** Statistics of the page cache of ufs_mount_dir(). */
+struct ufs_cache_stat {
+	/** Block accesses served by the cache. */
+	uint64_t hits;
+	/** Block accesses which had to go to the host file. */
+	uint64_t misses;
+	/** Blocks loaded ahead of the sequential readers. */
+	uint64_t readahead;
+	/** Blocks written back to the host files. */
+	uint64_t writeback;
+	/** Host calls made by the write-back. */
+	uint64_t writeback_calls;
+};
+
+/** Get the page cache statistics. All zeros if no directory is mounted. */
+void
+ufs_cache_stat(struct ufs_cache_stat *stat);
+
+/**
+ * Flush the mounted image to the disk. Without this call the changes still
+ * reach the image file eventually and are visible to the next mount, but can
+ * be lost on a system crash. With a mounted directory the changed blocks of
+ * the page cache are written back and the host files are flushed.
+ *
+ * @retval 0 Success or nothing is mounted.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - msync() or the write-back failed, errno is set.
+ */
+int
+ufs_sync(void);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ *
+ * If an image or a directory is mounted, the files are not deleted but stay in
+ * it, and it is unmounted. If the write-back of a mounted directory fails, the
+ * error code is UFS_ERR_IO and errno is set, otherwise it is UFS_ERR_NO_ERR.
+ * Check ufs_errno() for it.
  */
 void
 ufs_destroy(void);
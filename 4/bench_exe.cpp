@@ -0,0 +1,929 @@
+#include "thread_pool.h"
+#include "parallel.h"
+#include "thread_coro.h"
+
+#if __has_include("heap_help.h")
+#include "heap_help.h"
+#define BENCH_HAS_HEAP_HELP 1
+#else
+#define BENCH_HAS_HEAP_HELP 0
+#endif
+
+#include <algorithm>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmarks of the thread pool. Run without arguments to execute all of
+ * them, or pass names of the needed ones. Build with
+ * CMAKE_BUILD_TYPE=Release to get meaningful numbers. With
+ * ENABLE_LEAK_CHECKS the allocations per task are counted too.
+ */
+
+static const int bench_thread_counts[] = {1, 2, 4, 8, 12, 16, 20};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_report(const char *what, int threads, uint64_t ns, uint64_t ops)
+{
+	printf("%-24s %2d threads %10.1f ns/op %12.0f op/s\n", what, threads,
+	       (double)ns / ops, ops * 1e9 / ns);
+}
+
+/** Empty tasks pushed from the main thread, then all joined. */
+static void
+bench_empty(void)
+{
+	const int count = TPOOL_MAX_TASKS;
+	const int rounds = 10;
+	printf("# %d empty tasks pushed from outside, %d rounds\n", count,
+	       rounds);
+	static struct thread_task *tasks[TPOOL_MAX_TASKS];
+	for (int i = 0; i < count; ++i)
+		thread_task_new(&tasks[i], []() {});
+	for (int threads : bench_thread_counts) {
+		struct thread_pool *pool;
+		thread_pool_new(threads, &pool);
+		uint64_t start = bench_now_ns();
+		for (int r = 0; r < rounds; ++r) {
+			for (int i = 0; i < count; ++i)
+				thread_pool_push_task(pool, tasks[i]);
+			for (int i = 0; i < count; ++i)
+				thread_task_join(tasks[i]);
+		}
+		bench_report("empty", threads, bench_now_ns() - start,
+			     (uint64_t)count * rounds);
+		thread_pool_delete(pool);
+	}
+	for (int i = 0; i < count; ++i)
+		thread_task_delete(tasks[i]);
+}
+
+/**
+ * Empty tasks pushed by the tasks themselves. They land in the deques of
+ * the workers and spread via stealing.
+ */
+static void
+bench_nested(void)
+{
+	const int root_count = 20;
+	const int child_count = TPOOL_MAX_TASKS / root_count - 1;
+	const int rounds = 10;
+	printf("# %d tasks each pushing %d empty tasks, %d rounds\n",
+	       root_count, child_count, rounds);
+	static struct thread_task *tasks[TPOOL_MAX_TASKS];
+	struct thread_pool *pool = NULL;
+	struct thread_task *roots[root_count];
+	for (int i = 0; i < root_count * child_count; ++i)
+		thread_task_new(&tasks[i], []() {});
+	for (int i = 0; i < root_count; ++i) {
+		struct thread_task **children = &tasks[i * child_count];
+		thread_task_new(&roots[i], [&pool, children, child_count]() {
+			for (int j = 0; j < child_count; ++j)
+				thread_pool_push_task(pool, children[j]);
+		});
+	}
+	for (int threads : bench_thread_counts) {
+		thread_pool_new(threads, &pool);
+		uint64_t start = bench_now_ns();
+		for (int r = 0; r < rounds; ++r) {
+			for (int i = 0; i < root_count; ++i)
+				thread_pool_push_task(pool, roots[i]);
+			for (int i = 0; i < root_count; ++i)
+				thread_task_join(roots[i]);
+			for (int i = 0; i < root_count * child_count; ++i)
+				thread_task_join(tasks[i]);
+		}
+		bench_report("nested", threads, bench_now_ns() - start,
+			     (uint64_t)root_count * (child_count + 1) * rounds);
+		thread_pool_delete(pool);
+	}
+	for (int i = 0; i < root_count; ++i)
+		thread_task_delete(roots[i]);
+	for (int i = 0; i < root_count * child_count; ++i)
+		thread_task_delete(tasks[i]);
+}
+
+static uint64_t
+bench_alloc_count(void)
+{
+#if BENCH_HAS_HEAP_HELP
+	return heaph_get_alloc_total();
+#else
+	return 0;
+#endif
+}
+
+static void
+bench_task_cb(void *arg)
+{
+	__atomic_add_fetch((uint64_t *)arg, 1, __ATOMIC_RELAXED);
+}
+
+enum bench_task_kind {
+	BENCH_TASK_CB,
+	BENCH_TASK_LAMBDA,
+	BENCH_TASK_FUNCTION,
+};
+
+/**
+ * Full life cycle of a task: create, push, join, delete. Shows the cost of
+ * a task object itself depending on how its function is passed.
+ */
+static void
+bench_alloc_kind(const char *what, enum bench_task_kind kind)
+{
+	const int batch = 1000;
+	const int rounds = 200;
+	static struct thread_task *tasks[batch];
+	struct thread_pool *pool;
+	thread_pool_new(4, &pool);
+	uint64_t sum = 0;
+	uint64_t pad[4] = {1, 2, 3, 4};
+	uint64_t allocs = 0;
+	uint64_t start = 0;
+	/* The first round warms up the task cache and the deques. */
+	for (int r = -1; r < rounds; ++r) {
+		if (r == 0) {
+			allocs = bench_alloc_count();
+			start = bench_now_ns();
+		}
+		for (int i = 0; i < batch; ++i) {
+			switch (kind) {
+			case BENCH_TASK_CB:
+				thread_pool_task_new(pool, &tasks[i],
+						     bench_task_cb, &sum);
+				break;
+			case BENCH_TASK_LAMBDA:
+				thread_pool_task_new(pool, &tasks[i],
+						     [&sum, pad]() {
+					__atomic_add_fetch(&sum, pad[0],
+							   __ATOMIC_RELAXED);
+				});
+				break;
+			case BENCH_TASK_FUNCTION:
+				thread_pool_task_new(pool, &tasks[i],
+						     thread_task_f(
+					[&sum, pad]() {
+					__atomic_add_fetch(&sum, pad[0],
+							   __ATOMIC_RELAXED);
+				}));
+				break;
+			}
+			thread_pool_push_task(pool, tasks[i]);
+		}
+		for (int i = 0; i < batch; ++i) {
+			thread_task_join(tasks[i]);
+			thread_task_delete(tasks[i]);
+		}
+	}
+	uint64_t ns = bench_now_ns() - start;
+	uint64_t count = (uint64_t)batch * rounds;
+	bench_report(what, 4, ns, count);
+	if (BENCH_HAS_HEAP_HELP) {
+		printf("%-24s %.3f allocations/task\n", what,
+		       (double)(bench_alloc_count() - allocs) / count);
+	}
+	thread_pool_delete(pool);
+}
+
+static void
+bench_alloc(void)
+{
+	printf("# create/push/join/delete, lambdas capture 40 bytes\n");
+	if (!BENCH_HAS_HEAP_HELP)
+		printf("# build with ENABLE_LEAK_CHECKS to count allocs\n");
+	bench_alloc_kind("alloc_cb", BENCH_TASK_CB);
+	bench_alloc_kind("alloc_lambda", BENCH_TASK_LAMBDA);
+	bench_alloc_kind("alloc_function", BENCH_TASK_FUNCTION);
+}
+
+/** Fork-join of many tiny tasks: one by one versus a batch and a group. */
+static void
+bench_fork_join(void)
+{
+	const int count = TPOOL_MAX_TASKS;
+	const int rounds = 10;
+	printf("# fork-join of %d tasks, %d rounds\n", count, rounds);
+	static struct thread_task *tasks[TPOOL_MAX_TASKS];
+	uint64_t sum = 0;
+	for (int i = 0; i < count; ++i)
+		thread_task_new(&tasks[i], bench_task_cb, &sum);
+	for (int threads : bench_thread_counts) {
+		struct thread_pool *pool;
+		thread_pool_new(threads, &pool);
+		uint64_t start = bench_now_ns();
+		for (int r = 0; r < rounds; ++r) {
+			for (int i = 0; i < count; ++i)
+				thread_pool_push_task(pool, tasks[i]);
+			for (int i = 0; i < count; ++i)
+				thread_task_join(tasks[i]);
+		}
+		bench_report("one_by_one", threads, bench_now_ns() - start,
+			     (uint64_t)count * rounds);
+		thread_pool_delete(pool);
+	}
+	struct thread_task_group *group;
+	thread_task_group_new(&group);
+	for (int i = 0; i < count; ++i)
+		thread_task_set_group(tasks[i], group);
+	for (int threads : bench_thread_counts) {
+		struct thread_pool *pool;
+		thread_pool_new(threads, &pool);
+		uint64_t start = bench_now_ns();
+		for (int r = 0; r < rounds; ++r) {
+			thread_pool_push_tasks(pool, tasks, count);
+			thread_task_group_join(group);
+		}
+		bench_report("batch_group", threads, bench_now_ns() - start,
+			     (uint64_t)count * rounds);
+		thread_pool_delete(pool);
+	}
+	for (int i = 0; i < count; ++i)
+		thread_task_delete(tasks[i]);
+	thread_task_group_delete(group);
+}
+
+static void
+bench_task_busy(void *arg)
+{
+	uint64_t end = bench_now_ns() + *(uint64_t *)arg;
+	while (bench_now_ns() < end);
+}
+
+static void
+bench_join_latency_of(const char *what, uint64_t task_ns)
+{
+	const int count = 100000;
+	static uint64_t samples[count];
+	struct thread_pool *pool;
+	struct thread_task *task;
+	thread_pool_new(4, &pool);
+	thread_task_new(&task, bench_task_busy, &task_ns);
+	for (int i = 0; i < count; ++i) {
+		uint64_t start = bench_now_ns();
+		thread_pool_push_task(pool, task);
+		thread_task_join(task);
+		samples[i] = bench_now_ns() - start - task_ns;
+	}
+	thread_task_delete(task);
+	thread_pool_delete(pool);
+	std::sort(samples, samples + count);
+	printf("%-24s p50 %6.1f us  p90 %6.1f us  p99 %6.1f us  "
+	       "p99.9 %7.1f us  max %8.1f us\n", what,
+	       samples[count / 2] / 1e3, samples[count * 9 / 10] / 1e3,
+	       samples[count * 99 / 100] / 1e3,
+	       samples[count * 999 / 1000] / 1e3, samples[count - 1] / 1e3);
+}
+
+/**
+ * Push and join of a single task, minus the task's own run time. Shows the
+ * wakeup cost of a worker and of the joiner.
+ */
+static void
+bench_join(void)
+{
+	printf("# push + join round trip overhead, 4 threads\n");
+	bench_join_latency_of("join_empty", 0);
+	bench_join_latency_of("join_10us", 10000);
+	bench_join_latency_of("join_100us", 100000);
+}
+
+/** Heap memory taken by an idle task. */
+static void
+bench_memory(void)
+{
+	const int count = TPOOL_MAX_TASKS;
+	static struct thread_task *tasks[TPOOL_MAX_TASKS];
+	uint64_t sum = 0;
+	struct mallinfo2 before = mallinfo2();
+	for (int i = 0; i < count; ++i)
+		thread_task_new(&tasks[i], bench_task_cb, &sum);
+	struct mallinfo2 after = mallinfo2();
+	size_t used = after.uordblks + after.hblkhd - before.uordblks -
+		      before.hblkhd;
+	printf("# heap of %d tasks\n", count);
+	printf("%-24s %10.1f bytes/task\n", "memory", (double)used / count);
+	for (int i = 0; i < count; ++i)
+		thread_task_delete(tasks[i]);
+}
+
+static void
+bench_fill_random(int *data, size_t count)
+{
+	uint32_t seed = 1;
+	for (size_t i = 0; i < count; ++i) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (int)(seed ^ (seed >> 16));
+	}
+}
+
+/** Merge sort on the pool versus std::sort in one thread. */
+static void
+bench_sort(void)
+{
+	const size_t count = 100 * 1000 * 1000;
+	const int thread_counts[] = {1, 2, 4, 8, 16};
+	printf("# sort of %zu random ints\n", count);
+	int *data = new int[count];
+	bench_fill_random(data, count);
+	uint64_t start = bench_now_ns();
+	std::sort(data, data + count);
+	printf("%-24s %2d threads %10.1f ms\n", "std_sort", 1,
+	       (bench_now_ns() - start) / 1e6);
+	for (int threads : thread_counts) {
+		bench_fill_random(data, count);
+		struct thread_pool *pool;
+		thread_pool_new(threads, &pool);
+		start = bench_now_ns();
+		parallel_sort(pool, data, count);
+		printf("%-24s %2d threads %10.1f ms\n", "parallel_sort",
+		       threads, (bench_now_ns() - start) / 1e6);
+		thread_pool_delete(pool);
+		if (!std::is_sorted(data, data + count))
+			printf("not sorted\n");
+	}
+	delete[] data;
+}
+
+/** Sum of an array with parallel_reduce() and parallel_scan(). */
+static void
+bench_reduce(void)
+{
+	const size_t count = 100 * 1000 * 1000;
+	printf("# reduce and scan of %zu ints\n", count);
+	int *data = new int[count];
+	bench_fill_random(data, count);
+	for (int threads : bench_thread_counts) {
+		struct thread_pool *pool;
+		thread_pool_new(threads, &pool);
+		uint64_t start = bench_now_ns();
+		int64_t sum = parallel_reduce(pool, 0, count, 0, (int64_t)0,
+			[data](size_t b, size_t e) {
+				int64_t res = 0;
+				for (size_t i = b; i < e; ++i)
+					res += data[i];
+				return res;
+			},
+			[](int64_t a, int64_t b) { return a + b; });
+		bench_report("reduce", threads, bench_now_ns() - start, count);
+		start = bench_now_ns();
+		parallel_scan(pool, data, data, count, 0, 0,
+			      [](int a, int b) { return a ^ b; });
+		bench_report("scan", threads, bench_now_ns() - start, count);
+		thread_pool_delete(pool);
+		if (sum == 0)
+			printf("zero sum\n");
+	}
+	delete[] data;
+}
+
+/**
+ * A layered DAG: each task depends on two tasks of the previous layer. The
+ * whole graph is pushed at once. The utilization is the share of the worker
+ * time spent inside the tasks.
+ */
+static void
+bench_dag_of(const char *what, int width, int depth, uint64_t task_ns)
+{
+	const int count = width * depth;
+	struct thread_task **tasks = new thread_task *[count];
+	for (int threads : bench_thread_counts) {
+		struct thread_pool *pool;
+		thread_pool_new(threads, &pool);
+		for (int i = 0; i < count; ++i) {
+			thread_task_new(&tasks[i], bench_task_busy, &task_ns);
+			if (i < width)
+				continue;
+			int col = i % width;
+			thread_task *prev = tasks[i - width];
+			thread_task_add_dependency(tasks[i], prev);
+			prev = tasks[i - width - col + (col + 1) % width];
+			if (width > 1)
+				thread_task_add_dependency(tasks[i], prev);
+		}
+		uint64_t start = bench_now_ns();
+		thread_pool_push_tasks(pool, tasks, count);
+		for (int i = 0; i < count; ++i)
+			thread_task_join(tasks[i]);
+		uint64_t ns = bench_now_ns() - start;
+		for (int i = 0; i < count; ++i)
+			thread_task_delete(tasks[i]);
+		thread_pool_delete(pool);
+		printf("%-24s %2d threads %10.1f ns/op %12.0f op/s %5.1f%% "
+		       "busy\n", what, threads, (double)ns / count,
+		       count * 1e9 / ns,
+		       100.0 * task_ns * count / ns / threads);
+	}
+	delete[] tasks;
+}
+
+static void
+bench_dag(void)
+{
+	printf("# DAG of 1us tasks, each depends on 2 of the previous "
+	       "layer\n");
+	bench_dag_of("dag_wide_1000x50", 1000, 50, 1000);
+	bench_dag_of("dag_deep_4x10000", 4, 10000, 1000);
+}
+
+static uint64_t
+bench_fib_serial(int n)
+{
+	return n < 2 ? n : bench_fib_serial(n - 1) + bench_fib_serial(n - 2);
+}
+
+struct bench_fib_ctx {
+	struct thread_pool *pool;
+	int n;
+	uint64_t res;
+};
+
+enum {
+	/** Smaller Fibonacci numbers are computed without subtasks. */
+	BENCH_FIB_CUTOFF = 12,
+};
+
+/** Recursive Fibonacci: each task pushes a subtask and joins it. */
+static void
+bench_fib_task(void *arg)
+{
+	bench_fib_ctx *ctx = (bench_fib_ctx *)arg;
+	if (ctx->n < BENCH_FIB_CUTOFF) {
+		ctx->res = bench_fib_serial(ctx->n);
+		return;
+	}
+	bench_fib_ctx left = {ctx->pool, ctx->n - 1, 0};
+	bench_fib_ctx right = {ctx->pool, ctx->n - 2, 0};
+	struct thread_task *task;
+	thread_pool_task_new(ctx->pool, &task, bench_fib_task, &left);
+	thread_pool_push_task(ctx->pool, task);
+	bench_fib_task(&right);
+	thread_task_join(task);
+	thread_task_delete(task);
+	ctx->res = left.res + right.res;
+}
+
+static void
+bench_fib(void)
+{
+	const int n = 32;
+	printf("# fib(%d) with subtasks joined from the workers\n", n);
+	uint64_t start = bench_now_ns();
+	uint64_t expected = bench_fib_serial(n);
+	printf("%-24s %2d threads %10.1f ms\n", "fib_serial", 1,
+	       (bench_now_ns() - start) / 1e6);
+	for (int threads : bench_thread_counts) {
+		struct thread_pool *pool;
+		thread_pool_new(threads, &pool);
+		bench_fib_ctx ctx = {pool, n, 0};
+		struct thread_task *task;
+		thread_task_new(&task, bench_fib_task, &ctx);
+		start = bench_now_ns();
+		thread_pool_push_task(pool, task);
+		thread_task_join(task);
+		printf("%-24s %2d threads %10.1f ms\n", "fib_tasks", threads,
+		       (bench_now_ns() - start) / 1e6);
+		thread_task_delete(task);
+		thread_pool_delete(pool);
+		if (ctx.res != expected)
+			printf("wrong result\n");
+	}
+}
+
+/** Resident memory of the process in KB. */
+static long
+bench_rss_kb(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return -1;
+	long size = 0, rss = 0;
+	if (fscanf(f, "%ld %ld", &size, &rss) != 2)
+		rss = -1;
+	fclose(f);
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/** Number of threads of the process. */
+static int
+bench_thread_count(void)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL)
+		return -1;
+	char line[256];
+	int count = -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "Threads: %d", &count) == 1)
+			break;
+	}
+	fclose(f);
+	return count;
+}
+
+struct bench_burst_task {
+	uint64_t busy_ns;
+	/** Earliest start of a task of the burst. */
+	uint64_t first_start;
+};
+
+static void
+bench_burst_task_f(void *arg)
+{
+	bench_burst_task *b = (bench_burst_task *)arg;
+	uint64_t now = bench_now_ns();
+	uint64_t first = __atomic_load_n(&b->first_start, __ATOMIC_RELAXED);
+	while (now < first &&
+	       !__atomic_compare_exchange_n(&b->first_start, &first, now,
+					    false, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+	bench_task_busy(&b->busy_ns);
+}
+
+/**
+ * Bursts of tasks separated by quiet periods. Reports the delay before the
+ * first task of a burst starts, and the memory and threads between the
+ * bursts.
+ */
+static void
+bench_elastic_of(const char *what, double idle_timeout)
+{
+	const int count = 200;
+	const int bursts = 20;
+	struct thread_task *tasks[count];
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.thread_count = TPOOL_MAX_THREADS;
+	opts.idle_timeout = idle_timeout;
+	struct thread_pool *pool;
+	thread_pool_new_ext(&opts, &pool);
+	bench_burst_task b;
+	b.busy_ns = 10000;
+	for (int i = 0; i < count; ++i)
+		thread_task_new(&tasks[i], bench_burst_task_f, &b);
+	uint64_t delay_sum = 0;
+	uint64_t delay_max = 0;
+	long rss = 0;
+	int threads = 0;
+	for (int i = 0; i < bursts; ++i) {
+		b.first_start = UINT64_MAX;
+		uint64_t start = bench_now_ns();
+		thread_pool_push_tasks(pool, tasks, count);
+		for (int j = 0; j < count; ++j)
+			thread_task_join(tasks[j]);
+		uint64_t delay = b.first_start - start;
+		delay_sum += delay;
+		delay_max = std::max(delay_max, delay);
+		usleep(50000);
+		rss = std::max(rss, bench_rss_kb());
+		threads = std::max(threads, bench_thread_count());
+	}
+	printf("%-24s first start %6.1f us avg %7.1f us max, idle: %6ld KB "
+	       "RSS, %2d threads\n", what, delay_sum / 1e3 / bursts,
+	       delay_max / 1e3, rss, threads);
+	for (int i = 0; i < count; ++i)
+		thread_task_delete(tasks[i]);
+	thread_pool_delete(pool);
+}
+
+static void
+bench_elastic(void)
+{
+	printf("# bursts of 200 10us tasks every 50 ms, %d threads max\n",
+	       TPOOL_MAX_THREADS);
+	bench_elastic_of("elastic_fixed", 0);
+	bench_elastic_of("elastic_10ms", 0.01);
+}
+
+struct bench_probe {
+	uint64_t push_ns;
+	uint64_t start_ns;
+};
+
+static void
+bench_probe_f(void *arg)
+{
+	((bench_probe *)arg)->start_ns = bench_now_ns();
+}
+
+/**
+ * Start latency of the probe tasks pushed with @a priority while the pool
+ * is saturated with normal priority batch work.
+ */
+static void
+bench_priority_of(const char *what, enum thread_task_priority priority)
+{
+	const int batch_count = 20000;
+	const int probe_count = 500;
+	uint64_t batch_ns = 20000;
+	struct thread_task **batch = new thread_task *[batch_count];
+	struct thread_task *probes[probe_count];
+	static bench_probe samples[probe_count];
+	struct thread_pool *pool;
+	thread_pool_new(4, &pool);
+	for (int i = 0; i < batch_count; ++i)
+		thread_task_new(&batch[i], bench_task_busy, &batch_ns);
+	for (int i = 0; i < probe_count; ++i) {
+		thread_task_new(&probes[i], bench_probe_f, &samples[i]);
+		thread_task_set_priority(probes[i], priority);
+	}
+	thread_pool_push_tasks(pool, batch, batch_count);
+	for (int i = 0; i < probe_count; ++i) {
+		samples[i].push_ns = bench_now_ns();
+		thread_pool_push_task(pool, probes[i]);
+		usleep(200);
+	}
+	uint64_t latency[probe_count];
+	for (int i = 0; i < probe_count; ++i) {
+		thread_task_join(probes[i]);
+		thread_task_delete(probes[i]);
+		latency[i] = samples[i].start_ns - samples[i].push_ns;
+	}
+	for (int i = 0; i < batch_count; ++i) {
+		thread_task_join(batch[i]);
+		thread_task_delete(batch[i]);
+	}
+	delete[] batch;
+	thread_pool_delete(pool);
+	std::sort(latency, latency + probe_count);
+	printf("%-24s p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", what,
+	       latency[probe_count / 2] / 1e3,
+	       latency[probe_count * 99 / 100] / 1e3,
+	       latency[probe_count - 1] / 1e3);
+}
+
+static void
+bench_priority(void)
+{
+	printf("# start latency of probes under 20000 20us batch tasks, "
+	       "4 threads\n");
+	bench_priority_of("probe_normal", TPOOL_PRIORITY_NORMAL);
+	bench_priority_of("probe_high", TPOOL_PRIORITY_HIGH);
+}
+
+/** Sizes of the workload waiting for the ticks of an I/O-like clock. */
+enum {
+	BENCH_WAIT_TASKS = 1000,
+	BENCH_WAIT_ROUNDS = 5,
+	BENCH_WAIT_TICK_US = 1000,
+	BENCH_WAIT_THREADS = 4,
+};
+
+/** A clock the blocking tasks wait on, ticked by the main thread. */
+struct bench_ticker {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int tick;
+	int done_count;
+};
+
+/** Wait for each tick of the clock in turn, holding the worker. */
+static void
+bench_wait_blocking(void *arg)
+{
+	struct bench_ticker *t = (struct bench_ticker *)arg;
+	pthread_mutex_lock(&t->mutex);
+	int tick = t->tick;
+	for (int r = 0; r < BENCH_WAIT_ROUNDS; ++r) {
+		while (t->tick == tick)
+			pthread_cond_wait(&t->cond, &t->mutex);
+		tick = t->tick;
+	}
+	++t->done_count;
+	pthread_mutex_unlock(&t->mutex);
+}
+
+/** Wait for each tick of the clock in turn, suspended. */
+static thread_coro
+bench_wait_coro(struct thread_coro_event *ticks)
+{
+	for (int r = 0; r < BENCH_WAIT_ROUNDS; ++r)
+		co_await ticks[r];
+}
+
+/**
+ * Many tasks which mostly wait, like for I/O: each of them waits for a few
+ * ticks of a clock in turn. A blocking task holds a worker while waiting,
+ * so only a few of them make progress per tick. A coroutine task is
+ * suspended, so all of them move on each tick.
+ */
+static void
+bench_wait(void)
+{
+	const int count = BENCH_WAIT_TASKS;
+	const int threads = BENCH_WAIT_THREADS;
+	printf("# %d tasks waiting for %d ticks of %d us each, %d threads\n",
+	       count, BENCH_WAIT_ROUNDS, BENCH_WAIT_TICK_US, threads);
+	struct thread_task **tasks = new thread_task *[count];
+	struct thread_pool *pool;
+
+	struct bench_ticker ticker;
+	pthread_mutex_init(&ticker.mutex, NULL);
+	pthread_cond_init(&ticker.cond, NULL);
+	ticker.tick = 0;
+	ticker.done_count = 0;
+	thread_pool_new(threads, &pool);
+	for (int i = 0; i < count; ++i)
+		thread_task_new(&tasks[i], bench_wait_blocking, &ticker);
+	uint64_t start = bench_now_ns();
+	thread_pool_push_tasks(pool, tasks, count);
+	int tick_count = 0;
+	while (true) {
+		usleep(BENCH_WAIT_TICK_US);
+		pthread_mutex_lock(&ticker.mutex);
+		bool is_done = ticker.done_count == count;
+		++ticker.tick;
+		pthread_cond_broadcast(&ticker.cond);
+		pthread_mutex_unlock(&ticker.mutex);
+		if (is_done)
+			break;
+		++tick_count;
+	}
+	for (int i = 0; i < count; ++i) {
+		thread_task_join(tasks[i]);
+		thread_task_delete(tasks[i]);
+	}
+	uint64_t ns = bench_now_ns() - start;
+	thread_pool_delete(pool);
+	pthread_cond_destroy(&ticker.cond);
+	pthread_mutex_destroy(&ticker.mutex);
+	bench_report("wait_blocking", threads, ns, (uint64_t)count *
+		     BENCH_WAIT_ROUNDS);
+	printf("%-24s %d ticks\n", "", tick_count);
+
+	struct thread_coro_event ticks[BENCH_WAIT_ROUNDS];
+	thread_pool_new(threads, &pool);
+	for (int i = 0; i < count; ++i)
+		thread_task_new_coro(&tasks[i], bench_wait_coro(ticks));
+	start = bench_now_ns();
+	thread_pool_push_tasks(pool, tasks, count);
+	for (int r = 0; r < BENCH_WAIT_ROUNDS; ++r) {
+		usleep(BENCH_WAIT_TICK_US);
+		ticks[r].set();
+	}
+	for (int i = 0; i < count; ++i) {
+		thread_task_join(tasks[i]);
+		thread_task_delete(tasks[i]);
+	}
+	ns = bench_now_ns() - start;
+	thread_pool_delete(pool);
+	bench_report("wait_coro", threads, ns, (uint64_t)count *
+		     BENCH_WAIT_ROUNDS);
+	printf("%-24s %d ticks\n", "", BENCH_WAIT_ROUNDS);
+	delete[] tasks;
+}
+
+/** Number of tasks reading a buffer of a node. */
+enum {
+	BENCH_NUMA_PARTS = 64,
+};
+
+/**
+ * Read the per-node buffers in a parallel pass. Each buffer part is read
+ * by a task pushed to the node of the buffer, so with pinned workers the
+ * reads are local. Returns GB/s.
+ */
+static double
+bench_numa_pass(struct thread_pool *pool, int64_t **buffers, int node_count,
+		size_t count, bool use_hints)
+{
+	const int parts = BENCH_NUMA_PARTS;
+	static struct thread_task *tasks[TPOOL_MAX_NODES * parts];
+	int64_t sums[TPOOL_MAX_NODES * parts];
+	size_t part_size = count / parts;
+	uint64_t start = bench_now_ns();
+	for (int n = 0; n < node_count; ++n) {
+		for (int i = 0; i < parts; ++i) {
+			int64_t *data = buffers[n] + i * part_size;
+			int64_t *sum = &sums[n * parts + i];
+			thread_task_new(&tasks[n * parts + i],
+					[data, sum, part_size]() {
+				int64_t res = 0;
+				for (size_t j = 0; j < part_size; ++j)
+					res += data[j];
+				*sum = res;
+			});
+			thread_pool_push_task_to_node(pool,
+						      tasks[n * parts + i],
+						      use_hints ? n : -1);
+		}
+	}
+	for (int i = 0; i < node_count * parts; ++i) {
+		thread_task_join(tasks[i]);
+		thread_task_delete(tasks[i]);
+	}
+	uint64_t ns = bench_now_ns() - start;
+	return (double)node_count * count * sizeof(int64_t) / ns;
+}
+
+/**
+ * Memory bandwidth of workers pinned to the NUMA nodes reading their local
+ * memory, versus unpinned workers without hints. Does nothing on a machine
+ * with one node.
+ */
+static void
+bench_numa(void)
+{
+	int node_count = thread_pool_numa_node_count();
+	if (node_count < 2) {
+		printf("# numa: single node, skipped\n");
+		return;
+	}
+	const size_t count = 32 * 1024 * 1024;
+	const int rounds = 5;
+	int threads_per_node = TPOOL_MAX_THREADS / node_count;
+	int counts[TPOOL_MAX_NODES];
+	for (int n = 0; n < node_count; ++n)
+		counts[n] = threads_per_node;
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.thread_count = threads_per_node * node_count;
+	opts.node_thread_counts = counts;
+	opts.node_count = node_count;
+	struct thread_pool *pinned;
+	thread_pool_new_ext(&opts, &pinned);
+	printf("# read of %zu MB per node, %d nodes, %d threads per node\n",
+	       count * sizeof(int64_t) >> 20, node_count, threads_per_node);
+	int64_t *buffers[TPOOL_MAX_NODES];
+	for (int n = 0; n < node_count; ++n)
+		buffers[n] = (int64_t *)malloc(count * sizeof(int64_t));
+	/* First touch from the node's workers places the pages there. */
+	struct thread_task *tasks[TPOOL_MAX_NODES];
+	for (int n = 0; n < node_count; ++n) {
+		int64_t *data = buffers[n];
+		thread_task_new(&tasks[n], [data, count]() {
+			memset(data, 1, count * sizeof(int64_t));
+		});
+		thread_pool_push_task_to_node(pinned, tasks[n], n);
+	}
+	for (int n = 0; n < node_count; ++n) {
+		thread_task_join(tasks[n]);
+		thread_task_delete(tasks[n]);
+	}
+	struct thread_pool *unpinned;
+	thread_pool_new(opts.thread_count, &unpinned);
+	double local = 0;
+	double any = 0;
+	for (int i = 0; i < rounds; ++i) {
+		local = std::max(local, bench_numa_pass(pinned, buffers,
+							node_count, count,
+							true));
+		any = std::max(any, bench_numa_pass(unpinned, buffers,
+						    node_count, count, false));
+	}
+	printf("%-24s %10.2f GB/s\n", "numa_local", local);
+	printf("%-24s %10.2f GB/s\n", "numa_unpinned", any);
+	thread_pool_delete(unpinned);
+	thread_pool_delete(pinned);
+	for (int n = 0; n < node_count; ++n)
+		free(buffers[n]);
+}
+
+struct bench {
+	const char *name;
+	void (*func)(void);
+};
+
+static const struct bench benches[] = {
+	{"memory", bench_memory},
+	{"empty", bench_empty},
+	{"nested", bench_nested},
+	{"alloc", bench_alloc},
+	{"fork_join", bench_fork_join},
+	{"join", bench_join},
+	{"sort", bench_sort},
+	{"reduce", bench_reduce},
+	{"numa", bench_numa},
+	{"dag", bench_dag},
+	{"fib", bench_fib},
+	{"elastic", bench_elastic},
+	{"priority", bench_priority},
+	{"wait", bench_wait},
+};
+
+int
+main(int argc, char **argv)
+{
+	for (const struct bench &b : benches) {
+		bool is_needed = argc < 2;
+		for (int i = 1; i < argc && !is_needed; ++i)
+			is_needed = strcmp(argv[i], b.name) == 0;
+		if (is_needed)
+			b.func();
+	}
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include "parallel.h"
+
+/** A parallel_for() call shared by all its tasks. */
+struct parallel_for_ctx {
+	struct thread_pool *pool;
+	size_t grain;
+	const parallel_range_f *func;
+	struct thread_task_group *group;
+	/**
+	 * Created tasks, deleted when the group is joined. There is a slot
+	 * for each possible split.
+	 */
+	struct thread_task **tasks;
+	size_t task_count;
+};
+
+/**
+ * Run the range. The right halves are pushed as new tasks while the range
+ * is bigger than the grain, the rest is done right here.
+ */
+static void
+parallel_for_split(parallel_for_ctx *ctx, size_t begin, size_t end)
+{
+	while (end - begin > ctx->grain) {
+		/* Split on a grain border, so the parts are grain sized. */
+		size_t parts = (end - begin + ctx->grain - 1) / ctx->grain;
+		size_t mid = begin + parts / 2 * ctx->grain;
+		struct thread_task *task;
+		thread_pool_task_new(ctx->pool, &task, [ctx, mid, end]() {
+			parallel_for_split(ctx, mid, end);
+		});
+		thread_task_set_group(task, ctx->group);
+		if (thread_pool_push_task(ctx->pool, task) != 0) {
+			/* The pool is full, do the rest here. */
+			thread_task_delete(task);
+			break;
+		}
+		size_t i = __atomic_fetch_add(&ctx->task_count, 1,
+					      __ATOMIC_RELAXED);
+		ctx->tasks[i] = task;
+		end = mid;
+	}
+	(*ctx->func)(begin, end);
+}
+
+size_t
+parallel_grain(const struct thread_pool *pool, size_t count, size_t grain)
+{
+	if (grain != 0)
+		return grain;
+	size_t parts = (size_t)thread_pool_thread_count(pool) *
+		       PARALLEL_PARTS_PER_THREAD;
+	grain = count / parts;
+	return grain != 0 ? grain : 1;
+}
+
+void
+parallel_for(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+	     const parallel_range_f &func)
+{
+	if (begin >= end)
+		return;
+	grain = parallel_grain(pool, end - begin, grain);
+	if (end - begin <= grain) {
+		func(begin, end);
+		return;
+	}
+	parallel_for_ctx ctx;
+	ctx.pool = pool;
+	ctx.grain = grain;
+	ctx.func = &func;
+	thread_task_group_new(&ctx.group);
+	/* Each split makes one more part, there are parts - 1 of them. */
+	size_t parts = (end - begin + grain - 1) / grain;
+	ctx.tasks = new thread_task *[parts - 1];
+	ctx.task_count = 0;
+	parallel_for_split(&ctx, begin, end);
+	thread_task_group_join(ctx.group);
+	for (size_t i = 0; i < ctx.task_count; ++i)
+		thread_task_delete(ctx.tasks[i]);
+	delete[] ctx.tasks;
+	thread_task_group_delete(ctx.group);
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <stddef.h>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Parallel algorithms on top of the thread pool. Each of them splits its
+ * range recursively in halves: a task keeps the left half and pushes the
+ * right one, until the parts are not bigger than the grain size. The right
+ * halves are the biggest parts of a worker's deque, so the idle workers
+ * steal big pieces of work first.
+ *
+ * The calling thread takes part in the work and returns when all of it is
+ * done. It should not be a task of the same pool, because it blocks waiting
+ * for the other tasks.
+ *
+ * A grain size 0 means auto: the range is split into a few parts per
+ * thread, so the load is balanced even when the parts are not equal.
+ */
+
+using parallel_range_f = std::function<void(size_t begin, size_t end)>;
+
+/**
+ * Number of parts per thread for the auto grain size. More parts balance
+ * the load better, fewer parts cost less to schedule.
+ */
+enum {
+	PARALLEL_PARTS_PER_THREAD = 8,
+};
+
+/**
+ * Get the grain size for a range of @a count elements.
+ * @param pool Pool to run in.
+ * @param count Range size.
+ * @param grain Requested grain size, 0 for auto.
+ */
+size_t
+parallel_grain(const struct thread_pool *pool, size_t count, size_t grain);
+
+/**
+ * Call @a func for sub-ranges of [@a begin, @a end) in parallel. Each
+ * sub-range is not bigger than the grain size.
+ * @param pool Pool to run in.
+ * @param begin Range begin.
+ * @param end Range end, not included.
+ * @param grain Max sub-range size, 0 for auto.
+ * @param func Function to call for each sub-range.
+ */
+void
+parallel_for(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+	     const parallel_range_f &func);
+
+/**
+ * Reduce [@a begin, @a end) in parallel. @a map folds a sub-range into a
+ * value, @a combine merges two values. The sub-range values are combined
+ * from left to right, so @a combine needs to be associative, but not
+ * commutative.
+ * @param pool Pool to run in.
+ * @param begin Range begin.
+ * @param end Range end, not included.
+ * @param grain Max sub-range size, 0 for auto.
+ * @param identity Result for an empty range.
+ * @param map T map(size_t begin, size_t end).
+ * @param combine T combine(const T &left, const T &right).
+ */
+template<typename T, typename Map, typename Combine>
+T
+parallel_reduce(struct thread_pool *pool, size_t begin, size_t end,
+		size_t grain, const T &identity, const Map &map,
+		const Combine &combine)
+{
+	if (begin >= end)
+		return identity;
+	grain = parallel_grain(pool, end - begin, grain);
+	size_t part_count = (end - begin + grain - 1) / grain;
+	std::vector<T> parts(part_count, identity);
+	parallel_for(pool, 0, part_count, 1, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			size_t b = begin + i * grain;
+			parts[i] = map(b, std::min(b + grain, end));
+		}
+	});
+	T res = identity;
+	for (const T &part : parts)
+		res = combine(res, part);
+	return res;
+}
+
+/**
+ * Inclusive prefix scan: out[i] = in[0] op in[1] op ... op in[i]. @a in
+ * and @a out can be the same array. @a op needs to be associative.
+ * @param pool Pool to run in.
+ * @param in Input array.
+ * @param out Output array.
+ * @param count Number of elements.
+ * @param grain Max sub-range size, 0 for auto.
+ * @param identity Neutral element of @a op.
+ * @param op T op(const T &left, const T &right).
+ */
+template<typename T, typename Op>
+void
+parallel_scan(struct thread_pool *pool, const T *in, T *out, size_t count,
+	      size_t grain, const T &identity, const Op &op)
+{
+	if (count == 0)
+		return;
+	grain = parallel_grain(pool, count, grain);
+	size_t part_count = (count + grain - 1) / grain;
+	/* Sum of each part. */
+	std::vector<T> sums(part_count, identity);
+	parallel_for(pool, 0, part_count, 1, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			size_t b = i * grain;
+			size_t e = std::min(b + grain, count);
+			T sum = in[b];
+			for (size_t j = b + 1; j < e; ++j)
+				sum = op(sum, in[j]);
+			sums[i] = sum;
+		}
+	});
+	/* Sum of all the parts before each part. */
+	T prefix = identity;
+	for (size_t i = 0; i < part_count; ++i) {
+		T next = op(prefix, sums[i]);
+		sums[i] = prefix;
+		prefix = next;
+	}
+	parallel_for(pool, 0, part_count, 1, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			size_t b = i * grain;
+			size_t e = std::min(b + grain, count);
+			T sum = sums[i];
+			for (size_t j = b; j < e; ++j) {
+				sum = op(sum, in[j]);
+				out[j] = sum;
+			}
+		}
+	});
+}
+
+/**
+ * Find how many elements of the sorted @a a are among the first @a pos
+ * elements of the merge of @a a and @a b. The rest are from @a b.
+ */
+template<typename T, typename Cmp>
+size_t
+parallel_merge_split(const T *a, size_t a_size, const T *b, size_t b_size,
+		     size_t pos, const Cmp &cmp)
+{
+	size_t low = pos > b_size ? pos - b_size : 0;
+	size_t high = std::min(pos, a_size);
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		/* Stable: an equal element of a goes first. */
+		if (cmp(b[pos - mid - 1], a[mid]))
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return low;
+}
+
+/**
+ * Sort a run of the merge sort. Equal integers compared with std::less are
+ * indistinguishable, so they don't need the slower stable sort. Not so the
+ * floating point numbers: -0.0 equals +0.0, and NaN breaks the ordering
+ * std::sort relies on.
+ */
+template<typename T, typename Cmp>
+void
+parallel_sort_run(T *begin, T *end, const Cmp &cmp)
+{
+	if constexpr (std::is_integral_v<T> &&
+		      std::is_same_v<Cmp, std::less<T>>)
+		std::sort(begin, end, cmp);
+	else
+		std::stable_sort(begin, end, cmp);
+}
+
+/**
+ * Stable merge sort. The array is split into runs, sorted in parallel, and
+ * then the runs are merged pairwise in rounds. Each merge is split into
+ * independent parts of the grain size with a binary search, so all the
+ * threads work until the last round.
+ * @param pool Pool to run in.
+ * @param data Array to sort.
+ * @param count Number of elements.
+ * @param cmp Less-than comparator.
+ */
+template<typename T, typename Cmp = std::less<T>>
+void
+parallel_sort(struct thread_pool *pool, T *data, size_t count,
+	      const Cmp &cmp = Cmp())
+{
+	size_t grain = parallel_grain(pool, count, 0);
+	if (count <= grain) {
+		parallel_sort_run(data, data + count, cmp);
+		return;
+	}
+	size_t piece_count = (count + grain - 1) / grain;
+	parallel_for(pool, 0, piece_count, 1, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; ++i) {
+			size_t b = i * grain;
+			size_t e = std::min(b + grain, count);
+			parallel_sort_run(data + b, data + e, cmp);
+		}
+	});
+	std::vector<T> buffer(count);
+	T *src = data;
+	T *dst = buffer.data();
+	for (size_t run = grain; run < count; run *= 2) {
+		/*
+		 * Merge pairs of runs [b, b + run) and [b + run, b + 2 * run).
+		 * The output is split into pieces of the grain size. The run
+		 * is the grain multiplied by a power of 2, so a piece never
+		 * crosses a pair border.
+		 */
+		parallel_for(pool, 0, piece_count, 1, [&](size_t first,
+							  size_t last) {
+			for (size_t i = first; i < last; ++i) {
+				size_t out = i * grain;
+				size_t b = out / (2 * run) * (2 * run);
+				size_t mid = std::min(b + run, count);
+				size_t e = std::min(b + 2 * run, count);
+				size_t out_end = std::min(out + grain, e);
+				const T *a_ptr = src + b;
+				const T *b_ptr = src + mid;
+				size_t a_size = mid - b;
+				size_t b_size = e - mid;
+				size_t ai = parallel_merge_split(
+					a_ptr, a_size, b_ptr, b_size, out - b,
+					cmp);
+				size_t ae = parallel_merge_split(
+					a_ptr, a_size, b_ptr, b_size,
+					out_end - b, cmp);
+				std::merge(a_ptr + ai, a_ptr + ae,
+					   b_ptr + (out - b - ai),
+					   b_ptr + (out_end - b - ae),
+					   dst + out, cmp);
+			}
+		});
+		std::swap(src, dst);
+	}
+	if (src == data)
+		return;
+	parallel_for(pool, 0, count, grain, [&](size_t first, size_t last) {
+		std::copy(src + first, src + last, data + first);
+	});
+}
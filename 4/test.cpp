@@ -1,8 +1,13 @@
 #include "thread_pool.h"
+#include "parallel.h"
+#include "thread_coro.h"
 #include "unit.h"
+#include <dirent.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <cmath>
 
 static void
 test_new(void)
@@ -121,6 +126,988 @@ test_push(void)
 	unit_test_finish();
 }
 
+static void
+task_cb_inc(void *arg)
+{
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+/** Counts own copies alive, to check the tasks destroy their callables. */
+struct task_counted {
+	int *alive;
+	int *arg;
+
+	task_counted(int *alive, int *arg) : alive(alive), arg(arg)
+	{
+		++*alive;
+	}
+
+	task_counted(const task_counted &other)
+		: alive(other.alive), arg(other.arg)
+	{
+		++*alive;
+	}
+
+	~task_counted()
+	{
+		--*alive;
+	}
+
+	void
+	operator()()
+	{
+		__atomic_add_fetch(arg, 1, __ATOMIC_RELAXED);
+	}
+};
+
+static void
+test_task_kinds(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	int arg = 0;
+	/*
+	 * Plain function with an argument.
+	 */
+	unit_check(thread_task_new(&t, task_cb_inc, &arg) == 0,
+		   "created a callback task");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 1, "callback is called");
+	unit_fail_if(thread_task_delete(t) != 0);
+	/*
+	 * Small callable stored inline, with a destructor.
+	 */
+	int alive = 0;
+	unit_check(thread_task_new(&t, task_counted(&alive, &arg)) == 0,
+		   "created a task with a functor");
+	unit_check(alive == 1, "the functor is stored once");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 2, "functor is called");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(alive == 0, "the functor is destroyed");
+	/*
+	 * Too big for the inline storage, goes via std::function.
+	 */
+	int values[TPOOL_TASK_INLINE_SIZE / sizeof(int) + 1] = {0};
+	values[0] = 10;
+	unit_check(thread_task_new(&t, [values, &arg]() {
+		__atomic_add_fetch(&arg, values[0], __ATOMIC_RELAXED);
+	}) == 0, "created a task with a big lambda");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 12, "big lambda is called");
+	unit_fail_if(thread_task_delete(t) != 0);
+	/*
+	 * Deleted tasks are reused by the pool.
+	 */
+	struct thread_task *t2;
+	unit_fail_if(thread_pool_task_new(p, &t, task_cb_inc, &arg) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_task_new(p, &t2, task_make_inc(&arg)) != 0);
+	unit_check(t2 == t, "deleted task is reused");
+	unit_fail_if(thread_pool_push_task(p, t2) != 0);
+	unit_fail_if(thread_task_join(t2) != 0);
+	unit_check(arg == 13, "reused task runs the new function");
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "pool is not deleted before its task");
+	unit_fail_if(thread_task_delete(t2) != 0);
+
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_push_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const int count = 1000;
+	struct thread_task **tasks = new thread_task*[count];
+	int arg = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+					     task_make_inc(&arg)) != 0);
+	}
+	/*
+	 * Batch push, one by one join.
+	 */
+	unit_check(thread_pool_push_tasks(p, tasks, count) == 0,
+		   "pushed a batch");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_check(arg == count, "all the batch is done");
+	/*
+	 * Batch push, group join.
+	 */
+	struct thread_task_group *g;
+	unit_check(thread_task_group_new(&g) == 0, "created a group");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_set_group(tasks[i], g) != 0);
+	unit_check(thread_task_group_join(g) == 0, "empty group is joined");
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	unit_check(thread_task_group_join(g) == 0, "group is joined");
+	unit_check(arg == 2 * count, "all the group is done");
+	unit_check(thread_pool_delete(p) == 0, "no tasks in the pool");
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	/*
+	 * The group can be reused.
+	 */
+	int wait_arg = 0;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_make_wait_for(&wait_arg)) != 0);
+	unit_fail_if(thread_task_set_group(t, g) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_group_delete(g) == TPOOL_ERR_HAS_TASKS,
+		   "can't delete a group with tasks");
+	unit_check(thread_task_set_group(t, NULL) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't change the group of a pushed task");
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_group_join(g) != 0);
+	unit_check(arg == 3 * count, "the group is reused");
+	unit_check(thread_task_join(t) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "group task is already joined");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(thread_task_group_delete(g) == 0, "deleted the group");
+	/*
+	 * Too many tasks - nothing is pushed.
+	 */
+	wait_arg = 0;
+	unit_fail_if(thread_task_new(&t, task_make_wait_for(&wait_arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	struct thread_task **many = new thread_task*[TPOOL_MAX_TASKS]();
+	unit_check(thread_pool_push_tasks(p, many, TPOOL_MAX_TASKS) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too many tasks in a batch");
+	delete[] many;
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	delete[] tasks;
+	unit_check(thread_pool_delete(p) == 0, "no tasks in the pool");
+
+	unit_test_finish();
+}
+
+static void
+test_parallel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const size_t count = 100003;
+	int *marks = new int[count]();
+	const size_t grains[] = {0, 1, 7, 1000, count, count + 1};
+	/*
+	 * For.
+	 */
+	bool ok = true;
+	for (size_t grain : grains) {
+		size_t max_size = 0;
+		parallel_for(p, 0, count, grain, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; ++i) {
+				__atomic_add_fetch(&marks[i], 1,
+						   __ATOMIC_RELAXED);
+			}
+			size_t size = e - b;
+			size_t old = __atomic_load_n(&max_size,
+						     __ATOMIC_RELAXED);
+			while (size > old && !__atomic_compare_exchange_n(
+				&max_size, &old, size, false, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED));
+		});
+		ok = ok && max_size <= parallel_grain(p, count, grain);
+	}
+	for (size_t i = 0; i < count && ok; ++i)
+		ok = marks[i] == (int)(sizeof(grains) / sizeof(grains[0]));
+	unit_check(ok, "for visits each element once per call");
+	delete[] marks;
+	parallel_for(p, 10, 10, 0, [&](size_t, size_t) { ok = false; });
+	unit_check(ok, "for of an empty range does nothing");
+	/*
+	 * Reduce.
+	 */
+	for (size_t grain : grains) {
+		uint64_t sum = parallel_reduce(p, 1, count + 1, grain,
+					       (uint64_t)0,
+			[](size_t b, size_t e) {
+				uint64_t res = 0;
+				for (size_t i = b; i < e; ++i)
+					res += i;
+				return res;
+			},
+			[](uint64_t a, uint64_t b) { return a + b; });
+		ok = ok && sum == (uint64_t)count * (count + 1) / 2;
+	}
+	unit_check(ok, "reduce sum");
+	/* Concatenation is not commutative, the order must be kept. */
+	uint64_t digits = parallel_reduce(p, 1, 10, 2, (uint64_t)0,
+		[](size_t b, size_t e) {
+			uint64_t res = 0;
+			for (size_t i = b; i < e; ++i)
+				res = res * 10 + i;
+			return res;
+		},
+		[](uint64_t a, uint64_t b) {
+			uint64_t shift = 1;
+			while (shift <= b)
+				shift *= 10;
+			return a * shift + b;
+		});
+	unit_check(digits == 123456789, "reduce keeps the order");
+	/*
+	 * Scan.
+	 */
+	uint64_t *values = new uint64_t[count];
+	uint64_t *prefix = new uint64_t[count];
+	for (size_t grain : grains) {
+		for (size_t i = 0; i < count; ++i)
+			values[i] = i % 10;
+		parallel_scan(p, values, prefix, count, grain, (uint64_t)0,
+			      [](uint64_t a, uint64_t b) { return a + b; });
+		uint64_t sum = 0;
+		for (size_t i = 0; i < count && ok; ++i) {
+			sum += values[i];
+			ok = prefix[i] == sum;
+		}
+		/* In place. */
+		parallel_scan(p, values, values, count, grain, (uint64_t)0,
+			      [](uint64_t a, uint64_t b) { return a + b; });
+		for (size_t i = 0; i < count && ok; ++i)
+			ok = values[i] == prefix[i];
+	}
+	unit_check(ok, "scan");
+	delete[] values;
+	delete[] prefix;
+	/*
+	 * Sort.
+	 */
+	const size_t sizes[] = {0, 1, 2, 31, 1000, count};
+	uint32_t seed = 1;
+	for (size_t size : sizes) {
+		int *data = new int[size];
+		for (size_t i = 0; i < size; ++i) {
+			seed = seed * 1103515245 + 12345;
+			data[i] = (int)(seed >> 8) % 1000;
+		}
+		parallel_sort(p, data, size);
+		for (size_t i = 1; i < size && ok; ++i)
+			ok = data[i - 1] <= data[i];
+		delete[] data;
+	}
+	unit_check(ok, "sort");
+	/* Sort by the key only, the values show the original order. */
+	std::vector<std::pair<int, int>> pairs(count);
+	for (size_t i = 0; i < count; ++i)
+		pairs[i] = {(int)(count - i) % 100, (int)i};
+	parallel_sort(p, pairs.data(), count,
+		      [](const std::pair<int, int> &a,
+			 const std::pair<int, int> &b) {
+			return a.first < b.first;
+		      });
+	for (size_t i = 1; i < count && ok; ++i) {
+		ok = pairs[i - 1].first < pairs[i].first ||
+		     (pairs[i - 1].first == pairs[i].first &&
+		      pairs[i - 1].second < pairs[i].second);
+	}
+	unit_check(ok, "sort is stable");
+	/* The zeros of both signs are equal, but keep their order. */
+	std::vector<double> doubles(count);
+	std::vector<bool> zero_signs;
+	for (size_t i = 0; i < count; ++i) {
+		if (i % 3 != 0) {
+			doubles[i] = (double)(count - i);
+			continue;
+		}
+		seed = seed * 1103515245 + 12345;
+		doubles[i] = (seed >> 16) % 2 == 0 ? -0.0 : 0.0;
+		zero_signs.push_back(std::signbit(doubles[i]));
+	}
+	parallel_sort(p, doubles.data(), count);
+	for (size_t i = 0; i < zero_signs.size() && ok; ++i) {
+		ok = doubles[i] == 0 &&
+		     std::signbit(doubles[i]) == zero_signs[i];
+	}
+	unit_check(ok, "sort of doubles is stable");
+
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_numa(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.thread_count = 2;
+	opts.cpus = &cpus;
+	unit_check(thread_pool_new_ext(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "empty CPU set is forbidden");
+	int counts[] = {2, -1};
+	opts.node_thread_counts = counts;
+	opts.node_count = 1;
+	unit_check(thread_pool_new_ext(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "CPUs and nodes together are "\
+		   "forbidden");
+	opts.cpus = NULL;
+	opts.node_count = 2;
+	unit_check(thread_pool_new_ext(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative node count is "\
+		   "forbidden");
+	counts[0] = 0;
+	opts.node_count = 1;
+	unit_check(thread_pool_new_ext(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "0 threads is forbidden");
+	/*
+	 * Pinned to the CPUs: each task runs on one of them.
+	 */
+	unit_fail_if(sched_getaffinity(0, sizeof(cpus), &cpus) != 0);
+	opts.thread_count = 4;
+	opts.cpus = &cpus;
+	opts.node_thread_counts = NULL;
+	unit_check(thread_pool_new_ext(&opts, &p) == 0, "pinned to CPUs");
+	const int count = 100;
+	struct thread_task *tasks[count];
+	int bad_cpu_count = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], [&]() {
+			if (!CPU_ISSET(sched_getcpu(), &cpus)) {
+				__atomic_add_fetch(&bad_cpu_count, 1,
+						   __ATOMIC_RELAXED);
+			}
+		}) != 0);
+		unit_fail_if(thread_pool_push_task_to_node(p, tasks[i],
+							   i % 2) != 0);
+	}
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_check(bad_cpu_count == 0, "tasks run on the given CPUs");
+	unit_check(thread_pool_push_task_to_node(p, tasks[0], -2) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative node is forbidden");
+	unit_check(thread_pool_push_task_to_node(p, tasks[0],
+						 TPOOL_MAX_NODES) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too big node is forbidden");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Workers on node 0 take the tasks of the nodes without workers too.
+	 */
+	counts[0] = 3;
+	opts.cpus = NULL;
+	opts.node_thread_counts = counts;
+	opts.node_count = 1;
+	unit_check(thread_pool_new_ext(&opts, &p) == 0, "placed on nodes");
+	unit_check(thread_pool_thread_count(p) == 3, "thread count of nodes");
+	int arg = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+					     task_make_inc(&arg)) != 0);
+		unit_fail_if(thread_pool_push_task_to_node(
+			p, tasks[i], i % TPOOL_MAX_NODES) != 0);
+	}
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(arg == count, "all the node tasks are done");
+	unit_fail_if(thread_pool_delete(p) != 0);
+	unit_check(thread_pool_numa_node_count() >= 1, "node count");
+
+	unit_test_finish();
+}
+
+static void
+test_dependencies(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	/*
+	 * Diamond: a -> b, c -> d. Pushed in the reverse order.
+	 */
+	int a_done = 0, b_done = 0, c_done = 0, d_done = 0;
+	bool ok = true;
+	struct thread_task *a, *b, *c, *d;
+	unit_fail_if(thread_task_new(&a, [&]() {
+		__atomic_store_n(&a_done, 1, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_fail_if(thread_task_new(&b, [&]() {
+		ok = ok && __atomic_load_n(&a_done, __ATOMIC_RELAXED) == 1;
+		__atomic_store_n(&b_done, 1, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_fail_if(thread_task_new(&c, [&]() {
+		ok = ok && __atomic_load_n(&a_done, __ATOMIC_RELAXED) == 1;
+		__atomic_store_n(&c_done, 1, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_fail_if(thread_task_new(&d, [&]() {
+		ok = ok && __atomic_load_n(&b_done, __ATOMIC_RELAXED) == 1 &&
+		     __atomic_load_n(&c_done, __ATOMIC_RELAXED) == 1;
+		__atomic_store_n(&d_done, 1, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_check(thread_task_add_dependency(a, a) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "can't depend on itself");
+	unit_fail_if(thread_task_add_dependency(b, a) != 0);
+	unit_fail_if(thread_task_add_dependency(c, a) != 0);
+	unit_fail_if(thread_task_add_dependency(d, b) != 0);
+	unit_fail_if(thread_task_add_dependency(d, c) != 0);
+	unit_fail_if(thread_pool_push_task(p, d) != 0);
+	unit_fail_if(thread_pool_push_task(p, c) != 0);
+	unit_fail_if(thread_pool_push_task(p, b) != 0);
+	unit_check(thread_task_add_dependency(a, d) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't add to a pushed task");
+	usleep(1000);
+	unit_check(!thread_task_is_running(d) && d_done == 0,
+		   "dependent task waits");
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "waiting tasks are in the pool");
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_fail_if(thread_task_join(d) != 0);
+	unit_check(ok && d_done == 1, "diamond is done in order");
+	unit_fail_if(thread_task_join(a) != 0);
+	unit_fail_if(thread_task_join(b) != 0);
+	unit_fail_if(thread_task_join(c) != 0);
+	/*
+	 * The dependencies are dropped after the run.
+	 */
+	d_done = 0;
+	unit_fail_if(thread_pool_push_task(p, d) != 0);
+	unit_fail_if(thread_task_join(d) != 0);
+	unit_check(d_done == 1, "reused task has no dependencies");
+	/*
+	 * A deleted prerequisite releases the dependent.
+	 */
+	struct thread_task *t;
+	int arg = 0;
+	unit_fail_if(thread_task_new(&t, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_add_dependency(d, t) != 0);
+	unit_fail_if(thread_pool_push_task(p, d) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_join(d) != 0);
+	unit_check(arg == 0, "released by a deleted prerequisite");
+	/*
+	 * A dependent is not deleted before its prerequisite, or the
+	 * prerequisite releases the reused memory.
+	 */
+	unit_fail_if(thread_task_new(&t, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_add_dependency(d, t) != 0);
+	unit_check(thread_task_delete(d) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't delete a task with a prerequisite");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 1, "prerequisite is done");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_delete(a) != 0);
+	unit_fail_if(thread_task_delete(b) != 0);
+	unit_fail_if(thread_task_delete(c) != 0);
+	unit_fail_if(thread_task_delete(d) != 0);
+	/*
+	 * A long chain of detached tasks pushed at once.
+	 */
+	const int count = 1000;
+	struct thread_task **tasks = new thread_task*[count];
+	int last = -1;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], [&last, &ok, i]() {
+			ok = ok && last == i - 1;
+			last = i;
+		}) != 0);
+		if (i > 0) {
+			unit_fail_if(thread_task_add_dependency(
+				tasks[i], tasks[i - 1]) != 0);
+		}
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	for (int i = 0; i < count - 1; ++i)
+		unit_fail_if(thread_task_detach(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(tasks[count - 1]) != 0);
+	unit_check(ok && last == count - 1, "chain is done in order");
+	unit_fail_if(thread_task_delete(tasks[count - 1]) != 0);
+	delete[] tasks;
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct fib_ctx {
+	struct thread_pool *pool;
+	int n;
+	uint64_t res;
+};
+
+/** Fibonacci number with a subtask joined by its parent. */
+static void
+task_fib(void *arg)
+{
+	fib_ctx *ctx = (fib_ctx *)arg;
+	if (ctx->n < 2) {
+		ctx->res = ctx->n;
+		return;
+	}
+	fib_ctx left = {ctx->pool, ctx->n - 1, 0};
+	fib_ctx right = {ctx->pool, ctx->n - 2, 0};
+	struct thread_task *t;
+	thread_pool_task_new(ctx->pool, &t, task_fib, &left);
+	unit_fail_if(thread_pool_push_task(ctx->pool, t) != 0);
+	task_fib(&right);
+	unit_fail_if(thread_task_join(t) != 0);
+	thread_task_delete(t);
+	ctx->res = left.res + right.res;
+}
+
+static void
+test_helping_join(void)
+{
+	unit_test_start();
+
+	/*
+	 * The only worker joins its subtasks, and runs them itself.
+	 */
+	const int thread_counts[] = {1, 4};
+	for (int threads : thread_counts) {
+		struct thread_pool *p;
+		unit_fail_if(thread_pool_new(threads, &p) != 0);
+		fib_ctx ctx = {p, 18, 0};
+		struct thread_task *t;
+		unit_fail_if(thread_task_new(&t, task_fib, &ctx) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t) != 0);
+		unit_check(ctx.res == 2584, "fib is computed by joining "\
+			   "subtasks");
+		unit_fail_if(thread_task_delete(t) != 0);
+		unit_fail_if(thread_pool_delete(p) != 0);
+	}
+	/*
+	 * A worker sleeping in a join runs a task pushed meanwhile. The
+	 * joined task waits for it, so only that worker can run it.
+	 */
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	int wait_arg = 0;
+	struct thread_task *busy, *joiner, *helper;
+	unit_fail_if(thread_task_new(&busy,
+				     task_make_wait_for(&wait_arg)) != 0);
+	unit_fail_if(thread_task_new(&joiner, [&busy]() {
+		thread_task_join(busy);
+	}) != 0);
+	unit_fail_if(thread_task_new(&helper, task_make_inc(&wait_arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, busy) != 0);
+	unit_fail_if(thread_pool_push_task(p, joiner) != 0);
+	usleep(10000);
+	unit_fail_if(thread_pool_push_task(p, helper) != 0);
+	unit_fail_if(thread_task_join(joiner) != 0);
+	unit_fail_if(thread_task_join(helper) != 0);
+	unit_check(wait_arg == 1, "a worker sleeping in a join runs a "\
+		   "pushed task");
+	unit_fail_if(thread_task_delete(busy) != 0);
+	unit_fail_if(thread_task_delete(joiner) != 0);
+	unit_fail_if(thread_task_delete(helper) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+/** Number of threads of the process. */
+static int
+test_thread_count(void)
+{
+	DIR *dir = opendir("/proc/self/task");
+	if (dir == NULL)
+		return -1;
+	int count = 0;
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL)
+		count += e->d_name[0] != '.';
+	closedir(dir);
+	return count;
+}
+
+static void
+test_idle_timeout(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.thread_count = 4;
+	opts.idle_timeout = 0.01;
+	int base = test_thread_count();
+	unit_fail_if(thread_pool_new_ext(&opts, &p) != 0);
+	unit_check(test_thread_count() == base, "no threads at start");
+	const int count = 100;
+	struct thread_task *tasks[count];
+	int arg = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+					     task_make_inc(&arg)) != 0);
+	}
+	bool ok = true;
+	for (int round = 0; round < 3 && ok; ++round) {
+		ok = thread_pool_push_tasks(p, tasks, count) == 0;
+		for (int i = 0; i < count && ok; ++i)
+			ok = thread_task_join(tasks[i]) == 0;
+		/* The threads exit with the timeout and are reused. */
+		for (int i = 0; i < 100 && test_thread_count() != base; ++i)
+			usleep(10000);
+		ok = ok && test_thread_count() == base;
+	}
+	unit_check(ok && arg == 3 * count, "threads exit when idle and "\
+		   "start again");
+	/*
+	 * Bursts racing with the timeout.
+	 */
+	unit_fail_if(thread_pool_delete(p) != 0);
+	opts.idle_timeout = 0.0001;
+	unit_fail_if(thread_pool_new_ext(&opts, &p) != 0);
+	arg = 0;
+	for (int round = 0; round < 100 && ok; ++round) {
+		ok = thread_pool_push_tasks(p, tasks, 10) == 0;
+		for (int i = 0; i < 10 && ok; ++i)
+			ok = thread_task_join(tasks[i]) == 0;
+		usleep(round % 3 * 100);
+	}
+	unit_check(ok && arg == 1000, "bursts are done");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	unit_check(test_thread_count() == base, "all threads are joined");
+
+	unit_test_finish();
+}
+
+static void
+test_priorities(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct thread_task *t;
+	int wait_arg = 0;
+	unit_fail_if(thread_task_new(&t, task_make_wait_for(&wait_arg)) != 0);
+	unit_check(thread_task_set_priority(t, (thread_task_priority)3) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad priority");
+	unit_check(thread_task_set_deadline(t, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative deadline");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_set_priority(t, TPOOL_PRIORITY_HIGH) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't change a pushed task");
+	/*
+	 * The only worker is blocked, then runs all in the priority order.
+	 */
+	const int count = 10;
+	struct thread_task *tasks[3 * count];
+	int order[3 * count];
+	int next = 0;
+	for (int i = 0; i < 3 * count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], [&order, &next, i]() {
+			order[next++] = i;
+		}) != 0);
+	}
+	/* Low first, normal, then high. */
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_set_priority(tasks[i],
+			TPOOL_PRIORITY_LOW) != 0);
+		unit_fail_if(thread_task_set_priority(tasks[2 * count + i],
+			TPOOL_PRIORITY_HIGH) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3 * count) != 0);
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3 * count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	bool ok = next == 3 * count;
+	/* The normal ones can go in any order. */
+	for (int i = 0; i < 3 * count && ok; ++i)
+		ok = order[i] / count == 2 - i / count;
+	unit_check(ok, "high, normal, low order");
+	/*
+	 * An overdue low task goes before the normal ones.
+	 */
+	wait_arg = 0;
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	next = 0;
+	for (int i = 0; i < 3 * count; ++i) {
+		unit_fail_if(thread_task_set_priority(tasks[i],
+			TPOOL_PRIORITY_NORMAL) != 0);
+	}
+	unit_fail_if(thread_task_set_priority(tasks[0],
+					      TPOOL_PRIORITY_LOW) != 0);
+	unit_fail_if(thread_task_set_deadline(tasks[0], 0.001) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3 * count) != 0);
+	usleep(2000);
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3 * count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(next == 3 * count && order[0] == 0, "overdue low task "\
+		   "goes first");
+	/*
+	 * An overdue low task behind a low one with a later deadline.
+	 */
+	wait_arg = 0;
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	next = 0;
+	unit_fail_if(thread_task_set_priority(tasks[1],
+					      TPOOL_PRIORITY_LOW) != 0);
+	unit_fail_if(thread_task_set_deadline(tasks[0], 100) != 0);
+	unit_fail_if(thread_task_set_deadline(tasks[1], 0.001) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3 * count) != 0);
+	usleep(2000);
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3 * count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(next == 3 * count && order[0] == 1 &&
+		   order[3 * count - 1] == 0, "overdue low task goes before "\
+		   "the low ones with later deadlines");
+	/*
+	 * A flood of high tasks lets a normal one run after a burst. The
+	 * worker must be blocked before the push, or it takes the blocker
+	 * after the first burst.
+	 */
+	unit_fail_if(thread_task_delete(t) != 0);
+	wait_arg = 0;
+	int is_started = 0;
+	unit_fail_if(thread_task_new(&t, [&wait_arg, &is_started]() {
+		__atomic_store_n(&is_started, 1, __ATOMIC_RELAXED);
+		while (__atomic_load_n(&wait_arg, __ATOMIC_RELAXED) == 0)
+			usleep(100);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	while (__atomic_load_n(&is_started, __ATOMIC_RELAXED) == 0)
+		usleep(100);
+	next = 0;
+	for (int i = 0; i < 3 * count; ++i) {
+		unit_fail_if(thread_task_set_priority(tasks[i],
+			TPOOL_PRIORITY_HIGH) != 0);
+	}
+	unit_fail_if(thread_task_set_priority(tasks[0],
+					      TPOOL_PRIORITY_NORMAL) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, 3 * count) != 0);
+	__atomic_store_n(&wait_arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 3 * count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	static_assert(TPOOL_HIGH_PRIORITY_BURST < 3 * count - 1,
+		      "the flood is longer than a burst");
+	unit_check(next == 3 * count &&
+		   order[TPOOL_HIGH_PRIORITY_BURST] == 0, "normal task runs "\
+		   "after a burst of high ones");
+	for (int i = 0; i < 3 * count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_stats stats;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+#if TPOOL_STATS
+	unit_check(thread_pool_stats(p, &stats) == 0 &&
+		   stats.thread_count == 0 && stats.finished_count == 0 &&
+		   stats.run_time.count == 0, "no stats of a new pool");
+	const int count = 100;
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], []() {
+			usleep(100);
+		}) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	unit_check(stats.finished_count == count && stats.task_count == 0 &&
+		   stats.task_count_max == count && stats.queue_size == 0,
+		   "task counts");
+	unit_check(stats.thread_count == 2, "thread count");
+	unit_check(stats.wait_time.count == count &&
+		   stats.run_time.count == count, "all the tasks are timed");
+	uint64_t p50 = thread_pool_histogram_percentile(&stats.run_time, 50);
+	uint64_t p99 = thread_pool_histogram_percentile(&stats.run_time, 99);
+	unit_check(p50 >= 100000 && p50 <= p99 &&
+		   p99 <= stats.run_time.max, "run time percentiles");
+	unit_check(stats.park_count >= stats.unpark_count, "park counts");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	/*
+	 * A suspended task is finished once, but started twice.
+	 */
+	struct thread_task *t;
+	int call_count = 0;
+	unit_fail_if(thread_task_new(&t, [&t, &call_count]() {
+		if (++call_count == 1)
+			thread_task_suspend(t);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	while (thread_task_resume(t) != 0)
+		usleep(100);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	unit_check(call_count == 2 && stats.finished_count == count + 1 &&
+		   stats.run_time.count == count + 1 &&
+		   stats.wait_time.count == count + 2 &&
+		   stats.queue_size == 0, "suspended task counts");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	/*
+	 * Periodic dump is stopped with the pool.
+	 */
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.thread_count = 2;
+	opts.stats_interval = 0.05;
+	unit_fail_if(thread_pool_new_ext(&opts, &p) != 0);
+	usleep(120000);
+	unit_check(thread_pool_delete(p) == 0, "delete with a dump");
+#else
+	unit_check(thread_pool_stats(p, &stats) == TPOOL_ERR_NOT_IMPLEMENTED,
+		   "no stats");
+	unit_fail_if(thread_pool_delete(p) != 0);
+#endif
+
+	unit_test_finish();
+}
+
+struct suspend_ctx {
+	struct thread_task *task;
+	int call_count;
+};
+
+static void
+task_suspend_once(void *arg)
+{
+	struct suspend_ctx *ctx = (struct suspend_ctx *)arg;
+	if (__atomic_add_fetch(&ctx->call_count, 1, __ATOMIC_RELEASE) == 1)
+		thread_task_suspend(ctx->task);
+}
+
+static thread_coro
+coro_wait_twice(struct thread_coro_event *first,
+		struct thread_coro_event *second, int *counter)
+{
+	co_await *first;
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	co_await *second;
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void
+test_coroutines(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct suspend_ctx ctx = {NULL, 0};
+	unit_fail_if(thread_task_new(&ctx.task, task_suspend_once, &ctx) != 0);
+	unit_check(thread_task_suspend(ctx.task) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "a not running task can't be suspended");
+	unit_check(thread_task_resume(ctx.task) == TPOOL_ERR_TASK_NOT_SUSPENDED,
+		   "a not suspended task can't be resumed");
+	/*
+	 * A suspended task frees the only worker.
+	 */
+	unit_fail_if(thread_pool_push_task(p, ctx.task) != 0);
+	while (__atomic_load_n(&ctx.call_count, __ATOMIC_ACQUIRE) != 1)
+		usleep(100);
+	int arg = 0;
+	struct thread_task *task;
+	unit_fail_if(thread_task_new(&task, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task) != 0);
+	unit_check(arg == 1, "another task is run meanwhile");
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_check(!thread_task_is_finished(ctx.task) &&
+		   !thread_task_is_running(ctx.task), "the task is parked");
+	unit_check(thread_task_delete(ctx.task) == TPOOL_ERR_TASK_IN_POOL &&
+		   thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "a parked task is in the pool");
+	unit_check(thread_task_resume(ctx.task) == 0, "resume");
+	unit_fail_if(thread_task_join(ctx.task) != 0);
+	unit_check(ctx.call_count == 2, "the function is called again");
+	unit_fail_if(thread_task_delete(ctx.task) != 0);
+	/*
+	 * Many coroutines wait on one worker, and are woken by a task.
+	 */
+	const int count = 100;
+	struct thread_task *tasks[count];
+	struct thread_coro_event first;
+	struct thread_coro_event second;
+	int counter = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new_coro(&tasks[i], coro_wait_twice(
+			&first, &second, &counter)) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	unit_fail_if(thread_task_new(&task, [&first]() {
+		first.set();
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task) != 0);
+	unit_fail_if(thread_task_delete(task) != 0);
+	while (__atomic_load_n(&counter, __ATOMIC_RELAXED) != count)
+		usleep(100);
+	usleep(1000);
+	unit_check(__atomic_load_n(&counter, __ATOMIC_RELAXED) == count,
+		   "all the coroutines are at the second event");
+	second.set();
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_check(counter == 2 * count, "all the coroutines are finished");
+	/*
+	 * A set event doesn't suspend. A finished coroutine task does
+	 * nothing when pushed again.
+	 */
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[0]) != 0);
+	unit_fail_if(thread_task_delete(tasks[0]) != 0);
+	unit_fail_if(thread_task_new_coro(&tasks[0], coro_wait_twice(
+		&first, &second, &counter)) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[0]) != 0);
+	unit_check(counter == 2 * count + 2, "set events are not waited");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	/*
+	 * A never finished coroutine is destroyed with its task.
+	 */
+	first.reset();
+	unit_fail_if(thread_task_new_coro(&tasks[0], coro_wait_twice(
+		&first, &second, &counter)) != 0);
+	unit_check(thread_task_delete(tasks[0]) == 0, "delete a not started "
+		   "coroutine");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_thread_pool_delete(void)
 {
@@ -277,6 +1264,42 @@ test_timed_join(void)
 #endif
 }
 
+static void
+test_group_stress(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	const int count = 8;
+	struct thread_task *tasks[count];
+	int arg = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+					     task_make_inc(&arg)) != 0);
+	}
+	/*
+	 * The group is deleted right after the join, while the last finisher
+	 * may be waking the joiner up. Needs a sanitizer to see the misuse.
+	 */
+	const int rounds = 20000;
+	for (int r = 0; r < rounds; ++r) {
+		struct thread_task_group *g;
+		unit_fail_if(thread_task_group_new(&g) != 0);
+		for (int i = 0; i < count; ++i)
+			unit_fail_if(thread_task_set_group(tasks[i], g) != 0);
+		unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+		unit_fail_if(thread_task_group_join(g) != 0);
+		unit_fail_if(thread_task_group_delete(g) != 0);
+	}
+	unit_check(arg == rounds * count, "groups joined and deleted");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_check(thread_pool_delete(p) == 0, "no tasks in the pool");
+
+	unit_test_finish();
+}
+
 static void
 test_detach_stress(void)
 {
@@ -359,9 +1382,20 @@ main(int argc, char **argv)
 
 	test_new();
 	test_push();
+	test_task_kinds();
+	test_push_tasks();
+	test_parallel();
+	test_numa();
+	test_dependencies();
+	test_helping_join();
+	test_idle_timeout();
+	test_priorities();
+	test_stats();
+	test_coroutines();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
 	test_timed_join();
+	test_group_stress();
 	test_detach_stress();
 	test_detach_long();
 
@@ -0,0 +1,79 @@
+#include "thread_coro.h"
+
+/** The callable of a coroutine task. Owns the coroutine. */
+struct thread_coro_runner {
+	thread_coro::handle_t handle;
+
+	explicit thread_coro_runner(thread_coro::handle_t h) : handle(h)
+	{
+	}
+
+	thread_coro_runner(thread_coro_runner &&other) : handle(other.handle)
+	{
+		other.handle = NULL;
+	}
+
+	~thread_coro_runner()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+	void
+	operator()()
+	{
+		if (!handle.done())
+			handle.resume();
+	}
+};
+
+int
+thread_task_new_coro(struct thread_task **task, thread_coro &&coro)
+{
+	thread_coro::handle_t h = coro.handle;
+	coro.handle = NULL;
+	thread_task_new(task, thread_coro_runner(h));
+	h.promise().task = *task;
+	return 0;
+}
+
+bool
+thread_coro_event::awaiter::await_suspend(thread_coro::handle_t h)
+{
+	task = h.promise().task;
+	pthread_mutex_lock(&event->mutex);
+	if (event->flag) {
+		pthread_mutex_unlock(&event->mutex);
+		return false;
+	}
+	/* Before anybody can resume it. */
+	thread_task_suspend(task);
+	next = event->waiters;
+	event->waiters = this;
+	pthread_mutex_unlock(&event->mutex);
+	return true;
+}
+
+void
+thread_coro_event::set()
+{
+	pthread_mutex_lock(&mutex);
+	__atomic_store_n(&flag, true, __ATOMIC_RELEASE);
+	awaiter *a = waiters;
+	waiters = NULL;
+	pthread_mutex_unlock(&mutex);
+	while (a != NULL) {
+		/* The waiter is gone when its coroutine continues. */
+		awaiter *next = a->next;
+		thread_task_resume(a->task);
+		a = next;
+	}
+}
+
+void
+thread_coro_event::reset()
+{
+	pthread_mutex_lock(&mutex);
+	__atomic_store_n(&flag, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <coroutine>
+#include <pthread.h>
+#include <stdlib.h>
+
+/**
+ * Coroutine tasks. A function returning thread_coro is a C++20 coroutine,
+ * run by a pool task made with thread_task_new_coro(). When the coroutine
+ * waits in co_await, its task is suspended: the worker is free to run the
+ * other tasks, and the coroutine is continued by any worker when it is
+ * woken up. So thousands of tasks waiting for I/O or for each other need a
+ * few threads, not a thread each.
+ *
+ * The coroutines are stackless, so they move between the threads safely.
+ * Only the awaitables below suspend the task, any other co_await finishes
+ * it without finishing the coroutine.
+ */
+
+struct thread_coro {
+	struct promise_type {
+		/** The task running the coroutine. */
+		struct thread_task *task = NULL;
+
+		thread_coro
+		get_return_object()
+		{
+			return thread_coro(std::coroutine_handle<
+				promise_type>::from_promise(*this));
+		}
+
+		/** Started by the task. */
+		std::suspend_always
+		initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		/** Destroyed by the task. */
+		std::suspend_always
+		final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void
+		return_void()
+		{
+		}
+
+		void
+		unhandled_exception()
+		{
+			abort();
+		}
+	};
+
+	using handle_t = std::coroutine_handle<promise_type>;
+
+	explicit thread_coro(handle_t h) : handle(h)
+	{
+	}
+
+	thread_coro(thread_coro &&other) : handle(other.handle)
+	{
+		other.handle = NULL;
+	}
+
+	thread_coro(const thread_coro &) = delete;
+	thread_coro &operator=(const thread_coro &) = delete;
+
+	~thread_coro()
+	{
+		if (handle)
+			handle.destroy();
+	}
+
+	handle_t handle;
+};
+
+/**
+ * Create a new task running @a coro. The task owns the coroutine and is
+ * finished when the coroutine returns. Pushed again, it does nothing.
+ * @param[out] task Pointer to store result task object.
+ * @param coro Coroutine to run.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_new_coro(struct thread_task **task, thread_coro &&coro);
+
+/**
+ * An event a coroutine task can wait for without taking a worker. It is
+ * set by any thread, for example by an I/O loop or by another task, and
+ * then all its waiters are resumed. It stays set until reset, so the
+ * coroutines coming later don't wait.
+ */
+struct thread_coro_event {
+	struct awaiter {
+		struct thread_coro_event *event;
+		struct thread_task *task;
+		/** Next waiter of the event. */
+		struct awaiter *next;
+
+		bool
+		await_ready() const
+		{
+			return event->is_set();
+		}
+
+		bool
+		await_suspend(thread_coro::handle_t h);
+
+		void
+		await_resume() const
+		{
+		}
+	};
+
+	thread_coro_event()
+	{
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	~thread_coro_event()
+	{
+		pthread_mutex_destroy(&mutex);
+	}
+
+	thread_coro_event(const thread_coro_event &) = delete;
+	thread_coro_event &operator=(const thread_coro_event &) = delete;
+
+	/** Set the event and resume all its waiters. */
+	void
+	set();
+
+	/** Make the next waiters wait until the event is set again. */
+	void
+	reset();
+
+	bool
+	is_set() const
+	{
+		return __atomic_load_n(&flag, __ATOMIC_ACQUIRE);
+	}
+
+	awaiter
+	operator co_await()
+	{
+		return awaiter{this, NULL, NULL};
+	}
+
+	pthread_mutex_t mutex;
+	bool flag = false;
+	/** Suspended tasks waiting for the event. */
+	struct awaiter *waiters = NULL;
+};
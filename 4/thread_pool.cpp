@@ -1,76 +1,2008 @@
 #include "thread_pool.h"
 
+#include "rlist.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+enum thread_task_state {
+	/** Created or joined, can be pushed. */
+	TASK_STATE_NEW,
+	/** In a queue of a pool. */
+	TASK_STATE_QUEUED,
+	TASK_STATE_RUNNING,
+	/** Finished, but not joined yet. */
+	TASK_STATE_FINISHED,
+	TASK_STATE_MASK = 0x3,
+	/** Somebody sleeps on the state futex waiting for the finish. */
+	TASK_FLAG_WAITERS = 0x4,
+	/** Delete the task when it is finished. */
+	TASK_FLAG_DETACHED = 0x8,
+};
+
+enum {
+	/** Bounds of the adaptive spinning in join before sleeping. */
+	JOIN_SPIN_MIN = 16,
+	JOIN_SPIN_MAX = 4096,
+};
+
+enum thread_task_suspend_state {
+	TASK_SUSPEND_NONE,
+	/** Suspended by the function, which is still running. */
+	TASK_SUSPEND_REQUESTED,
+	/** The function returned, the task waits for a resume. */
+	TASK_SUSPEND_PARKED,
+	/** Resumed before the function returned. */
+	TASK_SUSPEND_WOKEN,
+};
 
 struct thread_task {
-	thread_task_f function;
+	/** The callable object run by the task. */
+	alignas(max_align_t) char storage[TPOOL_TASK_INLINE_SIZE];
+	void (*invoke)(void *storage);
+	/** Destructor of the callable, NULL if it is trivial. */
+	void (*destroy)(void *storage);
+	/**
+	 * One of thread_task_state and the flags. Used as a futex to wait for
+	 * the task finish.
+	 */
+	uint32_t state;
+	/** One of thread_task_suspend_state. */
+	uint32_t suspend;
+	/** Group joining the task, or NULL. */
+	thread_task_group *group;
+	/**
+	 * Next task in the injection queue of the pool, or in the cache of
+	 * the deleted tasks.
+	 */
+	thread_task *next;
+	/** Pool and NUMA node the task is pushed to. */
+	thread_pool *pool;
+	/** Pool the task is cached by when deleted, or NULL. */
+	thread_pool *owner;
+	int node;
+	/** One of thread_task_priority. */
+	int priority;
+	/** Start deadline of a low priority task, relative to the push. */
+	uint64_t deadline_ns;
+	/** Absolute start deadline of a queued low priority task. */
+	uint64_t deadline;
+#if TPOOL_STATS
+	/**
+	 * When the task was pushed, made ready by its prerequisites, or
+	 * resumed.
+	 */
+	uint64_t push_ns;
+	/** Run time of the previous slices of a suspended task. */
+	uint64_t run_ns;
+#endif
+	/**
+	 * Number of not finished prerequisites, plus 1 while the task is not
+	 * pushed. The task is put into the pool when it becomes 0.
+	 */
+	uint32_t pending;
+	/** Tasks depending on this one. Kept when the task is cached. */
+	thread_task **dependents;
+	int dependent_count;
+	int dependent_capacity;
 
-	/* PUT HERE OTHER MEMBERS */
+	~thread_task()
+	{
+		delete[] dependents;
+	}
 };
 
-struct thread_pool {
-	std::vector<pthread_t> threads;
+enum {
+	/** Max number of deleted tasks kept by a worker or a pool for reuse. */
+	TASK_CACHE_SIZE = 4096,
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/** Deleted tasks to reuse them without allocations. */
+struct task_cache {
+	thread_task *head;
+	int size;
 };
 
+enum {
+	/** Somebody sleeps on the group futex waiting for zero count. */
+	GROUP_FLAG_WAITERS = 0x80000000u,
+};
+
+struct thread_task_group {
+	/**
+	 * Number of pushed and not finished tasks of the group, and the
+	 * waiters flag. Used as a futex to wait for zero.
+	 */
+	uint32_t count;
+};
+
+/** Plain callback with its argument stored inside a task. */
+struct thread_task_cb {
+	thread_task_cb_f cb;
+	void *arg;
+};
+
+enum {
+	/** Initial capacity of a worker deque. Always a power of 2. */
+	DEQUE_INITIAL_SIZE = 256,
+	/** Max number of tasks a worker moves from the injection queue. */
+	INJECTION_BATCH = 32,
+	CACHE_LINE_SIZE = 64,
+};
+
+/**
+ * Ring buffer of a worker deque. When the deque grows the old buffer can
+ * still be read by thieves, so it is kept until the pool is deleted.
+ */
+struct deque_array {
+	int64_t size;
+	thread_task **items;
+	/** The buffer replaced by this one. */
+	deque_array *prev;
+};
+
+/**
+ * A queue of tasks protected by a mutex. The workers take the tasks in
+ * batches into their deques.
+ */
+struct task_queue {
+	alignas(CACHE_LINE_SIZE) pthread_mutex_t mutex;
+	thread_task *head;
+	thread_task *tail;
+	/** Number of tasks in the queue. */
+	int size;
+	/**
+	 * Start deadline of the first task, for the low priority queue. It
+	 * is sorted by the deadlines, so that is the earliest one.
+	 */
+	uint64_t head_deadline;
+};
+
+/** Placement of a worker, chosen when the pool is created. */
+struct worker_slot {
+	/** NUMA node of the worker, -1 if unknown. */
+	int node;
+	bool is_pinned;
+	/** CPUs the worker is allowed to run on if it is pinned. */
+	cpu_set_t cpus;
+	bool is_started;
+};
+
+#if TPOOL_STATS
+
+/**
+ * Statistics of a worker. Written only by the worker itself, so there are
+ * no atomic read-modify-writes, and read by thread_pool_stats().
+ */
+struct worker_stats {
+	uint64_t started_count;
+	uint64_t finished_count;
+	uint64_t steal_count;
+	uint64_t park_count;
+	uint64_t unpark_count;
+	thread_pool_histogram wait_time;
+	thread_pool_histogram run_time;
+};
+
+#endif
+
+/**
+ * A worker thread with its own Chase-Lev deque. The owner pushes and takes
+ * the tasks at the bottom without locks, other workers steal from the top.
+ */
+struct thread_worker {
+	alignas(CACHE_LINE_SIZE) int64_t top;
+	alignas(CACHE_LINE_SIZE) int64_t bottom;
+	deque_array *array;
+	struct thread_pool *pool;
+	pthread_t thread;
+	/** Placement of the worker. */
+	worker_slot *slot;
+	/** NUMA node of the worker, -1 if unknown. */
+	int node;
+	/**
+	 * The thread has exited after the idle timeout. The worker object
+	 * stays, so the thieves can still look into its empty deque, and it
+	 * is reused by the next spawned thread. Protected by the spawn mutex.
+	 */
+	bool is_retired;
+	/** State of the random generator choosing the steal victims. */
+	uint32_t rand_state;
+	/** Number of high priority tasks taken in a row. */
+	int high_run;
+	/**
+	 * How long a join by the worker spins before sleeping. Grows when
+	 * the spinning helps, and shrinks when it doesn't.
+	 */
+	int join_spin;
+	/** Deleted tasks of the pool, put and taken by this worker only. */
+	task_cache tasks;
+	/** Futex the worker sleeps on. Set to 1 to wake it up. */
+	uint32_t wakeup;
+	/**
+	 * Task the worker sleeps joining, or NULL. Its finisher wakes the
+	 * worker up. Protected by the idle mutex.
+	 */
+	thread_task *join_task;
+	/** A link in the list of the sleeping workers. */
+	rlist in_idle;
+#if TPOOL_STATS
+	worker_stats stats;
+#endif
+};
+
+struct thread_pool {
+	/** Max number of the workers. */
+	int thread_count;
+	/** Number of created worker objects. Only grows. */
+	int worker_count;
+	/** Number of running worker threads, not retired. */
+	int running_count;
+	/**
+	 * Idle workers exit after that long without tasks, 0 means they
+	 * never do.
+	 */
+	uint64_t idle_timeout_ns;
+	thread_worker *workers[TPOOL_MAX_THREADS];
+	/** Where to start each worker. */
+	worker_slot slots[TPOOL_MAX_THREADS];
+	/** Protects starting of the workers. */
+	pthread_mutex_t spawn_mutex;
+	/** Identifies the workers of this pool. */
+	pthread_key_t worker_key;
+	/** Queue of the tasks pushed from outside of the workers. */
+	task_queue injection;
+	/**
+	 * Queues of the high and low priority tasks. They are never moved to
+	 * the worker deques, so the workers check them before each task.
+	 */
+	task_queue high_queue;
+	task_queue low_queue;
+	/** Queues of the tasks pushed with a NUMA node hint. */
+	task_queue node_queues[TPOOL_MAX_NODES];
+	/** Number of pushed and not finished tasks. */
+	alignas(CACHE_LINE_SIZE) int task_count;
+	/**
+	 * Deleted tasks put by the threads other than the workers, or not
+	 * fitting into the worker caches.
+	 */
+	alignas(CACHE_LINE_SIZE) pthread_mutex_t cache_mutex;
+	task_cache tasks;
+	/** Number of not deleted tasks created with the pool cache. */
+	int owned_count;
+#if TPOOL_STATS
+	/** Max task count ever. */
+	int task_count_max;
+	/** Number of ever pushed tasks. */
+	uint64_t pushed_count;
+	/** Interval of the statistics dump, 0 if there is no dump. */
+	uint64_t stats_interval_ns;
+	/** Thread printing the statistics, woken up to stop by the cond. */
+	pthread_t stats_thread;
+	pthread_mutex_t stats_mutex;
+	pthread_cond_t stats_cond;
+#endif
+	/**
+	 * Workers going to sleep or sleeping, the most recent first. Also the
+	 * ones sleeping in a join, they run the pushed tasks too. A waker
+	 * removes a worker from the list, so each wakeup goes to a different
+	 * worker.
+	 */
+	alignas(CACHE_LINE_SIZE) pthread_mutex_t idle_mutex;
+	rlist idle;
+	/** Number of workers in the idle list. */
+	int idle_count;
+	bool is_stopping;
+};
+
+static void
+futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static void
+futex_wait(uint32_t *addr, uint32_t old)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
+}
+
+/**
+ * Wait until an absolute CLOCK_MONOTONIC @a deadline, so the spurious
+ * wakeups don't need to recalculate the timeout.
+ * @retval -1 and ETIMEDOUT Deadline is reached.
+ */
+static int
+futex_wait_until(uint32_t *addr, uint32_t old, const struct timespec *deadline)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, old,
+		       deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static uint64_t
+clock_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if TPOOL_STATS
+
+/** Add to a counter written by one thread only and read by others. */
+static inline void
+stat_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the histogram bucket of a value. The values below 2^SUB_BITS have own
+ * buckets, the others are split by the highest bit and the next SUB_BITS.
+ */
+static inline int
+histogram_bucket(uint64_t value)
+{
+	const int sub_bits = TPOOL_HISTOGRAM_SUB_BITS;
+	if (value < (1u << sub_bits))
+		return (int)value;
+	int high_bit = 63 - __builtin_clzll(value);
+	int shift = high_bit - sub_bits;
+	return ((shift + 1) << sub_bits) +
+	       (int)((value >> shift) & ((1u << sub_bits) - 1));
+}
+
+static void
+histogram_add(thread_pool_histogram *hist, uint64_t value)
+{
+	stat_add(&hist->buckets[histogram_bucket(value)], 1);
+	stat_add(&hist->count, 1);
+	stat_add(&hist->sum, value);
+	if (value > hist->max)
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+static void
+histogram_merge(thread_pool_histogram *dst, const thread_pool_histogram *src)
+{
+	for (int i = 0; i < TPOOL_HISTOGRAM_SIZE; ++i)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i],
+						   __ATOMIC_RELAXED);
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+#endif
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static deque_array *
+deque_array_new(int64_t size)
+{
+	deque_array *a = new deque_array();
+	a->size = size;
+	a->items = new thread_task *[size];
+	a->prev = NULL;
+	return a;
+}
+
+/** Push to the bottom. Only the owner can do that. */
+static void
+worker_push(thread_worker *w, thread_task *task)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	deque_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+	if (b - t >= a->size) {
+		deque_array *bigger = deque_array_new(a->size * 2);
+		for (int64_t i = t; i < b; ++i) {
+			bigger->items[i & (bigger->size - 1)] =
+				a->items[i & (a->size - 1)];
+		}
+		bigger->prev = a;
+		__atomic_store_n(&w->array, bigger, __ATOMIC_RELEASE);
+		a = bigger;
+	}
+	__atomic_store_n(&a->items[b & (a->size - 1)], task, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/** Take from the bottom. Only the owner can do that. */
+static thread_task *
+worker_take(thread_worker *w)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	deque_array *a = __atomic_load_n(&w->array, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		/* Empty. */
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	thread_task *task = __atomic_load_n(&a->items[b & (a->size - 1)],
+					    __ATOMIC_RELAXED);
+	if (t == b) {
+		/* The last one, race with the thieves. */
+		if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			task = NULL;
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/** Steal from the top. Can be done by any thread. */
+static thread_task *
+worker_steal(thread_worker *w)
+{
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	deque_array *a = __atomic_load_n(&w->array, __ATOMIC_ACQUIRE);
+	thread_task *task = __atomic_load_n(&a->items[t & (a->size - 1)],
+					    __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return task;
+}
+
+static bool
+worker_has_tasks(const thread_worker *w)
+{
+	return __atomic_load_n(&w->top, __ATOMIC_ACQUIRE) <
+	       __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+}
+
+/** Push a deleted task into a cache, if it is not full. */
+static bool
+task_cache_put(task_cache *c, thread_task *task)
+{
+	if (c->size >= TASK_CACHE_SIZE)
+		return false;
+	task->next = c->head;
+	c->head = task;
+	__atomic_store_n(&c->size, c->size + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/** Pop a task from a cache, NULL if it is empty. */
+static thread_task *
+task_cache_take(task_cache *c)
+{
+	thread_task *task = c->head;
+	if (task == NULL)
+		return NULL;
+	c->head = task->next;
+	__atomic_store_n(&c->size, c->size - 1, __ATOMIC_RELAXED);
+	return task;
+}
+
+static void
+task_cache_destroy(task_cache *c)
+{
+	thread_task *task;
+	while ((task = task_cache_take(c)) != NULL)
+		delete task;
+}
+
+static void
+task_queue_create(task_queue *q)
+{
+	pthread_mutex_init(&q->mutex, NULL);
+	q->head = NULL;
+	q->tail = NULL;
+	q->size = 0;
+	q->head_deadline = UINT64_MAX;
+}
+
+static void
+task_queue_destroy(task_queue *q)
+{
+	pthread_mutex_destroy(&q->mutex);
+}
+
+static bool
+task_queue_is_empty(task_queue *q)
+{
+	return __atomic_load_n(&q->size, __ATOMIC_ACQUIRE) == 0;
+}
+
+/** Append @a count tasks linked via the next pointers. */
+static void
+task_queue_push(task_queue *q, thread_task *first, thread_task *last,
+		int count)
+{
+	pthread_mutex_lock(&q->mutex);
+	if (q->tail != NULL) {
+		q->tail->next = first;
+	} else {
+		q->head = first;
+		__atomic_store_n(&q->head_deadline, first->deadline,
+				 __ATOMIC_RELAXED);
+	}
+	q->tail = last;
+	__atomic_add_fetch(&q->size, count, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * Insert a task keeping the queue sorted by the start deadlines, the equal
+ * ones in the push order. Usually they all have the default deadline, and
+ * the task goes to the tail right away.
+ */
+static void
+task_queue_insert_by_deadline(task_queue *q, thread_task *task)
+{
+	pthread_mutex_lock(&q->mutex);
+	if (q->tail == NULL || q->tail->deadline <= task->deadline) {
+		if (q->tail != NULL)
+			q->tail->next = task;
+		else
+			q->head = task;
+		q->tail = task;
+	} else {
+		/* The tail is later, so the search stops before it. */
+		thread_task **pos = &q->head;
+		while ((*pos)->deadline <= task->deadline)
+			pos = &(*pos)->next;
+		task->next = *pos;
+		*pos = task;
+	}
+	__atomic_store_n(&q->head_deadline, q->head->deadline,
+			 __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->size, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/** The first task of the queue has missed its start deadline. */
+static bool
+task_queue_is_overdue(task_queue *q)
+{
+	return !task_queue_is_empty(q) &&
+	       __atomic_load_n(&q->head_deadline, __ATOMIC_RELAXED) <=
+	       clock_now_ns();
+}
+
+/**
+ * Take a task from a queue. Up to @a max_count - 1 more are moved into the
+ * own deque so the queue lock is taken less often.
+ */
+static thread_task *
+worker_take_from(thread_worker *w, task_queue *q, int max_count)
+{
+	if (task_queue_is_empty(q))
+		return NULL;
+	pthread_mutex_lock(&q->mutex);
+	int size = q->size;
+	if (size == 0) {
+		pthread_mutex_unlock(&q->mutex);
+		return NULL;
+	}
+	/* Leave a share for the other workers. */
+	int count = (size - 1) / __atomic_load_n(&w->pool->running_count,
+						 __ATOMIC_ACQUIRE) + 1;
+	if (count > max_count)
+		count = max_count;
+	thread_task *task = q->head;
+	thread_task *next = task->next;
+	for (int i = 1; i < count; ++i) {
+		worker_push(w, next);
+		next = next->next;
+	}
+	q->head = next;
+	if (next == NULL)
+		q->tail = NULL;
+	__atomic_store_n(&q->head_deadline, next != NULL ? next->deadline :
+			 UINT64_MAX, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->size, size - count, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&q->mutex);
+	return task;
+}
+
+static uint32_t
+worker_rand(thread_worker *w)
+{
+	uint32_t x = w->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	w->rand_state = x;
+	return x;
+}
+
+/**
+ * Steal from the other workers starting from a random one.
+ * @param is_local Steal from the workers of the same node, or only from the
+ *   other nodes.
+ */
+static thread_task *
+worker_steal_any(thread_worker *w, bool is_local)
+{
+	thread_pool *pool = w->pool;
+	int count = __atomic_load_n(&pool->worker_count, __ATOMIC_ACQUIRE);
+	int start = worker_rand(w) % count;
+	for (int i = 0; i < count; ++i) {
+		thread_worker *victim = pool->workers[(start + i) % count];
+		if (victim == w || (victim->node == w->node) != is_local)
+			continue;
+		thread_task *task = worker_steal(victim);
+		if (task != NULL) {
+#if TPOOL_STATS
+			stat_add(&w->stats.steal_count, 1);
+#endif
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Find a task other than the high priority ones. The overdue low priority
+ * tasks go first, then the closest normal priority tasks: own deque, own
+ * node queue, the common queue, other workers of the node, then the other
+ * nodes. The low priority tasks are the last.
+ */
+static thread_task *
+worker_find_other_task(thread_worker *w)
+{
+	thread_pool *pool = w->pool;
+	thread_task *task;
+	if (task_queue_is_overdue(&pool->low_queue)) {
+		task = worker_take_from(w, &pool->low_queue, 1);
+		if (task != NULL)
+			return task;
+	}
+	task = worker_take(w);
+	if (task != NULL)
+		return task;
+	if (w->node >= 0) {
+		task = worker_take_from(w, &pool->node_queues[w->node],
+					INJECTION_BATCH);
+		if (task != NULL)
+			return task;
+	}
+	task = worker_take_from(w, &pool->injection, INJECTION_BATCH);
+	if (task != NULL)
+		return task;
+	task = worker_steal_any(w, true);
+	if (task != NULL)
+		return task;
+	for (int i = 0; i < TPOOL_MAX_NODES; ++i) {
+		if (i == w->node)
+			continue;
+		task = worker_take_from(w, &pool->node_queues[i],
+					INJECTION_BATCH);
+		if (task != NULL)
+			return task;
+	}
+	task = worker_steal_any(w, false);
+	if (task != NULL)
+		return task;
+	return worker_take_from(w, &pool->low_queue, 1);
+}
+
+/**
+ * Find a task. The high priority ones go first, but after a burst of them
+ * the worker takes one of the others, so a flood of the high priority
+ * tasks can't starve the rest.
+ */
+static thread_task *
+worker_find_task(thread_worker *w)
+{
+	thread_task *task;
+	if (w->high_run < TPOOL_HIGH_PRIORITY_BURST) {
+		task = worker_take_from(w, &w->pool->high_queue, 1);
+		if (task != NULL) {
+			++w->high_run;
+			return task;
+		}
+	}
+	/*
+	 * Reset also when there are no other tasks, so a pure high priority
+	 * load scans the other queues once per burst only.
+	 */
+	w->high_run = 0;
+	task = worker_find_other_task(w);
+	if (task != NULL)
+		return task;
+	task = worker_take_from(w, &w->pool->high_queue, 1);
+	if (task != NULL)
+		++w->high_run;
+	return task;
+}
+
+static bool
+pool_has_tasks(thread_pool *pool)
+{
+	if (!task_queue_is_empty(&pool->injection) ||
+	    !task_queue_is_empty(&pool->high_queue) ||
+	    !task_queue_is_empty(&pool->low_queue))
+		return true;
+	for (int i = 0; i < TPOOL_MAX_NODES; ++i) {
+		if (!task_queue_is_empty(&pool->node_queues[i]))
+			return true;
+	}
+	int count = __atomic_load_n(&pool->worker_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		if (worker_has_tasks(pool->workers[i]))
+			return true;
+	}
+	return false;
+}
+
+static void
+thread_pool_enqueue(thread_pool *pool, thread_task *first, thread_task *last,
+		    int count, int node);
+
+/**
+ * Drop the dependencies on a finished or deleted task. The pushed dependents
+ * without more prerequisites are put into their pools.
+ */
+static void
+task_release_dependents(thread_task *task)
+{
+	for (int i = 0; i < task->dependent_count; ++i) {
+		thread_task *dep = task->dependents[i];
+		if (__atomic_sub_fetch(&dep->pending, 1,
+				       __ATOMIC_ACQ_REL) != 0)
+			continue;
+		dep->next = NULL;
+#if TPOOL_STATS
+		dep->push_ns = clock_now_ns();
+#endif
+		thread_pool_enqueue(dep->pool, dep, dep, 1, dep->node);
+	}
+	task->dependent_count = 0;
+}
+
+/**
+ * Call the task function until it returns not suspended, or parks the task.
+ * A parked task is queued, not running, so its next run moves it to the
+ * running state again. The state is changed before the task can be resumed
+ * and run by another worker.
+ * @retval true The task is finished.
+ * @retval false The task is parked until thread_task_resume().
+ */
+static bool
+task_invoke(thread_task *task)
+{
+	while (true) {
+		task->invoke(task->storage);
+		uint32_t suspend = __atomic_load_n(&task->suspend,
+						   __ATOMIC_ACQUIRE);
+		if (suspend == TASK_SUSPEND_NONE)
+			return true;
+		if (suspend == TASK_SUSPEND_REQUESTED) {
+			__atomic_fetch_sub(&task->state,
+					   TASK_STATE_RUNNING -
+					   TASK_STATE_QUEUED,
+					   __ATOMIC_RELAXED);
+			if (__atomic_compare_exchange_n(&task->suspend,
+							&suspend,
+							TASK_SUSPEND_PARKED,
+							false,
+							__ATOMIC_ACQ_REL,
+							__ATOMIC_ACQUIRE))
+				return false;
+			__atomic_fetch_add(&task->state,
+					   TASK_STATE_RUNNING -
+					   TASK_STATE_QUEUED,
+					   __ATOMIC_RELAXED);
+		}
+		/* Resumed meanwhile, no need to queue it again. */
+		__atomic_store_n(&task->suspend, TASK_SUSPEND_NONE,
+				 __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Wake up the workers sleeping in the join of a finished task. The task is
+ * only compared with, its memory can be reused already. Then a worker
+ * joining the new task wakes up spuriously and sleeps again.
+ */
+static void
+thread_pool_wakeup_joiners(thread_pool *pool, thread_task *task)
+{
+	thread_worker *woken[TPOOL_MAX_THREADS];
+	int woken_count = 0;
+	thread_worker *w, *tmp;
+	pthread_mutex_lock(&pool->idle_mutex);
+	rlist_foreach_entry_safe(w, &pool->idle, in_idle, tmp) {
+		if (w->join_task != task)
+			continue;
+		rlist_del_entry(w, in_idle);
+		__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->wakeup, 1, __ATOMIC_RELEASE);
+		woken[woken_count++] = w;
+	}
+	pthread_mutex_unlock(&pool->idle_mutex);
+	for (int i = 0; i < woken_count; ++i)
+		futex_wake(&woken[i]->wakeup, 1);
+}
+
+static void
+task_run(thread_worker *w, thread_task *task)
+{
+	thread_pool *pool = w->pool;
+	/* Detach can only add a flag, it doesn't change the state. */
+	__atomic_fetch_add(&task->state, TASK_STATE_RUNNING - TASK_STATE_QUEUED,
+			   __ATOMIC_RELAXED);
+	/* Not pushed again yet. */
+	__atomic_store_n(&task->pending, 1, __ATOMIC_RELAXED);
+#if TPOOL_STATS
+	uint64_t start_ns = clock_now_ns();
+	stat_add(&w->stats.started_count, 1);
+	histogram_add(&w->stats.wait_time, start_ns - task->push_ns);
+#endif
+	bool is_finished = task_invoke(task);
+#if TPOOL_STATS
+	task->run_ns += clock_now_ns() - start_ns;
+#endif
+	if (!is_finished)
+		return;
+#if TPOOL_STATS
+	/* A suspended task is counted once, with all its slices. */
+	histogram_add(&w->stats.run_time, task->run_ns);
+	stat_add(&w->stats.finished_count, 1);
+#endif
+	/* Before the dependents can finish and the pool can be deleted. */
+	__atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELEASE);
+	if (task->dependent_count != 0)
+		task_release_dependents(task);
+	thread_task_group *group = task->group;
+	/* A grouped task is joined by its group. */
+	uint32_t old = __atomic_exchange_n(&task->state, group != NULL ?
+					   TASK_STATE_NEW : TASK_STATE_FINISHED,
+					   __ATOMIC_ACQ_REL);
+	if ((old & TASK_FLAG_DETACHED) != 0) {
+		/* Not joined by anybody, so nobody can be touching it. */
+		__atomic_store_n(&task->state, TASK_STATE_NEW,
+				 __ATOMIC_RELAXED);
+		thread_task_delete(task);
+	} else if ((old & TASK_FLAG_WAITERS) != 0) {
+		/*
+		 * The joiner can see the new state and delete the task before
+		 * the wakeup. Then it is spurious for whoever uses the memory,
+		 * and they all recheck their futex words anyway.
+		 */
+		futex_wake(&task->state, INT_MAX);
+		thread_pool_wakeup_joiners(pool, task);
+	}
+	if (group != NULL) {
+		/*
+		 * With the waiters the group is joined only when the flag is
+		 * cleared too, so the exchange is the last write to it. The
+		 * wakeup after that is like the one of the task above.
+		 */
+		uint32_t count = __atomic_sub_fetch(&group->count, 1,
+						    __ATOMIC_ACQ_REL);
+		if (count == GROUP_FLAG_WAITERS &&
+		    __atomic_compare_exchange_n(&group->count, &count, 0, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			futex_wake(&group->count, INT_MAX);
+	}
+}
+
+/**
+ * Exit the worker thread if it is still idle after the timeout. Nobody can
+ * wake it up or find the pool full meanwhile, because the spawn mutex is
+ * held. A pusher either takes the worker from the idle list before, or
+ * sees it not running and starts a new thread.
+ * @retval true The worker is retired.
+ */
+static bool
+worker_retire(thread_worker *w)
+{
+	thread_pool *pool = w->pool;
+	bool is_retired = false;
+	pthread_mutex_lock(&pool->spawn_mutex);
+	pthread_mutex_lock(&pool->idle_mutex);
+	if (!rlist_empty(&w->in_idle)) {
+		rlist_del_entry(w, in_idle);
+		/* Before idle count, so it isn't seen idle and running. */
+		__atomic_sub_fetch(&pool->running_count, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+		w->is_retired = true;
+		is_retired = true;
+	}
+	pthread_mutex_unlock(&pool->idle_mutex);
+	pthread_mutex_unlock(&pool->spawn_mutex);
+	return is_retired;
+}
+
+/**
+ * Sleep until woken up, or until the idle timeout.
+ * @retval true Woken up.
+ * @retval false Retired, the thread should exit.
+ */
+static bool
+worker_sleep_or_retire(thread_worker *w)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	uint64_t ns = deadline.tv_nsec + w->pool->idle_timeout_ns;
+	deadline.tv_sec += ns / 1000000000;
+	deadline.tv_nsec = ns % 1000000000;
+	while (__atomic_load_n(&w->wakeup, __ATOMIC_ACQUIRE) == 0) {
+		if (futex_wait_until(&w->wakeup, 0, &deadline) != 0 &&
+		    errno == ETIMEDOUT && worker_retire(w))
+			return false;
+	}
+	return true;
+}
+
+static void *
+worker_f(void *arg)
+{
+	thread_worker *w = (thread_worker *)arg;
+	thread_pool *pool = w->pool;
+	pthread_setspecific(pool->worker_key, w);
+	while (true) {
+		thread_task *task = worker_find_task(w);
+		if (task != NULL) {
+			task_run(w, task);
+			continue;
+		}
+		if (__atomic_load_n(&pool->is_stopping, __ATOMIC_ACQUIRE))
+			break;
+		/*
+		 * Announce the sleep before the last check. A pusher either
+		 * sees the worker idle and wakes it up, or the worker sees the
+		 * new task.
+		 */
+		__atomic_store_n(&w->wakeup, 0, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&pool->idle_mutex);
+		rlist_add_entry(&pool->idle, w, in_idle);
+		__atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->idle_mutex);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (pool_has_tasks(pool) ||
+		    __atomic_load_n(&pool->is_stopping, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock(&pool->idle_mutex);
+			if (!rlist_empty(&w->in_idle)) {
+				rlist_del_entry(w, in_idle);
+				__atomic_sub_fetch(&pool->idle_count, 1,
+						   __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock(&pool->idle_mutex);
+			continue;
+		}
+#if TPOOL_STATS
+		stat_add(&w->stats.park_count, 1);
+#endif
+		if (pool->idle_timeout_ns == 0) {
+			while (__atomic_load_n(&w->wakeup,
+					       __ATOMIC_ACQUIRE) == 0)
+				futex_wait(&w->wakeup, 0);
+		} else if (!worker_sleep_or_retire(w)) {
+			break;
+		}
+#if TPOOL_STATS
+		stat_add(&w->stats.unpark_count, 1);
+#endif
+	}
+	return NULL;
+}
+
+/** Start the thread of a worker, pinned if its slot says so. */
+static void
+worker_start(thread_worker *w)
+{
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	/* Pinned from the start, so the stack is allocated locally. */
+	if (w->slot->is_pinned) {
+		pthread_attr_setaffinity_np(&attr, sizeof(w->slot->cpus),
+					    &w->slot->cpus);
+	}
+	/* The CPUs can be out of the process affinity, run anywhere. */
+	if (pthread_create(&w->thread, &attr, worker_f, w) != 0)
+		pthread_create(&w->thread, NULL, worker_f, w);
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Find a retired worker to restart, preferably from @a node. Must be
+ * called under the spawn mutex.
+ */
+static thread_worker *
+thread_pool_find_retired(thread_pool *pool, int node)
+{
+	thread_worker *res = NULL;
+	for (int i = 0; i < pool->worker_count; ++i) {
+		thread_worker *w = pool->workers[i];
+		if (!w->is_retired)
+			continue;
+		if (res == NULL || w->node == node)
+			res = w;
+		if (w->node == node)
+			break;
+	}
+	return res;
+}
+
+/**
+ * Start one more worker if the limit allows. A retired worker is restarted
+ * first, if any.
+ * @param node Preferred NUMA node of the worker, -1 for any.
+ */
+static void
+thread_pool_spawn(thread_pool *pool, int node)
+{
+	pthread_mutex_lock(&pool->spawn_mutex);
+	if (pool->running_count >= pool->thread_count) {
+		pthread_mutex_unlock(&pool->spawn_mutex);
+		return;
+	}
+	thread_worker *w = thread_pool_find_retired(pool, node);
+	if (w != NULL) {
+		/* The old thread has exited or is about to. */
+		pthread_join(w->thread, NULL);
+		w->is_retired = false;
+		__atomic_store_n(&pool->running_count,
+				 pool->running_count + 1, __ATOMIC_RELEASE);
+		worker_start(w);
+		pthread_mutex_unlock(&pool->spawn_mutex);
+		return;
+	}
+	int count = pool->worker_count;
+	worker_slot *slot = NULL;
+	for (int i = 0; i < pool->thread_count; ++i) {
+		worker_slot *s = &pool->slots[i];
+		if (s->is_started)
+			continue;
+		if (slot == NULL)
+			slot = s;
+		if (s->node == node) {
+			slot = s;
+			break;
+		}
+	}
+	slot->is_started = true;
+	w = new thread_worker();
+	w->pool = pool;
+	w->array = deque_array_new(DEQUE_INITIAL_SIZE);
+	w->slot = slot;
+	w->node = slot->node;
+	w->is_retired = false;
+	w->rand_state = 2463534242u + count * 7919;
+	w->high_run = 0;
+	w->join_spin = JOIN_SPIN_MIN;
+	w->tasks.head = NULL;
+	w->tasks.size = 0;
+	w->wakeup = 0;
+	w->join_task = NULL;
+	rlist_create(&w->in_idle);
+	pool->workers[count] = w;
+	__atomic_store_n(&pool->worker_count, count + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&pool->running_count, pool->running_count + 1,
+			 __ATOMIC_RELEASE);
+	worker_start(w);
+	pthread_mutex_unlock(&pool->spawn_mutex);
+}
+
+/**
+ * Take a sleeping worker out of the idle list, preferably from @a node.
+ * Must be called under the idle mutex, the list must not be empty.
+ */
+static thread_worker *
+thread_pool_take_idle(thread_pool *pool, int node)
+{
+	thread_worker *w;
+	if (node >= 0) {
+		rlist_foreach_entry(w, &pool->idle, in_idle) {
+			if (w->node == node) {
+				rlist_del_entry(w, in_idle);
+				return w;
+			}
+		}
+	}
+	return rlist_shift_entry(&pool->idle, thread_worker, in_idle);
+}
+
+/**
+ * Wake up to @a count sleeping workers, and start new ones if not enough
+ * are sleeping.
+ * @param node Preferred NUMA node of the workers, -1 for any.
+ */
+static void
+thread_pool_wakeup(thread_pool *pool, int count, int node)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->idle_count, __ATOMIC_SEQ_CST) > 0) {
+		thread_worker *woken[TPOOL_MAX_THREADS];
+		int woken_count = 0;
+		pthread_mutex_lock(&pool->idle_mutex);
+		while (woken_count < count && !rlist_empty(&pool->idle)) {
+			thread_worker *w = thread_pool_take_idle(pool, node);
+			__atomic_sub_fetch(&pool->idle_count, 1,
+					   __ATOMIC_RELAXED);
+			/*
+			 * Set under the lock, so the flag can't arrive late
+			 * when the worker is already going to sleep again.
+			 */
+			__atomic_store_n(&w->wakeup, 1, __ATOMIC_RELEASE);
+			woken[woken_count++] = w;
+		}
+		pthread_mutex_unlock(&pool->idle_mutex);
+		for (int i = 0; i < woken_count; ++i)
+			futex_wake(&woken[i]->wakeup, 1);
+		count -= woken_count;
+	}
+	for (; count > 0; --count) {
+		if (__atomic_load_n(&pool->running_count, __ATOMIC_ACQUIRE) >=
+		    pool->thread_count)
+			break;
+		thread_pool_spawn(pool, node);
+	}
+}
+
+/**
+ * Parse a sysfs CPU list like "0-3,8,10-11" into @a cpus.
+ * @retval Number of CPUs in the list.
+ */
+static int
+numa_parse_cpulist(const char *str, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+	const char *pos = str;
+	while (*pos >= '0' && *pos <= '9') {
+		char *end;
+		long first = strtol(pos, &end, 10);
+		long last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, cpus);
+		pos = *end == ',' ? end + 1 : end;
+	}
+	return CPU_COUNT(cpus);
+}
+
+/**
+ * Read the CPUs of a NUMA node from sysfs.
+ * @retval Number of the CPUs, 0 if the node doesn't exist or has none.
+ */
+static int
+numa_node_cpus(int node, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	char buf[1024];
+	ssize_t rc = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (rc <= 0)
+		return 0;
+	buf[rc] = 0;
+	return numa_parse_cpulist(buf, cpus);
+}
+
+int
+thread_pool_numa_node_count(void)
+{
+	int count = 1;
+	cpu_set_t cpus;
+	for (int node = 1; node < TPOOL_MAX_NODES; ++node) {
+		if (numa_node_cpus(node, &cpus) > 0)
+			count = node + 1;
+	}
+	return count;
+}
+
+/**
+ * Find the NUMA node of a CPU.
+ * @retval -1 Unknown.
+ */
+static int
+numa_cpu_node(int cpu)
+{
+	cpu_set_t cpus;
+	for (int node = 0; node < TPOOL_MAX_NODES; ++node) {
+		if (numa_node_cpus(node, &cpus) > 0 && CPU_ISSET(cpu, &cpus))
+			return node;
+	}
+	return -1;
+}
+
+/**
+ * Place the workers on the NUMA nodes. The nodes are interleaved, so the
+ * lazily started workers cover all the nodes early.
+ */
+static int
+thread_pool_place_on_nodes(thread_pool *pool, const int *counts,
+			   int node_count)
+{
+	if (node_count <= 0 || node_count > TPOOL_MAX_NODES)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	int left[TPOOL_MAX_NODES];
+	int total = 0;
+	for (int node = 0; node < node_count; ++node) {
+		if (counts[node] < 0)
+			return TPOOL_ERR_INVALID_ARGUMENT;
+		left[node] = counts[node];
+		total += counts[node];
+	}
+	if (total <= 0 || total > TPOOL_MAX_THREADS)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	cpu_set_t node_cpus[TPOOL_MAX_NODES];
+	for (int node = 0; node < node_count; ++node) {
+		/* A single node machine can have no sysfs node info. */
+		if (numa_node_cpus(node, &node_cpus[node]) == 0 &&
+		    counts[node] > 0 && node != 0)
+			return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	int i = 0;
+	while (i < total) {
+		for (int node = 0; node < node_count; ++node) {
+			if (left[node] == 0)
+				continue;
+			--left[node];
+			worker_slot *slot = &pool->slots[i++];
+			slot->node = node;
+			slot->cpus = node_cpus[node];
+			slot->is_pinned = CPU_COUNT(&node_cpus[node]) > 0;
+		}
+	}
+	pool->thread_count = total;
+	return 0;
+}
+
+/** Pin each worker to one CPU of the set, round-robin. */
+static int
+thread_pool_place_on_cpus(thread_pool *pool, const cpu_set_t *cpus,
+			  int thread_count)
+{
+	if (CPU_COUNT(cpus) == 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	int cpu = -1;
+	for (int i = 0; i < thread_count; ++i) {
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while (!CPU_ISSET(cpu, cpus));
+		worker_slot *slot = &pool->slots[i];
+		CPU_ZERO(&slot->cpus);
+		CPU_SET(cpu, &slot->cpus);
+		slot->is_pinned = true;
+		slot->node = numa_cpu_node(cpu);
+	}
+	return 0;
+}
+
+#if TPOOL_STATS
+
+/** Print the statistics periodically until the pool is stopped. */
+static void *
+thread_pool_stats_f(void *arg)
+{
+	thread_pool *pool = (thread_pool *)arg;
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	pthread_mutex_lock(&pool->stats_mutex);
+	while (!__atomic_load_n(&pool->is_stopping, __ATOMIC_ACQUIRE)) {
+		uint64_t ns = deadline.tv_nsec + pool->stats_interval_ns;
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+		while (!__atomic_load_n(&pool->is_stopping,
+					__ATOMIC_ACQUIRE) &&
+		       pthread_cond_timedwait(&pool->stats_cond,
+					      &pool->stats_mutex,
+					      &deadline) != ETIMEDOUT);
+		if (__atomic_load_n(&pool->is_stopping, __ATOMIC_ACQUIRE))
+			break;
+		struct thread_pool_stats stats;
+		thread_pool_stats(pool, &stats);
+		thread_pool_stats_print(&stats, stderr);
+	}
+	pthread_mutex_unlock(&pool->stats_mutex);
+	return NULL;
+}
+
+#endif
+
+void
+thread_pool_opts_create(struct thread_pool_opts *opts)
+{
+	opts->thread_count = 0;
+	opts->cpus = NULL;
+	opts->node_thread_counts = NULL;
+	opts->node_count = 0;
+	opts->idle_timeout = 0;
+	opts->stats_interval = 0;
+}
+
 int
 thread_pool_new(int thread_count, struct thread_pool **pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)thread_count;
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct thread_pool_opts opts;
+	thread_pool_opts_create(&opts);
+	opts.thread_count = thread_count;
+	return thread_pool_new_ext(&opts, pool);
+}
+
+int
+thread_pool_new_ext(const struct thread_pool_opts *opts,
+		    struct thread_pool **pool)
+{
+	if (opts->node_thread_counts == NULL &&
+	    (opts->thread_count <= 0 ||
+	     opts->thread_count > TPOOL_MAX_THREADS))
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (opts->node_thread_counts != NULL && opts->cpus != NULL)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	thread_pool *p = new thread_pool();
+	p->thread_count = opts->thread_count;
+	for (int i = 0; i < TPOOL_MAX_THREADS; ++i) {
+		p->slots[i].node = -1;
+		p->slots[i].is_pinned = false;
+		p->slots[i].is_started = false;
+	}
+	int rc = 0;
+	if (opts->node_thread_counts != NULL) {
+		rc = thread_pool_place_on_nodes(p, opts->node_thread_counts,
+						opts->node_count);
+	} else if (opts->cpus != NULL) {
+		rc = thread_pool_place_on_cpus(p, opts->cpus,
+					       opts->thread_count);
+	}
+	if (rc != 0) {
+		delete p;
+		return rc;
+	}
+	p->worker_count = 0;
+	p->running_count = 0;
+	p->idle_timeout_ns = opts->idle_timeout > 0 ?
+			     (uint64_t)(opts->idle_timeout * 1e9) : 0;
+	pthread_mutex_init(&p->spawn_mutex, NULL);
+	pthread_key_create(&p->worker_key, NULL);
+	task_queue_create(&p->injection);
+	task_queue_create(&p->high_queue);
+	task_queue_create(&p->low_queue);
+	for (int i = 0; i < TPOOL_MAX_NODES; ++i)
+		task_queue_create(&p->node_queues[i]);
+	p->task_count = 0;
+	pthread_mutex_init(&p->cache_mutex, NULL);
+	p->tasks.head = NULL;
+	p->tasks.size = 0;
+	p->owned_count = 0;
+	pthread_mutex_init(&p->idle_mutex, NULL);
+	rlist_create(&p->idle);
+	p->idle_count = 0;
+	p->is_stopping = false;
+#if TPOOL_STATS
+	p->task_count_max = 0;
+	p->pushed_count = 0;
+	p->stats_interval_ns = opts->stats_interval > 0 ?
+			       (uint64_t)(opts->stats_interval * 1e9) : 0;
+	if (p->stats_interval_ns != 0) {
+		pthread_mutex_init(&p->stats_mutex, NULL);
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&p->stats_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		pthread_create(&p->stats_thread, NULL, thread_pool_stats_f, p);
+	}
+#endif
+	*pool = p;
+	return 0;
 }
 
 int
 thread_pool_delete(struct thread_pool *pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
+	if (__atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) != 0 ||
+	    __atomic_load_n(&pool->owned_count, __ATOMIC_ACQUIRE) != 0)
+		return TPOOL_ERR_HAS_TASKS;
+#if TPOOL_STATS
+	if (pool->stats_interval_ns != 0) {
+		pthread_mutex_lock(&pool->stats_mutex);
+		__atomic_store_n(&pool->is_stopping, true, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&pool->stats_cond);
+		pthread_mutex_unlock(&pool->stats_mutex);
+		pthread_join(pool->stats_thread, NULL);
+		pthread_cond_destroy(&pool->stats_cond);
+		pthread_mutex_destroy(&pool->stats_mutex);
+	}
+#endif
+	__atomic_store_n(&pool->is_stopping, true, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&pool->idle_mutex);
+	while (!rlist_empty(&pool->idle)) {
+		thread_worker *w = rlist_shift_entry(&pool->idle,
+						     thread_worker, in_idle);
+		__atomic_store_n(&w->wakeup, 1, __ATOMIC_RELEASE);
+		futex_wake(&w->wakeup, 1);
+	}
+	__atomic_store_n(&pool->idle_count, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->idle_mutex);
+	/*
+	 * The workers steal from each other until they all are stopped. The
+	 * threads of the retired ones have exited, but are not joined yet.
+	 */
+	for (int i = 0; i < pool->worker_count; ++i)
+		pthread_join(pool->workers[i]->thread, NULL);
+	for (int i = 0; i < pool->worker_count; ++i) {
+		thread_worker *w = pool->workers[i];
+		deque_array *a = w->array;
+		while (a != NULL) {
+			deque_array *prev = a->prev;
+			delete[] a->items;
+			delete a;
+			a = prev;
+		}
+		task_cache_destroy(&w->tasks);
+		delete w;
+	}
+	task_cache_destroy(&pool->tasks);
+	pthread_mutex_destroy(&pool->cache_mutex);
+	pthread_key_delete(pool->worker_key);
+	pthread_mutex_destroy(&pool->spawn_mutex);
+	task_queue_destroy(&pool->injection);
+	task_queue_destroy(&pool->high_queue);
+	task_queue_destroy(&pool->low_queue);
+	for (int i = 0; i < TPOOL_MAX_NODES; ++i)
+		task_queue_destroy(&pool->node_queues[i]);
+	pthread_mutex_destroy(&pool->idle_mutex);
+	delete pool;
+	return 0;
+}
+
+uint64_t
+thread_pool_histogram_percentile(const struct thread_pool_histogram *hist,
+				 double percentile)
+{
+	if (hist->count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(percentile / 100 * hist->count);
+	if (rank >= hist->count)
+		rank = hist->count - 1;
+	const int sub_bits = TPOOL_HISTOGRAM_SUB_BITS;
+	uint64_t seen = 0;
+	for (int i = 0; i < TPOOL_HISTOGRAM_SIZE; ++i) {
+		seen += hist->buckets[i];
+		if (seen <= rank)
+			continue;
+		if (i < (1 << sub_bits))
+			return i;
+		int shift = (i >> sub_bits) - 1;
+		uint64_t sub = (1u << sub_bits) + (i & ((1 << sub_bits) - 1));
+		uint64_t upper = ((sub + 1) << shift) - 1;
+		return upper < hist->max ? upper : hist->max;
+	}
+	return hist->max;
+}
+
+int
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats)
+{
+#if TPOOL_STATS
+	memset(stats, 0, sizeof(*stats));
+	stats->thread_count = __atomic_load_n(&pool->running_count,
+					      __ATOMIC_RELAXED);
+	stats->task_count = __atomic_load_n(&pool->task_count,
+					    __ATOMIC_RELAXED);
+	stats->task_count_max = __atomic_load_n(&pool->task_count_max,
+						__ATOMIC_RELAXED);
+	uint64_t started_count = 0;
+	int count = __atomic_load_n(&pool->worker_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		const worker_stats *ws = &pool->workers[i]->stats;
+		started_count += __atomic_load_n(&ws->started_count,
+						 __ATOMIC_RELAXED);
+		stats->finished_count += __atomic_load_n(&ws->finished_count,
+							 __ATOMIC_RELAXED);
+		stats->steal_count += __atomic_load_n(&ws->steal_count,
+						      __ATOMIC_RELAXED);
+		stats->park_count += __atomic_load_n(&ws->park_count,
+						     __ATOMIC_RELAXED);
+		stats->unpark_count += __atomic_load_n(&ws->unpark_count,
+						       __ATOMIC_RELAXED);
+		histogram_merge(&stats->wait_time, &ws->wait_time);
+		histogram_merge(&stats->run_time, &ws->run_time);
+	}
+	uint64_t pushed_count = __atomic_load_n(&pool->pushed_count,
+						__ATOMIC_RELAXED);
+	/* The counters are read at different times. */
+	stats->queue_size = pushed_count > started_count ?
+			    (int)(pushed_count - started_count) : 0;
+	return 0;
+#else
 	(void)pool;
+	(void)stats;
 	return TPOOL_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
+void
+thread_pool_stats_print(const struct thread_pool_stats *stats, FILE *out)
+{
+	const thread_pool_histogram *wait = &stats->wait_time;
+	const thread_pool_histogram *run = &stats->run_time;
+	fprintf(out, "thread_pool: threads %d, tasks %d (max %d), queued %d, "
+		"finished %llu, steals %llu, parks %llu, unparks %llu, "
+		"wait p50/p99/max %.1f/%.1f/%.1f us, "
+		"run p50/p99/max %.1f/%.1f/%.1f us\n", stats->thread_count,
+		stats->task_count, stats->task_count_max, stats->queue_size,
+		(unsigned long long)stats->finished_count,
+		(unsigned long long)stats->steal_count,
+		(unsigned long long)stats->park_count,
+		(unsigned long long)stats->unpark_count,
+		thread_pool_histogram_percentile(wait, 50) / 1e3,
+		thread_pool_histogram_percentile(wait, 99) / 1e3,
+		wait->max / 1e3,
+		thread_pool_histogram_percentile(run, 50) / 1e3,
+		thread_pool_histogram_percentile(run, 99) / 1e3,
+		run->max / 1e3);
+}
+
+int
+thread_pool_thread_count(const struct thread_pool *pool)
+{
+	return pool->thread_count;
+}
+
+/**
+ * Move the high and low priority tasks of the list into their queues.
+ * @retval The list of the rest, normal priority tasks.
+ */
+static thread_task *
+thread_pool_enqueue_prioritized(thread_pool *pool, thread_task *first,
+				thread_task **last, int *count)
+{
+	thread_task *normal_first = NULL;
+	*last = NULL;
+	*count = 0;
+	uint64_t now = 0;
+	for (thread_task *task = first; task != NULL;) {
+		thread_task *next = task->next;
+		task->next = NULL;
+		if (task->priority == TPOOL_PRIORITY_HIGH) {
+			task_queue_push(&pool->high_queue, task, task, 1);
+		} else if (task->priority == TPOOL_PRIORITY_LOW) {
+			if (now == 0)
+				now = clock_now_ns();
+			task->deadline = now + task->deadline_ns;
+			task_queue_insert_by_deadline(&pool->low_queue, task);
+		} else {
+			if (*last != NULL)
+				(*last)->next = task;
+			else
+				normal_first = task;
+			*last = task;
+			++*count;
+		}
+		task = next;
+	}
+	return normal_first;
+}
+
+/**
+ * Put the tasks linked via the next pointers into the pool and wake up the
+ * workers for them. The tasks are already counted in the pool.
+ */
+static void
+thread_pool_enqueue(thread_pool *pool, thread_task *first, thread_task *last,
+		    int count, int node)
+{
+	int total = count;
+	first = thread_pool_enqueue_prioritized(pool, first, &last, &count);
+	thread_worker *w = (thread_worker *)pthread_getspecific(
+		pool->worker_key);
+	if (count == 0) {
+		/* Everything went to the priority queues. */
+	} else if (w != NULL && (node < 0 || node == w->node)) {
+		/* A task pushing more work, keep it local. */
+		for (thread_task *task = first; task != NULL;) {
+			thread_task *next = task->next;
+			worker_push(w, task);
+			task = next;
+		}
+	} else {
+		task_queue *q = node < 0 ? &pool->injection :
+			&pool->node_queues[node];
+		task_queue_push(q, first, last, count);
+	}
+	thread_pool_wakeup(pool, total, node);
 }
 
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return thread_pool_push_tasks_to_node(pool, &task, 1, -1);
+}
+
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count)
+{
+	return thread_pool_push_tasks_to_node(pool, tasks, count, -1);
+}
+
+int
+thread_pool_push_task_to_node(struct thread_pool *pool,
+			      struct thread_task *task, int node)
+{
+	return thread_pool_push_tasks_to_node(pool, &task, 1, node);
+}
+
+int
+thread_pool_push_tasks_to_node(struct thread_pool *pool,
+			       struct thread_task **tasks, int count, int node)
+{
+	if (node < -1 || node >= TPOOL_MAX_NODES)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (count <= 0)
+		return 0;
+	int task_count = __atomic_add_fetch(&pool->task_count, count,
+					    __ATOMIC_RELAXED);
+	if (task_count > TPOOL_MAX_TASKS) {
+		__atomic_sub_fetch(&pool->task_count, count, __ATOMIC_RELAXED);
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+#if TPOOL_STATS
+	int task_count_max = __atomic_load_n(&pool->task_count_max,
+					     __ATOMIC_RELAXED);
+	while (task_count > task_count_max &&
+	       !__atomic_compare_exchange_n(&pool->task_count_max,
+					    &task_count_max, task_count, false,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+	__atomic_add_fetch(&pool->pushed_count, count, __ATOMIC_RELAXED);
+	uint64_t now = clock_now_ns();
+#endif
+	thread_task *first = NULL;
+	thread_task *last = NULL;
+	int ready_count = 0;
+	for (int i = 0; i < count; ++i) {
+		thread_task *task = tasks[i];
+		if (task->group != NULL)
+			__atomic_add_fetch(&task->group->count, 1,
+					   __ATOMIC_RELAXED);
+		task->pool = pool;
+		task->node = node;
+#if TPOOL_STATS
+		task->push_ns = now;
+		task->run_ns = 0;
+#endif
+		__atomic_store_n(&task->state, TASK_STATE_QUEUED,
+				 __ATOMIC_RELAXED);
+		/* Wait for the prerequisites, if any is not finished yet. */
+		if (__atomic_sub_fetch(&task->pending, 1,
+				       __ATOMIC_ACQ_REL) != 0)
+			continue;
+		task->next = NULL;
+		if (last != NULL)
+			last->next = task;
+		else
+			first = task;
+		last = task;
+		++ready_count;
+	}
+	if (ready_count > 0)
+		thread_pool_enqueue(pool, first, last, ready_count, node);
+	return 0;
+}
+
+/**
+ * Take a deleted task from the cache of the calling worker, or of the pool
+ * if the caller is not its worker or has no tasks cached.
+ */
+static thread_task *
+thread_pool_take_cached(thread_pool *pool)
+{
+	thread_worker *w = (thread_worker *)pthread_getspecific(
+		pool->worker_key);
+	thread_task *task = NULL;
+	if (w != NULL)
+		task = task_cache_take(&w->tasks);
+	if (task == NULL &&
+	    __atomic_load_n(&pool->tasks.size, __ATOMIC_RELAXED) != 0) {
+		pthread_mutex_lock(&pool->cache_mutex);
+		task = task_cache_take(&pool->tasks);
+		pthread_mutex_unlock(&pool->cache_mutex);
+	}
+	return task;
+}
+
+/**
+ * Keep a deleted task of the pool for reuse. The pool is not touched after
+ * its owned task counter is decremented, it can be deleted then.
+ */
+static void
+thread_pool_put_cached(thread_pool *pool, thread_task *task)
+{
+	thread_worker *w = (thread_worker *)pthread_getspecific(
+		pool->worker_key);
+	if (w == NULL || !task_cache_put(&w->tasks, task)) {
+		pthread_mutex_lock(&pool->cache_mutex);
+		bool is_cached = task_cache_put(&pool->tasks, task);
+		pthread_mutex_unlock(&pool->cache_mutex);
+		if (!is_cached)
+			delete task;
+	}
+	__atomic_sub_fetch(&pool->owned_count, 1, __ATOMIC_RELEASE);
+}
+
+int
+thread_pool_task_new_inline(struct thread_pool *pool,
+			    struct thread_task **task, void (*invoke)(void *),
+			    void (*destroy)(void *), void **storage)
+{
+	thread_task *t = NULL;
+	if (pool != NULL) {
+		__atomic_add_fetch(&pool->owned_count, 1, __ATOMIC_RELAXED);
+		t = thread_pool_take_cached(pool);
+	}
+	if (t == NULL)
+		t = new thread_task();
+	t->invoke = invoke;
+	t->destroy = destroy;
+	t->state = TASK_STATE_NEW;
+	t->suspend = TASK_SUSPEND_NONE;
+	t->group = NULL;
+	t->next = NULL;
+	t->pool = NULL;
+	t->owner = pool;
+	t->node = -1;
+	t->pending = 1;
+	t->dependent_count = 0;
+	t->priority = TPOOL_PRIORITY_NORMAL;
+	t->deadline_ns = (uint64_t)TPOOL_LOW_PRIORITY_DEADLINE_MS * 1000000;
+	t->deadline = UINT64_MAX;
+	*storage = t->storage;
+	*task = t;
+	return 0;
+}
+
+int
+thread_task_new_inline(struct thread_task **task, void (*invoke)(void *),
+		       void (*destroy)(void *), void **storage)
+{
+	return thread_pool_task_new_inline(NULL, task, invoke, destroy,
+					   storage);
+}
+
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     const thread_task_f &function)
+{
+	static_assert(sizeof(thread_task_f) <= TPOOL_TASK_INLINE_SIZE,
+		      "std::function fits into a task");
+	void *storage;
+	thread_pool_task_new_inline(pool, task,
+		[](void *p) { (*(thread_task_f *)p)(); },
+		[](void *p) { ((thread_task_f *)p)->~thread_task_f(); },
+		&storage);
+	new (storage) thread_task_f(function);
+	return 0;
+}
+
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     thread_task_cb_f cb, void *arg)
+{
+	static_assert(sizeof(thread_task_cb) <= TPOOL_TASK_INLINE_SIZE,
+		      "callback fits into a task");
+	void *storage;
+	thread_pool_task_new_inline(pool, task, [](void *p) {
+		thread_task_cb *c = (thread_task_cb *)p;
+		c->cb(c->arg);
+	}, NULL, &storage);
+	thread_task_cb *c = (thread_task_cb *)storage;
+	c->cb = cb;
+	c->arg = arg;
+	return 0;
 }
 
 int
 thread_task_new(struct thread_task **task, const thread_task_f &function)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)function;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return thread_pool_task_new(NULL, task, function);
+}
+
+int
+thread_task_new(struct thread_task **task, thread_task_cb_f cb, void *arg)
+{
+	return thread_pool_task_new(NULL, task, cb, arg);
 }
 
 bool
 thread_task_is_finished(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return false;
+	return (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+		TASK_STATE_MASK) == TASK_STATE_FINISHED;
 }
 
 bool
 thread_task_is_running(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
+	return (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+		TASK_STATE_MASK) == TASK_STATE_RUNNING;
+}
+
+/**
+ * The task is in a pool. A grouped task goes back to the new state when
+ * finished, so the finished state alone can't be waited for.
+ */
+static inline bool
+task_state_is_pending(uint32_t state)
+{
+	state &= TASK_STATE_MASK;
+	return state == TASK_STATE_QUEUED || state == TASK_STATE_RUNNING;
+}
+
+/**
+ * Spin a bit waiting for the task finish. Most tasks are short, and a
+ * sleep with a wakeup costs a few microseconds. A worker of the task's pool
+ * adapts the spinning to its joins. The other threads have nowhere to keep
+ * that, and spin the minimum.
+ * @param w Worker of the task's pool calling the join, or NULL.
+ */
+static bool
+task_spin_wait(struct thread_task *task, thread_worker *w)
+{
+	int limit = w != NULL ? w->join_spin : JOIN_SPIN_MIN;
+	for (int i = 0; i < limit; ++i) {
+		uint32_t state = __atomic_load_n(&task->state,
+						 __ATOMIC_ACQUIRE);
+		if (!task_state_is_pending(state)) {
+			if (w != NULL && limit < JOIN_SPIN_MAX)
+				w->join_spin = limit * 2;
+			return true;
+		}
+		cpu_relax();
+	}
+	if (w != NULL && limit > JOIN_SPIN_MIN)
+		w->join_spin = limit / 2;
 	return false;
 }
 
+/**
+ * Sleep in a join until the task is finished, or until a task is pushed to
+ * help with. The worker sleeps in the idle list, so a pusher wakes it up as
+ * any idle worker, and the finisher finds it there by the joined task. It
+ * is put into the list before the waiters flag is set, so the finisher
+ * seeing the flag sees the worker too.
+ */
+static void
+worker_join_sleep(thread_worker *w, struct thread_task *task)
+{
+	thread_pool *pool = w->pool;
+	__atomic_store_n(&w->wakeup, 0, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&pool->idle_mutex);
+	w->join_task = task;
+	rlist_add_entry(&pool->idle, w, in_idle);
+	__atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->idle_mutex);
+	bool is_pending = false;
+	uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	while (task_state_is_pending(state)) {
+		if ((state & TASK_FLAG_WAITERS) != 0 ||
+		    __atomic_compare_exchange_n(&task->state, &state,
+						state | TASK_FLAG_WAITERS,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			is_pending = true;
+			break;
+		}
+	}
+	/* Like in worker_f(), a pusher or the worker sees the other. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (is_pending && !pool_has_tasks(pool)) {
+		while (__atomic_load_n(&w->wakeup, __ATOMIC_ACQUIRE) == 0)
+			futex_wait(&w->wakeup, 0);
+	}
+	pthread_mutex_lock(&pool->idle_mutex);
+	if (!rlist_empty(&w->in_idle)) {
+		rlist_del_entry(w, in_idle);
+		__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+	}
+	w->join_task = NULL;
+	pthread_mutex_unlock(&pool->idle_mutex);
+}
+
+/**
+ * Wait for the task finish. A worker of the task's pool runs the other
+ * tasks meanwhile, the awaited one first if it is on top of the own deque.
+ * So the tasks joining their subtasks don't block the workers, and don't
+ * deadlock when all the workers are joining. A timed join doesn't help, to
+ * return in time.
+ * @param deadline Absolute CLOCK_MONOTONIC time, NULL for infinity.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ */
+static int
+task_wait(struct thread_task *task, const struct timespec *deadline)
+{
+	uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	if ((state & TASK_STATE_MASK) == TASK_STATE_NEW)
+		return TPOOL_ERR_TASK_NOT_PUSHED;
+	thread_worker *w = NULL;
+	if (deadline == NULL && task_state_is_pending(state)) {
+		w = (thread_worker *)pthread_getspecific(
+			task->pool->worker_key);
+	}
+	bool is_spun = false;
+	while (true) {
+		state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+		if (!task_state_is_pending(state))
+			break;
+		if (w != NULL) {
+			thread_task *other = worker_find_task(w);
+			if (other != NULL) {
+				task_run(w, other);
+				continue;
+			}
+		}
+		if (!is_spun) {
+			is_spun = true;
+			if (task_spin_wait(task, w))
+				continue;
+		}
+		if (w != NULL) {
+			worker_join_sleep(w, task);
+			continue;
+		}
+		if ((state & TASK_FLAG_WAITERS) == 0 &&
+		    !__atomic_compare_exchange_n(&task->state, &state,
+						 state | TASK_FLAG_WAITERS,
+						 false, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		state |= TASK_FLAG_WAITERS;
+		if (deadline == NULL) {
+			futex_wait(&task->state, state);
+			continue;
+		}
+		if (futex_wait_until(&task->state, state, deadline) != 0 &&
+		    errno == ETIMEDOUT &&
+		    task_state_is_pending(__atomic_load_n(&task->state,
+							  __ATOMIC_ACQUIRE)))
+			return TPOOL_ERR_TIMEOUT;
+	}
+	__atomic_store_n(&task->state, TASK_STATE_NEW, __ATOMIC_RELAXED);
+	return 0;
+}
+
 int
 thread_task_join(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return task_wait(task, NULL);
 }
 
 #if NEED_TIMED_JOIN
@@ -78,10 +2010,17 @@ thread_task_join(struct thread_task *task)
 int
 thread_task_timed_join(struct thread_task *task, double timeout)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)timeout;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout > 0) {
+		/* Huge timeouts are clamped to about a hundred years. */
+		if (timeout > 3e9)
+			timeout = 3e9;
+		uint64_t ns = deadline.tv_nsec + (uint64_t)(timeout * 1e9);
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+	}
+	return task_wait(task, &deadline);
 }
 
 #endif
@@ -89,9 +2028,122 @@ thread_task_timed_join(struct thread_task *task, double timeout)
 int
 thread_task_delete(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_STATE_NEW)
+		return TPOOL_ERR_TASK_IN_POOL;
+	/*
+	 * The prerequisites still point at the task, and would release it
+	 * after its memory is reused.
+	 */
+	if (__atomic_load_n(&task->pending, __ATOMIC_ACQUIRE) > 1)
+		return TPOOL_ERR_TASK_IN_POOL;
+	if (task->dependent_count != 0)
+		task_release_dependents(task);
+	if (task->destroy != NULL)
+		task->destroy(task->storage);
+	if (task->owner != NULL)
+		thread_pool_put_cached(task->owner, task);
+	else
+		delete task;
+	return 0;
+}
+
+int
+thread_task_set_priority(struct thread_task *task,
+			 enum thread_task_priority priority)
+{
+	if (priority < TPOOL_PRIORITY_HIGH || priority > TPOOL_PRIORITY_LOW)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_STATE_NEW)
+		return TPOOL_ERR_TASK_IN_POOL;
+	task->priority = priority;
+	return 0;
+}
+
+int
+thread_task_set_deadline(struct thread_task *task, double timeout)
+{
+	if (timeout < 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_STATE_NEW)
+		return TPOOL_ERR_TASK_IN_POOL;
+	/* Huge timeouts are clamped to about a hundred years. */
+	if (timeout > 3e9)
+		timeout = 3e9;
+	task->deadline_ns = (uint64_t)(timeout * 1e9);
+	return 0;
+}
+
+int
+thread_task_add_dependency(struct thread_task *task,
+			   struct thread_task *prerequisite)
+{
+	if (task == prerequisite)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) !=
+	    TASK_STATE_NEW ||
+	    __atomic_load_n(&prerequisite->state, __ATOMIC_ACQUIRE) !=
+	    TASK_STATE_NEW)
+		return TPOOL_ERR_TASK_IN_POOL;
+	if (prerequisite->dependent_count ==
+	    prerequisite->dependent_capacity) {
+		int capacity = prerequisite->dependent_capacity * 2;
+		if (capacity == 0)
+			capacity = 4;
+		thread_task **dependents = new thread_task *[capacity];
+		std::copy(prerequisite->dependents,
+			  prerequisite->dependents +
+			  prerequisite->dependent_count, dependents);
+		delete[] prerequisite->dependents;
+		prerequisite->dependents = dependents;
+		prerequisite->dependent_capacity = capacity;
+	}
+	prerequisite->dependents[prerequisite->dependent_count++] = task;
+	__atomic_add_fetch(&task->pending, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+thread_task_suspend(struct thread_task *task)
+{
+	if ((__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+	     TASK_STATE_MASK) != TASK_STATE_RUNNING)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	uint32_t suspend = TASK_SUSPEND_NONE;
+	if (!__atomic_compare_exchange_n(&task->suspend, &suspend,
+					 TASK_SUSPEND_REQUESTED, false,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	return 0;
+}
+
+int
+thread_task_resume(struct thread_task *task)
+{
+	uint32_t suspend = __atomic_load_n(&task->suspend, __ATOMIC_ACQUIRE);
+	while (true) {
+		uint32_t next;
+		if (suspend == TASK_SUSPEND_REQUESTED)
+			next = TASK_SUSPEND_WOKEN;
+		else if (suspend == TASK_SUSPEND_PARKED)
+			next = TASK_SUSPEND_NONE;
+		else
+			return TPOOL_ERR_TASK_NOT_SUSPENDED;
+		if (__atomic_compare_exchange_n(&task->suspend, &suspend, next,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			break;
+	}
+	/* The function is still running and calls itself again. */
+	if (suspend == TASK_SUSPEND_REQUESTED)
+		return 0;
+	task->next = NULL;
+#if TPOOL_STATS
+	task->push_ns = clock_now_ns();
+	/* Each start needs a push, for the queue size. */
+	__atomic_add_fetch(&task->pool->pushed_count, 1, __ATOMIC_RELAXED);
+#endif
+	thread_pool_enqueue(task->pool, task, task, 1, task->node);
+	return 0;
 }
 
 #if NEED_DETACH
@@ -99,9 +2151,73 @@ thread_task_delete(struct thread_task *task)
 int
 thread_task_detach(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	uint32_t state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	do {
+		switch (state & TASK_STATE_MASK) {
+		case TASK_STATE_NEW:
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		case TASK_STATE_FINISHED:
+			__atomic_store_n(&task->state, TASK_STATE_NEW,
+					 __ATOMIC_RELAXED);
+			return thread_task_delete(task);
+		}
+		/* The worker deletes it if the flag is set before finish. */
+	} while (!__atomic_compare_exchange_n(&task->state, &state,
+					      state | TASK_FLAG_DETACHED, false,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	return 0;
 }
 
 #endif
+
+int
+thread_task_group_new(struct thread_task_group **group)
+{
+	thread_task_group *g = new thread_task_group();
+	g->count = 0;
+	*group = g;
+	return 0;
+}
+
+int
+thread_task_group_delete(struct thread_task_group *group)
+{
+	/* The flag alone is a finisher which is going to clear it. */
+	if (__atomic_load_n(&group->count, __ATOMIC_ACQUIRE) != 0)
+		return TPOOL_ERR_HAS_TASKS;
+	delete group;
+	return 0;
+}
+
+int
+thread_task_set_group(struct thread_task *task,
+		      struct thread_task_group *group)
+{
+	if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_STATE_NEW)
+		return TPOOL_ERR_TASK_IN_POOL;
+	task->group = group;
+	return 0;
+}
+
+int
+thread_task_group_join(struct thread_task_group *group)
+{
+	uint32_t count = __atomic_load_n(&group->count, __ATOMIC_ACQUIRE);
+	/*
+	 * Not done while only the flag is left: the last finisher hasn't
+	 * cleared it yet, and is going to touch the group.
+	 */
+	while (count != 0) {
+		if ((count & GROUP_FLAG_WAITERS) != 0 ||
+		    __atomic_compare_exchange_n(&group->count, &count,
+						count | GROUP_FLAG_WAITERS,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			futex_wait(&group->count, count | GROUP_FLAG_WAITERS);
+			count = __atomic_load_n(&group->count,
+						__ATOMIC_ACQUIRE);
+		}
+	}
+	return 0;
+}
@@ -1,7 +1,14 @@
 #pragma once
 
 #include <functional>
+#include <new>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <type_traits>
+#include <utility>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -16,17 +23,60 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_DETACH 0
-#define NEED_TIMED_JOIN 0
+#define NEED_DETACH 1
+#define NEED_TIMED_JOIN 1
+
+/**
+ * Collect the pool statistics, see thread_pool_stats(). Define as 0 to
+ * compile the collection out, then the pool doesn't spend a cycle on it.
+ */
+#ifndef TPOOL_STATS
+#define TPOOL_STATS 1
+#endif
 
 struct thread_pool;
 struct thread_task;
+struct thread_task_group;
 
 using thread_task_f = std::function<void(void)>;
 
+/** Plain function to run by a task with an opaque argument. */
+typedef void (*thread_task_cb_f)(void *arg);
+
 enum {
 	TPOOL_MAX_THREADS = 20,
 	TPOOL_MAX_TASKS = 100000,
+	TPOOL_MAX_NODES = 8,
+	/**
+	 * Callables not bigger than that are stored right inside the task
+	 * object, without a separate allocation.
+	 */
+	TPOOL_TASK_INLINE_SIZE = 48,
+};
+
+enum thread_task_priority {
+	/**
+	 * Run before the other tasks, in the push order, but not more than
+	 * TPOOL_HIGH_PRIORITY_BURST in a row by one worker.
+	 */
+	TPOOL_PRIORITY_HIGH,
+	/** The default. */
+	TPOOL_PRIORITY_NORMAL,
+	/**
+	 * Run when there are no other tasks, or when the start deadline
+	 * has passed.
+	 */
+	TPOOL_PRIORITY_LOW,
+};
+
+enum {
+	/** Default start deadline of a low priority task. */
+	TPOOL_LOW_PRIORITY_DEADLINE_MS = 100,
+	/**
+	 * Max number of high priority tasks a worker runs in a row. Then it
+	 * takes one of the other tasks, if any, so they don't starve.
+	 */
+	TPOOL_HIGH_PRIORITY_BURST = 16,
 };
 
 enum thread_pool_errcode {
@@ -37,6 +87,7 @@ enum thread_pool_errcode {
 	TPOOL_ERR_TASK_IN_POOL,
 	TPOOL_ERR_NOT_IMPLEMENTED,
 	TPOOL_ERR_TIMEOUT,
+	TPOOL_ERR_TASK_NOT_SUSPENDED,
 };
 
 /** Thread pool API. */
@@ -54,16 +105,157 @@ enum thread_pool_errcode {
 int
 thread_pool_new(int thread_count, struct thread_pool **pool);
 
+/** Placement of the workers of a pool on CPUs and NUMA nodes. */
+struct thread_pool_opts {
+	/** Number of threads. Ignored if node_thread_counts is set. */
+	int thread_count;
+	/**
+	 * CPUs to pin the workers to, one CPU per worker, round-robin. NULL
+	 * means no pinning.
+	 */
+	const cpu_set_t *cpus;
+	/**
+	 * Number of workers on each NUMA node, indexed by node ID. A worker
+	 * is pinned to all the CPUs of its node. NULL means no placement on
+	 * the nodes. Can't be used together with cpus.
+	 */
+	const int *node_thread_counts;
+	/** Size of node_thread_counts. */
+	int node_count;
+	/**
+	 * Seconds an idle worker waits for tasks before its thread exits.
+	 * The pool starts without threads and starts them on demand, so it
+	 * shrinks to zero when quiet, and grows back up to the thread count
+	 * with the load. 0 means the threads never exit.
+	 */
+	double idle_timeout;
+	/**
+	 * Print the pool statistics to stderr every that many seconds. 0
+	 * means never. Ignored without TPOOL_STATS.
+	 */
+	double stats_interval;
+};
+
+/**
+ * Initialize pool options with the defaults: no pinning, no idle timeout,
+ * no statistics dump. The thread count has to be set.
+ */
+void
+thread_pool_opts_create(struct thread_pool_opts *opts);
+
+/**
+ * Create a new thread pool with its workers pinned to the given CPUs or
+ * NUMA nodes. The workers know their nodes: they take the tasks pushed to
+ * their node first, and steal from the workers of the same node before the
+ * others.
+ * @param opts Pool options.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - bad thread count, empty CPU
+ *       set, or a node without CPUs.
+ */
+int
+thread_pool_new_ext(const struct thread_pool_opts *opts,
+		    struct thread_pool **pool);
+
+/**
+ * Get the number of NUMA nodes in the system, 1 if there is no NUMA.
+ */
+int
+thread_pool_numa_node_count(void);
+
+enum {
+	/**
+	 * Each power of 2 range of the histogram values is split into that
+	 * many buckets, as a power of 2. So the relative error is 1/8.
+	 */
+	TPOOL_HISTOGRAM_SUB_BITS = 3,
+	TPOOL_HISTOGRAM_SIZE = (64 - TPOOL_HISTOGRAM_SUB_BITS + 1) <<
+			       TPOOL_HISTOGRAM_SUB_BITS,
+};
+
+/** Histogram of durations in nanoseconds, with log-linear buckets. */
+struct thread_pool_histogram {
+	uint64_t buckets[TPOOL_HISTOGRAM_SIZE];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+/**
+ * Get a percentile of the histogram values, in nanoseconds. It is the upper
+ * bound of the bucket with the percentile.
+ * @param hist Histogram.
+ * @param percentile Percentile from 0 to 100.
+ */
+uint64_t
+thread_pool_histogram_percentile(const struct thread_pool_histogram *hist,
+				 double percentile);
+
+/** Statistics of a pool since its creation. */
+struct thread_pool_stats {
+	/** Number of the running worker threads. */
+	int thread_count;
+	/** Number of the pushed or resumed and not started tasks. */
+	int queue_size;
+	/** Number of the pushed and not finished tasks. */
+	int task_count;
+	/** Max task_count ever. */
+	int task_count_max;
+	/** Number of the finished tasks. */
+	uint64_t finished_count;
+	/** Number of the tasks taken from the other workers. */
+	uint64_t steal_count;
+	/** Number of times the workers went to sleep, and were woken up. */
+	uint64_t park_count;
+	uint64_t unpark_count;
+	/** Time from push or resume to start of the tasks. */
+	struct thread_pool_histogram wait_time;
+	/**
+	 * Run time of the finished tasks. The slices of a suspended task are
+	 * summed up.
+	 */
+	struct thread_pool_histogram run_time;
+};
+
+/**
+ * Collect the statistics of @a pool. Each worker keeps its own counters, so
+ * the collection doesn't slow the tasks down, but the result is not an
+ * exact snapshot while the pool works.
+ * @param pool Pool to inspect.
+ * @param[out] stats Statistics.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_NOT_IMPLEMENTED - compiled without TPOOL_STATS.
+ */
+int
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats);
+
+/** Print the statistics in one line. */
+void
+thread_pool_stats_print(const struct thread_pool_stats *stats, FILE *out);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
  * @retval 0 Success.
  * @retval != Error code.
- *     - TPOOL_ERR_HAS_TASKS - pool still has tasks.
+ *     - TPOOL_ERR_HAS_TASKS - pool still has tasks, or not
+ *       deleted tasks created by thread_pool_task_new().
  */
 int
 thread_pool_delete(struct thread_pool *pool);
 
+/**
+ * Get the max number of threads in @a pool.
+ * @param pool Pool to get the thread count of.
+ */
+int
+thread_pool_thread_count(const struct thread_pool *pool);
+
 /**
  * Push @a task into thread pool queue. The task must not be
  * already pushed or deleted - otherwise this is undefined
@@ -79,6 +271,48 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks at once. The queue is locked once, and not more
+ * workers are woken up than there are new tasks. Either all the tasks are
+ * pushed or none.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool would have too many
+ *       tasks.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
+/**
+ * Push @a task preferably to a worker of NUMA @a node. If the node has no
+ * workers, or they are all busy, the others take the task too.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param node NUMA node, -1 for any.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - bad node.
+ */
+int
+thread_pool_push_task_to_node(struct thread_pool *pool,
+			      struct thread_task *task, int node);
+
+/**
+ * Batch version of thread_pool_push_task_to_node(), see
+ * thread_pool_push_tasks().
+ */
+int
+thread_pool_push_tasks_to_node(struct thread_pool *pool,
+			       struct thread_task **tasks, int count, int node);
+
 /** Thread pool task API. */
 
 /**
@@ -91,6 +325,94 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, const thread_task_f &function);
 
+/**
+ * Create a new task running @a cb with @a arg.
+ * @param[out] task Pointer to store result task object.
+ * @param cb Function to run by this task.
+ * @param arg Argument for @a cb.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_new(struct thread_task **task, thread_task_cb_f cb, void *arg);
+
+/**
+ * Create a new task with a callable object of TPOOL_TASK_INLINE_SIZE bytes
+ * at most, constructed by the caller. Used by the thread_task_new() template
+ * below, normally there is no need to call it directly.
+ * @param[out] task Pointer to store result task object.
+ * @param invoke Function calling the object.
+ * @param destroy Function destroying the object.
+ * @param[out] storage Memory to construct the object in.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_new_inline(struct thread_task **task, void (*invoke)(void *),
+		       void (*destroy)(void *), void **storage);
+
+/**
+ * Create a new task with a small callable object, like a lambda with a few
+ * captures. It is stored inside the task, so std::function and its possible
+ * allocation are avoided. Bigger callables go to the std::function version.
+ */
+template<typename F, typename T = std::decay_t<F>,
+	 typename = std::enable_if_t<
+		!std::is_convertible_v<T, thread_task_cb_f> &&
+		std::is_invocable_v<T &> &&
+		sizeof(T) <= TPOOL_TASK_INLINE_SIZE &&
+		alignof(T) <= alignof(max_align_t)>>
+int
+thread_task_new(struct thread_task **task, F &&function)
+{
+	void *storage;
+	thread_task_new_inline(task, [](void *p) { (*(T *)p)(); },
+			       [](void *p) { ((T *)p)->~T(); }, &storage);
+	new (storage) T(std::forward<F>(function));
+	return 0;
+}
+
+/**
+ * Versions of thread_task_new() reusing the tasks deleted before, so they
+ * never allocate memory when there are such tasks. A worker of @a pool
+ * reuses its own deleted tasks without locks. The task can be pushed into
+ * any pool, but has to be deleted before @a pool.
+ * @param pool Pool keeping the task when it is deleted, NULL for none.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ *
+ * @retval Always 0.
+ */
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     const thread_task_f &function);
+
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     thread_task_cb_f cb, void *arg);
+
+int
+thread_pool_task_new_inline(struct thread_pool *pool,
+			    struct thread_task **task, void (*invoke)(void *),
+			    void (*destroy)(void *), void **storage);
+
+template<typename F, typename T = std::decay_t<F>,
+	 typename = std::enable_if_t<
+		!std::is_convertible_v<T, thread_task_cb_f> &&
+		std::is_invocable_v<T &> &&
+		sizeof(T) <= TPOOL_TASK_INLINE_SIZE &&
+		alignof(T) <= alignof(max_align_t)>>
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     F &&function)
+{
+	void *storage;
+	thread_pool_task_new_inline(pool, task, [](void *p) { (*(T *)p)(); },
+				    [](void *p) { ((T *)p)->~T(); }, &storage);
+	new (storage) T(std::forward<F>(function));
+	return 0;
+}
+
 /**
  * Check if @a task is finished and joined.
  * @param task Task to check.
@@ -109,6 +431,8 @@ thread_task_is_running(const struct thread_task *task);
  * Join the task. If it is not finished, then wait until it is.
  * Note, this function does not delete task object. It can be
  * reused for a next task or deleted via thread_task_delete.
+ * Called from a task of the same pool, it runs the other queued
+ * tasks while waiting, so joining subtasks doesn't block the worker.
  * @param task Task to join.
  *
  * @retval 0 Success.
@@ -143,11 +467,157 @@ thread_task_timed_join(struct thread_task *task, double timeout);
  * @retval 0 Success.
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_IN_POOL - can not drop the task. It still
- *       is in a pool. Need to join it firstly.
+ *       is in a pool. Need to join it firstly. Or it still has a
+ *       prerequisite, not finished nor deleted.
  */
 int
 thread_task_delete(struct thread_task *task);
 
+/** Task group API. */
+
+/**
+ * Create a new group to wait for many tasks at once, like a latch.
+ * @param[out] group Pointer to store result group object.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_group_new(struct thread_task_group **group);
+
+/**
+ * Delete @a group, free its memory.
+ * @param group Group to delete.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_HAS_TASKS - the group has not finished tasks.
+ */
+int
+thread_task_group_delete(struct thread_task_group *group);
+
+/**
+ * Make @a task a member of @a group, or of no group if it is NULL. A group
+ * task is joined by the group: when it is finished it can be pushed again or
+ * deleted right away, without thread_task_join(), and
+ * thread_task_is_finished() is never true for it. The task keeps the group
+ * until it is changed.
+ * @param task Task to add.
+ * @param group Group to add to.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_group(struct thread_task *task,
+		      struct thread_task_group *group);
+
+/**
+ * Wait until all the pushed tasks of @a group are finished.
+ * @param group Group to join.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_group_join(struct thread_task_group *group);
+
+/** Task priority API. */
+
+/**
+ * Set the priority of @a task. A worker takes a high priority task first,
+ * if any is queued, unless it has just run TPOOL_HIGH_PRIORITY_BURST of
+ * them in a row. The tasks pushed by the workers are normally
+ * kept in their local queues, but the high and low priority ones go to
+ * the shared queues of the pool. The node hint is used only for the normal
+ * priority tasks.
+ * @param task Task to change.
+ * @param priority New priority.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - bad priority.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_priority(struct thread_task *task,
+			 enum thread_task_priority priority);
+
+/**
+ * Set the start deadline of a low priority task, relative to its push.
+ * When a queued low priority task misses it, the task is run before the
+ * normal priority ones, so it doesn't starve under load. The low priority
+ * tasks start in the order of their deadlines. The default is
+ * TPOOL_LOW_PRIORITY_DEADLINE_MS. The tasks of the other priorities are not
+ * affected.
+ * @param task Task to change.
+ * @param timeout Timeout in seconds.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - negative timeout.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_deadline(struct thread_task *task, double timeout);
+
+/** Task dependency API. */
+
+/**
+ * Make @a task wait for @a prerequisite. A pushed task with not finished
+ * prerequisites is not run and doesn't take a worker, it is put into the
+ * pool automatically when the last of them is finished. So a graph of tasks
+ * is pushed at once, in any order, and is run as the dependencies allow. A
+ * task made ready by a worker is run by the same worker next, unless stolen.
+ *
+ * The dependency is dropped when the prerequisite is finished or deleted, so
+ * each push of a reused task needs the dependencies added again. Until
+ * then the dependent task can't be deleted, even not pushed: delete or run
+ * its prerequisites first. A cycle makes the tasks wait forever.
+ * @param task Dependent task.
+ * @param prerequisite Task to finish before @a task is run.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the task depends on itself.
+ *     - TPOOL_ERR_TASK_IN_POOL - one of the tasks is in a pool.
+ */
+int
+thread_task_add_dependency(struct thread_task *task,
+			   struct thread_task *prerequisite);
+
+/** Task suspension API. */
+
+/**
+ * Suspend the running @a task. Called by the task's own function, before it
+ * hands out the task to be resumed. When the function returns, the task is
+ * not finished but parked: it doesn't take a worker, it can't be joined
+ * yet, and it stays counted in its pool. thread_task_resume() puts it into
+ * the pool again, and then the function is called once more, on any
+ * worker. So the function of a suspendable task is a state machine, like a
+ * coroutine, see thread_coro.h. A task resumed before its function returns
+ * is called again right away.
+ * @param task Task to suspend.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the task is not running, or is
+ *       already suspended.
+ */
+int
+thread_task_suspend(struct thread_task *task);
+
+/**
+ * Resume a suspended @a task. Can be called from any thread, including a
+ * worker of the same pool. The task keeps its pool, node and priority.
+ * @param task Task to resume.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_NOT_SUSPENDED - the task is not suspended.
+ */
+int
+thread_task_resume(struct thread_task *task);
+
 #if NEED_DETACH
 
 /**
@@ -0,0 +1,610 @@
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Benchmarks of the chat, a load generator. Run without arguments to execute
+ * all of them, or pass names of the needed ones. Build with
+ * CMAKE_BUILD_TYPE=Release to get meaningful numbers.
+ *
+ * The server runs in a child process, so the clients and the peers don't
+ * share one descriptor limit, and the clients are driven by one epoll in
+ * the parent.
+ */
+
+enum {
+	/** Size of a lobby message, with the '\n'. */
+	BENCH_MSG_SIZE = 64,
+	/** Size of a message in the bandwidth bench. */
+	BENCH_BIG_MSG_SIZE = 1024,
+	/** Messages received at once in the parse bench. */
+	BENCH_PARSE_BATCH = 64,
+	/** Max events taken from the clients' epoll at once. */
+	BENCH_EPOLL_BATCH = 256,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Allow as many descriptors as the hard limit does. */
+static void
+bench_raise_fd_limit(void)
+{
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+		return;
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+}
+
+/** A server in a child process. */
+struct bench_server {
+	pid_t pid;
+	uint16_t port;
+	/** The backend the server has got. */
+	enum chat_backend backend;
+	/** Server's syscall counter, in memory shared with the child. */
+	uint64_t *syscalls;
+};
+
+/**
+ * Start a server in a child process. It serves until killed, dropping the
+ * messages it gets.
+ * @param reactor_count Number of the server's reactors.
+ * @param backend Backend of the server.
+ * @param output_limit Output limit of a client, 0 is no limit.
+ * @param policy Policy of the output limit.
+ */
+static void
+bench_server_start(struct bench_server *bs, int reactor_count,
+		   enum chat_backend backend, size_t output_limit,
+		   enum chat_output_policy policy)
+{
+	void *shared = mmap(NULL, sizeof(*bs->syscalls),
+			    PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		abort();
+	bs->syscalls = (uint64_t *)shared;
+	int fds[2];
+	if (pipe(fds) != 0)
+		abort();
+	pid_t pid = fork();
+	if (pid < 0)
+		abort();
+	if (pid > 0) {
+		close(fds[1]);
+		bs->pid = pid;
+		if (read(fds[0], &bs->port, sizeof(bs->port)) !=
+		    sizeof(bs->port) ||
+		    read(fds[0], &bs->backend, sizeof(bs->backend)) !=
+		    sizeof(bs->backend))
+			abort();
+		close(fds[0]);
+		return;
+	}
+	close(fds[0]);
+	struct chat_server *server = chat_server_new();
+	if (chat_server_set_reactor_count(server, reactor_count) != 0 ||
+	    chat_server_set_backend(server, backend) != 0 ||
+	    chat_server_set_output_limit(server, output_limit, policy) != 0 ||
+	    chat_server_listen(server, 0) != 0)
+		abort();
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	getsockname(chat_server_get_socket(server), (struct sockaddr *)&addr,
+		    &len);
+	uint16_t res = ntohs(addr.sin_port);
+	backend = chat_server_get_backend(server);
+	if (write(fds[1], &res, sizeof(res)) != sizeof(res) ||
+	    write(fds[1], &backend, sizeof(backend)) != sizeof(backend))
+		abort();
+	close(fds[1]);
+	while (true) {
+		int rc = chat_server_update(server, -1);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+			_exit(1);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(server)) != NULL)
+			delete msg;
+		__atomic_store_n(bs->syscalls,
+				 chat_server_get_syscall_count(server),
+				 __ATOMIC_RELAXED);
+	}
+}
+
+/** CPU time the server has spent, in nanoseconds, from /proc. */
+static uint64_t
+bench_server_cpu_ns(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	unsigned long utime = 0, stime = 0;
+	/* The name in parentheses can't have spaces, it is "bench". */
+	if (fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		   "%lu %lu", &utime, &stime) != 2)
+		utime = stime = 0;
+	fclose(f);
+	return (uint64_t)(utime + stime) * 1000000000 / sysconf(_SC_CLK_TCK);
+}
+
+/** Current and peak resident memory of the server, in KiB, from /proc. */
+static void
+bench_server_rss(pid_t pid, size_t *rss, size_t *peak)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	FILE *f = fopen(path, "r");
+	*rss = *peak = 0;
+	if (f == NULL)
+		return;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		sscanf(line, "VmRSS: %zu", rss);
+		sscanf(line, "VmHWM: %zu", peak);
+	}
+	fclose(f);
+}
+
+static uint64_t
+bench_server_syscalls(const struct bench_server *bs)
+{
+	return __atomic_load_n(bs->syscalls, __ATOMIC_RELAXED);
+}
+
+static void
+bench_server_stop(struct bench_server *bs)
+{
+	kill(bs->pid, SIGKILL);
+	waitpid(bs->pid, NULL, 0);
+	munmap(bs->syscalls, sizeof(*bs->syscalls));
+}
+
+/** Clients connected to one server, with an epoll to drive them. */
+struct bench_clients {
+	struct chat_client **clients;
+	int count;
+	int epoll;
+	/** Size of the sent messages, with the '\n'. */
+	int msg_size;
+	/** Messages received by each client. */
+	int64_t *received;
+	/** Delivery latencies of the timed messages. */
+	std::vector<uint64_t> latencies;
+};
+
+static void
+bench_clients_connect(struct bench_clients *bc, uint16_t port, int count,
+		      int msg_size, enum chat_framing framing)
+{
+	char addr[64];
+	snprintf(addr, sizeof(addr), "127.0.0.1:%u", port);
+	bc->clients = new chat_client *[count];
+	bc->received = new int64_t[count]();
+	bc->count = count;
+	bc->msg_size = msg_size;
+	bc->epoll = epoll_create1(0);
+	if (bc->epoll < 0)
+		abort();
+	for (int i = 0; i < count; ++i) {
+		char name[32];
+		snprintf(name, sizeof(name), "bench_%d", i);
+		struct chat_client *c = chat_client_new(name);
+		chat_client_set_framing(c, framing);
+		if (chat_client_connect(c, addr) != 0) {
+			printf("connect failed: %s\n", strerror(errno));
+			abort();
+		}
+		bc->clients[i] = c;
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.u64 = i;
+		epoll_ctl(bc->epoll, EPOLL_CTL_ADD,
+			  chat_client_get_descriptor(c), &ev);
+		/* Send the name. */
+		chat_client_update(c, 0);
+	}
+}
+
+static void
+bench_clients_delete(struct bench_clients *bc)
+{
+	for (int i = 0; i < bc->count; ++i)
+		chat_client_delete(bc->clients[i]);
+	close(bc->epoll);
+	delete[] bc->clients;
+	delete[] bc->received;
+}
+
+/** Feed a message stamped with the current time to client @a i. */
+static void
+bench_clients_send(struct bench_clients *bc, int i)
+{
+	char msg[BENCH_BIG_MSG_SIZE];
+	int size = bc->msg_size;
+	int len = snprintf(msg, size, "%" PRIu64 " ", bench_now_ns());
+	memset(msg + len, 'x', size - 1 - len);
+	msg[size - 1] = '\n';
+	chat_client_feed(bc->clients[i], msg, size);
+	/* No EPOLLOUT edge comes for an already writable socket. */
+	chat_client_update(bc->clients[i], 0);
+}
+
+/**
+ * Handle the client events for @a timeout_ms at most. The received messages
+ * are counted, and their latencies are saved if @a is_timed.
+ * @retval Number of received messages.
+ */
+static int64_t
+bench_clients_poll(struct bench_clients *bc, int timeout_ms, bool is_timed)
+{
+	struct epoll_event events[BENCH_EPOLL_BATCH];
+	int count = epoll_wait(bc->epoll, events, BENCH_EPOLL_BATCH,
+			       timeout_ms);
+	int64_t total = 0;
+	for (int e = 0; e < count; ++e) {
+		int i = (int)events[e].data.u64;
+		struct chat_client *c = bc->clients[i];
+		chat_client_update(c, 0);
+		struct chat_message *msg;
+		uint64_t now = bench_now_ns();
+		while ((msg = chat_client_pop_next(c)) != NULL) {
+			if (is_timed) {
+				/* The number is followed by a space. */
+				uint64_t sent = strtoull(
+					chat_message_get_data(msg).data(),
+					NULL, 10);
+				bc->latencies.push_back(now - sent);
+			}
+			++bc->received[i];
+			++total;
+			delete msg;
+		}
+	}
+	return total;
+}
+
+/**
+ * Wait until the server has accepted all the clients: send pings from the
+ * first client until each other one has got at least one.
+ */
+static void
+bench_clients_warm_up(struct bench_clients *bc)
+{
+	while (true) {
+		bool is_ready = true;
+		for (int i = 1; i < bc->count && is_ready; ++i)
+			is_ready = bc->received[i] > 0;
+		if (is_ready)
+			break;
+		bench_clients_send(bc, 0);
+		uint64_t deadline = bench_now_ns() + 100 * 1000000;
+		while (bench_now_ns() < deadline)
+			bench_clients_poll(bc, 10, false);
+	}
+	/* Drain the rest of the pings. */
+	while (bench_clients_poll(bc, 100, false) != 0) {
+	}
+}
+
+/**
+ * Lobby load: in each round @a sender_count clients send a message of
+ * @a msg_size bytes, and the round ends when all the other clients have got
+ * all of them. Reports the delivered messages and bytes per second, the
+ * server's CPU time and syscalls per delivered message, and the latency
+ * from feed to pop.
+ */
+static void
+bench_load_with(int reactor_count, enum chat_backend backend,
+		enum chat_framing framing, int client_count, int sender_count,
+		int rounds, int msg_size)
+{
+	struct bench_server bs;
+	bench_server_start(&bs, reactor_count, backend, 0,
+			   CHAT_OUTPUT_DROP_OLDEST);
+	pid_t pid = bs.pid;
+	struct bench_clients bc;
+	bench_clients_connect(&bc, bs.port, client_count, msg_size, framing);
+	bench_clients_warm_up(&bc);
+
+	int64_t per_round = (int64_t)sender_count * (client_count - 1);
+	bc.latencies.reserve(per_round * rounds);
+	uint64_t start = bench_now_ns();
+	uint64_t cpu_start = bench_server_cpu_ns(pid);
+	uint64_t syscalls_start = bench_server_syscalls(&bs);
+	for (int r = 0; r < rounds; ++r) {
+		for (int s = 0; s < sender_count; ++s) {
+			bench_clients_send(&bc,
+					   s * client_count / sender_count);
+		}
+		int64_t received = 0;
+		while (received < per_round)
+			received += bench_clients_poll(&bc, -1, true);
+	}
+	uint64_t ns = bench_now_ns() - start;
+	uint64_t cpu_ns = bench_server_cpu_ns(pid) - cpu_start;
+	uint64_t syscalls = bench_server_syscalls(&bs) - syscalls_start;
+	std::vector<uint64_t> &lat = bc.latencies;
+	std::sort(lat.begin(), lat.end());
+	double msg_per_sec = lat.size() * 1e9 / ns;
+	printf("%-5s %-6s %d reactors %6d clients %3d senders %10.0f msg/s "
+	       "%8.1f MB/s  server %6.0f ns/msg %6.3f syscalls/msg  "
+	       "p50 %9.1f us  p99 %9.1f us\n",
+	       bs.backend == CHAT_BACKEND_URING ? "uring" : "epoll",
+	       framing == CHAT_FRAMING_BINARY ? "binary" : "text",
+	       reactor_count, client_count, sender_count, msg_per_sec,
+	       msg_per_sec * msg_size / 1e6, (double)cpu_ns / lat.size(),
+	       (double)syscalls / lat.size(), lat[lat.size() / 2] / 1e3,
+	       lat[lat.size() * 99 / 100] / 1e3);
+	bench_clients_delete(&bc);
+	bench_server_stop(&bs);
+}
+
+static void
+bench_load_of(int reactor_count, int client_count, int sender_count,
+	      int rounds, int msg_size)
+{
+	bench_load_with(reactor_count, CHAT_BACKEND_EPOLL, CHAT_FRAMING_TEXT,
+			client_count, sender_count, rounds, msg_size);
+}
+
+static void
+bench_load(void)
+{
+	printf("# lobby broadcast of %d byte messages, delivered messages\n",
+	       BENCH_MSG_SIZE);
+	bench_load_of(1, 1000, 10, 100, BENCH_MSG_SIZE);
+	bench_load_of(1, 10000, 10, 10, BENCH_MSG_SIZE);
+}
+
+static void
+bench_broadcast(void)
+{
+	printf("# broadcast bandwidth of %d byte messages\n",
+	       BENCH_BIG_MSG_SIZE);
+	bench_load_of(1, 1000, 1, 200, BENCH_BIG_MSG_SIZE);
+	bench_load_of(1, 1000, 10, 50, BENCH_BIG_MSG_SIZE);
+}
+
+static void
+bench_reactors(void)
+{
+	printf("# lobby broadcast of %d byte messages, server's reactors\n",
+	       BENCH_MSG_SIZE);
+	for (int count = 1; count <= 8; count *= 2)
+		bench_load_of(count, 1000, 10, 100, BENCH_MSG_SIZE);
+}
+
+static void
+bench_uring(void)
+{
+	printf("# server backends, lobby broadcast\n");
+	const enum chat_backend backends[] = {
+		CHAT_BACKEND_EPOLL, CHAT_BACKEND_URING,
+	};
+	for (enum chat_backend b : backends) {
+		bench_load_with(1, b, CHAT_FRAMING_TEXT, 1000, 1, 200, BENCH_MSG_SIZE);
+		bench_load_with(1, b, CHAT_FRAMING_TEXT, 1000, 10, 100, BENCH_MSG_SIZE);
+		bench_load_with(1, b, CHAT_FRAMING_TEXT, 1000, 10, 50, BENCH_BIG_MSG_SIZE);
+		bench_load_with(1, b, CHAT_FRAMING_TEXT, 10000, 10, 10, BENCH_MSG_SIZE);
+	}
+}
+
+/**
+ * A client connects and never reads, another one sends 64 MiB. Reports the
+ * server's memory without an output limit and with each policy.
+ */
+static void
+bench_slow_with(enum chat_backend backend, size_t limit,
+		enum chat_output_policy policy)
+{
+	/* Don't let the server inherit the previous runs' garbage. */
+	malloc_trim(0);
+	struct bench_server bs;
+	bench_server_start(&bs, 1, backend, limit, policy);
+	/* The child has inherited some of the parent's memory. */
+	size_t rss_start, peak;
+	bench_server_rss(bs.pid, &rss_start, &peak);
+	int slow = socket(AF_INET, SOCK_STREAM, 0);
+	int size = 4096;
+	setsockopt(slow, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(bs.port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(slow, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    send(slow, "slow\n", 5, 0) != 5)
+		abort();
+	char addr_str[64];
+	snprintf(addr_str, sizeof(addr_str), "127.0.0.1:%u", bs.port);
+	struct chat_client *fast = chat_client_new("fast");
+	if (chat_client_connect(fast, addr_str) != 0)
+		abort();
+	std::string msg(BENCH_BIG_MSG_SIZE, 'x');
+	msg.back() = '\n';
+	int count = 64 * 1024 * 1024 / BENCH_BIG_MSG_SIZE;
+	for (int i = 0; i < count; ++i) {
+		chat_client_feed(fast, msg.data(), msg.size());
+		chat_client_update(fast, 0);
+	}
+	/* Let the server take what it can. With the pause it is stuck. */
+	uint64_t deadline = bench_now_ns() + 500 * 1000000;
+	while (bench_now_ns() < deadline)
+		chat_client_update(fast, 0.01);
+	size_t rss;
+	bench_server_rss(bs.pid, &rss, &peak);
+	const char *names[] = {"drop oldest", "disconnect", "pause"};
+	printf("%-5s %-11s server RSS %7zu KiB at start, %7zu KiB peak\n",
+	       bs.backend == CHAT_BACKEND_URING ? "uring" : "epoll",
+	       limit == 0 ? "no limit" : names[policy], rss_start, peak);
+	chat_client_delete(fast);
+	close(slow);
+	bench_server_stop(&bs);
+}
+
+static void
+bench_slow(void)
+{
+	printf("# a client doesn't read, 64 MiB broadcast, 64 KiB output "
+	       "limit\n");
+	const enum chat_backend backends[] = {
+		CHAT_BACKEND_EPOLL, CHAT_BACKEND_URING,
+	};
+	for (enum chat_backend b : backends) {
+		bench_slow_with(b, 0, CHAT_OUTPUT_DROP_OLDEST);
+		bench_slow_with(b, 64 * 1024, CHAT_OUTPUT_DROP_OLDEST);
+		bench_slow_with(b, 64 * 1024, CHAT_OUTPUT_DISCONNECT);
+		bench_slow_with(b, 64 * 1024, CHAT_OUTPUT_PAUSE);
+	}
+}
+
+/**
+ * Parse cost of a message on the server, from the received bytes to a
+ * message for the application and a buffer to forward. A line is scanned
+ * for '\n', trimmed, copied into the message and encoded again. A frame is
+ * cut by its header and copied once, the message views it.
+ */
+static void
+bench_framing_parse(enum chat_framing framing, int msg_size)
+{
+	const std::string author = "bench_author";
+	std::string data(msg_size - 1, 'x');
+	std::string batch;
+	for (int i = 0; i < BENCH_PARSE_BATCH; ++i) {
+		if (framing == CHAT_FRAMING_TEXT) {
+			batch += data;
+			batch += '\n';
+			continue;
+		}
+		struct chat_buf *frame = chat_frame_new(author, data, 0);
+		batch.append(frame->data, frame->size);
+		chat_buf_unref(frame);
+	}
+	struct chat_ring ring;
+	size_t scanned = 0;
+	std::string line;
+	int64_t count = std::max(256 * 1024 * 1024 / msg_size,
+				 BENCH_PARSE_BATCH * 100);
+	uint64_t ns = 0;
+	for (int64_t done = 0; done < count; done += BENCH_PARSE_BATCH) {
+		/* As a recv() would. */
+		chat_ring_append(&ring, batch.data(), batch.size());
+		uint64_t start = bench_now_ns();
+		for (int i = 0; i < BENCH_PARSE_BATCH; ++i) {
+			struct chat_message *msg;
+			struct chat_buf *buf;
+			if (framing == CHAT_FRAMING_BINARY) {
+				if (chat_ring_read_frame(&ring, &buf) <= 0)
+					abort();
+				msg = chat_message_new_from_frame(buf);
+				if (msg->frame_author != author)
+					abort();
+				chat_buf_unref(buf);
+				delete msg;
+				continue;
+			}
+			if (!chat_ring_read_line(&ring, &scanned, &line))
+				abort();
+			std::string_view text = chat_trim(line);
+			msg = new chat_message();
+#if NEED_AUTHOR
+			msg->author = author;
+			buf = chat_buf_new(author.size() + text.size() + 2);
+			char *pos = buf->data;
+			memcpy(pos, author.data(), author.size());
+			pos += author.size();
+			*pos++ = '\n';
+#else
+			buf = chat_buf_new(text.size() + 1);
+			char *pos = buf->data;
+#endif
+			msg->data = text;
+			memcpy(pos, text.data(), text.size());
+			pos[text.size()] = '\n';
+			chat_buf_unref(buf);
+			delete msg;
+		}
+		ns += bench_now_ns() - start;
+	}
+	printf("%-6s %5d bytes %8.1f ns/msg %8.2f GB/s\n",
+	       framing == CHAT_FRAMING_BINARY ? "binary" : "text", msg_size,
+	       (double)ns / count, (double)count * msg_size / ns);
+}
+
+static void
+bench_framing(void)
+{
+	printf("# parse cost of a message on the server\n");
+	const enum chat_framing framings[] = {
+		CHAT_FRAMING_TEXT, CHAT_FRAMING_BINARY,
+	};
+	const int sizes[] = {BENCH_MSG_SIZE, BENCH_BIG_MSG_SIZE, 16 * 1024};
+	for (int size : sizes) {
+		for (enum chat_framing f : framings)
+			bench_framing_parse(f, size);
+	}
+	printf("# framings, lobby broadcast\n");
+	for (enum chat_framing f : framings) {
+		bench_load_with(1, CHAT_BACKEND_EPOLL, f, 1000, 10, 100,
+				BENCH_MSG_SIZE);
+		bench_load_with(1, CHAT_BACKEND_EPOLL, f, 1000, 10, 50,
+				BENCH_BIG_MSG_SIZE);
+	}
+}
+
+struct bench {
+	const char *name;
+	void (*func)(void);
+};
+
+static const struct bench benches[] = {
+	{"load", bench_load},
+	{"broadcast", bench_broadcast},
+	{"reactors", bench_reactors},
+	{"uring", bench_uring},
+	{"slow", bench_slow},
+	{"framing", bench_framing},
+};
+
+int
+main(int argc, char **argv)
+{
+	bench_raise_fd_limit();
+	for (const struct bench &b : benches) {
+		bool is_needed = argc < 2;
+		for (int i = 1; i < argc && !is_needed; ++i)
+			is_needed = strcmp(argv[i], b.name) == 0;
+		if (is_needed)
+			b.func();
+	}
+	return 0;
+}
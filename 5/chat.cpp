@@ -1,6 +1,11 @@
 #include "chat.h"
 
+#include <algorithm>
+#include <ctype.h>
 #include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 int
 chat_events_to_poll_events(int mask)
@@ -12,3 +17,299 @@ chat_events_to_poll_events(int mask)
 		res |= POLLOUT;
 	return res;
 }
+
+std::string_view
+chat_trim(std::string_view str)
+{
+	size_t begin = 0;
+	size_t end = str.size();
+	while (begin < end && isspace((unsigned char)str[begin]))
+		++begin;
+	while (end > begin && isspace((unsigned char)str[end - 1]))
+		--end;
+	return str.substr(begin, end - begin);
+}
+
+void
+chat_ring_reserve(struct chat_ring *ring, size_t size)
+{
+	size_t used = chat_ring_size(ring);
+	if (ring->capacity - used >= size)
+		return;
+	size_t capacity = ring->capacity;
+	if (capacity == 0)
+		capacity = CHAT_RING_MIN_CAPACITY;
+	while (capacity - used < size)
+		capacity *= 2;
+	char *data = new char[capacity];
+	chat_ring_copy(ring, used, data);
+	delete[] ring->data;
+	ring->data = data;
+	ring->capacity = capacity;
+	ring->head = 0;
+	ring->tail = used;
+}
+
+/**
+ * Get the parts of @a ring from @a begin to @a end positions, split by the
+ * wrap. Returns the number of the parts.
+ */
+static int
+chat_ring_iov(const struct chat_ring *ring, size_t begin, size_t end,
+	      struct iovec *iov)
+{
+	if (begin == end)
+		return 0;
+	size_t mask = ring->capacity - 1;
+	size_t offset = begin & mask;
+	size_t size = std::min(end - begin, ring->capacity - offset);
+	iov[0].iov_base = ring->data + offset;
+	iov[0].iov_len = size;
+	if (size == end - begin)
+		return 1;
+	iov[1].iov_base = ring->data;
+	iov[1].iov_len = end - begin - size;
+	return 2;
+}
+
+void
+chat_ring_append(struct chat_ring *ring, const char *data, size_t size)
+{
+	chat_ring_reserve(ring, size);
+	struct iovec iov[2];
+	int count = chat_ring_iov(ring, ring->tail, ring->tail + size, iov);
+	for (int i = 0; i < count; ++i) {
+		memcpy(iov[i].iov_base, data, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+	ring->tail += size;
+}
+
+void
+chat_ring_swap(struct chat_ring *a, struct chat_ring *b)
+{
+	std::swap(a->data, b->data);
+	std::swap(a->capacity, b->capacity);
+	std::swap(a->head, b->head);
+	std::swap(a->tail, b->tail);
+}
+
+void
+chat_ring_consume(struct chat_ring *ring, size_t size)
+{
+	ring->head += size;
+	if (ring->head != ring->tail)
+		return;
+	/* Start over, so the next data is not wrapped. */
+	ring->head = 0;
+	ring->tail = 0;
+	if (ring->capacity > CHAT_RING_KEEP_CAPACITY) {
+		delete[] ring->data;
+		ring->data = NULL;
+		ring->capacity = 0;
+	}
+}
+
+bool
+chat_ring_find(const struct chat_ring *ring, char c, size_t offset,
+	       size_t *pos)
+{
+	struct iovec iov[2];
+	int count = chat_ring_iov(ring, ring->head + offset, ring->tail, iov);
+	for (int i = 0; i < count; ++i) {
+		const char *found = (const char *)memchr(iov[i].iov_base, c,
+							 iov[i].iov_len);
+		if (found != NULL) {
+			*pos = offset + (found - (const char *)iov[i].iov_base);
+			return true;
+		}
+		offset += iov[i].iov_len;
+	}
+	return false;
+}
+
+void
+chat_ring_copy(const struct chat_ring *ring, size_t size, char *dst)
+{
+	struct iovec iov[2];
+	int count = chat_ring_iov(ring, ring->head, ring->head + size, iov);
+	for (int i = 0; i < count; ++i) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+}
+
+ssize_t
+chat_ring_recv(struct chat_ring *ring, int fd)
+{
+	chat_ring_reserve(ring, CHAT_RING_MIN_CAPACITY);
+	struct iovec iov[2];
+	int count = chat_ring_iov(ring, ring->tail,
+				  ring->head + ring->capacity, iov);
+	ssize_t rc = readv(fd, iov, count);
+	if (rc > 0)
+		ring->tail += rc;
+	return rc;
+}
+
+ssize_t
+chat_ring_send(struct chat_ring *ring, int fd)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = chat_ring_iov(ring, ring->head, ring->tail, iov);
+	/* A closed peer is an error, not a SIGPIPE. */
+	ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	if (rc > 0)
+		chat_ring_consume(ring, rc);
+	return rc;
+}
+
+bool
+chat_ring_read_line(struct chat_ring *ring, size_t *scanned,
+		    std::string *line)
+{
+	size_t pos;
+	if (!chat_ring_find(ring, '\n', *scanned, &pos)) {
+		*scanned = chat_ring_size(ring);
+		return false;
+	}
+	line->resize(pos);
+	chat_ring_copy(ring, pos, line->data());
+	chat_ring_consume(ring, pos + 1);
+	*scanned = 0;
+	return true;
+}
+
+struct chat_buf *
+chat_buf_new(size_t size)
+{
+	char *mem = new char[sizeof(struct chat_buf) + size];
+	struct chat_buf *buf = (struct chat_buf *)mem;
+	buf->ref_count = 1;
+	buf->type = CHAT_BUF_TEXT;
+	buf->size = size;
+	buf->next = NULL;
+	buf->data = mem + sizeof(*buf);
+	return buf;
+}
+
+void
+chat_buf_unref(struct chat_buf *buf)
+{
+	if (--buf->ref_count == 0)
+		delete[] (char *)buf;
+}
+
+const char CHAT_FRAME_MAGIC[CHAT_FRAME_MAGIC_SIZE] = {'\0', 'C', 'F', '1'};
+
+static inline void
+chat_store_u32(char *dst, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		dst[i] = (char)(value >> (8 * i));
+}
+
+static inline uint32_t
+chat_load_u32(const char *src)
+{
+	uint32_t res = 0;
+	for (int i = 0; i < 4; ++i)
+		res |= (uint32_t)(unsigned char)src[i] << (8 * i);
+	return res;
+}
+
+void
+chat_frame_header_encode(const struct chat_frame_header *hdr, char *dst)
+{
+	chat_store_u32(dst, hdr->author_size);
+	chat_store_u32(dst + 4, hdr->data_size);
+	dst[8] = (char)hdr->flags;
+	dst[9] = (char)(hdr->flags >> 8);
+	/* Reserved. */
+	dst[10] = 0;
+	dst[11] = 0;
+}
+
+void
+chat_frame_header_decode(const char *src, struct chat_frame_header *hdr)
+{
+	hdr->author_size = chat_load_u32(src);
+	hdr->data_size = chat_load_u32(src + 4);
+	hdr->flags = (uint16_t)((unsigned char)src[8] |
+				(unsigned char)src[9] << 8);
+}
+
+struct chat_buf *
+chat_frame_new(std::string_view author, std::string_view data,
+	       uint16_t flags)
+{
+	struct chat_frame_header hdr;
+	hdr.author_size = author.size();
+	hdr.data_size = data.size();
+	hdr.flags = flags;
+	struct chat_buf *buf = chat_buf_new(CHAT_FRAME_HEADER_SIZE +
+					    author.size() + data.size());
+	buf->type = CHAT_BUF_FRAME;
+	chat_frame_header_encode(&hdr, buf->data);
+	char *pos = buf->data + CHAT_FRAME_HEADER_SIZE;
+	memcpy(pos, author.data(), author.size());
+	memcpy(pos + author.size(), data.data(), data.size());
+	return buf;
+}
+
+void
+chat_frame_parse(const struct chat_buf *frame, struct chat_frame_header *hdr,
+		 std::string_view *author, std::string_view *data)
+{
+	chat_frame_header_decode(frame->data, hdr);
+	const char *pos = frame->data + CHAT_FRAME_HEADER_SIZE;
+	*author = std::string_view(pos, hdr->author_size);
+	*data = std::string_view(pos + hdr->author_size, hdr->data_size);
+}
+
+int
+chat_ring_read_frame(struct chat_ring *ring, struct chat_buf **frame)
+{
+	size_t size = chat_ring_size(ring);
+	if (size < CHAT_FRAME_HEADER_SIZE)
+		return 0;
+	char head[CHAT_FRAME_HEADER_SIZE];
+	chat_ring_copy(ring, sizeof(head), head);
+	struct chat_frame_header hdr;
+	chat_frame_header_decode(head, &hdr);
+	if ((size_t)hdr.author_size + hdr.data_size > CHAT_FRAME_MAX_SIZE)
+		return -1;
+	size_t frame_size = CHAT_FRAME_HEADER_SIZE + (size_t)hdr.author_size +
+			    hdr.data_size;
+	if (size < frame_size) {
+		/* The rest is received in place, without regrowing. */
+		chat_ring_reserve(ring, frame_size - size);
+		return 0;
+	}
+	struct chat_buf *buf = chat_buf_new(frame_size);
+	buf->type = CHAT_BUF_FRAME;
+	chat_ring_copy(ring, frame_size, buf->data);
+	chat_ring_consume(ring, frame_size);
+	*frame = buf;
+	return 1;
+}
+
+struct chat_message *
+chat_message_new_from_frame(struct chat_buf *frame)
+{
+	struct chat_message *msg = new chat_message();
+	struct chat_frame_header hdr;
+	chat_frame_parse(frame, &hdr, &msg->frame_author, &msg->frame_data);
+	chat_buf_ref(frame);
+	msg->frame = frame;
+	return msg;
+}
+
+chat_message::~chat_message()
+{
+	if (frame != NULL)
+		chat_buf_unref(frame);
+}
@@ -13,10 +13,14 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_AUTHOR 0
-#define NEED_SERVER_FEED 0
+#define NEED_AUTHOR 1
+#define NEED_SERVER_FEED 1
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
+#include <string_view>
+#include <sys/types.h>
 
 enum chat_errcode {
 	CHAT_ERR_INVALID_ARGUMENT = 1,
@@ -34,6 +38,32 @@ enum chat_events {
 	CHAT_EVENT_OUTPUT = 2,
 };
 
+/** The kernel interface a server or a client does its I/O with. */
+enum chat_backend {
+	/** epoll for the server, poll for the client. Always available. */
+	CHAT_BACKEND_EPOLL,
+	/**
+	 * io_uring: multishot accept and receive into provided buffers, the
+	 * sends and the waiting are done in one syscall. When the kernel
+	 * doesn't support it, the epoll backend is used instead.
+	 */
+	CHAT_BACKEND_URING,
+};
+
+/** How the messages are encoded on the wire. */
+enum chat_framing {
+	/** '\n'-terminated lines: the author's one, if any, and the text. */
+	CHAT_FRAMING_TEXT,
+	/**
+	 * Length-prefixed frames, see chat_frame_header. The client asks for
+	 * it when connects, and the server forwards them as they come,
+	 * without scanning and copying into messages.
+	 */
+	CHAT_FRAMING_BINARY,
+};
+
+struct chat_buf;
+
 struct chat_message {
 #if NEED_AUTHOR
 	/** Author's name. */
@@ -41,10 +71,244 @@ struct chat_message {
 #endif
 	/** 0-terminate text. */
 	std::string data;
+	/**
+	 * A binary framed message is not copied out of its frame: the strings
+	 * above are empty, and the views point into the frame, which is shared
+	 * with the peers it is sent to. Use chat_message_get_author() and
+	 * chat_message_get_data() to read a message of any framing.
+	 */
+	struct chat_buf *frame = NULL;
+	std::string_view frame_author;
+	std::string_view frame_data;
 
-	/* PUT HERE OTHER MEMBERS */
+	chat_message() = default;
+	chat_message(const chat_message &) = delete;
+	chat_message &operator=(const chat_message &) = delete;
+	~chat_message();
 };
 
+#if NEED_AUTHOR
+static inline std::string_view
+chat_message_get_author(const struct chat_message *msg)
+{
+	if (msg->frame != NULL)
+		return msg->frame_author;
+	return msg->author;
+}
+#endif
+
+/** Text of the message. Not 0-terminated if it is a frame's view. */
+static inline std::string_view
+chat_message_get_data(const struct chat_message *msg)
+{
+	if (msg->frame != NULL)
+		return msg->frame_data;
+	return msg->data;
+}
+
 /** Convert chat_events mask to events suitable for poll(). */
 int
 chat_events_to_poll_events(int mask);
+
+/** Remove the isspace() characters from both ends of @a str. */
+std::string_view
+chat_trim(std::string_view str);
+
+enum {
+	/** The smallest ring buffer, and the least free space to read into. */
+	CHAT_RING_MIN_CAPACITY = 4096,
+	/** A bigger buffer is freed when becomes empty. */
+	CHAT_RING_KEEP_CAPACITY = 64 * 1024,
+};
+
+/**
+ * A ring buffer of bytes, growing when full. Used for the socket input and
+ * output: the data is received and sent with readv()/sendmsg() of the two
+ * parts around the wrap, so nothing is moved until the buffer grows.
+ */
+struct chat_ring {
+	char *data = NULL;
+	/** A power of 2, or 0 when nothing is allocated. */
+	size_t capacity = 0;
+	/** Read and write positions, not wrapped. */
+	size_t head = 0;
+	size_t tail = 0;
+
+	chat_ring() = default;
+	chat_ring(const chat_ring &) = delete;
+	chat_ring &operator=(const chat_ring &) = delete;
+
+	~chat_ring()
+	{
+		delete[] data;
+	}
+};
+
+static inline size_t
+chat_ring_size(const struct chat_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+/** Grow @a ring to have at least @a size bytes of free space. */
+void
+chat_ring_reserve(struct chat_ring *ring, size_t size);
+
+/** Copy @a size bytes of @a data to the end of @a ring. */
+void
+chat_ring_append(struct chat_ring *ring, const char *data, size_t size);
+
+/** Exchange the contents of @a a and @a b. */
+void
+chat_ring_swap(struct chat_ring *a, struct chat_ring *b);
+
+/** Drop @a size bytes from the beginning of @a ring. */
+void
+chat_ring_consume(struct chat_ring *ring, size_t size);
+
+/**
+ * Find the first @a c in @a ring, starting from @a offset bytes after the
+ * beginning.
+ * @retval true Found, its offset from the beginning is in @a pos.
+ * @retval false Not found.
+ */
+bool
+chat_ring_find(const struct chat_ring *ring, char c, size_t offset,
+	       size_t *pos);
+
+/** Copy @a size bytes from the beginning of @a ring to @a dst. */
+void
+chat_ring_copy(const struct chat_ring *ring, size_t size, char *dst);
+
+/**
+ * Receive from @a fd into the free space of @a ring, growing it if needed.
+ * @retval Result of readv().
+ */
+ssize_t
+chat_ring_recv(struct chat_ring *ring, int fd);
+
+/**
+ * Send the data of @a ring to @a fd and consume the sent part.
+ * @retval Result of sendmsg().
+ */
+ssize_t
+chat_ring_send(struct chat_ring *ring, int fd);
+
+/**
+ * Take a '\n'-terminated line from the beginning of @a ring, without the
+ * '\n'. @a scanned is how many bytes of @a ring are known to have no '\n',
+ * so a long line is not scanned again each time a part of it arrives.
+ * @retval true The line is in @a line.
+ * @retval false No full line yet.
+ */
+bool
+chat_ring_read_line(struct chat_ring *ring, size_t *scanned,
+		    std::string *line);
+
+/** What a chat_buf holds. */
+enum chat_buf_type {
+	/** A message as text lines. */
+	CHAT_BUF_TEXT,
+	/** A message as a binary frame. */
+	CHAT_BUF_FRAME,
+	/** The answer to the binary framing request, CHAT_FRAME_MAGIC. */
+	CHAT_BUF_MAGIC,
+};
+
+/**
+ * An encoded message shared by all the peers it is sent to, so a broadcast
+ * stores and copies it once. Freed when the last reference is dropped. The
+ * counter is not atomic: a buffer belongs to one thread at a time.
+ */
+struct chat_buf {
+	int ref_count;
+	enum chat_buf_type type;
+	size_t size;
+	/** Link in a mailbox of a server's reactor, while being posted. */
+	struct chat_buf *next;
+	/** The data, right after the header. */
+	char *data;
+};
+
+/** Create a text buffer of @a size bytes with one reference. */
+struct chat_buf *
+chat_buf_new(size_t size);
+
+static inline void
+chat_buf_ref(struct chat_buf *buf)
+{
+	++buf->ref_count;
+}
+
+void
+chat_buf_unref(struct chat_buf *buf);
+
+enum {
+	/** Size of an encoded chat_frame_header. */
+	CHAT_FRAME_HEADER_SIZE = 12,
+	/** Size of CHAT_FRAME_MAGIC. */
+	CHAT_FRAME_MAGIC_SIZE = 4,
+	/**
+	 * Max size of a frame's author and text together. A bigger frame
+	 * breaks the connection, so a header alone can't make the receiver
+	 * allocate gigabytes.
+	 */
+	CHAT_FRAME_MAX_SIZE = 64 * 1024 * 1024,
+};
+
+/**
+ * The binary framing request of a client, its first bytes. The server
+ * answers with the same bytes in place of a message, and the messages
+ * after them are frames. A text line can't start with '\0', so they are
+ * told from the text which the server has sent before.
+ */
+extern const char CHAT_FRAME_MAGIC[CHAT_FRAME_MAGIC_SIZE];
+
+enum chat_frame_flag {
+	/** The client's first frame, carrying only its name. */
+	CHAT_FRAME_HELLO = 1,
+};
+
+/**
+ * Header of a binary frame. Encoded as little-endian numbers in this
+ * order, followed by the author's name and the text.
+ */
+struct chat_frame_header {
+	uint32_t author_size;
+	uint32_t data_size;
+	/** chat_frame_flag mask. */
+	uint16_t flags;
+};
+
+void
+chat_frame_header_encode(const struct chat_frame_header *hdr, char *dst);
+
+void
+chat_frame_header_decode(const char *src, struct chat_frame_header *hdr);
+
+/** Create a frame buffer of a message, with one reference. */
+struct chat_buf *
+chat_frame_new(std::string_view author, std::string_view data,
+	       uint16_t flags);
+
+/** Get the header, the author and the text of a frame buffer. */
+void
+chat_frame_parse(const struct chat_buf *frame, struct chat_frame_header *hdr,
+		 std::string_view *author, std::string_view *data);
+
+/**
+ * Take a whole frame from the beginning of @a ring. Only its header is
+ * looked at, and the frame is copied into a new buffer at once.
+ * @retval 1 The frame is in @a frame, with one reference.
+ * @retval 0 No full frame yet. @a ring is grown to fit it.
+ * @retval -1 The frame is bigger than CHAT_FRAME_MAX_SIZE.
+ */
+int
+chat_ring_read_frame(struct chat_ring *ring, struct chat_buf **frame);
+
+/**
+ * Make a message viewing @a frame, referencing it. The message must be
+ * deleted in the thread owning the frame.
+ */
+struct chat_message *
+chat_message_new_from_frame(struct chat_buf *frame);
@@ -1,102 +1,616 @@
 #include "chat.h"
 #include "chat_client.h"
+#include "chat_uring.h"
 
 #include <cstring>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+enum {
+	/** io_uring: size of the submission queue. */
+	CHAT_CLIENT_URING_ENTRIES = 8,
+	/** io_uring: number and size of the provided receive buffers. */
+	CHAT_CLIENT_URING_BUF_COUNT = 64,
+	CHAT_CLIENT_URING_BUF_SIZE = 4096,
+};
+
+/** Kinds of the client's io_uring requests, stored in their user data. */
+enum chat_client_uring_op {
+	CHAT_CLIENT_URING_RECV = 1,
+	CHAT_CLIENT_URING_SEND,
+	CHAT_CLIENT_URING_CANCEL,
+};
+
 struct chat_client {
 	/** Socket connected to the server. */
 	int socket = -1;
-	/** Array of received messages. */
-	/* ... */
+	/** Received messages, not popped yet. */
+	std::deque<chat_message *> messages;
+	/** Input buffer. */
+	struct chat_ring in;
+	/** Bytes of the input known to have no '\n'. */
+	size_t in_scanned = 0;
 	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	struct chat_ring out;
+	/** The last fed line, not finished with '\n' yet. */
+	std::string feed_line;
+	/** Own name, sent to the server first. */
+	std::string name;
+	enum chat_backend backend = CHAT_BACKEND_EPOLL;
+	enum chat_framing framing = CHAT_FRAMING_TEXT;
+	/**
+	 * The server has answered the binary framing request, the input is
+	 * frames. Until then it is text.
+	 */
+	bool is_binary_in = false;
+	/** The ring when io_uring is the backend, instead of poll. */
+	struct chat_uring *uring = NULL;
+	/** io_uring: requests in flight. */
+	int uring_ops = 0;
+	/** io_uring: the multishot receive is armed. */
+	bool is_receiving = false;
+	/**
+	 * io_uring: the output being sent. The new output is appended to
+	 * the other buffer meanwhile, since it may be moved when grows.
+	 */
+	struct chat_ring sending;
+	bool is_sending = false;
+	struct msghdr send_msg;
+	struct iovec send_iov[2];
+#if NEED_AUTHOR
+	/** Author of the message being received, when its line is read. */
+	std::string author;
+	bool has_author = false;
+#endif
 };
 
 struct chat_client *
 chat_client_new(std::string_view name)
 {
-	/* Ignore 'name' param if don't want to support it for +5 points. */
-	(void)name;
-	/* IMPLEMENT THIS FUNCTION */
-	return new chat_client();
+	struct chat_client *client = new chat_client();
+	/*
+	 * The server drops them too. And a text name starting with '\0'
+	 * could be taken for CHAT_FRAME_MAGIC.
+	 */
+	size_t begin = name.find_first_not_of('\0');
+	if (begin != std::string_view::npos)
+		client->name = name.substr(begin);
+	return client;
+}
+
+int
+chat_client_set_backend(struct chat_client *client,
+			enum chat_backend backend)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	client->backend = backend;
+	return 0;
+}
+
+enum chat_backend
+chat_client_get_backend(const struct chat_client *client)
+{
+	return client->backend;
+}
+
+int
+chat_client_set_framing(struct chat_client *client,
+			enum chat_framing framing)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	client->framing = framing;
+	return 0;
+}
+
+/** Queue a frame of a message, built right in the output. */
+static void
+chat_client_send_frame(struct chat_client *client, std::string_view author,
+		       std::string_view data, uint16_t flags)
+{
+	struct chat_frame_header hdr;
+	hdr.author_size = author.size();
+	hdr.data_size = data.size();
+	hdr.flags = flags;
+	char head[CHAT_FRAME_HEADER_SIZE];
+	chat_frame_header_encode(&hdr, head);
+	chat_ring_append(&client->out, head, sizeof(head));
+	chat_ring_append(&client->out, author.data(), author.size());
+	chat_ring_append(&client->out, data.data(), data.size());
+}
+
+static int
+chat_client_uring_reap(struct chat_client *client);
+
+static void
+chat_client_uring_recv(struct chat_client *client);
+
+/**
+ * Close the ring. The kernel must not touch the buffers after, so all the
+ * requests are cancelled and waited for first.
+ */
+static void
+chat_client_uring_close(struct chat_client *client)
+{
+	struct chat_uring *ring = client->uring;
+	struct io_uring_sqe *sqe;
+	if (client->uring_ops > 0 &&
+	    (sqe = chat_uring_get_sqe(ring)) != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY |
+				    IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data = CHAT_CLIENT_URING_CANCEL;
+		++client->uring_ops;
+	}
+	while (client->uring_ops > 0) {
+		if (chat_uring_enter(ring, true, -1) < 0 && errno != EINTR)
+			break;
+		chat_client_uring_reap(client);
+	}
+	chat_uring_destroy(ring);
+	delete ring;
+	client->uring = NULL;
 }
 
 void
 chat_client_delete(struct chat_client *client)
 {
+	if (client->uring != NULL)
+		chat_client_uring_close(client);
 	if (client->socket >= 0)
 		close(client->socket);
-
-	/* IMPLEMENT THIS FUNCTION */
-
+	for (struct chat_message *msg : client->messages)
+		delete msg;
 	delete client;
 }
 
 int
 chat_client_connect(struct chat_client *client, std::string_view addr)
 {
-	/*
-	 * 1) Use getaddrinfo() to resolve addr to struct sockaddr_in.
-	 * 2) Create a client socket (function socket()).
-	 * 3) Connect it by the found address (function connect()).
-	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)addr;
-
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	size_t colon = addr.rfind(':');
+	if (colon == std::string_view::npos)
+		return CHAT_ERR_NO_ADDR;
+	std::string host(addr.substr(0, colon));
+	std::string port(addr.substr(colon + 1));
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addrs;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0)
+		return CHAT_ERR_NO_ADDR;
+	int sock = -1;
+	for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+		sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (connect(sock, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	if (sock < 0)
+		return CHAT_ERR_SYS;
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != 0) {
+		close(sock);
+		return CHAT_ERR_SYS;
+	}
+	client->socket = sock;
+	if (client->backend == CHAT_BACKEND_URING) {
+		client->uring = new chat_uring();
+		if (chat_uring_create(client->uring, CHAT_CLIENT_URING_ENTRIES,
+				      CHAT_CLIENT_URING_BUF_COUNT,
+				      CHAT_CLIENT_URING_BUF_SIZE) != 0) {
+			/* No io_uring in the kernel, or it is not allowed. */
+			delete client->uring;
+			client->uring = NULL;
+			client->backend = CHAT_BACKEND_EPOLL;
+		} else {
+			/* The caller may wait for the ring's descriptor. */
+			chat_client_uring_recv(client);
+			if (chat_uring_enter(client->uring, false, 0) < 0) {
+				chat_client_uring_close(client);
+				close(sock);
+				client->socket = -1;
+				return CHAT_ERR_SYS;
+			}
+		}
+	}
+	if (client->framing == CHAT_FRAMING_BINARY) {
+		chat_ring_append(&client->out, CHAT_FRAME_MAGIC,
+				 CHAT_FRAME_MAGIC_SIZE);
+#if NEED_AUTHOR
+		chat_client_send_frame(client, client->name, "",
+				       CHAT_FRAME_HELLO);
+#endif
+		return 0;
+	}
+#if NEED_AUTHOR
+	chat_ring_append(&client->out, client->name.data(),
+			 client->name.size());
+	chat_ring_append(&client->out, "\n", 1);
+#endif
+	return 0;
 }
 
 struct chat_message *
 chat_client_pop_next(struct chat_client *client)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	return NULL;
+	if (client->messages.empty())
+		return NULL;
+	struct chat_message *msg = client->messages.front();
+	client->messages.pop_front();
+	return msg;
+}
+
+/**
+ * Check if the server has answered the binary framing request, when a new
+ * message starts.
+ * @retval true The answer is taken, or it is text.
+ * @retval false Not enough input yet.
+ */
+static bool
+chat_client_check_magic(struct chat_client *client)
+{
+	if (client->framing != CHAT_FRAMING_BINARY)
+		return true;
+#if NEED_AUTHOR
+	/* Not a message start. */
+	if (client->has_author)
+		return true;
+#endif
+	size_t size = chat_ring_size(&client->in);
+	if (size == 0)
+		return false;
+	char magic[CHAT_FRAME_MAGIC_SIZE];
+	chat_ring_copy(&client->in, 1, magic);
+	/* A text line never starts with it. */
+	if (magic[0] != '\0')
+		return true;
+	if (size < CHAT_FRAME_MAGIC_SIZE)
+		return false;
+	chat_ring_copy(&client->in, CHAT_FRAME_MAGIC_SIZE, magic);
+	if (memcmp(magic, CHAT_FRAME_MAGIC, CHAT_FRAME_MAGIC_SIZE) != 0)
+		return true;
+	chat_ring_consume(&client->in, CHAT_FRAME_MAGIC_SIZE);
+	client->in_scanned = 0;
+	client->is_binary_in = true;
+	return true;
+}
+
+/**
+ * Turn the received lines into messages. Each message is the author's line
+ * followed by the text line, or just the text without the authors. After
+ * the server's answer to the binary framing request they are frames.
+ * @retval 0 Success.
+ * @retval -1 A frame is too big, the connection is to be closed.
+ */
+static int
+chat_client_parse(struct chat_client *client)
+{
+	std::string line;
+	while (true) {
+		if (client->is_binary_in) {
+			struct chat_buf *frame;
+			int rc = chat_ring_read_frame(&client->in, &frame);
+			if (rc < 0)
+				return -1;
+			if (rc == 0)
+				break;
+			client->messages.push_back(
+				chat_message_new_from_frame(frame));
+			chat_buf_unref(frame);
+			continue;
+		}
+		if (!chat_client_check_magic(client))
+			break;
+		if (client->is_binary_in)
+			continue;
+		if (!chat_ring_read_line(&client->in, &client->in_scanned,
+					 &line))
+			break;
+#if NEED_AUTHOR
+		if (!client->has_author) {
+			client->author = std::move(line);
+			client->has_author = true;
+			continue;
+		}
+		client->has_author = false;
+#endif
+		struct chat_message *msg = new chat_message();
+#if NEED_AUTHOR
+		msg->author = std::move(client->author);
+#endif
+		msg->data = std::move(line);
+		client->messages.push_back(msg);
+	}
+	return 0;
+}
+
+/**
+ * Read the socket until it is drained.
+ * @retval 0 Success.
+ * @retval -1 The connection is closed or broken, or a frame is too big.
+ */
+static int
+chat_client_read(struct chat_client *client)
+{
+	while (true) {
+		ssize_t rc = chat_ring_recv(&client->in, client->socket);
+		if (rc > 0)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc < 0 && errno == EINTR)
+			continue;
+		/* The messages received before the close are still valid. */
+		chat_client_parse(client);
+		return -1;
+	}
+	return chat_client_parse(client);
+}
+
+/**
+ * Send the output until it is empty or the socket is full.
+ * @retval 0 Success.
+ * @retval -1 The connection is broken.
+ */
+static int
+chat_client_write(struct chat_client *client)
+{
+	while (chat_ring_size(&client->out) != 0) {
+		ssize_t rc = chat_ring_send(&client->out, client->socket);
+		if (rc >= 0)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		if (errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/** Receive the data with one request, until it fails. */
+static void
+chat_client_uring_recv(struct chat_client *client)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(client->uring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->socket;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = CHAT_URING_BUF_GROUP;
+	sqe->user_data = CHAT_CLIENT_URING_RECV;
+	++client->uring_ops;
+	client->is_receiving = true;
+}
+
+/**
+ * Send all the output with one request. It is sent whole, or the
+ * connection is broken.
+ */
+static void
+chat_client_uring_send(struct chat_client *client)
+{
+	chat_ring_swap(&client->out, &client->sending);
+	struct chat_ring *out = &client->sending;
+	size_t mask = out->capacity - 1;
+	size_t offset = out->head & mask;
+	size_t size = chat_ring_size(out);
+	struct msghdr *msg = &client->send_msg;
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_iov = client->send_iov;
+	client->send_iov[0].iov_base = out->data + offset;
+	if (offset + size <= out->capacity) {
+		client->send_iov[0].iov_len = size;
+		msg->msg_iovlen = 1;
+	} else {
+		client->send_iov[0].iov_len = out->capacity - offset;
+		client->send_iov[1].iov_base = out->data;
+		client->send_iov[1].iov_len = size - (out->capacity - offset);
+		msg->msg_iovlen = 2;
+	}
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(client->uring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = client->socket;
+	sqe->addr = (uint64_t)msg;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = CHAT_CLIENT_URING_SEND;
+	++client->uring_ops;
+	client->is_sending = true;
+}
+
+/**
+ * Handle the io_uring completions.
+ * @retval Number of the completions, or -1 if the connection is broken.
+ */
+static int
+chat_client_uring_reap(struct chat_client *client)
+{
+	struct chat_uring *ring = client->uring;
+	bool is_broken = false;
+	int count = 0;
+	struct io_uring_cqe *cqe;
+	while ((cqe = chat_uring_peek_cqe(ring)) != NULL) {
+		uint64_t op = cqe->user_data;
+		int res = cqe->res;
+		uint32_t flags = cqe->flags;
+		chat_uring_cqe_seen(ring);
+		++count;
+		bool is_more = (flags & IORING_CQE_F_MORE) != 0;
+		if (!is_more)
+			--client->uring_ops;
+		if (op == CHAT_CLIENT_URING_RECV) {
+			if ((flags & IORING_CQE_F_BUFFER) != 0) {
+				uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+				if (res > 0) {
+					chat_ring_append(
+						&client->in,
+						chat_uring_buf(ring, bid), res);
+				}
+				chat_uring_buf_recycle(ring, bid);
+			}
+			if (!is_more)
+				client->is_receiving = false;
+			/* Out of the buffers, or the kernel has ended it. */
+			if (res <= 0 && res != -ENOBUFS)
+				is_broken = true;
+		} else if (op == CHAT_CLIENT_URING_SEND) {
+			client->is_sending = false;
+			if (res < 0 ||
+			    (size_t)res != chat_ring_size(&client->sending))
+				is_broken = true;
+			else
+				chat_ring_consume(&client->sending, res);
+		}
+	}
+	if (count != 0 && chat_client_parse(client) != 0)
+		is_broken = true;
+	return is_broken ? -1 : count;
+}
+
+/**
+ * The io_uring update. One syscall submits the requests and waits for the
+ * completions.
+ */
+static int
+chat_client_uring_update(struct chat_client *client, int timeout_ms)
+{
+	struct chat_uring *ring = client->uring;
+	if (!client->is_receiving)
+		chat_client_uring_recv(client);
+	if (!client->is_sending && chat_ring_size(&client->out) != 0)
+		chat_client_uring_send(client);
+	bool is_wait = chat_uring_peek_cqe(ring) == NULL;
+	if (chat_uring_enter(ring, is_wait, timeout_ms) < 0 &&
+	    errno != ETIME && errno != EINTR && errno != EBUSY)
+		return CHAT_ERR_SYS;
+	int count = chat_client_uring_reap(client);
+	if (count < 0) {
+		/* The server is gone, nothing more to wait for. */
+		chat_client_uring_close(client);
+		close(client->socket);
+		client->socket = -1;
+		return 0;
+	}
+	if (count == 0)
+		return CHAT_ERR_TIMEOUT;
+	return 0;
 }
 
 int
 chat_client_update(struct chat_client *client, double timeout)
 {
-	/*
-	 * The easiest way to wait for updates on a single socket with a timeout
-	 * is to use poll(). Epoll is good for many sockets, poll is good for a
-	 * few.
-	 *
-	 * You create one struct pollfd, fill it, call poll() on it, handle the
-	 * events (do read/write).
-	 */
-	(void)client;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	if (client->uring != NULL)
+		return chat_client_uring_update(client, timeout_ms);
+	struct pollfd pfd;
+	pfd.fd = client->socket;
+	pfd.events = chat_events_to_poll_events(
+		chat_client_get_events(client));
+	pfd.revents = 0;
+	int rc = poll(&pfd, 1, timeout_ms);
+	if (rc < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (rc == 0)
+		return CHAT_ERR_TIMEOUT;
+	bool is_broken = false;
+	if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) != 0)
+		is_broken = chat_client_read(client) != 0;
+	if (!is_broken && (pfd.revents & POLLOUT) != 0)
+		is_broken = chat_client_write(client) != 0;
+	if (is_broken) {
+		/* The server is gone, nothing more to wait for. */
+		close(client->socket);
+		client->socket = -1;
+	}
+	return 0;
 }
 
 int
 chat_client_get_descriptor(const struct chat_client *client)
 {
+	/* The io_uring descriptor is readable when there are completions. */
+	if (client->uring != NULL)
+		return client->uring->fd;
 	return client->socket;
 }
 
 int
 chat_client_get_events(const struct chat_client *client)
 {
+	if (client->socket < 0)
+		return 0;
 	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer.
+	 * With io_uring the output is sent by the next update, and the ring's
+	 * descriptor is always writable.
 	 */
-	(void)client;
+	if (chat_ring_size(&client->out) != 0)
+		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
 	return CHAT_EVENT_INPUT;
 }
 
+/**
+ * Queue a fed line for sending, trimmed. Empty lines are not sent. Without
+ * the names the ones starting with '\0' aren't either: the server drops
+ * them, and the first one could be taken for CHAT_FRAME_MAGIC.
+ */
+static void
+chat_client_send_line(struct chat_client *client, std::string_view line)
+{
+	line = chat_trim(line);
+	if (line.empty())
+		return;
+#if !NEED_AUTHOR
+	if (line[0] == '\0')
+		return;
+#endif
+	if (client->framing == CHAT_FRAMING_BINARY) {
+#if NEED_AUTHOR
+		chat_client_send_frame(client, client->name, line, 0);
+#else
+		chat_client_send_frame(client, "", line, 0);
+#endif
+		return;
+	}
+	chat_ring_append(&client->out, line.data(), line.size());
+	chat_ring_append(&client->out, "\n", 1);
+}
+
 int
-chat_client_feed(struct chat_client *client, const char *msg, uint32_t msg_size)
+chat_client_feed(struct chat_client *client, const char *msg,
+		 uint32_t msg_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	const char *end = msg + msg_size;
+	while (msg < end) {
+		const char *eol = (const char *)memchr(msg, '\n', end - msg);
+		if (eol == NULL) {
+			client->feed_line.append(msg, end - msg);
+			break;
+		}
+		if (client->feed_line.empty()) {
+			chat_client_send_line(client,
+					      std::string_view(msg, eol - msg));
+		} else {
+			client->feed_line.append(msg, eol - msg);
+			chat_client_send_line(client, client->feed_line);
+			client->feed_line.clear();
+		}
+		msg = eol + 1;
+	}
+	return 0;
 }
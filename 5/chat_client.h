@@ -1,5 +1,7 @@
 #pragma once
 
+#include "chat.h"
+
 #include <stdint.h>
 #include <string_view>
 
@@ -16,6 +18,46 @@ chat_client_new(std::string_view name);
 void
 chat_client_delete(struct chat_client *client);
 
+/**
+ * Set the backend of the client. With io_uring the data is received with a
+ * multishot request, and the output is sent and the completions are waited
+ * for in one syscall. If the kernel doesn't support it, connect falls back
+ * to poll; chat_client_get_backend() tells which one is used. By default it
+ * is poll, CHAT_BACKEND_EPOLL.
+ *
+ * @param client Chat client.
+ * @param backend Backend to use.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_backend(struct chat_client *client,
+			enum chat_backend backend);
+
+/** Get the backend of the client, the actual one after connect. */
+enum chat_backend
+chat_client_get_backend(const struct chat_client *client);
+
+/**
+ * Set the framing of the client's messages. The binary one is asked from
+ * the server when connecting: the messages are sent and received as
+ * length-prefixed frames, and the received ones are views of them, see
+ * chat_message_get_data(). The messages the server has sent before the
+ * answer are text. By default it is CHAT_FRAMING_TEXT.
+ *
+ * @param client Chat client.
+ * @param framing Framing to use.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_framing(struct chat_client *client,
+			enum chat_framing framing);
+
 /**
  * Try to connect to the given address.
  *
@@ -13,12 +13,20 @@ int
 main(int argc, char **argv)
 {
 	if (argc < 2) {
-		printf("Expected an address to connect to\n");
+		printf("Expected an address to connect to, and optionally a "
+		       "name, and the options: uring for the backend, binary "
+		       "for the framing\n");
 		return -1;
 	}
 	const char *addr = argv[1];
 	const char *name = argc >= 3 ? argv[2] : "anon";
 	struct chat_client *cli = chat_client_new(name);
+	for (int i = 3; i < argc; ++i) {
+		if (strcmp(argv[i], "uring") == 0)
+			chat_client_set_backend(cli, CHAT_BACKEND_URING);
+		else if (strcmp(argv[i], "binary") == 0)
+			chat_client_set_framing(cli, CHAT_FRAMING_BINARY);
+	}
 	int rc = chat_client_connect(cli, addr);
 	if (rc != 0) {
 		printf("Couldn't connect: %d\n", rc);
@@ -89,9 +97,13 @@ main(int argc, char **argv)
 		struct chat_message *msg;
 		while ((msg = chat_client_pop_next(cli)) != NULL) {
 #if NEED_AUTHOR
-			printf("%s: %s\n", msg->author.c_str(), msg->data.c_str());
+			std::string_view author = chat_message_get_author(msg);
+			std::string_view data = chat_message_get_data(msg);
+			printf("%.*s: %.*s\n", (int)author.size(), author.data(),
+			       (int)data.size(), data.data());
 #else
-			printf("%s\n", msg->data.c_str());
+			std::string_view data = chat_message_get_data(msg);
+			printf("%.*s\n", (int)data.size(), data.data());
 #endif
 			delete msg;
 		}
@@ -1,139 +1,1726 @@
 #include "chat.h"
 #include "chat_server.h"
+#include "chat_uring.h"
 
+#include "rlist.h"
+
+#include <deque>
+#include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+enum {
+	/** Max number of events taken from epoll at once. */
+	CHAT_EPOLL_BATCH = 256,
+	/** Max number of not accepted clients. */
+	CHAT_LISTEN_BACKLOG = 4096,
+	/** Max number of buffers sent to a peer in one syscall. */
+	CHAT_IOV_BATCH = 64,
+	/** io_uring: size of the submission queue. */
+	CHAT_URING_ENTRIES = 4096,
+	/** io_uring: number and size of the provided receive buffers. */
+	CHAT_URING_BUF_COUNT = 1024,
+	CHAT_URING_BUF_SIZE = 4096,
+	/** io_uring: max number of linked sends of a peer in flight. */
+	CHAT_URING_SEND_CHAIN = 4,
+};
+
+/**
+ * Kinds of the io_uring requests, stored in the low bits of their user
+ * data. The rest is a pointer to the object of the request.
+ */
+enum chat_uring_op {
+	/** Multishot accept, of a reactor. */
+	CHAT_URING_ACCEPT,
+	/** Read of the mail eventfd, of a reactor. */
+	CHAT_URING_MAIL,
+	/** Multishot receive, of a peer. */
+	CHAT_URING_RECV,
+	/** Send, of a chat_uring_send. */
+	CHAT_URING_SEND,
+	/** Cancellation of all the requests, of a reactor. */
+	CHAT_URING_CANCEL,
+	CHAT_URING_OP_MASK = 7,
+};
+
 struct chat_peer {
 	/** Client's socket. To read/write messages. */
 	int socket;
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Input buffer. */
+	struct chat_ring in;
+	/** Bytes of the input known to have no '\n'. */
+	size_t in_scanned = 0;
+	/**
+	 * The framing is known, by the first bytes of the input. Until then
+	 * the peer is sent text.
+	 */
+	bool has_framing = false;
+	/** The peer has asked for binary frames. */
+	bool is_binary = false;
+	/** Output queue. The buffers are shared with the other peers. */
+	std::deque<chat_buf *> out;
+	/** Bytes of the first output buffer already sent. */
+	size_t out_offset = 0;
+	/** Bytes of the output not sent yet. */
+	size_t out_size = 0;
+	/**
+	 * The socket can take more data. With the edge-triggered epoll it is
+	 * false only after a send has hit EAGAIN, until EPOLLOUT comes.
+	 */
+	bool is_writable = true;
+	/** io_uring: requests in flight. The peer is freed after them. */
+	int uring_ops = 0;
+	/** io_uring: sends in flight, one chain of them at most. */
+	int uring_sends = 0;
+	/** io_uring: the peer is dropped, its requests are ending. */
+	bool is_closed = false;
+	/** io_uring: the first output buffers being sent, not droppable. */
+	size_t out_busy = 0;
+	/** io_uring: the multishot receive is armed, and being cancelled. */
+	bool is_receiving = false;
+	bool is_recv_cancelled = false;
+	/** The output is over the limit, and the peer pauses the server. */
+	bool is_over = false;
+	/** The output is over the limit, and the peer is to be dropped. */
+	bool is_kicked = false;
+#if NEED_AUTHOR
+	/** Client's name, the first line it sends. */
+	std::string name;
+	bool has_name = false;
+#endif
+	/** Link in the list of all the peers of the server. */
+	struct rlist in_peers;
+	/**
+	 * Link in the list of the peers with output to send, or in the list
+	 * of the kicked ones.
+	 */
+	struct rlist in_flush;
+	/** Link in the list of the peers with input left while paused. */
+	struct rlist in_paused;
 };
 
-struct chat_server {
+/** A sendmsg request of io_uring, of the first buffers of an output. */
+struct chat_uring_send {
+	struct chat_peer *peer;
+	struct msghdr msg;
+	struct iovec iov[CHAT_IOV_BATCH];
+	/** Number of the buffers, and their size. */
+	int count;
+	size_t size;
+};
+
+/**
+ * A reactor is an event loop serving a part of the peers. Each one has its
+ * own listening socket, all bound to the same port with SO_REUSEPORT, so
+ * the kernel spreads the new connections among them, and a peer stays in
+ * the reactor which has accepted it. The first reactor runs in
+ * chat_server_update(), each other one in its own thread. They share
+ * nothing but the mailboxes.
+ */
+struct chat_reactor {
+	struct chat_server *server;
 	/** Listening socket. To accept new clients. */
 	int socket = -1;
-	/** Array of peers. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Epoll with the listening socket, the mail event and the peers. */
+	int epoll = -1;
+	/** Eventfd, signaled when the mailbox gets not empty. */
+	int mail_event = -1;
+	/**
+	 * Broadcasts from the other reactors. A lock-free stack: the posters
+	 * push to it, and the reactor takes the whole stack at once.
+	 */
+	struct chat_buf *mail = NULL;
+	/** All the peers. */
+	struct rlist peers;
+	/** Writable peers with not empty output. */
+	struct rlist flush;
+	/** Number of peers with not empty output, sent or blocked. */
+	int output_count = 0;
+	/** Bytes queued to all the peers, readable by any thread. */
+	size_t output_size = 0;
+	/** Peers to drop, their output has exceeded the limit. */
+	struct rlist kicked;
+	/** Peers whose input is not read, because the server is paused. */
+	struct rlist paused;
+	/** The ring when io_uring is the backend, instead of the epoll. */
+	struct chat_uring *uring = NULL;
+	/** io_uring: requests in flight. */
+	int uring_ops = 0;
+	/** io_uring: the multishot accept is armed. */
+	bool is_accepting = false;
+	/** io_uring: the mail event's counter, read by the ring. */
+	uint64_t mail_count = 0;
+	/** Syscalls of the event loop, readable by any thread. */
+	uint64_t syscall_count = 0;
+	pthread_t thread;
+};
+
+struct chat_server {
+	/** Reactors, created by listen. The first one is the caller's. */
+	struct chat_reactor *reactors = NULL;
+	int reactor_count = 1;
+	enum chat_backend backend = CHAT_BACKEND_EPOLL;
+	/** Number of the reactors having a running thread. */
+	int thread_count = 0;
+	/** The reactor threads have to exit. */
+	bool is_stopped = false;
+	/** Max bytes queued to a peer, 0 is no limit. */
+	size_t output_limit = 0;
+	enum chat_output_policy output_policy = CHAT_OUTPUT_DROP_OLDEST;
+	/**
+	 * Number of the peers over the output limit with the pause policy.
+	 * No reactor reads the input while it is not 0.
+	 */
+	int pause_count = 0;
+	/** Received messages, not popped yet. */
+	std::deque<chat_message *> messages;
+	/** The last fed line, not finished with '\n' yet. */
+	std::string feed_line;
 };
 
 struct chat_server *
 chat_server_new(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
 	return new chat_server();
 }
 
-void
-chat_server_delete(struct chat_server *server)
+int
+chat_server_set_reactor_count(struct chat_server *server, int count)
 {
-	if (server->socket >= 0)
-		close(server->socket);
+	if (count < 1)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->reactors != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->reactor_count = count;
+	return 0;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+int
+chat_server_set_backend(struct chat_server *server,
+			enum chat_backend backend)
+{
+	if (server->reactors != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->backend = backend;
+	return 0;
+}
 
-	delete server;
+enum chat_backend
+chat_server_get_backend(const struct chat_server *server)
+{
+	return server->backend;
 }
 
 int
-chat_server_listen(struct chat_server *server, uint16_t port)
+chat_server_set_output_limit(struct chat_server *server, size_t size,
+			     enum chat_output_policy policy)
+{
+	if (server->reactors != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->output_limit = size;
+	server->output_policy = policy;
+	return 0;
+}
+
+size_t
+chat_server_get_output_size(const struct chat_server *server)
+{
+	size_t res = 0;
+	for (int i = 0; server->reactors != NULL &&
+			i < server->reactor_count; ++i) {
+		res += __atomic_load_n(&server->reactors[i].output_size,
+				       __ATOMIC_RELAXED);
+	}
+	return res;
+}
+
+static inline bool
+chat_server_is_paused(const struct chat_server *server)
+{
+	return __atomic_load_n(&server->pause_count, __ATOMIC_ACQUIRE) != 0;
+}
+
+uint64_t
+chat_server_get_syscall_count(const struct chat_server *server)
+{
+	uint64_t res = 0;
+	for (int i = 0; server->reactors != NULL &&
+			i < server->reactor_count; ++i) {
+		const struct chat_reactor *reactor = &server->reactors[i];
+		res += __atomic_load_n(&reactor->syscall_count,
+				       __ATOMIC_RELAXED);
+		if (reactor->uring != NULL)
+			res += __atomic_load_n(&reactor->uring->enter_count,
+					       __ATOMIC_RELAXED);
+	}
+	return res;
+}
+
+/** Count a syscall of the reactor's event loop. */
+static inline void
+chat_reactor_syscall(struct chat_reactor *reactor)
+{
+	/* Only the reactor's thread writes it. */
+	__atomic_store_n(&reactor->syscall_count, reactor->syscall_count + 1,
+			 __ATOMIC_RELAXED);
+}
+
+/** Get an entry for a new io_uring request of the reactor. */
+static struct io_uring_sqe *
+chat_reactor_get_sqe(struct chat_reactor *reactor, enum chat_uring_op op,
+		     void *ptr)
+{
+	struct io_uring_sqe *sqe;
+	while ((sqe = chat_uring_get_sqe(reactor->uring)) == NULL)
+		chat_uring_enter(reactor->uring, false, 0);
+	sqe->user_data = (uint64_t)ptr | op;
+	++reactor->uring_ops;
+	return sqe;
+}
+
+/** Accept the clients with one request, until it fails. */
+static void
+chat_reactor_uring_accept(struct chat_reactor *reactor)
+{
+	struct io_uring_sqe *sqe = chat_reactor_get_sqe(
+		reactor, CHAT_URING_ACCEPT, reactor);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = reactor->socket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	reactor->is_accepting = true;
+}
+
+/** Wait for the mail by reading the eventfd. */
+static void
+chat_reactor_uring_read_mail(struct chat_reactor *reactor)
+{
+	struct io_uring_sqe *sqe = chat_reactor_get_sqe(
+		reactor, CHAT_URING_MAIL, reactor);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = reactor->mail_event;
+	sqe->addr = (uint64_t)&reactor->mail_count;
+	sqe->len = sizeof(reactor->mail_count);
+}
+
+/**
+ * Receive the peer's data with one request, until it fails. The kernel
+ * takes a provided buffer for each piece of data.
+ */
+static void
+chat_peer_uring_recv(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	struct io_uring_sqe *sqe = chat_reactor_get_sqe(
+		reactor, CHAT_URING_RECV, peer);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = peer->socket;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = CHAT_URING_BUF_GROUP;
+	++peer->uring_ops;
+	peer->is_receiving = true;
+}
+
+static void
+chat_reactor_wakeup(struct chat_reactor *reactor);
+
+/**
+ * Account @a size bytes more queued to @a peer, or less if negative. The
+ * peer stops pausing the server when half of its limit is left.
+ */
+static void
+chat_peer_account(struct chat_reactor *reactor, struct chat_peer *peer,
+		  ssize_t size)
+{
+	peer->out_size += size;
+	/* Only the reactor's thread writes it. */
+	__atomic_store_n(&reactor->output_size, reactor->output_size + size,
+			 __ATOMIC_RELAXED);
+	struct chat_server *server = reactor->server;
+	if (!peer->is_over || peer->out_size > server->output_limit / 2)
+		return;
+	peer->is_over = false;
+	if (__atomic_sub_fetch(&server->pause_count, 1,
+			       __ATOMIC_ACQ_REL) != 0)
+		return;
+	/* Each reactor resumes reading when wakes up. */
+	for (int i = 0; i < server->reactor_count; ++i)
+		chat_reactor_wakeup(&server->reactors[i]);
+}
+
+static void
+chat_peer_delete(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	if (reactor->epoll >= 0)
+		epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, peer->socket, NULL);
+	close(peer->socket);
+	if (peer->out_size != 0)
+		--reactor->output_count;
+	chat_peer_account(reactor, peer, -(ssize_t)peer->out_size);
+	for (struct chat_buf *buf : peer->out)
+		chat_buf_unref(buf);
+	rlist_del(&peer->in_peers);
+	rlist_del(&peer->in_flush);
+	rlist_del(&peer->in_paused);
+	delete peer;
+	/* The accept could stop because of the descriptors limit. */
+	if (reactor->uring != NULL && !reactor->is_accepting &&
+	    !__atomic_load_n(&reactor->server->is_stopped, __ATOMIC_ACQUIRE))
+		chat_reactor_uring_accept(reactor);
+}
+
+/**
+ * Drop the disconnected peer. With io_uring it is freed only when all its
+ * requests end, and shutdown() makes them end.
+ */
+static void
+chat_reactor_drop_peer(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	if (reactor->uring == NULL) {
+		chat_peer_delete(reactor, peer);
+		return;
+	}
+	if (peer->is_closed)
+		return;
+	peer->is_closed = true;
+	rlist_del(&peer->in_peers);
+	rlist_del(&peer->in_flush);
+	rlist_del(&peer->in_paused);
+	if (peer->uring_ops == 0) {
+		chat_peer_delete(reactor, peer);
+		return;
+	}
+	chat_reactor_syscall(reactor);
+	shutdown(peer->socket, SHUT_RDWR);
+}
+
+/** Wake the reactor up to take its mail. */
+static void
+chat_reactor_wakeup(struct chat_reactor *reactor)
+{
+	uint64_t one = 1;
+	/* Fails only when the counter is huge, then it is woken anyway. */
+	ssize_t rc = write(reactor->mail_event, &one, sizeof(one));
+	(void)rc;
+}
+
+/**
+ * Give @a buf to another reactor. The reference is passed to the receiver.
+ * Lock-free and safe to call from any thread.
+ * @retval true The reactor is woken up, with a syscall.
+ */
+static bool
+chat_reactor_post(struct chat_reactor *reactor, struct chat_buf *buf)
+{
+	struct chat_buf *head = __atomic_load_n(&reactor->mail,
+						__ATOMIC_RELAXED);
+	do {
+		buf->next = head;
+	} while (!__atomic_compare_exchange_n(&reactor->mail, &head, buf, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	/*
+	 * Not empty mailbox means that the reactor is woken up already and
+	 * hasn't taken the mail yet.
+	 */
+	if (head != NULL)
+		return false;
+	chat_reactor_wakeup(reactor);
+	return true;
+}
+
+/** Take all the mail of the reactor, in the order of posting. */
+static struct chat_buf *
+chat_reactor_take_mail(struct chat_reactor *reactor)
+{
+	struct chat_buf *buf = __atomic_exchange_n(&reactor->mail, NULL,
+						   __ATOMIC_ACQUIRE);
+	struct chat_buf *res = NULL;
+	while (buf != NULL) {
+		struct chat_buf *next = buf->next;
+		buf->next = res;
+		res = buf;
+		buf = next;
+	}
+	return res;
+}
+
+static int
+chat_reactor_uring_reap(struct chat_reactor *reactor);
+
+/** Cancel all the io_uring requests, and wait until they end. */
+static void
+chat_reactor_uring_drain(struct chat_reactor *reactor)
+{
+	struct io_uring_sqe *sqe = chat_reactor_get_sqe(
+		reactor, CHAT_URING_CANCEL, reactor);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+	while (reactor->uring_ops > 0) {
+		if (chat_uring_enter(reactor->uring, true, -1) < 0 &&
+		    errno != EINTR)
+			break;
+		chat_reactor_uring_reap(reactor);
+	}
+}
+
+/** Close the descriptors of the reactor, and drop its peers and mail. */
+static void
+chat_reactor_close(struct chat_reactor *reactor)
+{
+	/* The kernel must not touch the peers and buffers being freed. */
+	if (reactor->uring != NULL && reactor->uring->fd >= 0)
+		chat_reactor_uring_drain(reactor);
+	while (!rlist_empty(&reactor->peers)) {
+		struct chat_peer *peer = rlist_first_entry(
+			&reactor->peers, struct chat_peer, in_peers);
+		chat_peer_delete(reactor, peer);
+	}
+	if (reactor->socket >= 0)
+		close(reactor->socket);
+	if (reactor->mail_event >= 0)
+		close(reactor->mail_event);
+	if (reactor->epoll >= 0)
+		close(reactor->epoll);
+	if (reactor->uring != NULL) {
+		chat_uring_destroy(reactor->uring);
+		delete reactor->uring;
+	}
+	struct chat_buf *buf = chat_reactor_take_mail(reactor);
+	while (buf != NULL) {
+		struct chat_buf *next = buf->next;
+		chat_buf_unref(buf);
+		buf = next;
+	}
+}
+
+/** Stop the reactor threads, and close all the reactors. */
+static void
+chat_server_stop(struct chat_server *server)
+{
+	__atomic_store_n(&server->is_stopped, true, __ATOMIC_RELEASE);
+	for (int i = 1; i <= server->thread_count; ++i)
+		chat_reactor_wakeup(&server->reactors[i]);
+	for (int i = 1; i <= server->thread_count; ++i)
+		pthread_join(server->reactors[i].thread, NULL);
+	for (int i = 0; i < server->reactor_count; ++i)
+		chat_reactor_close(&server->reactors[i]);
+	delete[] server->reactors;
+	server->reactors = NULL;
+	server->thread_count = 0;
+}
+
+void
+chat_server_delete(struct chat_server *server)
+{
+	if (server->reactors != NULL)
+		chat_server_stop(server);
+	for (struct chat_message *msg : server->messages)
+		delete msg;
+	delete server;
+}
+
+/**
+ * Create the reactor's listening socket, bound to @a port, and its epoll or
+ * io_uring.
+ * @param is_shared Other reactors listen on the same port.
+ */
+static int
+chat_reactor_listen(struct chat_reactor *reactor, uint16_t port,
+		    bool is_shared)
 {
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	/* Listen on all IPs of this machine. */
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+	struct chat_server *server = reactor->server;
+	if (server->backend == CHAT_BACKEND_URING) {
+		reactor->uring = new chat_uring();
+		if (chat_uring_create(reactor->uring, CHAT_URING_ENTRIES,
+				      CHAT_URING_BUF_COUNT,
+				      CHAT_URING_BUF_SIZE) != 0) {
+			delete reactor->uring;
+			reactor->uring = NULL;
+			if (reactor != &server->reactors[0])
+				return CHAT_ERR_SYS;
+			/* No io_uring in the kernel, or it is not allowed. */
+			server->backend = CHAT_BACKEND_EPOLL;
+		}
+	}
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sock < 0)
+		return CHAT_ERR_SYS;
+	reactor->socket = sock;
+	int value = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
 	/*
-	 * 1) Create a server socket (function socket()).
-	 * 2) Bind the server socket to addr (function bind()).
-	 * 3) Listen the server socket (function listen()).
-	 * 4) Create epoll/kqueue if needed.
+	 * Only when needed. Otherwise another server of the same user could
+	 * take the port silently, instead of getting it busy.
 	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	if (is_shared &&
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &value,
+		       sizeof(value)) != 0)
+		return CHAT_ERR_SYS;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		return errno == EADDRINUSE ? CHAT_ERR_PORT_BUSY : CHAT_ERR_SYS;
+	if (listen(sock, CHAT_LISTEN_BACKLOG) != 0)
+		return CHAT_ERR_SYS;
+	reactor->mail_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reactor->mail_event < 0)
+		return CHAT_ERR_SYS;
+	if (reactor->uring != NULL) {
+		chat_reactor_uring_accept(reactor);
+		chat_reactor_uring_read_mail(reactor);
+		/* The caller may wait for the ring's descriptor right away. */
+		if (chat_uring_enter(reactor->uring, false, 0) < 0)
+			return CHAT_ERR_SYS;
+		return 0;
+	}
+	reactor->epoll = epoll_create1(0);
+	if (reactor->epoll < 0)
+		return CHAT_ERR_SYS;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	/* The listening socket is the reactor itself. */
+	ev.data.ptr = reactor;
+	if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, sock, &ev) != 0)
+		return CHAT_ERR_SYS;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &reactor->mail;
+	if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, reactor->mail_event,
+		      &ev) != 0)
+		return CHAT_ERR_SYS;
+	return 0;
+}
+
+static void *
+chat_reactor_worker_f(void *arg);
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+int
+chat_server_listen(struct chat_server *server, uint16_t port)
+{
+	if (server->reactors != NULL)
+		return CHAT_ERR_ALREADY_STARTED;
+	int count = server->reactor_count;
+	server->is_stopped = false;
+	server->reactors = new chat_reactor[count];
+	for (int i = 0; i < count; ++i) {
+		struct chat_reactor *reactor = &server->reactors[i];
+		reactor->server = server;
+		rlist_create(&reactor->peers);
+		rlist_create(&reactor->flush);
+		rlist_create(&reactor->kicked);
+		rlist_create(&reactor->paused);
+	}
+	int rc = 0;
+	for (int i = 0; i < count && rc == 0; ++i) {
+		rc = chat_reactor_listen(&server->reactors[i], port, count > 1);
+		if (rc != 0 || port != 0)
+			continue;
+		/* The others join the port the first one has got. */
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(server->reactors[i].socket,
+				(struct sockaddr *)&addr, &len) != 0)
+			rc = CHAT_ERR_SYS;
+		port = ntohs(addr.sin_port);
+	}
+	for (int i = 1; i < count && rc == 0; ++i) {
+		if (pthread_create(&server->reactors[i].thread, NULL,
+				   chat_reactor_worker_f,
+				   &server->reactors[i]) != 0)
+			rc = CHAT_ERR_SYS;
+		else
+			++server->thread_count;
+	}
+	if (rc != 0) {
+		int err = errno;
+		chat_server_stop(server);
+		errno = err;
+	}
+	return rc;
 }
 
 struct chat_message *
 chat_server_pop_next(struct chat_server *server)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	if (server->messages.empty())
+		return NULL;
+	struct chat_message *msg = server->messages.front();
+	server->messages.pop_front();
+	return msg;
+}
+
+/** Start serving an accepted client. */
+static void
+chat_reactor_add_peer(struct chat_reactor *reactor, int sock)
+{
+	struct chat_peer *peer = new chat_peer();
+	peer->socket = sock;
+	rlist_create(&peer->in_flush);
+	rlist_create(&peer->in_paused);
+	if (reactor->uring != NULL) {
+		chat_peer_uring_recv(reactor, peer);
+		rlist_add_tail(&reactor->peers, &peer->in_peers);
+		return;
+	}
+	/*
+	 * Both events are added once. Edge-triggered EPOLLOUT comes only
+	 * after a send has filled the socket, so it is never delivered while
+	 * the peer has nothing to send.
+	 */
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = peer;
+	if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, sock, &ev) != 0) {
+		close(sock);
+		delete peer;
+		return;
+	}
+	rlist_add_tail(&reactor->peers, &peer->in_peers);
+}
+
+/**
+ * Accept all the pending clients. With io_uring they are accepted already,
+ * and are taken from the completions.
+ */
+static void
+chat_reactor_accept(struct chat_reactor *reactor)
+{
+	if (reactor->uring != NULL) {
+		chat_reactor_uring_reap(reactor);
+		return;
+	}
+	while (true) {
+		chat_reactor_syscall(reactor);
+		int sock = accept4(reactor->socket, NULL, NULL, SOCK_NONBLOCK);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* EAGAIN, or out of descriptors. */
+			return;
+		}
+		chat_reactor_add_peer(reactor, sock);
+	}
+}
+
+/**
+ * Drop the oldest output of @a peer until it is @a size bytes at most. The
+ * buffers being sent are kept, so the stream is not broken.
+ */
+static void
+chat_peer_drop_oldest(struct chat_reactor *reactor, struct chat_peer *peer,
+		      size_t size)
+{
+	size_t busy = peer->out_busy;
+	if (peer->out_offset != 0)
+		busy = 1;
+	while (peer->out_size > size && peer->out.size() > busy) {
+		auto it = peer->out.begin() + busy;
+		struct chat_buf *buf = *it;
+		/* The messages after it are frames. */
+		if (buf->type == CHAT_BUF_MAGIC) {
+			++busy;
+			continue;
+		}
+		peer->out.erase(it);
+		chat_peer_account(reactor, peer, -(ssize_t)buf->size);
+		chat_buf_unref(buf);
+	}
+}
+
+/** Drop the peer at the end of the update, it is in a broadcast now. */
+static void
+chat_reactor_kick(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	peer->is_kicked = true;
+	rlist_del(&peer->in_flush);
+	rlist_add_tail(&reactor->kicked, &peer->in_flush);
+}
+
+/**
+ * Queue @a buf for sending to @a peer. If that exceeds the output limit,
+ * the server's policy is applied.
+ */
+static void
+chat_peer_append(struct chat_reactor *reactor, struct chat_peer *peer,
+		 struct chat_buf *buf)
+{
+	if (peer->is_kicked)
+		return;
+	struct chat_server *server = reactor->server;
+	size_t limit = server->output_limit;
+	if (peer->out_size == 0) {
+		++reactor->output_count;
+		if (peer->is_writable)
+			rlist_add_tail(&reactor->flush, &peer->in_flush);
+	} else if (limit != 0 && peer->out_size + buf->size > limit) {
+		switch (server->output_policy) {
+		case CHAT_OUTPUT_DROP_OLDEST:
+			chat_peer_drop_oldest(reactor, peer,
+					      limit > buf->size ?
+					      limit - buf->size : 0);
+			break;
+		case CHAT_OUTPUT_DISCONNECT:
+			chat_reactor_kick(reactor, peer);
+			return;
+		case CHAT_OUTPUT_PAUSE:
+			if (peer->is_over)
+				break;
+			peer->is_over = true;
+			__atomic_add_fetch(&server->pause_count, 1,
+					   __ATOMIC_ACQ_REL);
+			break;
+		}
+	}
+	chat_buf_ref(buf);
+	peer->out.push_back(buf);
+	chat_peer_account(reactor, peer, buf->size);
+}
+
+static struct chat_buf *
+chat_buf_convert(const struct chat_buf *buf);
+
+/**
+ * Queue @a buf for sending to all the reactor's peers but @a author. The
+ * peers of the other framing get it converted, once for all of them. A
+ * text too big for a frame is not sent to the binary peers.
+ */
+static void
+chat_reactor_append(struct chat_reactor *reactor,
+		    const struct chat_peer *author, struct chat_buf *buf)
+{
+	struct chat_buf *other = NULL;
+	bool is_converted = false;
+	struct chat_peer *peer;
+	rlist_foreach_entry(peer, &reactor->peers, in_peers) {
+		if (peer == author)
+			continue;
+		if (peer->is_binary == (buf->type == CHAT_BUF_FRAME)) {
+			chat_peer_append(reactor, peer, buf);
+			continue;
+		}
+		if (!is_converted) {
+			other = chat_buf_convert(buf);
+			is_converted = true;
+		}
+		if (other != NULL)
+			chat_peer_append(reactor, peer, other);
+	}
+	if (other != NULL)
+		chat_buf_unref(other);
+}
+
+/**
+ * Encode a message as text for sending: the author's line, if any, and the
+ * text line.
+ */
+static struct chat_buf *
+chat_text_new(std::string_view author, std::string_view data)
+{
+	size_t size = data.size() + 1;
+#if NEED_AUTHOR
+	size += author.size() + 1;
+#endif
+	struct chat_buf *buf = chat_buf_new(size);
+	char *pos = buf->data;
+#if NEED_AUTHOR
+	memcpy(pos, author.data(), author.size());
+	pos += author.size();
+	*pos++ = '\n';
+#else
+	(void)author;
+#endif
+	memcpy(pos, data.data(), data.size());
+	pos += data.size();
+	*pos = '\n';
+	return buf;
+}
+
+static struct chat_buf *
+chat_message_encode(const struct chat_message *msg)
+{
+#if NEED_AUTHOR
+	return chat_text_new(msg->author, msg->data);
+#else
+	return chat_text_new(std::string_view(), msg->data);
+#endif
+}
+
+/** Get the author, if any, and the text of an encoded message. */
+static void
+chat_message_split(const struct chat_buf *buf, std::string_view *author,
+		   std::string_view *data)
+{
+	const char *pos = buf->data;
+	/* Without the last '\n'. */
+	const char *end = buf->data + buf->size - 1;
+#if NEED_AUTHOR
+	const char *eol = (const char *)memchr(pos, '\n', end - pos);
+	*author = std::string_view(pos, eol - pos);
+	pos = eol + 1;
+#else
+	*author = std::string_view();
+#endif
+	*data = std::string_view(pos, end - pos);
+}
+
+/** Make a message out of an encoded one. */
+static struct chat_message *
+chat_message_decode(const struct chat_buf *buf)
+{
+	std::string_view author;
+	std::string_view data;
+	chat_message_split(buf, &author, &data);
+	struct chat_message *msg = new chat_message();
+#if NEED_AUTHOR
+	msg->author = author;
+#endif
+	msg->data = data;
+	return msg;
+}
+
+/**
+ * Encode a message of one framing in the other one. Only here a frame is
+ * scanned for '\n', the frames are forwarded to the binary peers as is.
+ * @retval NULL The text is too big for a frame, or the frame has a '\n',
+ *         the text peers would take it for more lines, of any author.
+ */
+static struct chat_buf *
+chat_buf_convert(const struct chat_buf *buf)
+{
+	std::string_view author;
+	std::string_view data;
+	if (buf->type == CHAT_BUF_TEXT) {
+		chat_message_split(buf, &author, &data);
+		if (author.size() + data.size() > CHAT_FRAME_MAX_SIZE)
+			return NULL;
+		return chat_frame_new(author, data, 0);
+	}
+	struct chat_frame_header hdr;
+	chat_frame_parse(buf, &hdr, &author, &data);
+	if (author.find('\n') != std::string_view::npos ||
+	    data.find('\n') != std::string_view::npos)
+		return NULL;
+	return chat_text_new(author, data);
+}
+
+/**
+ * Send an encoded message, text or a frame, to all the peers except its
+ * author. All the reactor's peers of the same framing reference the same
+ * buffer. The other reactors get a copy each in their mailboxes.
+ */
+static void
+chat_reactor_broadcast(struct chat_reactor *reactor,
+		       const struct chat_peer *author, struct chat_buf *buf)
+{
+	chat_reactor_append(reactor, author, buf);
+	struct chat_server *server = reactor->server;
+	for (int i = 0; i < server->reactor_count; ++i) {
+		struct chat_reactor *other = &server->reactors[i];
+		if (other == reactor)
+			continue;
+		struct chat_buf *copy = chat_buf_new(buf->size);
+		copy->type = buf->type;
+		memcpy(copy->data, buf->data, buf->size);
+		if (chat_reactor_post(other, copy))
+			chat_reactor_syscall(reactor);
+	}
+}
+
+/**
+ * Deliver the mail to the reactor's peers. The first reactor also keeps
+ * the messages for the application, they come from the other reactors'
+ * peers. The mail event has to be reset before, to not miss a post.
+ */
+static void
+chat_reactor_deliver_mail(struct chat_reactor *reactor)
+{
+	struct chat_server *server = reactor->server;
+	bool is_first = reactor == &server->reactors[0];
+	struct chat_buf *buf = chat_reactor_take_mail(reactor);
+	while (buf != NULL) {
+		struct chat_buf *next = buf->next;
+		chat_reactor_append(reactor, NULL, buf);
+		if (is_first && buf->type == CHAT_BUF_FRAME) {
+			server->messages.push_back(
+				chat_message_new_from_frame(buf));
+		} else if (is_first) {
+			server->messages.push_back(chat_message_decode(buf));
+		}
+		chat_buf_unref(buf);
+		buf = next;
+	}
+}
+
+/** Take the mail, woken up by the epoll. */
+static void
+chat_reactor_receive(struct chat_reactor *reactor)
+{
+	uint64_t count;
+	chat_reactor_syscall(reactor);
+	ssize_t rc = read(reactor->mail_event, &count, sizeof(count));
+	(void)rc;
+	/* The clients connected by now get the messages too. */
+	chat_reactor_accept(reactor);
+	chat_reactor_deliver_mail(reactor);
+}
+
+/**
+ * Switch the peer to the binary frames. It is answered with
+ * CHAT_FRAME_MAGIC, placed after the output being sent already, and the
+ * text queued after that is converted.
+ */
+static void
+chat_peer_start_frames(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	peer->is_binary = true;
+	bool is_idle = peer->out_size == 0;
+	size_t busy = peer->out_busy;
+	if (peer->out_offset != 0)
+		busy = 1;
+	for (size_t i = busy; i < peer->out.size();) {
+		struct chat_buf *buf = peer->out[i];
+		struct chat_buf *frame = chat_buf_convert(buf);
+		if (frame == NULL) {
+			peer->out.erase(peer->out.begin() + i);
+			chat_peer_account(reactor, peer, -(ssize_t)buf->size);
+			chat_buf_unref(buf);
+			continue;
+		}
+		peer->out[i] = frame;
+		chat_peer_account(reactor, peer,
+				  (ssize_t)frame->size - (ssize_t)buf->size);
+		chat_buf_unref(buf);
+		++i;
+	}
+	struct chat_buf *magic = chat_buf_new(CHAT_FRAME_MAGIC_SIZE);
+	magic->type = CHAT_BUF_MAGIC;
+	memcpy(magic->data, CHAT_FRAME_MAGIC, CHAT_FRAME_MAGIC_SIZE);
+	if (is_idle) {
+		++reactor->output_count;
+		if (peer->is_writable && !peer->is_kicked)
+			rlist_add_tail(&reactor->flush, &peer->in_flush);
+	}
+	peer->out.insert(peer->out.begin() + busy, magic);
+	chat_peer_account(reactor, peer, magic->size);
+}
+
+/**
+ * Learn the peer's framing by its first bytes.
+ * @retval true The framing is known.
+ * @retval false Not enough input yet.
+ */
+static bool
+chat_peer_negotiate(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	size_t size = chat_ring_size(&peer->in);
+	if (size == 0)
+		return false;
+	char magic[CHAT_FRAME_MAGIC_SIZE];
+	chat_ring_copy(&peer->in, 1, magic);
+	if (magic[0] == '\0') {
+		if (size < CHAT_FRAME_MAGIC_SIZE)
+			return false;
+		chat_ring_copy(&peer->in, CHAT_FRAME_MAGIC_SIZE, magic);
+		if (memcmp(magic, CHAT_FRAME_MAGIC,
+			   CHAT_FRAME_MAGIC_SIZE) == 0) {
+			chat_ring_consume(&peer->in, CHAT_FRAME_MAGIC_SIZE);
+			chat_peer_start_frames(reactor, peer);
+		}
+	}
+	peer->has_framing = true;
+	return true;
+}
+
+#if NEED_AUTHOR
+
+/**
+ * Set the name the peer's messages are sent with. A message starts with
+ * the name, and a text line can't start with '\0', see CHAT_FRAME_MAGIC.
+ * So the leading ones are dropped.
+ */
+static void
+chat_peer_set_name(struct chat_peer *peer, std::string_view name)
+{
+	size_t begin = name.find_first_not_of('\0');
+	if (begin != std::string_view::npos)
+		peer->name = name.substr(begin);
+	peer->has_name = true;
+}
+
+#endif
+
+/**
+ * Take the next frame of the peer and broadcast it as is. The first
+ * reactor keeps a message viewing it, the others send it by mail. Its text
+ * is trimmed, as of a text line, but not scanned for '\n': such a frame
+ * is not sent to the text peers, see chat_buf_convert(). A peer sending a
+ * too big frame is kicked.
+ * @retval true A frame is taken.
+ * @retval false No full frame yet, or the peer is kicked.
+ */
+static bool
+chat_peer_read_frame(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	struct chat_buf *frame;
+	int rc = chat_ring_read_frame(&peer->in, &frame);
+	if (rc < 0)
+		chat_reactor_kick(reactor, peer);
+	if (rc <= 0)
+		return false;
+	struct chat_frame_header hdr;
+	std::string_view author;
+	std::string_view data;
+	chat_frame_parse(frame, &hdr, &author, &data);
+	bool is_hello = (hdr.flags & CHAT_FRAME_HELLO) != 0;
+	/* Same as a text line. */
+	std::string_view text = chat_trim(data);
+#if NEED_AUTHOR
+	if (is_hello && !peer->has_name) {
+		chat_peer_set_name(peer, author);
+	} else if (!text.empty() &&
+		   (author != peer->name || text.size() != data.size())) {
+		/* Nobody speaks for another one, and the text is trimmed. */
+		struct chat_buf *own = chat_frame_new(peer->name, text, 0);
+		chat_buf_unref(frame);
+		frame = own;
+	}
+#else
+	/* Dropped, as a text line, see chat_peer_parse(). */
+	if (!text.empty() && text[0] == '\0')
+		text = std::string_view();
+	if (!text.empty() && text.size() != data.size()) {
+		struct chat_buf *own = chat_frame_new(author, text, 0);
+		chat_buf_unref(frame);
+		frame = own;
+	}
+#endif
+	if (!is_hello && !text.empty()) {
+		chat_reactor_broadcast(reactor, peer, frame);
+		struct chat_server *server = reactor->server;
+		if (reactor == &server->reactors[0]) {
+			server->messages.push_back(
+				chat_message_new_from_frame(frame));
+		}
+	}
+	chat_buf_unref(frame);
+	return true;
+}
+
+/**
+ * Turn the received lines or frames of @a peer into messages. The first
+ * reactor keeps them for the application, the others send them to it by
+ * mail.
+ */
+static void
+chat_peer_parse(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	struct chat_server *server = reactor->server;
+	bool is_first = reactor == &server->reactors[0];
+	if (!peer->has_framing && !chat_peer_negotiate(reactor, peer))
+		return;
+	std::string line;
+	while (true) {
+		/* The rest is parsed on resume. */
+		if (chat_server_is_paused(server)) {
+			if (rlist_empty(&peer->in_paused))
+				rlist_add_tail(&reactor->paused,
+					       &peer->in_paused);
+			break;
+		}
+		if (peer->is_binary) {
+			if (!chat_peer_read_frame(reactor, peer))
+				break;
+			continue;
+		}
+		if (!chat_ring_read_line(&peer->in, &peer->in_scanned, &line))
+			break;
+#if NEED_AUTHOR
+		if (!peer->has_name) {
+			chat_peer_set_name(peer, line);
+			continue;
+		}
+#endif
+		std::string_view text = chat_trim(line);
+		if (text.empty())
+			continue;
+#if !NEED_AUTHOR
+		/*
+		 * A binary client, which gets text before CHAT_FRAME_MAGIC,
+		 * would take it for one. So it is dropped for everybody.
+		 */
+		if (text[0] == '\0')
+			continue;
+#endif
+		struct chat_message *msg = new chat_message();
+#if NEED_AUTHOR
+		msg->author = peer->name;
+#endif
+		msg->data = text;
+		struct chat_buf *buf = chat_message_encode(msg);
+		chat_reactor_broadcast(reactor, peer, buf);
+		chat_buf_unref(buf);
+		if (is_first)
+			server->messages.push_back(msg);
+		else
+			delete msg;
+	}
+}
+
+/**
+ * Read the peer's socket until it is drained.
+ * @retval 0 Success.
+ * @retval -1 The peer is disconnected.
+ */
+static int
+chat_peer_read(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	/* The producers are not read while the server is paused. */
+	if (chat_server_is_paused(reactor->server)) {
+		if (rlist_empty(&peer->in_paused))
+			rlist_add_tail(&reactor->paused, &peer->in_paused);
+		return 0;
+	}
+	while (true) {
+		chat_reactor_syscall(reactor);
+		ssize_t rc = chat_ring_recv(&peer->in, peer->socket);
+		if (rc > 0) {
+			/*
+			 * Parse each piece right away, so the input doesn't
+			 * pile up in the buffer. If the server gets paused,
+			 * the rest waits in the socket.
+			 */
+			chat_peer_parse(reactor, peer);
+			if (!rlist_empty(&peer->in_paused) || peer->is_kicked)
+				return 0;
+			continue;
+		}
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (rc < 0 && errno == EINTR)
+			continue;
+		/* The messages received before the close are still valid. */
+		chat_peer_parse(reactor, peer);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Send the first buffers of the peer's output in one syscall, and drop the
+ * sent ones.
+ * @retval Result of sendmsg().
+ */
+static ssize_t
+chat_peer_send(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	struct iovec iov[CHAT_IOV_BATCH];
+	int count = 0;
+	size_t offset = peer->out_offset;
+	for (struct chat_buf *buf : peer->out) {
+		if (count == CHAT_IOV_BATCH)
+			break;
+		iov[count].iov_base = buf->data + offset;
+		iov[count].iov_len = buf->size - offset;
+		offset = 0;
+		++count;
+	}
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	chat_reactor_syscall(reactor);
+	ssize_t rc = sendmsg(peer->socket, &msg, MSG_NOSIGNAL);
+	if (rc <= 0)
+		return rc;
+	chat_peer_account(reactor, peer, -rc);
+	size_t sent = peer->out_offset + rc;
+	peer->out_offset = 0;
+	while (sent > 0) {
+		struct chat_buf *buf = peer->out.front();
+		if (sent < buf->size) {
+			peer->out_offset = sent;
+			break;
+		}
+		sent -= buf->size;
+		peer->out.pop_front();
+		chat_buf_unref(buf);
+	}
+	return rc;
+}
+
+/**
+ * Send the peer's output until it is empty or the socket is full.
+ * @retval 0 Success.
+ * @retval -1 The peer is disconnected.
+ */
+static int
+chat_peer_write(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	while (peer->out_size != 0) {
+		ssize_t rc = chat_peer_send(reactor, peer);
+		if (rc >= 0)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			peer->is_writable = false;
+			return 0;
+		}
+		if (errno != EINTR)
+			return -1;
+	}
+	--reactor->output_count;
+	return 0;
+}
+
+/**
+ * Send the peer's output with io_uring: a chain of linked sendmsg requests,
+ * which the kernel runs in order. Each one sends all its buffers or fails,
+ * and then the rest of the chain is cancelled. The output is sent only by
+ * one chain at a time, so it is not reordered.
+ */
+static void
+chat_peer_uring_send(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	size_t buf_count = peer->out.size();
+	int chain = (buf_count + CHAT_IOV_BATCH - 1) / CHAT_IOV_BATCH;
+	if (chain > CHAT_URING_SEND_CHAIN)
+		chain = CHAT_URING_SEND_CHAIN;
+	chat_uring_reserve(reactor->uring, chain);
+	auto it = peer->out.begin();
+	for (int i = 0; i < chain; ++i) {
+		struct chat_uring_send *send = new chat_uring_send();
+		send->peer = peer;
+		send->count = 0;
+		send->size = 0;
+		for (; it != peer->out.end() &&
+		       send->count < CHAT_IOV_BATCH; ++it) {
+			++peer->out_busy;
+			struct iovec *iov = &send->iov[send->count++];
+			iov->iov_base = (*it)->data;
+			iov->iov_len = (*it)->size;
+			send->size += (*it)->size;
+		}
+		send->msg.msg_iov = send->iov;
+		send->msg.msg_iovlen = send->count;
+		struct io_uring_sqe *sqe = chat_reactor_get_sqe(
+			reactor, CHAT_URING_SEND, send);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = peer->socket;
+		sqe->addr = (uint64_t)&send->msg;
+		/* Sent whole, as many times as the socket takes it. */
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		if (i + 1 < chain)
+			sqe->flags = IOSQE_IO_LINK;
+		++peer->uring_ops;
+		++peer->uring_sends;
+	}
+}
+
+/**
+ * Send the output of all the writable peers having it. The messages are
+ * accumulated during a whole update, so each peer gets them in one send.
+ * @retval Number of flushed peers.
+ */
+static int
+chat_reactor_flush(struct chat_reactor *reactor)
+{
+	int count = 0;
+	while (!rlist_empty(&reactor->flush)) {
+		struct chat_peer *peer = rlist_first_entry(
+			&reactor->flush, struct chat_peer, in_flush);
+		rlist_del(&peer->in_flush);
+		++count;
+		if (reactor->uring != NULL)
+			chat_peer_uring_send(reactor, peer);
+		else if (chat_peer_write(reactor, peer) != 0)
+			chat_peer_delete(reactor, peer);
+	}
+	return count;
+}
+
+/**
+ * Stop receiving from the peer while the server is paused. The multishot
+ * receive would take the data regardless, so it is cancelled.
+ */
+static void
+chat_peer_uring_pause(struct chat_reactor *reactor, struct chat_peer *peer)
+{
+	if (rlist_empty(&peer->in_paused))
+		rlist_add_tail(&reactor->paused, &peer->in_paused);
+	if (!peer->is_receiving || peer->is_recv_cancelled)
+		return;
+	struct io_uring_sqe *sqe = chat_reactor_get_sqe(
+		reactor, CHAT_URING_CANCEL, reactor);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)peer | CHAT_URING_RECV;
+	peer->is_recv_cancelled = true;
+}
+
+static void
+chat_peer_uring_recv_done(struct chat_reactor *reactor,
+			  struct chat_peer *peer, int res, uint32_t flags)
+{
+	bool is_more = (flags & IORING_CQE_F_MORE) != 0;
+	if (!is_more) {
+		--peer->uring_ops;
+		peer->is_receiving = false;
+		peer->is_recv_cancelled = false;
+	}
+	if ((flags & IORING_CQE_F_BUFFER) != 0) {
+		uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (res > 0 && !peer->is_closed) {
+			chat_ring_append(&peer->in,
+					 chat_uring_buf(reactor->uring, bid),
+					 res);
+		}
+		chat_uring_buf_recycle(reactor->uring, bid);
+	}
+	if (peer->is_closed) {
+		if (peer->uring_ops == 0)
+			chat_peer_delete(reactor, peer);
+		return;
+	}
+	struct chat_server *server = reactor->server;
+	bool is_stopped = __atomic_load_n(&server->is_stopped,
+					  __ATOMIC_ACQUIRE);
+	if (res > 0 && !is_stopped) {
+		chat_peer_parse(reactor, peer);
+	} else if (is_stopped || (res != -ENOBUFS && res != -ECANCELED)) {
+		/* The messages received before the close are still valid. */
+		chat_peer_parse(reactor, peer);
+		chat_reactor_drop_peer(reactor, peer);
+		return;
+	}
+	/*
+	 * Out of the provided buffers, or the kernel has ended it, or it is
+	 * cancelled for the pause.
+	 */
+	if (chat_server_is_paused(server))
+		chat_peer_uring_pause(reactor, peer);
+	else if (!is_more)
+		chat_peer_uring_recv(reactor, peer);
+}
+
+static void
+chat_peer_uring_send_done(struct chat_reactor *reactor,
+			  struct chat_uring_send *send, int res)
+{
+	struct chat_peer *peer = send->peer;
+	bool is_sent = res >= 0 && (size_t)res == send->size;
+	int count = send->count;
+	size_t size = send->size;
+	delete send;
+	--peer->uring_ops;
+	--peer->uring_sends;
+	if (peer->is_closed) {
+		if (peer->uring_ops == 0)
+			chat_peer_delete(reactor, peer);
+		return;
+	}
+	if (!is_sent) {
+		chat_reactor_drop_peer(reactor, peer);
+		return;
+	}
+	for (int i = 0; i < count; ++i) {
+		chat_buf_unref(peer->out.front());
+		peer->out.pop_front();
+	}
+	peer->out_busy -= count;
+	chat_peer_account(reactor, peer, -(ssize_t)size);
+	if (peer->uring_sends != 0 || peer->is_kicked)
+		return;
+	if (peer->out_size != 0)
+		rlist_add_tail(&reactor->flush, &peer->in_flush);
+	else
+		--reactor->output_count;
+}
+
+/**
+ * Read the peers left unread while the server was paused, if it is not
+ * anymore, and drop the peers kicked for exceeding the output limit.
+ */
+static void
+chat_reactor_settle(struct chat_reactor *reactor)
+{
+	struct chat_server *server = reactor->server;
+	while (!rlist_empty(&reactor->paused) &&
+	       !chat_server_is_paused(server)) {
+		struct chat_peer *peer = rlist_first_entry(
+			&reactor->paused, struct chat_peer, in_paused);
+		rlist_del(&peer->in_paused);
+		/*
+		 * The input left is parsed first, the socket may have nothing
+		 * new. Paused again, if not all is parsed.
+		 */
+		chat_peer_parse(reactor, peer);
+		if (peer->is_kicked)
+			continue;
+		if (reactor->uring != NULL) {
+			if (!peer->is_receiving &&
+			    !chat_server_is_paused(server))
+				chat_peer_uring_recv(reactor, peer);
+		} else if (chat_peer_read(reactor, peer) != 0) {
+			chat_peer_delete(reactor, peer);
+		}
+	}
+	while (!rlist_empty(&reactor->kicked)) {
+		struct chat_peer *peer = rlist_first_entry(
+			&reactor->kicked, struct chat_peer, in_flush);
+		rlist_del(&peer->in_flush);
+		chat_reactor_drop_peer(reactor, peer);
+	}
+}
+
+/**
+ * Handle the io_uring completions.
+ * @retval Number of the completions.
+ */
+static int
+chat_reactor_uring_reap(struct chat_reactor *reactor)
+{
+	struct chat_uring *ring = reactor->uring;
+	bool is_stopped = __atomic_load_n(&reactor->server->is_stopped,
+					  __ATOMIC_ACQUIRE);
+	int count = 0;
+	struct io_uring_cqe *cqe;
+	while ((cqe = chat_uring_peek_cqe(ring)) != NULL) {
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		uint32_t flags = cqe->flags;
+		chat_uring_cqe_seen(ring);
+		++count;
+		if ((flags & IORING_CQE_F_MORE) == 0)
+			--reactor->uring_ops;
+		void *ptr = (void *)(data & ~(uint64_t)CHAT_URING_OP_MASK);
+		switch (data & CHAT_URING_OP_MASK) {
+		case CHAT_URING_ACCEPT:
+			if (res >= 0) {
+				if (is_stopped)
+					close(res);
+				else
+					chat_reactor_add_peer(reactor, res);
+			}
+			if ((flags & IORING_CQE_F_MORE) != 0)
+				break;
+			reactor->is_accepting = false;
+			/* Out of descriptors, retried when one is freed. */
+			if (!is_stopped && res != -EMFILE && res != -ENFILE)
+				chat_reactor_uring_accept(reactor);
+			break;
+		case CHAT_URING_MAIL:
+			if (is_stopped)
+				break;
+			chat_reactor_deliver_mail(reactor);
+			chat_reactor_uring_read_mail(reactor);
+			break;
+		case CHAT_URING_RECV:
+			chat_peer_uring_recv_done(
+				reactor, (struct chat_peer *)ptr, res, flags);
+			break;
+		case CHAT_URING_SEND:
+			chat_peer_uring_send_done(
+				reactor, (struct chat_uring_send *)ptr, res);
+			break;
+		default:
+			break;
+		}
+	}
+	return count;
+}
+
+/**
+ * Submit the new io_uring requests, when the caller is going to wait for
+ * the ring's descriptor.
+ */
+static void
+chat_reactor_uring_submit(struct chat_reactor *reactor)
+{
+	if (reactor->uring != NULL && chat_uring_pending(reactor->uring) != 0)
+		chat_uring_enter(reactor->uring, false, 0);
+}
+
+/**
+ * The io_uring event loop iteration. One syscall submits the requests made
+ * by the previous iteration and waits for the completions.
+ */
+static int
+chat_reactor_uring_update(struct chat_reactor *reactor, int timeout_ms)
+{
+	struct chat_uring *ring = reactor->uring;
+	bool is_wait = chat_uring_peek_cqe(ring) == NULL;
+	if (!rlist_empty(&reactor->flush))
+		timeout_ms = 0;
+	if ((is_wait || chat_uring_pending(ring) != 0) &&
+	    chat_uring_enter(ring, is_wait, timeout_ms) < 0 &&
+	    errno != ETIME && errno != EINTR && errno != EBUSY)
+		return CHAT_ERR_SYS;
+	int count = chat_reactor_uring_reap(reactor);
+	chat_reactor_settle(reactor);
+	int flushed = chat_reactor_flush(reactor);
+	if (reactor == &reactor->server->reactors[0])
+		chat_reactor_uring_submit(reactor);
+	if (count == 0 && flushed == 0)
+		return CHAT_ERR_TIMEOUT;
+	return 0;
+}
+
+static int
+chat_reactor_update(struct chat_reactor *reactor, int timeout_ms)
+{
+	if (reactor->uring != NULL)
+		return chat_reactor_uring_update(reactor, timeout_ms);
+	struct epoll_event events[CHAT_EPOLL_BATCH];
+	if (!rlist_empty(&reactor->flush))
+		timeout_ms = 0;
+	chat_reactor_syscall(reactor);
+	int count = epoll_wait(reactor->epoll, events, CHAT_EPOLL_BATCH,
+			       timeout_ms);
+	if (count < 0) {
+		if (errno != EINTR)
+			return CHAT_ERR_SYS;
+		count = 0;
+	}
+	for (int i = 0; i < count; ++i) {
+		if (events[i].data.ptr == reactor) {
+			chat_reactor_accept(reactor);
+			continue;
+		}
+		if (events[i].data.ptr == &reactor->mail) {
+			chat_reactor_receive(reactor);
+			continue;
+		}
+		struct chat_peer *peer = (struct chat_peer *)events[i].data.ptr;
+		if ((events[i].events & EPOLLOUT) != 0 && !peer->is_writable) {
+			peer->is_writable = true;
+			if (peer->out_size != 0 && !peer->is_kicked)
+				rlist_add_tail(&reactor->flush,
+					       &peer->in_flush);
+		}
+		if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0 &&
+		    chat_peer_read(reactor, peer) != 0)
+			chat_peer_delete(reactor, peer);
+	}
+	chat_reactor_settle(reactor);
+	int flushed = chat_reactor_flush(reactor);
+	if (count == 0 && flushed == 0)
+		return CHAT_ERR_TIMEOUT;
+	return 0;
+}
+
+static void *
+chat_reactor_worker_f(void *arg)
+{
+	struct chat_reactor *reactor = (struct chat_reactor *)arg;
+	bool *is_stopped = &reactor->server->is_stopped;
+	while (!__atomic_load_n(is_stopped, __ATOMIC_ACQUIRE)) {
+		int rc = chat_reactor_update(reactor, -1);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+			abort();
+	}
 	return NULL;
 }
 
 int
 chat_server_update(struct chat_server *server, double timeout)
 {
-	/*
-	 * 1) Wait on epoll/kqueue/poll for update on any socket.
-	 * 2) Handle the update.
-	 * 2.1) If the update was on listen-socket, then you probably need to
-	 *     call accept() on it - a new client wants to join.
-	 * 2.2) If the update was on a client-socket, then you might want to
-	 *     read/write on it.
-	 */
-	(void)server;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (server->reactors == NULL)
+		return CHAT_ERR_NOT_STARTED;
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	return chat_reactor_update(&server->reactors[0], timeout_ms);
 }
 
 int
 chat_server_get_descriptor(const struct chat_server *server)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
-
+	if (server->reactors == NULL)
+		return -1;
 	/*
-	 * Server has multiple sockets - own and from connected clients. Hence
-	 * you can't return a socket here. But if you are using epoll/kqueue,
-	 * then you can return their descriptor. These descriptors can be polled
-	 * just like sockets and will return an event when any of their owned
-	 * descriptors has any events.
-	 *
-	 * For example, assume you created an epoll descriptor and added to
-	 * there a listen-socket and a few client-sockets. Now if you will call
-	 * poll() on the epoll's descriptor, then on return from poll() you can
-	 * be sure epoll_wait() can return something useful for some of those
-	 * sockets.
+	 * The epoll descriptor is readable when any of the sockets has an
+	 * event, or mail has come from the other reactors. The output is
+	 * always flushed before returning to the caller, so the only output
+	 * to wait for is the blocked one, and it comes as EPOLLOUT inside the
+	 * epoll. The io_uring descriptor is readable when there are
+	 * completions.
 	 */
-#endif
-	(void)server;
-	return -1;
+	const struct chat_reactor *reactor = &server->reactors[0];
+	if (reactor->uring != NULL)
+		return reactor->uring->fd;
+	return reactor->epoll;
 }
 
 int
 chat_server_get_socket(const struct chat_server *server)
 {
-	return server->socket;
+	if (server->reactors == NULL)
+		return -1;
+	return server->reactors[0].socket;
 }
 
 int
 chat_server_get_events(const struct chat_server *server)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer in any of the client-sockets.
-	 */
-	(void)server;
+	if (server->reactors == NULL)
+		return 0;
+	if (server->reactors[0].output_count != 0)
+		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
 	return CHAT_EVENT_INPUT;
 }
 
-int
-chat_server_feed(struct chat_server *server, const char *msg, uint32_t msg_size)
+/** Broadcast a fed line, trimmed. Empty lines are not sent. */
+static void
+chat_server_feed_line(struct chat_server *server, std::string_view line)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
+	line = chat_trim(line);
+	if (line.empty())
+		return;
+	struct chat_message msg;
+#if NEED_AUTHOR
+	msg.author = "server";
 #endif
-	(void)server;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	msg.data = line;
+	struct chat_buf *buf = chat_message_encode(&msg);
+	chat_reactor_broadcast(&server->reactors[0], NULL, buf);
+	chat_buf_unref(buf);
+}
+
+int
+chat_server_feed(struct chat_server *server, const char *msg,
+		 uint32_t msg_size)
+{
+	if (server->reactors == NULL)
+		return CHAT_ERR_NOT_STARTED;
+	/* The clients connected by now get the message too. */
+	chat_reactor_accept(&server->reactors[0]);
+	const char *end = msg + msg_size;
+	while (msg < end) {
+		const char *eol = (const char *)memchr(msg, '\n', end - msg);
+		if (eol == NULL) {
+			server->feed_line.append(msg, end - msg);
+			break;
+		}
+		if (server->feed_line.empty()) {
+			chat_server_feed_line(server,
+					      std::string_view(msg, eol - msg));
+		} else {
+			server->feed_line.append(msg, eol - msg);
+			chat_server_feed_line(server, server->feed_line);
+			server->feed_line.clear();
+		}
+		msg = eol + 1;
+	}
+	chat_reactor_settle(&server->reactors[0]);
+	chat_reactor_flush(&server->reactors[0]);
+	chat_reactor_uring_submit(&server->reactors[0]);
+	return 0;
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "chat.h"
+
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_server;
@@ -15,6 +18,92 @@ chat_server_new(void);
 void
 chat_server_delete(struct chat_server *server);
 
+/**
+ * Set the number of reactors, event loops each serving a part of the
+ * clients. The first one runs in chat_server_update(), the others run in
+ * their own threads, so the server can use that many cores. The clients are
+ * spread among the reactors by the kernel, with SO_REUSEPORT. The messages
+ * of all the clients are still popped by chat_server_pop_next(). By default
+ * there is one reactor and no threads.
+ *
+ * @param server Chat server.
+ * @param count Number of reactors.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the count is less than 1.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_reactor_count(struct chat_server *server, int count);
+
+/**
+ * Set the backend of the server's event loops. With io_uring a reactor
+ * accepts and receives with multishot requests, and sends and waits in one
+ * syscall. If the kernel doesn't support it, listen falls back to epoll;
+ * chat_server_get_backend() tells which one is used. By default it is
+ * epoll.
+ *
+ * @param server Chat server.
+ * @param backend Backend to use.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_backend(struct chat_server *server,
+			enum chat_backend backend);
+
+/** Get the backend of the server, the actual one after listen. */
+enum chat_backend
+chat_server_get_backend(const struct chat_server *server);
+
+/** What the server does when a client's output exceeds the limit. */
+enum chat_output_policy {
+	/** Drop the oldest messages not being sent yet. */
+	CHAT_OUTPUT_DROP_OLDEST,
+	/** Disconnect the client. */
+	CHAT_OUTPUT_DISCONNECT,
+	/**
+	 * Stop reading from all the clients, until the client has got half
+	 * of its output. Nothing is lost, but one slow client slows down
+	 * everyone.
+	 */
+	CHAT_OUTPUT_PAUSE,
+};
+
+/**
+ * Limit the output queued to each client, so a client which doesn't read
+ * can't make the server run out of memory. By default there is no limit.
+ *
+ * @param server Chat server.
+ * @param size Max bytes queued to a client, 0 is no limit.
+ * @param policy What to do when a message doesn't fit.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_output_limit(struct chat_server *server, size_t size,
+			     enum chat_output_policy policy);
+
+/**
+ * Get the number of bytes queued to all the clients, of all the reactors.
+ * A message shared by many clients is counted for each of them. Safe to
+ * call from any thread.
+ */
+size_t
+chat_server_get_output_size(const struct chat_server *server);
+
+/**
+ * Get the number of syscalls done by the server's event loops, of all the
+ * reactors. For the benchmarks. Safe to call from any thread.
+ */
+uint64_t
+chat_server_get_syscall_count(const struct chat_server *server);
+
 /**
  * Try to listen for new clients on the given port.
  *
@@ -32,7 +121,8 @@ chat_server_listen(struct chat_server *server, uint16_t port);
 
 /**
  * Pop a next pending chat message. The returned message has to be
- * freed using chat_message_delete().
+ * freed using chat_message_delete(). A message of a client with the binary
+ * framing is a view of its frame, see chat_message_get_data().
  *
  * @param server Chat server.
  *
@@ -1,10 +1,14 @@
 #include "chat.h"
 #include "chat_server.h"
 
+#include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 static int
 port_from_str(const char *str, uint16_t *port)
@@ -26,7 +30,8 @@ int
 main(int argc, char **argv)
 {
 	if (argc < 2) {
-		printf("Expected a port to listen on\n");
+		printf("Expected a port to listen on, and optionally a "
+		       "reactor count and a backend, epoll or uring\n");
 		return -1;
 	}
 	uint16_t port = 0;
@@ -36,6 +41,15 @@ main(int argc, char **argv)
 		return -1;
 	}
 	struct chat_server *serv = chat_server_new();
+	/* Optionally, the number of reactors, each taking a core. */
+	if (argc > 2 && chat_server_set_reactor_count(serv,
+						      atoi(argv[2])) != 0) {
+		printf("Invalid reactor count\n");
+		chat_server_delete(serv);
+		return -1;
+	}
+	if (argc > 3 && strcmp(argv[3], "uring") == 0)
+		chat_server_set_backend(serv, CHAT_BACKEND_URING);
 	rc = chat_server_listen(serv, port);
 	if (rc != 0) {
 		printf("Couldn't listen: %d\n", rc);
@@ -44,10 +58,67 @@ main(int argc, char **argv)
 	}
 #if NEED_SERVER_FEED
 	/*
-	 * If want +5 points, then do similarly to the client_exe - create 2
-	 * pollfd objects, wait on STDIN_FILENO and on
-	 * chat_server_get_descriptor(), process events, etc.
+	 * Wait on the standard input and on the server's epoll descriptor at
+	 * once. The lines typed in are broadcast to all the clients.
 	 */
+	struct pollfd poll_fds[2];
+	memset(poll_fds, 0, sizeof(poll_fds));
+
+	struct pollfd *poll_input = &poll_fds[0];
+	poll_input->fd = STDIN_FILENO;
+	poll_input->events = POLLIN;
+
+	struct pollfd *poll_server = &poll_fds[1];
+	poll_server->fd = chat_server_get_descriptor(serv);
+	assert(poll_server->fd >= 0);
+
+	const int buf_size = 1024;
+	char buf[buf_size];
+	while (true) {
+		poll_server->events = chat_events_to_poll_events(
+			chat_server_get_events(serv));
+		int rc = poll(poll_fds, 2, -1);
+		if (rc < 0) {
+			printf("Poll error: %d\n", errno);
+			break;
+		}
+		if (poll_input->revents != 0) {
+			poll_input->revents = 0;
+			rc = read(STDIN_FILENO, buf, buf_size);
+			if (rc <= 0) {
+				/* No more server's messages, keep serving. */
+				poll_input->fd = -1;
+			} else {
+				rc = chat_server_feed(serv, buf, rc);
+				if (rc != 0) {
+					printf("Feed error: %d\n", rc);
+					break;
+				}
+			}
+		}
+		if (poll_server->revents != 0) {
+			poll_server->revents = 0;
+			rc = chat_server_update(serv, 0);
+			if (rc != 0 && rc != CHAT_ERR_TIMEOUT) {
+				printf("Update error: %d\n", rc);
+				break;
+			}
+		}
+		/* Flush all the pending messages to the standard output. */
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(serv)) != NULL) {
+#if NEED_AUTHOR
+			std::string_view author = chat_message_get_author(msg);
+			std::string_view data = chat_message_get_data(msg);
+			printf("%.*s: %.*s\n", (int)author.size(), author.data(),
+			       (int)data.size(), data.data());
+#else
+			std::string_view data = chat_message_get_data(msg);
+			printf("%.*s\n", (int)data.size(), data.data());
+#endif
+			delete msg;
+		}
+	}
 #else
 	/*
 	 * The basic implementation without server messages. Just serving
@@ -63,9 +134,13 @@ main(int argc, char **argv)
 		struct chat_message *msg;
 		while ((msg = chat_server_pop_next(serv)) != NULL) {
 #if NEED_AUTHOR
-			printf("%s: %s\n", msg->author.c_str(), msg->data.c_str());
+			std::string_view author = chat_message_get_author(msg);
+			std::string_view data = chat_message_get_data(msg);
+			printf("%.*s: %.*s\n", (int)author.size(), author.data(),
+			       (int)data.size(), data.data());
 #else
-			printf("%s\n", msg->data.c_str());
+			std::string_view data = chat_message_get_data(msg);
+			printf("%.*s\n", (int)data.size(), data.data());
 #endif
 			delete msg;
 		}
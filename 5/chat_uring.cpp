@@ -0,0 +1,210 @@
+#include "chat_uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	/** Max number of operations in a probe. */
+	CHAT_URING_PROBE_OPS = 256,
+};
+
+/**
+ * Check that the kernel is new enough. Multishot receive has come together
+ * with zero copy send, and only the operations can be probed, not the
+ * flags.
+ */
+static bool
+chat_uring_probe(int fd)
+{
+	size_t size = sizeof(struct io_uring_probe) +
+		      CHAT_URING_PROBE_OPS * sizeof(struct io_uring_probe_op);
+	char *mem = new char[size]();
+	struct io_uring_probe *probe = (struct io_uring_probe *)mem;
+	bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			  probe, CHAT_URING_PROBE_OPS) == 0 &&
+		  probe->last_op >= IORING_OP_SEND_ZC &&
+		  (probe->ops[IORING_OP_SEND_ZC].flags &
+		   IO_URING_OP_SUPPORTED) != 0;
+	delete[] mem;
+	return ok;
+}
+
+static int
+chat_uring_create_bufs(struct chat_uring *ring, unsigned buf_count,
+		       unsigned buf_size)
+{
+	/* The ring of buffers has to be page aligned. */
+	ring->buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+	void *mem = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+	ring->buf_ring = (struct io_uring_buf_ring *)mem;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)mem;
+	reg.ring_entries = buf_count;
+	reg.bgid = CHAT_URING_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd,
+		    IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		return -1;
+	ring->bufs = new char[(size_t)buf_count * buf_size];
+	ring->buf_count = buf_count;
+	ring->buf_size = buf_size;
+	for (unsigned i = 0; i < buf_count; ++i)
+		chat_uring_buf_recycle(ring, i);
+	return 0;
+}
+
+int
+chat_uring_create(struct chat_uring *ring, unsigned entries,
+		  unsigned buf_count, unsigned buf_size)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	/* Room for the multishot completions. */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+	unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+			    IORING_FEAT_EXT_ARG;
+	if ((params.features & features) != features ||
+	    !chat_uring_probe(ring->fd)) {
+		chat_uring_destroy(ring);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	size_t sq_size = params.sq_off.array +
+			 params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+			 params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	void *rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED) {
+		chat_uring_destroy(ring);
+		return -1;
+	}
+	ring->rings = rings;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		chat_uring_destroy(ring);
+		return -1;
+	}
+	ring->sqes = (struct io_uring_sqe *)sqes;
+	char *base = (char *)rings;
+	ring->sq_head = (unsigned *)(base + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	/* Entry i always takes the slot i. */
+	unsigned *array = (unsigned *)(base + params.sq_off.array);
+	for (unsigned i = 0; i < params.sq_entries; ++i)
+		array[i] = i;
+	ring->cq_head = (unsigned *)(base + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+	if (chat_uring_create_bufs(ring, buf_count, buf_size) != 0) {
+		int err = errno;
+		chat_uring_destroy(ring);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void
+chat_uring_destroy(struct chat_uring *ring)
+{
+	if (ring->fd >= 0)
+		close(ring->fd);
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->rings != NULL)
+		munmap(ring->rings, ring->rings_size);
+	if (ring->buf_ring != NULL)
+		munmap(ring->buf_ring, ring->buf_ring_size);
+	delete[] ring->bufs;
+	*ring = chat_uring();
+}
+
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries)
+		return NULL;
+	struct io_uring_sqe *sqe =
+		&ring->sqes[ring->sq_local_tail & ring->sq_mask];
+	++ring->sq_local_tail;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+chat_uring_reserve(struct chat_uring *ring, unsigned count)
+{
+	while (ring->sq_entries - chat_uring_pending(ring) < count) {
+		if (chat_uring_enter(ring, false, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+chat_uring_enter(struct chat_uring *ring, bool is_wait, int timeout_ms)
+{
+	unsigned to_submit = chat_uring_pending(ring);
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail,
+			 __ATOMIC_RELEASE);
+	unsigned flags = 0;
+	unsigned wait_nr = 0;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	struct __kernel_timespec ts;
+	if (is_wait) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		wait_nr = 1;
+		if (timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+			arg.ts = (uint64_t)&ts;
+		}
+	}
+	__atomic_store_n(&ring->enter_count, ring->enter_count + 1,
+			 __ATOMIC_RELAXED);
+	return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+		       flags, is_wait ? &arg : NULL,
+		       is_wait ? sizeof(arg) : 0);
+}
+
+void
+chat_uring_buf_recycle(struct chat_uring *ring, uint16_t bid)
+{
+	/*
+	 * Not buf_ring->bufs: in C++ the flexible array of the header is
+	 * shifted by its empty placeholder struct.
+	 */
+	struct io_uring_buf *bufs = (struct io_uring_buf *)ring->buf_ring;
+	struct io_uring_buf *buf =
+		&bufs[ring->buf_tail & (ring->buf_count - 1)];
+	buf->addr = (uint64_t)chat_uring_buf(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+	++ring->buf_tail;
+	/* The tail shares the memory with the reserved field of bufs[0]. */
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail,
+			 __ATOMIC_RELEASE);
+}
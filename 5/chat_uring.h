@@ -0,0 +1,123 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A thin io_uring wrapper over the raw syscalls: the submission and
+ * completion rings mapped into the process, and a ring of provided buffers
+ * for the multishot receives. Only what the chat server needs.
+ */
+
+struct chat_uring {
+	int fd = -1;
+	/** Submission queue, shared with the kernel. */
+	unsigned *sq_head = NULL;
+	unsigned *sq_tail = NULL;
+	unsigned sq_mask = 0;
+	unsigned sq_entries = 0;
+	struct io_uring_sqe *sqes = NULL;
+	/** Tail with the prepared entries, published on submit. */
+	unsigned sq_local_tail = 0;
+	/** Completion queue, shared with the kernel. */
+	unsigned *cq_head = NULL;
+	unsigned *cq_tail = NULL;
+	unsigned cq_mask = 0;
+	struct io_uring_cqe *cqes = NULL;
+	/** Mapping of the rings. */
+	void *rings = NULL;
+	size_t rings_size = 0;
+	size_t sqes_size = 0;
+	/** Provided buffers, picked by the kernel for the receives. */
+	struct io_uring_buf_ring *buf_ring = NULL;
+	size_t buf_ring_size = 0;
+	char *bufs = NULL;
+	unsigned buf_count = 0;
+	unsigned buf_size = 0;
+	uint16_t buf_tail = 0;
+	/** Number of io_uring_enter() calls, readable by any thread. */
+	uint64_t enter_count = 0;
+};
+
+enum {
+	/** Group ID of the provided buffers. */
+	CHAT_URING_BUF_GROUP = 0,
+};
+
+/**
+ * Create the ring with @a entries submission entries and a group of
+ * @a buf_count provided buffers of @a buf_size bytes. Fails when the kernel
+ * lacks any of the needed features: provided buffer rings, multishot
+ * receive, timed waits.
+ * @retval 0 Success.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_create(struct chat_uring *ring, unsigned entries,
+		  unsigned buf_count, unsigned buf_size);
+
+/** Close the ring. The requests in flight are cancelled. */
+void
+chat_uring_destroy(struct chat_uring *ring);
+
+/**
+ * Get a zeroed submission entry to fill.
+ * @retval NULL The queue is full, submit first.
+ */
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring);
+
+/** Number of the prepared entries not taken by the kernel yet. */
+static inline unsigned
+chat_uring_pending(const struct chat_uring *ring)
+{
+	return ring->sq_local_tail -
+	       __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Make sure there is room for @a count entries, to put them into one
+ * submission. Like a chain of linked requests, which must not be split.
+ * @retval 0 Success.
+ * @retval -1 Error of the submission, check errno.
+ */
+int
+chat_uring_reserve(struct chat_uring *ring, unsigned count);
+
+/**
+ * Submit the prepared entries, and wait for a completion if @a is_wait, for
+ * @a timeout_ms at most, or infinitely if it is negative. One syscall.
+ * @retval >=0 Number of submitted entries.
+ * @retval -1 Error, check errno. ETIME is the timeout.
+ */
+int
+chat_uring_enter(struct chat_uring *ring, bool is_wait, int timeout_ms);
+
+/** Get the next completion, or NULL if there is none. */
+static inline struct io_uring_cqe *
+chat_uring_peek_cqe(struct chat_uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/** Give the peeked completion back to the kernel. */
+static inline void
+chat_uring_cqe_seen(struct chat_uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/** Data of the provided buffer @a bid. */
+static inline char *
+chat_uring_buf(const struct chat_uring *ring, uint16_t bid)
+{
+	return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+/** Give the provided buffer @a bid back to the kernel. */
+void
+chat_uring_buf_recycle(struct chat_uring *ring, uint16_t bid);
@@ -3,11 +3,14 @@
 #include "chat_client.h"
 #include "chat_server.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <errno.h>
 #include <new>
 #include <pthread.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 enum {
 	TEST_MSG_ID_LEN = 64,
@@ -144,7 +147,7 @@ static bool
 author_is_eq(const struct chat_message *msg, std::string_view name)
 {
 #if NEED_AUTHOR
-	return msg->author == name;
+	return chat_message_get_author(msg) == name;
 #else
 	(void)msg;
 	(void)name;
@@ -397,7 +400,7 @@ test_multi_client(void)
 	}
 	unit_msg("Check all is delivered");
 	test_msg_clear_id(test_msg);
-	int *msg_counts = new int[client_count];
+	int *msg_counts = new int[client_count]();
 	for (int i = 0, end = msg_count * client_count; i < end; ++i) {
 		msg = chat_server_pop_next(s);
 		unit_fail_if(msg == NULL);
@@ -507,7 +510,7 @@ test_stress(void)
 			test_stress_worker_f, &ctx);
 		unit_fail_if(rc != 0);
 	}
-	int *msg_counts = new int[client_count];
+	int *msg_counts = new int[client_count]();
 	struct test_msg *test_msg = test_msg_new(ctx.msg_len);
 	unit_msg("Receive all messages");
 	for (int i = 0, end = ctx.msg_count * client_count; i < end; ++i) {
@@ -570,7 +573,7 @@ test_big_author(void)
 	std::string body(body_len + 1, 'm');
 	body.back() = '\n';
 
-	unit_check(chat_client_feed(c1, body, body_len + 1) == 0, "feed to client");
+	unit_check(chat_client_feed(c1, body.data(), body_len + 1) == 0, "feed to client");
 	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
 	unit_check(msg != NULL, "server got msg");
 	body.resize(body_len);
@@ -662,12 +665,692 @@ test_server_feed(void)
 	unit_check(chat_client_update(c2, 0) == CHAT_ERR_TIMEOUT,
 		   "no more events in c2");
 
+	unit_msg("Feed and close");
+	unit_fail_if(chat_server_feed(s, "one\ntwo\n", 8) != 0);
+	server_consume_events(s);
+	chat_server_delete(s);
+	int rc;
+	while ((rc = chat_client_update(c1, 0.1)) == 0)
+		{};
+	unit_fail_if(rc != CHAT_ERR_NOT_STARTED);
+	msg = chat_client_pop_next(c1);
+	unit_check(msg != NULL && msg->data == "one", "c1 got msg");
+	delete msg;
+	msg = chat_client_pop_next(c1);
+	unit_check(msg != NULL && msg->data == "two", "the lines received "\
+		   "with the close are not lost");
+	delete msg;
+
 	chat_client_delete(c1);
 	chat_client_delete(c2);
+
+	unit_test_finish();
+#endif
+}
+
+/**
+ * Send @a msg_count messages from each of the clients, and check that the
+ * server pops them all and the other clients get them, in order of each
+ * sender. Then check the server feed.
+ */
+static void
+check_broadcast(struct chat_server *s, struct chat_client **clis,
+		int client_count, int msg_count)
+{
+	struct chat_message *msg;
+	unit_msg("Send messages");
+	for (int mi = 0; mi < msg_count; ++mi) {
+		for (int ci = 0; ci < client_count; ++ci) {
+			char data[128];
+			int size = snprintf(data, sizeof(data),
+					    "cli_%d_msg_%d\n", ci, mi);
+			unit_fail_if(chat_client_feed(
+				clis[ci], data, size) != 0);
+			chat_client_update(clis[ci], 0);
+		}
+	}
+	unit_msg("Check all is popped from the server");
+	int *msg_counts = new int[client_count]();
+	for (int i = 0, end = msg_count * client_count; i < end; ++i) {
+		/* The other reactors don't wait for the first one. */
+		while ((msg = chat_server_pop_next(s)) == NULL) {
+			for (int ci = 0; ci < client_count; ++ci)
+				chat_client_update(clis[ci], 0);
+			chat_server_update(s, 0.01);
+		}
+		int cli_id = -1;
+		int msg_id = -1;
+		std::string data(chat_message_get_data(msg));
+		unit_fail_if(sscanf(data.c_str(), "cli_%d_msg_%d",
+				    &cli_id, &msg_id) != 2);
+		unit_fail_if(cli_id >= client_count || cli_id < 0);
+		unit_fail_if(msg_counts[cli_id] != msg_id);
+		++msg_counts[cli_id];
+		char name[128];
+		snprintf(name, sizeof(name), "cli_%d", cli_id);
+		unit_fail_if(!author_is_eq(msg, name));
+		delete msg;
+	}
+	unit_msg("Check all is delivered");
+	for (int ci = 0; ci < client_count; ++ci) {
+		memset(msg_counts, 0, client_count * sizeof(msg_counts[0]));
+		int total_msg_count = msg_count * (client_count - 1);
+		for (int mi = 0; mi < total_msg_count; ++mi) {
+			msg = client_pop_next_blocking(clis[ci], s);
+			int cli_id = -1;
+			int msg_id = -1;
+			std::string data(chat_message_get_data(msg));
+			unit_fail_if(sscanf(data.c_str(), "cli_%d_msg_%d",
+					    &cli_id, &msg_id) != 2);
+			unit_fail_if(cli_id >= client_count || cli_id < 0);
+			unit_fail_if(msg_counts[cli_id] != msg_id);
+			++msg_counts[cli_id];
+			delete msg;
+		}
+		unit_fail_if(msg_counts[ci] != 0);
+	}
+	delete[] msg_counts;
+	unit_check(true, "all messages are delivered in order");
+#if NEED_SERVER_FEED
+	unit_msg("Feed from the server");
+	unit_fail_if(chat_server_feed(s, "admin\n", 6) != 0);
+	for (int ci = 0; ci < client_count; ++ci) {
+		msg = client_pop_next_blocking(clis[ci], s);
+		unit_fail_if(chat_message_get_data(msg) != "admin");
+		unit_fail_if(!author_is_eq(msg, "server"));
+		delete msg;
+	}
+	unit_check(true, "the feed is delivered to all clients");
+#endif
+}
+
+/**
+ * Create and connect @a count clients named cli_<i>. The even ones use
+ * @a backend, the odd ones the default.
+ */
+static struct chat_client **
+connect_clients(uint16_t port, int count, enum chat_backend backend,
+		enum chat_framing framing)
+{
+	unit_msg("Connect clients");
+	struct chat_client **clis = new chat_client*[count];
+	for (int i = 0; i < count; ++i) {
+		char name[128];
+		snprintf(name, sizeof(name), "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		if (i % 2 == 0) {
+			unit_fail_if(chat_client_set_backend(
+				clis[i], backend) != 0);
+		}
+		if (i % 3 == 0) {
+			unit_fail_if(chat_client_set_framing(
+				clis[i], framing) != 0);
+		}
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	return clis;
+}
+
+static void
+test_reactors(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_reactor_count(s, 0) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "zero reactors");
+	unit_check(chat_server_set_reactor_count(s, 4) == 0, "4 reactors");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_reactor_count(s, 2) ==
+		   CHAT_ERR_ALREADY_STARTED, "set after listen");
+	int client_count = 20;
+	struct chat_client **clis = connect_clients(
+		server_get_port(s), client_count, CHAT_BACKEND_EPOLL,
+		CHAT_FRAMING_TEXT);
+	check_broadcast(s, clis, client_count, 10);
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	delete[] clis;
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_uring(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_get_backend(s) == CHAT_BACKEND_EPOLL,
+		   "epoll by default");
+	unit_fail_if(chat_server_set_backend(s, CHAT_BACKEND_URING) != 0);
+	unit_fail_if(chat_server_set_reactor_count(s, 2) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_backend(s, CHAT_BACKEND_EPOLL) ==
+		   CHAT_ERR_ALREADY_STARTED, "set after listen");
+	bool is_uring = chat_server_get_backend(s) == CHAT_BACKEND_URING;
+	if (!is_uring)
+		unit_msg("No io_uring, fell back to epoll");
+	uint16_t port = server_get_port(s);
+	/* Mixed clients, to check both with both. */
+	int client_count = 20;
+	struct chat_client **all = connect_clients(port, client_count,
+						   CHAT_BACKEND_URING,
+						   CHAT_FRAMING_TEXT);
+	unit_check(chat_client_get_backend(all[0]) ==
+		   chat_server_get_backend(s), "client backend");
+	unit_check(chat_client_set_backend(all[0], CHAT_BACKEND_EPOLL) ==
+		   CHAT_ERR_ALREADY_STARTED, "set after connect");
+	check_broadcast(s, all, client_count, 10);
+
+	unit_msg("Big message, bigger than a receive buffer");
+	uint32_t len = 1024 * 1024;
+	std::string big(len, 'x');
+	big.push_back('\n');
+	unit_fail_if(chat_client_feed(all[0], big.data(), big.size()) != 0);
+	struct chat_message *msg = NULL;
+	while ((msg = chat_server_pop_next(s)) == NULL) {
+		chat_client_update(all[0], 0);
+		chat_server_update(s, 0.01);
+	}
+	unit_fail_if(msg->data.size() != len);
+	delete msg;
+	for (int ci = 1; ci < client_count; ++ci) {
+		msg = client_pop_next_blocking(all[ci], s);
+		unit_fail_if(msg->data.size() != len);
+		delete msg;
+	}
+	unit_check(true, "big message is delivered");
+
+	unit_msg("Disconnect");
+	chat_client_delete(all[1]);
+	unit_fail_if(chat_client_feed(all[0], "bye\n", 4) != 0);
+	while ((msg = chat_server_pop_next(s)) == NULL) {
+		chat_client_update(all[0], 0);
+		chat_server_update(s, 0.01);
+	}
+	unit_fail_if(msg->data != "bye");
+	delete msg;
+	for (int ci = 2; ci < client_count; ++ci) {
+		msg = client_pop_next_blocking(all[ci], s);
+		unit_fail_if(msg->data != "bye");
+		delete msg;
+	}
+	unit_check(true, "the rest get the messages after a disconnect");
+	chat_client_delete(all[0]);
+	for (int i = 2; i < client_count; ++i)
+		chat_client_delete(all[i]);
+	delete[] all;
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+/** Connect a raw socket, which speaks for itself. */
+static int
+connect_raw(uint16_t port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	unit_fail_if(sock < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(connect(sock, (struct sockaddr *)&addr,
+			     sizeof(addr)) != 0);
+	return sock;
+}
+
+/**
+ * Update the server until it closes the raw socket.
+ * @retval true Closed, what it has sent before is in @a in.
+ * @retval false Still open after a while.
+ */
+static bool
+raw_wait_close(struct chat_server *s, int sock, std::string *in)
+{
+	for (int i = 0; i < 1000; ++i) {
+		chat_server_update(s, 0.01);
+		char buf[4096];
+		ssize_t rc = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if (rc == 0)
+			return true;
+		if (rc > 0)
+			in->append(buf, rc);
+	}
+	return false;
+}
+
+static void
+test_framing(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_message *msg;
+
+	unit_msg("Binary client");
+	struct chat_client *c = chat_client_new("binary");
+	unit_fail_if(chat_client_set_framing(c, CHAT_FRAMING_BINARY) != 0);
+	unit_fail_if(chat_client_connect(c, make_addr_str(port)) != 0);
+	unit_check(chat_client_set_framing(c, CHAT_FRAMING_TEXT) ==
+		   CHAT_ERR_ALREADY_STARTED, "set after connect");
+#if NEED_SERVER_FEED
+	/* Sent before the framing is known, most likely as text. */
+	unit_fail_if(chat_server_feed(s, "first\n", 6) != 0);
+	msg = client_pop_next_blocking(c, s);
+	unit_check(chat_message_get_data(msg) == "first" &&
+		   author_is_eq(msg, "server"), "got a message before frames");
+	delete msg;
+#endif
+	unit_fail_if(chat_client_feed(c, "  hello \n", 9) != 0);
+	while ((msg = chat_server_pop_next(s)) == NULL) {
+		chat_client_update(c, 0);
+		chat_server_update(s, 0.01);
+	}
+	unit_check(msg->frame != NULL && msg->data.empty(),
+		   "the server's message views the frame");
+	unit_check(chat_message_get_data(msg) == "hello" &&
+		   author_is_eq(msg, "binary"), "frame is decoded");
+	delete msg;
+	chat_client_delete(c);
+
+	chat_server_delete(s);
+
+	unit_msg("Binary and text clients together");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_reactor_count(s, 2) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	int client_count = 12;
+	struct chat_client **all = connect_clients(port, client_count,
+						   CHAT_BACKEND_URING,
+						   CHAT_FRAMING_BINARY);
+	check_broadcast(s, all, client_count, 10);
+
+	unit_msg("Big frame, received in parts");
+	uint32_t len = 1024 * 1024;
+	std::string big(len, 'x');
+	big.push_back('\n');
+	unit_fail_if(chat_client_feed(all[0], big.data(), big.size()) != 0);
+	while ((msg = chat_server_pop_next(s)) == NULL) {
+		chat_client_update(all[0], 0);
+		chat_server_update(s, 0.01);
+	}
+	unit_fail_if(chat_message_get_data(msg).size() != len);
+	delete msg;
+	for (int ci = 1; ci < client_count; ++ci) {
+		msg = client_pop_next_blocking(all[ci], s);
+		unit_fail_if(chat_message_get_data(msg).size() != len);
+		unit_fail_if(!author_is_eq(msg, "cli_0"));
+		delete msg;
+	}
+	unit_check(true, "big frame is delivered to all");
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(all[i]);
+	delete[] all;
+	chat_server_delete(s);
+
+	unit_msg("Too big frame");
+	s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	int sock = connect_raw(port);
+	char head[CHAT_FRAME_MAGIC_SIZE + CHAT_FRAME_HEADER_SIZE];
+	memcpy(head, CHAT_FRAME_MAGIC, CHAT_FRAME_MAGIC_SIZE);
+	struct chat_frame_header hdr;
+	hdr.author_size = UINT32_MAX;
+	hdr.data_size = UINT32_MAX;
+	hdr.flags = 0;
+	chat_frame_header_encode(&hdr, head + CHAT_FRAME_MAGIC_SIZE);
+	unit_fail_if(send(sock, head, sizeof(head), 0) != sizeof(head));
+	std::string in;
+	unit_check(raw_wait_close(s, sock, &in), "too big frame drops the "\
+		   "peer");
+	close(sock);
+	chat_server_delete(s);
+
+	unit_msg("Lines forged in a frame");
+	s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	c = chat_client_new("text");
+	unit_fail_if(chat_client_connect(c, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c, "ready\n", 6) != 0);
+	delete server_pop_next_blocking_from(s, c);
+	struct chat_client *bin = chat_client_new("binary");
+	unit_fail_if(chat_client_set_framing(bin, CHAT_FRAMING_BINARY) != 0);
+	unit_fail_if(chat_client_connect(bin, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(bin, "ready\n", 6) != 0);
+	delete server_pop_next_blocking_from(s, bin);
+	delete client_pop_next_blocking(c, s);
+	sock = connect_raw(port);
+	std::string out(CHAT_FRAME_MAGIC, CHAT_FRAME_MAGIC_SIZE);
+	const struct {
+		const char *data;
+		uint16_t flags;
+	} frames[] = {
+		{"", CHAT_FRAME_HELLO},
+		{"  hi  ", 0},
+		{"x\nother\nfake", 0},
+		{"end", 0},
+	};
+	for (const auto &f : frames) {
+		struct chat_buf *frame = chat_frame_new("raw", f.data, f.flags);
+		out.append(frame->data, frame->size);
+		chat_buf_unref(frame);
+	}
+	unit_fail_if(send(sock, out.data(), out.size(), 0) !=
+		     (ssize_t)out.size());
+	msg = client_pop_next_blocking(c, s);
+	unit_check(chat_message_get_data(msg) == "hi" &&
+		   author_is_eq(msg, "raw"), "frame text is trimmed");
+	delete msg;
+	msg = client_pop_next_blocking(c, s);
+	unit_check(chat_message_get_data(msg) == "end", "no lines are "\
+		   "forged");
+	delete msg;
+	delete client_pop_next_blocking(bin, s);
+	msg = client_pop_next_blocking(bin, s);
+	unit_check(chat_message_get_data(msg) == "x\nother\nfake",
+		   "the binary peers get '\\n' as is");
+	delete msg;
+	close(sock);
+	chat_client_delete(bin);
+	chat_client_delete(c);
 	chat_server_delete(s);
 
+#if NEED_AUTHOR
+	unit_msg("Text name looking like the magic");
+	s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	struct chat_client *b = chat_client_new("binary");
+	unit_fail_if(chat_client_set_framing(b, CHAT_FRAMING_BINARY) != 0);
+	unit_fail_if(chat_client_connect(b, make_addr_str(port)) != 0);
+	c = chat_client_new(std::string_view("\0CF1name", 8));
+	unit_fail_if(chat_client_connect(c, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c, "hi\n", 3) != 0);
+	msg = server_pop_next_blocking_from(s, c);
+	unit_check(chat_message_get_data(msg) == "hi" &&
+		   author_is_eq(msg, "CF1name"), "the client is not taken "\
+		   "for a binary one");
+	delete msg;
+	msg = client_pop_next_blocking(b, s);
+	unit_check(chat_message_get_data(msg) == "hi" &&
+		   author_is_eq(msg, "CF1name"), "leading '\\0' of a text "\
+		   "name is dropped");
+	delete msg;
+	sock = connect_raw(port);
+	const char raw[] = "\0\0raw\nhello\n";
+	unit_fail_if(send(sock, raw, sizeof(raw) - 1, 0) !=
+		     (ssize_t)sizeof(raw) - 1);
+	msg = client_pop_next_blocking(b, s);
+	unit_check(chat_message_get_data(msg) == "hello" &&
+		   author_is_eq(msg, "raw"), "the server drops them too");
+	delete msg;
+	close(sock);
+	chat_client_delete(b);
+	chat_client_delete(c);
+	chat_server_delete(s);
+#else
+	unit_msg("Text looking like the magic");
+	s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	struct chat_client *b = chat_client_new("binary");
+	unit_fail_if(chat_client_set_framing(b, CHAT_FRAMING_BINARY) != 0);
+	unit_fail_if(chat_client_connect(b, make_addr_str(port)) != 0);
+	c = chat_client_new("text");
+	unit_fail_if(chat_client_connect(c, make_addr_str(port)) != 0);
+	const char text[] = "\0CF1x\nhi\n";
+	unit_fail_if(chat_client_feed(c, text, sizeof(text) - 1) != 0);
+	msg = server_pop_next_blocking_from(s, c);
+	unit_check(chat_message_get_data(msg) == "hi", "the client doesn't "\
+		   "send a line starting with '\\0'");
+	delete msg;
+	msg = client_pop_next_blocking(b, s);
+	unit_fail_if(chat_message_get_data(msg) != "hi");
+	delete msg;
+
+	sock = connect_raw(port);
+	const char lines[] = "one\n\0x\ntwo\n";
+	unit_fail_if(send(sock, lines, sizeof(lines) - 1, 0) !=
+		     (ssize_t)sizeof(lines) - 1);
+	int raw_frames = connect_raw(port);
+	out.assign(CHAT_FRAME_MAGIC, CHAT_FRAME_MAGIC_SIZE);
+	const std::string_view datas[] = {std::string_view("\0y", 2), "three"};
+	for (std::string_view data : datas) {
+		struct chat_buf *frame = chat_frame_new("", data, 0);
+		out.append(frame->data, frame->size);
+		chat_buf_unref(frame);
+	}
+	msg = client_pop_next_blocking(b, s);
+	unit_fail_if(chat_message_get_data(msg) != "one");
+	delete msg;
+	msg = client_pop_next_blocking(b, s);
+	unit_check(chat_message_get_data(msg) == "two", "the server drops "\
+		   "a line starting with '\\0'");
+	delete msg;
+	unit_fail_if(send(raw_frames, out.data(), out.size(), 0) !=
+		     (ssize_t)out.size());
+	msg = client_pop_next_blocking(b, s);
+	unit_check(chat_message_get_data(msg) == "three", "and a frame");
+	delete msg;
+	const char *expected[] = {"one", "two", "three"};
+	bool is_eq = true;
+	for (const char *data : expected) {
+		msg = client_pop_next_blocking(c, s);
+		is_eq = is_eq && chat_message_get_data(msg) == data;
+		delete msg;
+	}
+	unit_check(is_eq, "the text peers get the same");
+	is_eq = true;
+	for (const char *data : expected) {
+		msg = chat_server_pop_next(s);
+		is_eq = is_eq && msg != NULL &&
+			chat_message_get_data(msg) == data;
+		delete msg;
+	}
+	unit_check(is_eq && chat_server_pop_next(s) == NULL, "the server "\
+		   "keeps the same");
+	close(sock);
+	close(raw_frames);
+	chat_client_delete(b);
+	chat_client_delete(c);
+	chat_server_delete(s);
+#endif
+
 	unit_test_finish();
+}
+
+/**
+ * Connect a raw socket with a small receive buffer, which is not read until
+ * asked. Sends the name, if any, so the server treats it as a client.
+ */
+static int
+connect_slow(uint16_t port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	unit_fail_if(sock < 0);
+	int size = 4096;
+	unit_fail_if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size,
+				sizeof(size)) != 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(connect(sock, (struct sockaddr *)&addr,
+			     sizeof(addr)) != 0);
+#if NEED_AUTHOR
+	unit_fail_if(send(sock, "slow\n", 5, 0) != 5);
 #endif
+	return sock;
+}
+
+/**
+ * Read what has come to the slow socket, and check the message order.
+ * @retval Number of bytes read, or -1 on EOF or an error.
+ */
+static ssize_t
+slow_read(int sock, std::string *in, int *next_id, int *msg_count)
+{
+	char buf[16384];
+	ssize_t rc = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (rc <= 0)
+		return -1;
+	in->append(buf, rc);
+	size_t pos;
+	while ((pos = in->find('\n')) != std::string::npos) {
+		int id;
+		if (sscanf(in->c_str(), "msg_%d", &id) == 1) {
+			/* Some may be dropped, but not reordered. */
+			unit_fail_if(id < *next_id);
+			*next_id = id + 1;
+			++*msg_count;
+		}
+		in->erase(0, pos + 1);
+	}
+	return rc;
+}
+
+/**
+ * A client doesn't read, and another one floods the chat. The output queued
+ * to the slow one has to stay bounded with any policy. With @a limit 0 it is
+ * not, for comparison.
+ */
+static void
+test_slow_consumer_with(enum chat_backend backend, size_t limit,
+			enum chat_output_policy policy)
+{
+	const char *names[] = {"drop oldest", "disconnect", "pause"};
+	const char *backend_name =
+		backend == CHAT_BACKEND_URING ? "io_uring" : "epoll";
+	if (limit == 0)
+		unit_msg("No limit, %s", backend_name);
+	else
+		unit_msg("Policy '%s', %s", names[policy], backend_name);
+	int msg_count = 16 * 1024;
+	size_t msg_size = 1024;
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_backend(s, backend) != 0);
+	unit_fail_if(chat_server_set_output_limit(s, limit, policy) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	int slow = connect_slow(port);
+	struct chat_client *fast = chat_client_new("fast");
+	unit_fail_if(chat_client_set_backend(fast, backend) != 0);
+	unit_fail_if(chat_client_connect(fast, make_addr_str(port)) != 0);
+	/* Accept both, and read the names. */
+	chat_server_update(s, 0.1);
+	server_consume_events(s);
+	size_t max_output = 0;
+	int popped = 0;
+	std::string msg(msg_size, 'x');
+	for (int i = 0; i < msg_count; ++i) {
+		int len = snprintf(&msg[0], msg_size, "msg_%d ", i);
+		msg[len] = 'x';
+		msg[msg_size - 1] = '\n';
+		unit_fail_if(chat_client_feed(fast, msg.data(),
+					      msg.size()) != 0);
+		chat_client_update(fast, 0);
+		chat_server_update(s, 0);
+		struct chat_message *m;
+		while ((m = chat_server_pop_next(s)) != NULL) {
+			++popped;
+			delete m;
+		}
+		max_output = std::max(max_output,
+				      chat_server_get_output_size(s));
+	}
+	unit_msg("%d MiB sent, max output %zu KiB, %d messages read by the "
+		 "server", (int)(msg_count * msg_size >> 20),
+		 max_output / 1024, popped);
+	if (limit == 0) {
+		unit_check(max_output > (size_t)msg_count * msg_size / 16,
+			   "the output is not bounded");
+		policy = CHAT_OUTPUT_PAUSE;
+	} else {
+		unit_check(max_output < (size_t)msg_count * msg_size / 16,
+			   "the output is bounded");
+	}
+	if (limit != 0 && policy == CHAT_OUTPUT_PAUSE)
+		unit_check(popped < msg_count, "the server is paused");
+
+	std::string in;
+	int next_id = 0;
+	int received = 0;
+	bool is_eof = false;
+	while (!is_eof) {
+		is_eof = slow_read(slow, &in, &next_id, &received) < 0;
+		chat_client_update(fast, 0);
+		chat_server_update(s, 0);
+		struct chat_message *m;
+		while ((m = chat_server_pop_next(s)) != NULL) {
+			++popped;
+			delete m;
+		}
+		if (policy != CHAT_OUTPUT_DISCONNECT && popped == msg_count &&
+		    next_id == msg_count &&
+		    chat_server_get_output_size(s) == 0)
+			break;
+	}
+	unit_fail_if(popped != msg_count);
+	unit_msg("The slow client got %d messages", received);
+	switch (policy) {
+	case CHAT_OUTPUT_DROP_OLDEST:
+		unit_check(received < msg_count && next_id == msg_count,
+			   "the oldest messages are dropped");
+		break;
+	case CHAT_OUTPUT_DISCONNECT:
+		unit_check(is_eof && received < msg_count,
+			   "the slow client is disconnected");
+		while (chat_server_get_output_size(s) != 0)
+			chat_server_update(s, 0.01);
+		break;
+	case CHAT_OUTPUT_PAUSE:
+		unit_check(received == msg_count, "nothing is lost");
+		break;
+	}
+	close(slow);
+	chat_client_delete(fast);
+	chat_server_delete(s);
+}
+
+static void
+test_slow_consumer(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_output_limit(s, 1024,
+		   CHAT_OUTPUT_PAUSE) == CHAT_ERR_ALREADY_STARTED,
+		   "set after listen");
+	chat_server_delete(s);
+	const enum chat_backend backends[] = {
+		CHAT_BACKEND_EPOLL, CHAT_BACKEND_URING,
+	};
+	const enum chat_output_policy policies[] = {
+		CHAT_OUTPUT_DROP_OLDEST, CHAT_OUTPUT_DISCONNECT,
+		CHAT_OUTPUT_PAUSE,
+	};
+	for (enum chat_backend b : backends) {
+		test_slow_consumer_with(b, 0, CHAT_OUTPUT_DROP_OLDEST);
+		for (enum chat_output_policy p : policies)
+			test_slow_consumer_with(b, 64 * 1024, p);
+	}
+
+	unit_test_finish();
 }
 
 int
@@ -693,6 +1376,10 @@ main(int argc, char **argv)
 	test_stress();
 	test_big_author();
 	test_server_feed();
+	test_reactors();
+	test_uring();
+	test_framing();
+	test_slow_consumer();
 
 	unit_test_finish();
 	return 0;
@@ -148,6 +148,12 @@ public:
 	void
 	untrace(void *ptr);
 
+	uint64_t
+	get_alloc_count();
+
+	uint64_t
+	get_alloc_total();
+
 private:
 	std::mutex m_mutex;
 	allocation_map m_allocations;
@@ -308,11 +314,41 @@ heap_help::untrace(void *ptr)
 	m_mutex.unlock();
 }
 
+uint64_t
+heap_help::get_alloc_count()
+{
+	m_mutex.lock();
+	uint64_t res = m_allocations.size();
+	m_mutex.unlock();
+	return res;
+}
+
+uint64_t
+heap_help::get_alloc_total()
+{
+	m_mutex.lock();
+	uint64_t res = m_alloc_count;
+	m_mutex.unlock();
+	return res;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 static heap_help glob_hh;
 }
 
+uint64_t
+heaph_get_alloc_count(void)
+{
+	return glob_hh.get_alloc_count();
+}
+
+uint64_t
+heaph_get_alloc_total(void)
+{
+	return glob_hh.get_alloc_total();
+}
+
 void *
 operator new(std::size_t n)
 {